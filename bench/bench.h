@@ -0,0 +1,94 @@
+#pragma once
+/** \file bench.h
+ *
+ * \brief Helpers shared by the benchmark programs.
+ *
+ * A benchmark program prints each measurement on its own line as
+ *
+ *     BENCH <name> <value> <unit> <lower|higher>
+ *
+ * where the last word says which direction is better. Everything else it prints is ignored by
+ * bench_compare, which runs the programs several times and compares the results to a baseline.
+ */
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+/** Report a measurement where a lower value is better, like a latency. */
+static inline void
+bench_report_lower(char const *name, double value, char const *unit)
+{
+    printf("BENCH %s %.6g %s lower\n", name, value, unit);
+    fflush(stdout);
+}
+
+/** Report a measurement where a higher value is better, like a throughput. */
+static inline void
+bench_report_higher(char const *name, double value, char const *unit)
+{
+    printf("BENCH %s %.6g %s higher\n", name, value, unit);
+    fflush(stdout);
+}
+
+/** Report the peak resident set size of this process so far. */
+static inline void
+bench_report_peak_rss(char const *name)
+{
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+    bench_report_lower(name, (double)usage.ru_maxrss, "KiB");
+}
+
+/** A qsort() comparison for doubles, in ascending order. */
+static inline int
+bench_compare_doubles(void const *a, void const *b)
+{
+    double x = *(double const *)a;
+    double y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+/** The median of some samples, which are sorted in place. */
+static inline double
+bench_median(size_t num_samples, double samples[num_samples])
+{
+    qsort(samples, num_samples, sizeof(samples[0]), bench_compare_doubles);
+
+    if (num_samples % 2) {
+        return samples[num_samples / 2];
+    }
+
+    return 0.5 * (samples[num_samples / 2 - 1] + samples[num_samples / 2]);
+}
+
+/** Point HOME at a new empty directory, so the benchmark gets its own store.
+ *
+ * \param dir must have room for at least 32 characters, the directory is stored here.
+ *
+ * \returns 0 on success or -1 on failure.
+ */
+static inline int
+bench_temp_home(char dir[static 32])
+{
+    strcpy(dir, "/tmp/obsdb-bench-XXXXXX");
+    StopIf(!mkdtemp(dir), return -1, "unable to create a temporary directory");
+    StopIf(setenv("HOME", dir, 1), return -1, "unable to set HOME");
+
+    return 0;
+}
+
+/** Remove a directory made by bench_temp_home() and everything in it. */
+static inline void
+bench_remove_temp_home(char const *dir)
+{
+    char command[64] = {0};
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command)) {
+        fprintf(stderr, "unable to remove %s\n", dir);
+    }
+}
@@ -0,0 +1,417 @@
+/** \file bench_compare.c
+ *
+ * \brief Run the benchmarks several times and compare the results to a stored baseline.
+ *
+ * Usage: bench_compare [-r RUNS] [-b BASELINE] [-o RESULTS] [-t PERCENT] [-s] PROGRAM...
+ *
+ *  - \c -r the number of times to run each program, default 7.
+ *  - \c -b the baseline file, default bench/baseline.json. It is created if it doesn't exist.
+ *  - \c -o also save this run's results to this file, in the same format as the baseline.
+ *  - \c -t the smallest change, in percent, that counts as a regression, default 5.
+ *  - \c -s save this run as the new baseline instead of comparing to it.
+ *
+ * Each program prints its measurements as described in bench.h. For every measurement the median
+ * and a distribution free 95% confidence interval for the median are reported. A measurement is
+ * flagged as a regression when its median got worse by more than the threshold and a Mann-Whitney
+ * U test says the difference from the baseline samples is significant (p < 0.05).
+ *
+ * The exit code is 0 if nothing regressed, 1 if something did and 2 on errors.
+ */
+#include "bench.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** The most times a benchmark can be run. */
+#define BENCH_MAX_RUNS 64
+
+/** The most measurements that can be compared. */
+#define BENCH_MAX_SERIES 128
+
+/** The significance level for flagging a change. */
+#define BENCH_ALPHA 0.05
+
+/** All the samples of one measurement. */
+struct BenchSeries {
+    char name[64];                  /**< The name of the measurement. */
+    char unit[16];                  /**< The unit of the measurement. */
+    bool higher_is_better;          /**< Which direction is an improvement. */
+    size_t num_samples;             /**< The number of samples in \ref samples. */
+    double samples[BENCH_MAX_RUNS]; /**< One sample per run, sorted once the runs are done. */
+    double median;                  /**< The median of \ref samples. */
+    double ci_low;                  /**< The lower end of the 95% confidence interval. */
+    double ci_high;                 /**< The upper end of the 95% confidence interval. */
+};
+
+/** A set of measurements, from this run or from the baseline. */
+struct BenchResults {
+    size_t runs;                                  /**< The number of times the programs ran. */
+    size_t num_series;                            /**< The number of measurements. */
+    struct BenchSeries series[BENCH_MAX_SERIES];  /**< The measurements. */
+};
+
+static struct BenchSeries *
+bench_find_series(struct BenchResults *results, char const *name)
+{
+    for (size_t i = 0; i < results->num_series; i++) {
+        if (strcmp(results->series[i].name, name) == 0) {
+            return &results->series[i];
+        }
+    }
+
+    return 0;
+}
+
+/** Find a series by name, adding it if it isn't there yet. */
+static struct BenchSeries *
+bench_get_series(struct BenchResults *results, char const *name, char const *unit,
+                 bool higher_is_better)
+{
+    struct BenchSeries *series = bench_find_series(results, name);
+    if (series) {
+        return series;
+    }
+
+    StopIf(results->num_series == BENCH_MAX_SERIES, return 0, "too many measurements");
+
+    series = &results->series[results->num_series++];
+    *series = (struct BenchSeries){.higher_is_better = higher_is_better};
+    snprintf(series->name, sizeof(series->name), "%s", name);
+    snprintf(series->unit, sizeof(series->unit), "%s", unit);
+
+    return series;
+}
+
+/** Run a benchmark program once and add its measurements to \a results. */
+static int
+bench_run_program(char const *program, struct BenchResults *results)
+{
+    FILE *out = popen(program, "r");
+    StopIf(!out, return -1, "unable to run %s", program);
+
+    char line[512] = {0};
+    while (fgets(line, sizeof(line), out)) {
+        char name[64] = {0};
+        char unit[16] = {0};
+        char better[8] = {0};
+        double value = 0.0;
+
+        if (sscanf(line, "BENCH %63s %lf %15s %7s", name, &value, unit, better) != 4) {
+            continue;
+        }
+
+        struct BenchSeries *series =
+            bench_get_series(results, name, unit, strcmp(better, "higher") == 0);
+        StopIf(!series, pclose(out); return -1, "unable to record %s", name);
+
+        if (series->num_samples < BENCH_MAX_RUNS) {
+            series->samples[series->num_samples++] = value;
+        }
+    }
+
+    int status = pclose(out);
+    StopIf(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0, return -1,
+           "%s failed", program);
+
+    return 0;
+}
+
+/** Sort the samples and fill in the median and its confidence interval.
+ *
+ * The interval is between the order statistics that bracket the median with at least 95%
+ * probability according to the binomial distribution, so it makes no assumptions about how the
+ * samples are distributed. With fewer than 6 samples that isn't possible and the interval is the
+ * range of the samples.
+ */
+static void
+bench_summarize(struct BenchSeries *series)
+{
+    size_t n = series->num_samples;
+    if (n == 0) {
+        return;
+    }
+
+    double *s = series->samples;
+    series->median = bench_median(n, s);
+
+    // Find the largest k with P(B <= k - 1) <= 0.025 for B ~ Binomial(n, 1/2).
+    size_t k = 0;
+    double term = pow(0.5, n); // P(B = 0)
+    double cumulative = term;
+    while (cumulative <= (1.0 - 0.95) / 2.0 && k < n / 2) {
+        k++;
+        term *= (double)(n - k + 1) / k;
+        cumulative += term;
+    }
+
+    series->ci_low = k > 0 ? s[k - 1] : s[0];
+    series->ci_high = k > 0 ? s[n - k] : s[n - 1];
+}
+
+/** The two sided p-value of a Mann-Whitney U test, using the normal approximation. */
+static double
+bench_mann_whitney_p(struct BenchSeries const *a, struct BenchSeries const *b)
+{
+    size_t n1 = a->num_samples;
+    size_t n2 = b->num_samples;
+    if (n1 == 0 || n2 == 0) {
+        return 1.0;
+    }
+
+    double u = 0.0;
+    for (size_t i = 0; i < n1; i++) {
+        for (size_t j = 0; j < n2; j++) {
+            if (a->samples[i] > b->samples[j]) {
+                u += 1.0;
+            } else if (a->samples[i] == b->samples[j]) {
+                u += 0.5;
+            }
+        }
+    }
+
+    double mean = n1 * n2 / 2.0;
+    double sd = sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0);
+    double z = (fabs(u - mean) - 0.5) / sd;
+    if (z < 0.0) {
+        z = 0.0;
+    }
+
+    return erfc(z / sqrt(2.0));
+}
+
+static int
+bench_save(char const *path, struct BenchResults const *results)
+{
+    FILE *f = fopen(path, "w");
+    StopIf(!f, return -1, "unable to write %s", path);
+
+    fprintf(f, "{\n  \"runs\": %zu,\n  \"benchmarks\": [\n", results->runs);
+    for (size_t i = 0; i < results->num_series; i++) {
+        struct BenchSeries const *s = &results->series[i];
+
+        fprintf(f,
+                "    {\"name\": \"%s\", \"unit\": \"%s\", \"better\": \"%s\", \"median\": %.9g, "
+                "\"ci_low\": %.9g, \"ci_high\": %.9g, \"samples\": [",
+                s->name, s->unit, s->higher_is_better ? "higher" : "lower", s->median, s->ci_low,
+                s->ci_high);
+        for (size_t j = 0; j < s->num_samples; j++) {
+            fprintf(f, "%s%.9g", j ? ", " : "", s->samples[j]);
+        }
+        fprintf(f, "]}%s\n", i + 1 < results->num_series ? "," : "");
+    }
+    fputs("  ]\n}\n", f);
+
+    StopIf(fclose(f), return -1, "unable to write %s", path);
+    return 0;
+}
+
+/** Copy the string value of \a key in a line written by bench_save(). */
+static bool
+bench_json_string(char const *line, char const *key, size_t size, char buf[size])
+{
+    char pattern[32] = {0};
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+
+    char const *start = strstr(line, pattern);
+    if (!start) {
+        return false;
+    }
+    start += strlen(pattern);
+
+    char const *end = strchr(start, '"');
+    if (!end || (size_t)(end - start) >= size) {
+        return false;
+    }
+
+    memcpy(buf, start, end - start);
+    buf[end - start] = '\0';
+    return true;
+}
+
+/** Load a baseline written by bench_save(), each measurement is on a line of its own. */
+static int
+bench_load(char const *path, struct BenchResults *results)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+
+    *results = (struct BenchResults){0};
+
+    char line[8192] = {0};
+    while (fgets(line, sizeof(line), f)) {
+        char const *runs = strstr(line, "\"runs\": ");
+        if (runs) {
+            results->runs = strtoul(runs + strlen("\"runs\": "), 0, 10);
+            continue;
+        }
+
+        char name[64] = {0};
+        char unit[16] = {0};
+        char better[8] = {0};
+        if (!bench_json_string(line, "name", sizeof(name), name) ||
+            !bench_json_string(line, "unit", sizeof(unit), unit) ||
+            !bench_json_string(line, "better", sizeof(better), better)) {
+            continue;
+        }
+
+        struct BenchSeries *series =
+            bench_get_series(results, name, unit, strcmp(better, "higher") == 0);
+        StopIf(!series, break, "baseline %s has too many measurements", path);
+
+        char const *samples = strstr(line, "\"samples\": [");
+        if (!samples) {
+            continue;
+        }
+
+        char *next = (char *)samples + strlen("\"samples\": [");
+        while (series->num_samples < BENCH_MAX_RUNS) {
+            char *end = 0;
+            double value = strtod(next, &end);
+            if (end == next) {
+                break;
+            }
+            series->samples[series->num_samples++] = value;
+            next = end + strspn(end, ", ");
+        }
+
+        bench_summarize(series);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/** Print how each measurement compares to the baseline.
+ *
+ * \returns the number of regressions.
+ */
+static size_t
+bench_report(struct BenchResults *current, struct BenchResults *baseline, double threshold)
+{
+    size_t num_regressions = 0;
+
+    printf("%-28s %-7s %12s %12s %27s %8s %7s  %s\n", "benchmark", "unit", "baseline", "median",
+           "95% CI", "change", "p", "verdict");
+
+    for (size_t i = 0; i < current->num_series; i++) {
+        struct BenchSeries *cur = &current->series[i];
+        struct BenchSeries *base = bench_find_series(baseline, cur->name);
+
+        char ci[64] = {0};
+        snprintf(ci, sizeof(ci), "[%.4g, %.4g]", cur->ci_low, cur->ci_high);
+
+        if (!base || base->num_samples == 0) {
+            printf("%-28s %-7s %12s %12.4g %27s %8s %7s  %s\n", cur->name, cur->unit, "-",
+                   cur->median, ci, "-", "-", "new");
+            continue;
+        }
+
+        double change = (cur->median - base->median) / fabs(base->median);
+        double worse = cur->higher_is_better ? -change : change;
+        double p = bench_mann_whitney_p(cur, base);
+
+        char const *verdict = "ok";
+        if (p < BENCH_ALPHA && worse > threshold) {
+            verdict = "REGRESSION";
+            num_regressions++;
+        } else if (p < BENCH_ALPHA && -worse > threshold) {
+            verdict = "improved";
+        }
+
+        printf("%-28s %-7s %12.4g %12.4g %27s %+7.1f%% %7.3f  %s\n", cur->name, cur->unit,
+               base->median, cur->median, ci, 100.0 * change, p, verdict);
+    }
+
+    for (size_t i = 0; i < baseline->num_series; i++) {
+        if (!bench_find_series(current, baseline->series[i].name)) {
+            printf("%-28s missing from this run\n", baseline->series[i].name);
+        }
+    }
+
+    return num_regressions;
+}
+
+int
+main(int argc, char *argv[argc + 1])
+{
+    size_t runs = 7;
+    char const *baseline_path = "bench/baseline.json";
+    char const *results_path = 0;
+    double threshold = 0.05;
+    bool save = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "r:b:o:t:s")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = strtoul(optarg, 0, 10);
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        case 't':
+            threshold = strtod(optarg, 0) / 100.0;
+            break;
+        case 's':
+            save = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r RUNS] [-b BASELINE] [-o RESULTS] [-t PERCENT] [-s] "
+                            "PROGRAM...\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    StopIf(optind >= argc, return 2, "no benchmark programs given");
+    StopIf(runs < 1 || runs > BENCH_MAX_RUNS, return 2, "runs must be from 1 to %d",
+           BENCH_MAX_RUNS);
+
+    static struct BenchResults current = {0};
+    static struct BenchResults baseline = {0};
+
+    // Interleave the programs so a slow stretch on the machine doesn't land on just one of them.
+    current.runs = runs;
+    for (size_t r = 0; r < runs; r++) {
+        for (int i = optind; i < argc; i++) {
+            fprintf(stderr, "run %zu/%zu: %s\n", r + 1, runs, argv[i]);
+            StopIf(bench_run_program(argv[i], &current), return 2, "benchmark failed");
+        }
+    }
+
+    for (size_t i = 0; i < current.num_series; i++) {
+        bench_summarize(&current.series[i]);
+    }
+
+    if (results_path) {
+        StopIf(bench_save(results_path, &current), return 2, "unable to save the results");
+    }
+
+    if (save || bench_load(baseline_path, &baseline)) {
+        StopIf(bench_save(baseline_path, &current), return 2, "unable to save the baseline");
+        printf("saved baseline %s\n", baseline_path);
+        bench_report(&current, &(struct BenchResults){0}, threshold);
+        return 0;
+    }
+
+    size_t num_regressions = bench_report(&current, &baseline, threshold);
+    if (num_regressions) {
+        printf("%zu regression%s against %s\n", num_regressions, num_regressions > 1 ? "s" : "",
+               baseline_path);
+        return 1;
+    }
+
+    return 0;
+}
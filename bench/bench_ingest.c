@@ -0,0 +1,230 @@
+/** \file bench_ingest.c
+ *
+ * \brief Benchmark parsing and storing downloaded responses.
+ *
+ * Usage: bench_ingest [-c CHUNK_BYTES] [FILE...]
+ *
+ * Replays SynopticLabs CSV responses through the same path a download takes after cURL, from the
+ * write callback through the CSV parser into the local store, with the network out of the picture.
+ * The responses are read from the files, which must name their stations in \c # \c STATION:
+ * comments, or generated with the synthetic data generator if there are none. They are handed to
+ * the parser \c CHUNK_BYTES at a time, by default the 16 KiB cURL uses.
+ *
+ * Every run stores the responses in a new store. Reports the median parse rate, the end to end
+ * row rate, the insert rate, and the peak resident set size.
+ */
+#include "bench.h"
+#include "download.h"
+#include "obs.h"
+#include "obs_store.h"
+#include "synth.h"
+#include "utils.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/** The number of times the responses are stored. */
+#define BENCH_ITERATIONS 5
+
+/** The most stations in a response. */
+#define BENCH_MAX_SITES OBS_DOWNLOAD_MAX_SITES_PER_REQUEST
+
+/** The seed, number of stations and number of years of the generated response. */
+#define BENCH_SEED 1
+#define BENCH_SYNTH_SITES 10
+#define BENCH_SYNTH_YEARS 2
+
+/** The end of the generated data, 2024-01-01 00Z. */
+#define BENCH_END 1704067200
+
+/** A response and the request it answers. */
+struct BenchPayload {
+    char *data;
+    size_t len;
+    size_t num_sites;
+    char sites[BENCH_MAX_SITES][32];
+    char const *site_ids[BENCH_MAX_SITES];
+    struct ObsTimeRange tr;
+};
+
+/** Find the stations named in the comments of a response. */
+static int
+bench_payload_find_sites(struct BenchPayload *payload)
+{
+    static char const *const marker = "# STATION:";
+    size_t const marker_len = strlen(marker);
+
+    char const *line = payload->data;
+    char const *end = payload->data + payload->len;
+    while (line < end) {
+        char const *next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+
+        if ((size_t)(next - line) > marker_len && strncmp(line, marker, marker_len) == 0) {
+            StopIf(payload->num_sites == BENCH_MAX_SITES, return -1, "too many stations");
+
+            char *site = payload->sites[payload->num_sites];
+            char const *c = line + marker_len;
+            while (c < next && isspace(*c)) {
+                c++;
+            }
+            for (size_t i = 0; c < next && !isspace(*c) && i < sizeof(payload->sites[0]) - 1; i++) {
+                site[i] = tolower(*c);
+                c++;
+            }
+
+            payload->site_ids[payload->num_sites] = site;
+            payload->num_sites++;
+        }
+
+        line = next;
+    }
+
+    StopIf(payload->num_sites == 0, return -1, "no '%s' comments found", marker);
+
+    return 0;
+}
+
+/** Read a recorded response. */
+static int
+bench_payload_read(char const *path, struct BenchPayload *payload)
+{
+    FILE *f = fopen(path, "rb");
+    StopIf(!f, return -1, "unable to open %s", path);
+
+    int rc = -1;
+    StopIf(fseek(f, 0, SEEK_END), goto CLEAN_UP, "unable to seek in %s", path);
+    long len = ftell(f);
+    StopIf(len < 0, goto CLEAN_UP, "unable to size %s", path);
+    rewind(f);
+
+    payload->data = malloc(len + 1);
+    StopIf(!payload->data, goto CLEAN_UP, "out of memory");
+
+    payload->len = fread(payload->data, 1, len, f);
+    StopIf(payload->len != (size_t)len, goto CLEAN_UP, "unable to read %s", path);
+
+    // The requested time range isn't saved with the response, so ask for everything.
+    payload->tr = (struct ObsTimeRange){.start = 0, .end = BENCH_END};
+
+    rc = bench_payload_find_sites(payload);
+
+CLEAN_UP:
+    fclose(f);
+    return rc;
+}
+
+/** Generate a response with the synthetic data generator. */
+static int
+bench_payload_generate(struct BenchPayload *payload)
+{
+    payload->tr = (struct ObsTimeRange){
+        .start = BENCH_END - BENCH_SYNTH_YEARS * 365 * 24 * HOURSEC, .end = BENCH_END};
+
+    FILE *f = open_memstream(&payload->data, &payload->len);
+    StopIf(!f, return -1, "unable to open a memory stream");
+
+    size_t num_obs = obs_synth_write_csv(f, BENCH_SEED, 0, BENCH_SYNTH_SITES, payload->tr);
+    StopIf(fclose(f) || num_obs == SIZE_MAX, return -1, "unable to generate a response");
+
+    return bench_payload_find_sites(payload);
+}
+
+/** Store all the responses in a new store. */
+static int
+bench_replay(size_t num_payloads, struct BenchPayload payloads[num_payloads], size_t chunk_size,
+             struct ObsDownloadReplayStats *stats)
+{
+    char home[32] = {0};
+    StopIf(bench_temp_home(home), return -1, "unable to set up");
+
+    int rc = -1;
+
+    ObsStore *store = obs_connect("BENCHMARK");
+    StopIf(!store, goto CLEAN_UP, "unable to connect");
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, goto CLEAN_UP, "unable to open the store");
+
+    for (size_t i = 0; i < num_payloads; i++) {
+        struct BenchPayload *p = &payloads[i];
+        rc = obs_download_replay(db, p->num_sites, p->site_ids, p->tr, p->data, p->len,
+                                 chunk_size, stats);
+        StopIf(rc, goto CLEAN_UP, "unable to store a response");
+    }
+
+CLEAN_UP:
+    if (store) {
+        obs_close(&store);
+    }
+    bench_remove_temp_home(home);
+
+    return rc;
+}
+
+int
+main(int argc, char *argv[argc + 1])
+{
+    size_t chunk_size = CURL_MAX_WRITE_SIZE;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            chunk_size = strtoul(optarg, 0, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c CHUNK_BYTES] [FILE...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    StopIf(chunk_size == 0, return EXIT_FAILURE, "the chunk size must be positive");
+
+    int exit_code = EXIT_FAILURE;
+
+    size_t num_payloads = optind < argc ? argc - optind : 1;
+    struct BenchPayload *payloads = calloc(num_payloads, sizeof(*payloads));
+    StopIf(!payloads, return EXIT_FAILURE, "out of memory");
+
+    for (size_t i = 0; i < num_payloads; i++) {
+        int rc = optind < argc ? bench_payload_read(argv[optind + i], &payloads[i])
+                               : bench_payload_generate(&payloads[i]);
+        StopIf(rc, goto CLEAN_UP, "unable to load the responses");
+    }
+
+    double parse_mb_per_sec[BENCH_ITERATIONS] = {0};
+    double rows_per_sec[BENCH_ITERATIONS] = {0};
+    double insert_rows_per_sec[BENCH_ITERATIONS] = {0};
+
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        struct ObsDownloadReplayStats stats = {0};
+        StopIf(bench_replay(num_payloads, payloads, chunk_size, &stats), goto CLEAN_UP,
+               "replay failed");
+        StopIf(stats.num_rows == 0, goto CLEAN_UP, "nothing was stored");
+
+        parse_mb_per_sec[i] = stats.num_bytes / 1.0e6 / (stats.parse_ms / 1000.0);
+        rows_per_sec[i] = stats.num_rows / ((stats.parse_ms + stats.store_ms) / 1000.0);
+        insert_rows_per_sec[i] = stats.num_rows / (stats.store_ms / 1000.0);
+    }
+
+    bench_report_higher("ingest_parse_mb_per_sec", bench_median(BENCH_ITERATIONS, parse_mb_per_sec),
+                        "MB/s");
+    bench_report_higher("ingest_rows_per_sec", bench_median(BENCH_ITERATIONS, rows_per_sec),
+                        "rows/s");
+    bench_report_higher("ingest_insert_rows_per_sec",
+                        bench_median(BENCH_ITERATIONS, insert_rows_per_sec), "rows/s");
+    bench_report_peak_rss("ingest_peak_rss");
+    exit_code = EXIT_SUCCESS;
+
+CLEAN_UP:
+    for (size_t i = 0; i < num_payloads; i++) {
+        free(payloads[i].data);
+    }
+    free(payloads);
+
+    return exit_code;
+}
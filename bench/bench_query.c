@@ -0,0 +1,190 @@
+/** \file bench_query.c
+ *
+ * \brief Benchmark loading a store and querying it.
+ *
+ * Usage: bench_query
+ *
+ * Fills a new store in a temporary directory with ten years of synthetic observations for a few
+ * sites, then times queries against it with the network and the shared cache out of the picture.
+ * Reports the insert rate while filling, the median latency of each kind of query, and the peak
+ * resident set size.
+ */
+#include "bench.h"
+#include "obs.h"
+#include "obs_db.h"
+#include "obs_store.h"
+#include "synth.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/** The number of sites in the store. */
+#define BENCH_NUM_SITES 4
+
+/** The number of years of data for each site. */
+#define BENCH_YEARS 10
+
+/** The number of times each query is timed. */
+#define BENCH_ITERATIONS 30
+
+/** The end of the data, 2024-01-01 00Z. */
+#define BENCH_END 1704067200
+
+/** The seed of the synthetic data. */
+#define BENCH_SEED 1
+
+/** The ids of the sites, filled in by bench_fill(). */
+static char bench_sites[BENCH_NUM_SITES][8] = {{0}};
+
+static struct ObsTimeRange const bench_all = {BENCH_END - BENCH_YEARS * 365 * 24 * HOURSEC,
+                                              BENCH_END};
+
+/** Fill the store with synthetic data for the first few stations that report precipitation. */
+static int
+bench_fill(sqlite3 *db)
+{
+    double start = obs_util_monotonic_ms();
+    size_t num_rows = 0;
+
+    for (size_t s = 0, index = 0; s < BENCH_NUM_SITES; index++) {
+        struct ObsSynthStation station = {0};
+        obs_synth_station(BENCH_SEED, index, &station);
+        if (!station.has_precip) {
+            continue;
+        }
+
+        size_t num = obs_synth_fill_store(db, BENCH_SEED, index, 1, bench_all);
+        StopIf(num == SIZE_MAX, return -1, "unable to fill the store");
+        num_rows += num;
+
+        obs_util_strcpy_to_lowercase(sizeof(bench_sites[s]), bench_sites[s], station.id);
+        s++;
+    }
+
+    double seconds = (obs_util_monotonic_ms() - start) / 1000.0;
+    bench_report_higher("fill_rows_per_sec", num_rows / seconds, "rows/s");
+
+    return 0;
+}
+
+/** Which query to time. */
+enum BenchQuery {
+    BENCH_MAX_T,
+    BENCH_MIN_T,
+    BENCH_MIN_T_COMPACT,
+    BENCH_PRECIP,
+    BENCH_PRECIP_COMPACT,
+    BENCH_DAILY_SUMMARY,
+    BENCH_INVENTORY
+};
+
+/** Time a query, returning the median latency in milliseconds or NAN on failure. */
+static double
+bench_time_query(ObsStore *store, enum BenchQuery query, struct ObsTimeRange tr)
+{
+    double samples[BENCH_ITERATIONS] = {0};
+
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        char const *site = bench_sites[i % BENCH_NUM_SITES];
+        struct ObsTemperature *temps = 0;
+        struct ObsPrecipitation *precip = 0;
+        struct ObsTemperatureCompact *compact_temps = 0;
+        struct ObsPrecipitationCompact *compact_precip = 0;
+        struct ObsDailySummary *summary = 0;
+        struct ObsTimeRange *missing = 0;
+        size_t num = 0;
+        int rc = 0;
+
+        double start = obs_util_monotonic_ms();
+        switch (query) {
+        case BENCH_MAX_T:
+            rc = obs_query_max_t(store, site, tr, 6, 24, &temps, &num);
+            break;
+        case BENCH_MIN_T:
+            rc = obs_query_min_t(store, site, tr, 18, 24, &temps, &num);
+            break;
+        case BENCH_MIN_T_COMPACT:
+            rc = obs_query_min_t_compact(store, site, tr, 18, 24, &compact_temps, &num);
+            break;
+        case BENCH_PRECIP:
+            rc = obs_query_precipitation(store, site, tr, 24, 24, 12, &precip, &num);
+            break;
+        case BENCH_PRECIP_COMPACT:
+            rc = obs_query_precipitation_compact(store, site, tr, 24, 24, 12, &compact_precip,
+                                                 &num);
+            break;
+        case BENCH_DAILY_SUMMARY:
+            rc = obs_query_daily_summary(store, site, tr, 6, 24, &summary, &num);
+            break;
+        case BENCH_INVENTORY:
+            rc = obs_db_have_inventory(obs_store_db(store), site, tr, &missing, &num) < 0;
+            break;
+        }
+        samples[i] = obs_util_monotonic_ms() - start;
+
+        free(temps);
+        free(precip);
+        free(compact_temps);
+        free(compact_precip);
+        free(summary);
+        free(missing);
+        StopIf(rc, return NAN, "query failed");
+    }
+
+    return bench_median(BENCH_ITERATIONS, samples);
+}
+
+int
+main(void)
+{
+    char home[32] = {0};
+    StopIf(bench_temp_home(home), return EXIT_FAILURE, "unable to set up");
+
+    int exit_code = EXIT_FAILURE;
+
+    ObsStore *store = obs_connect("BENCHMARK");
+    StopIf(!store, goto CLEAN_UP, "unable to connect");
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, goto CLEAN_UP, "unable to open the store");
+
+    StopIf(bench_fill(db), goto CLEAN_UP, "unable to fill the store");
+
+    // Leave the first day out so the windows that start before the data are complete.
+    struct ObsTimeRange all = {bench_all.start + 24 * HOURSEC, bench_all.end};
+    struct ObsTimeRange year = {bench_all.end - 365 * 24 * HOURSEC, bench_all.end};
+
+    struct {
+        char const *name;
+        enum BenchQuery query;
+        struct ObsTimeRange tr;
+    } const cases[] = {
+        {"query_max_t_1y_ms", BENCH_MAX_T, year},
+        {"query_min_t_10y_ms", BENCH_MIN_T, all},
+        {"query_min_t_compact_10y_ms", BENCH_MIN_T_COMPACT, all},
+        {"query_precip_1y_ms", BENCH_PRECIP, year},
+        {"query_precip_10y_ms", BENCH_PRECIP, all},
+        {"query_precip_compact_10y_ms", BENCH_PRECIP_COMPACT, all},
+        {"query_daily_summary_10y_ms", BENCH_DAILY_SUMMARY, all},
+        {"inventory_10y_ms", BENCH_INVENTORY, all},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        double ms = bench_time_query(store, cases[i].query, cases[i].tr);
+        StopIf(isnan(ms), goto CLEAN_UP, "%s failed", cases[i].name);
+        bench_report_lower(cases[i].name, ms, "ms");
+    }
+
+    bench_report_peak_rss("query_peak_rss");
+    exit_code = EXIT_SUCCESS;
+
+CLEAN_UP:
+    if (store) {
+        obs_close(&store);
+    }
+    bench_remove_temp_home(home);
+
+    return exit_code;
+}
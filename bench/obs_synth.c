@@ -0,0 +1,115 @@
+/** \file obs_synth.c
+ *
+ * \brief Make a synthetic data set, as a CSV response or straight into the local store.
+ *
+ * Usage: obs_synth [-s SEED] [-n SITES] [-f FIRST] [-y YEARS] [-e END] (-c FILE | -d)
+ *
+ *  - \c -s the seed that picks the data set, default 1.
+ *  - \c -n the number of stations, default 10.
+ *  - \c -f the index of the first station, default 0.
+ *  - \c -y the number of years of data, default 1.
+ *  - \c -e the end of the data in seconds since the epoch, default 2024-01-01 00Z.
+ *  - \c -c write a SynopticLabs CSV response to FILE, or standard output if FILE is -.
+ *  - \c -d store the data in the local store in $HOME.
+ *
+ * The same options always make the same data.
+ */
+#include "obs.h"
+#include "obs_store.h"
+#include "synth.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+static void
+obs_synth_usage(char const *program)
+{
+    fprintf(stderr,
+            "usage: %s [-s SEED] [-n SITES] [-f FIRST] [-y YEARS] [-e END] (-c FILE | -d)\n",
+            program);
+}
+
+int
+main(int argc, char *argv[argc + 1])
+{
+    uint64_t seed = 1;
+    size_t num_sites = 10;
+    size_t first_site = 0;
+    double years = 1.0;
+    time_t end = 1704067200;
+    char const *csv_path = 0;
+    bool to_store = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "s:n:f:y:e:c:d")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, 0, 10);
+            break;
+        case 'n':
+            num_sites = strtoul(optarg, 0, 10);
+            break;
+        case 'f':
+            first_site = strtoul(optarg, 0, 10);
+            break;
+        case 'y':
+            years = strtod(optarg, 0);
+            break;
+        case 'e':
+            end = strtoll(optarg, 0, 10);
+            break;
+        case 'c':
+            csv_path = optarg;
+            break;
+        case 'd':
+            to_store = true;
+            break;
+        default:
+            obs_synth_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!csv_path == !to_store || years <= 0.0) {
+        obs_synth_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct ObsTimeRange tr = {end - (time_t)(years * 365.0 * 24 * HOURSEC), end};
+    size_t num_obs = 0;
+
+    if (csv_path) {
+        FILE *f = strcmp(csv_path, "-") == 0 ? stdout : fopen(csv_path, "w");
+        StopIf(!f, return EXIT_FAILURE, "unable to open %s", csv_path);
+
+        num_obs = obs_synth_write_csv(f, seed, first_site, num_sites, tr);
+
+        StopIf(f != stdout && fclose(f), return EXIT_FAILURE, "unable to write %s", csv_path);
+    } else {
+        ObsStore *store = obs_connect("SYNTHETIC");
+        StopIf(!store, return EXIT_FAILURE, "unable to connect to the store");
+
+        // One station at a time, each goes in its own shard if the archive is sharded.
+        num_obs = 0;
+        for (size_t i = first_site; i < first_site + num_sites && num_obs != SIZE_MAX; i++) {
+            struct ObsSynthStation station = {0};
+            obs_synth_station(seed, i, &station);
+
+            sqlite3 *db = obs_store_site_db(store, station.id);
+            size_t num = db ? obs_synth_fill_store(db, seed, i, 1, tr) : SIZE_MAX;
+            num_obs = num == SIZE_MAX ? SIZE_MAX : num_obs + num;
+        }
+
+        obs_close(&store);
+    }
+
+    StopIf(num_obs == SIZE_MAX, return EXIT_FAILURE, "unable to make the data set");
+    fprintf(stderr, "%zu observations for %zu stations\n", num_obs, num_sites);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+/** \file synth.c
+ *
+ * \brief Implementation of the synthetic observations.
+ */
+#include "synth.h"
+#include "obs_db.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/** How long (in hours) weather departures from the climate take to fade. */
+#define OBS_SYNTH_WEATHER_HOURS 36.0
+
+/** The typical size of weather departures from the climate, in Fahrenheit. */
+#define OBS_SYNTH_WEATHER_F 6.0
+
+/** The average time between outages, in seconds. */
+#define OBS_SYNTH_OUTAGE_EVERY_SEC (45.0 * 24 * HOURSEC)
+
+/** The chance a wet hour is followed by a dry one. */
+#define OBS_SYNTH_DRY_CHANCE 0.3
+
+/** The average rain in a wet hour, in inches. */
+#define OBS_SYNTH_WET_HOUR_IN 0.04
+
+/** How precipitation too small to measure is written. */
+#define OBS_SYNTH_TRACE_IN 0.001
+
+/** The chance a temperature is missing from a report. */
+#define OBS_SYNTH_MISSING_T_CHANCE 0.002
+
+/** splitmix64, a small fast generator that is fine for test data. */
+static uint64_t
+obs_synth_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15u);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return z ^ (z >> 31);
+}
+
+/** A uniform random number in [0, 1). */
+static double
+obs_synth_uniform(uint64_t *state)
+{
+    return (obs_synth_rand(state) >> 11) * 0x1.0p-53;
+}
+
+/** An exponentially distributed random number. */
+static double
+obs_synth_exponential(uint64_t *state, double mean)
+{
+    return -mean * log(1.0 - obs_synth_uniform(state));
+}
+
+/** A normally distributed random number with mean 0 and standard deviation 1. */
+static double
+obs_synth_normal(uint64_t *state)
+{
+    double u1 = 1.0 - obs_synth_uniform(state);
+    double u2 = obs_synth_uniform(state);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/** The seed of the generator for a station, so each station's data depends on nothing else. */
+static uint64_t
+obs_synth_station_seed(uint64_t seed, size_t index)
+{
+    uint64_t state = seed ^ (0xD1B54A32D192ED03u * (index + 1));
+    return obs_synth_rand(&state);
+}
+
+void
+obs_synth_station(uint64_t seed, size_t index, struct ObsSynthStation *station)
+{
+    uint64_t rng = obs_synth_station_seed(seed, index);
+
+    *station = (struct ObsSynthStation){0};
+
+    if (index < 26 * 26 * 26) {
+        snprintf(station->id, sizeof(station->id), "K%c%c%c", (int)('A' + index / (26 * 26)),
+                 (int)('A' + index / 26 % 26), (int)('A' + index % 26));
+    } else {
+        snprintf(station->id, sizeof(station->id), "S%05zu", index % 100000);
+    }
+
+    double pick = obs_synth_uniform(&rng);
+    if (pick < 0.6) {
+        station->cadence = OBS_SYNTH_METAR;
+        station->minute = 53;
+        station->has_precip = obs_synth_uniform(&rng) >= 0.1;
+    } else if (pick < 0.75) {
+        station->cadence = OBS_SYNTH_FIVE_MINUTE;
+        station->minute = 0;
+        station->has_precip = obs_synth_uniform(&rng) >= 0.1;
+    } else if (pick < 0.9) {
+        station->cadence = OBS_SYNTH_RAWS;
+        station->minute = (unsigned)(obs_synth_uniform(&rng) * 60);
+        station->has_precip = true;
+    } else {
+        station->cadence = OBS_SYNTH_SYNOPTIC;
+        station->minute = 0;
+        station->has_precip = false;
+    }
+
+    station->mean_t_f = 35.0 + 40.0 * obs_synth_uniform(&rng);
+    station->annual_range_f = 5.0 + 25.0 * obs_synth_uniform(&rng);
+    station->diurnal_range_f = 4.0 + 14.0 * obs_synth_uniform(&rng);
+    station->wet_chance = 0.005 + 0.03 * obs_synth_uniform(&rng);
+    if (station->cadence == OBS_SYNTH_METAR) {
+        station->specials_per_day = 0.5 + obs_synth_uniform(&rng);
+    }
+}
+
+/** The seconds between regular reports. */
+static time_t
+obs_synth_interval(enum ObsSynthCadence cadence)
+{
+    switch (cadence) {
+    case OBS_SYNTH_FIVE_MINUTE:
+        return 5 * 60;
+    case OBS_SYNTH_SYNOPTIC:
+        return 3 * HOURSEC;
+    case OBS_SYNTH_METAR:
+    case OBS_SYNTH_RAWS:
+    default:
+        return HOURSEC;
+    }
+}
+
+/** Pick the time of the next outage after \a after. */
+static void
+obs_synth_schedule_outage(struct ObsSynthStream *stream, time_t after)
+{
+    stream->outage_start = after + (time_t)obs_synth_exponential(&stream->rng,
+                                                                 OBS_SYNTH_OUTAGE_EVERY_SEC);
+
+    // From an hour to a week, spread evenly on a log scale.
+    double hours = exp(log(168.0) * obs_synth_uniform(&stream->rng));
+    stream->outage_end = stream->outage_start + (time_t)(hours * HOURSEC);
+}
+
+/** Pick the time of the next special after \a after, specials come 4 times as often in rain. */
+static void
+obs_synth_schedule_special(struct ObsSynthStream *stream, time_t after)
+{
+    double per_day = stream->station.specials_per_day * (stream->wet ? 4.0 : 1.0);
+    if (per_day <= 0.0) {
+        stream->next_special = stream->tr.end;
+        return;
+    }
+
+    // Reports are made on the minute.
+    time_t wait = (time_t)obs_synth_exponential(&stream->rng, 24.0 * HOURSEC / per_day);
+    stream->next_special = (after + 60 + wait) / 60 * 60;
+}
+
+void
+obs_synth_stream_init(struct ObsSynthStream *stream, uint64_t seed, size_t index,
+                      struct ObsTimeRange tr)
+{
+    *stream = (struct ObsSynthStream){.tr = tr};
+    obs_synth_station(seed, index, &stream->station);
+
+    // Use a different sequence than the one that picked the station's character.
+    stream->rng = obs_synth_station_seed(seed, index) ^ 0x5851F42D4C957F2Du;
+
+    time_t interval = obs_synth_interval(stream->station.cadence);
+    time_t first = tr.start / interval * interval + stream->station.minute * 60;
+    while (first < tr.start) {
+        first += interval;
+    }
+    stream->next_regular = first;
+
+    stream->weather_time = tr.start;
+    stream->weather_f = OBS_SYNTH_WEATHER_F * obs_synth_normal(&stream->rng);
+    stream->rain_hour = tr.start / HOURSEC;
+
+    obs_synth_schedule_outage(stream, tr.start);
+    obs_synth_schedule_special(stream, tr.start);
+}
+
+/** Move the rain forward hour by hour to the hour containing \a t. */
+static void
+obs_synth_advance_rain(struct ObsSynthStream *stream, time_t t)
+{
+    time_t hour = t / HOURSEC;
+    while (stream->rain_hour < hour) {
+        double chance = stream->wet ? 1.0 - OBS_SYNTH_DRY_CHANCE : stream->station.wet_chance;
+        stream->wet = obs_synth_uniform(&stream->rng) < chance;
+        stream->rain_hour++;
+
+        stream->rain_in = 0.0;
+        if (stream->wet) {
+            double amount = obs_synth_exponential(&stream->rng, OBS_SYNTH_WET_HOUR_IN);
+            amount = round(amount * 100.0) / 100.0;
+            stream->rain_in = amount > 0.0 ? amount : OBS_SYNTH_TRACE_IN;
+        }
+    }
+}
+
+/** The temperature at \a t, the weather noise is an AR(1) process in time. */
+static double
+obs_synth_temperature(struct ObsSynthStream *stream, time_t t)
+{
+    struct ObsSynthStation const *st = &stream->station;
+
+    double hours = (t - stream->weather_time) / (double)HOURSEC;
+    double keep = exp(-hours / OBS_SYNTH_WEATHER_HOURS);
+    double shock = OBS_SYNTH_WEATHER_F * obs_synth_normal(&stream->rng);
+    stream->weather_f = keep * stream->weather_f + sqrt(1.0 - keep * keep) * shock;
+    stream->weather_time = t;
+
+    // Coldest in mid January and at dawn, warmest in mid July and mid afternoon.
+    double year_day = fmod(t / 86400.0, 365.2425);
+    double day_hour = (t % 86400) / (double)HOURSEC;
+    double annual = cos(2.0 * M_PI * (year_day - 15.0) / 365.2425);
+    double diurnal = cos(2.0 * M_PI * (day_hour - 3.0) / 24.0);
+    double t_f = st->mean_t_f - st->annual_range_f * annual - st->diurnal_range_f * diurnal +
+                 stream->weather_f;
+
+    // Temperatures are measured in whole degrees Celsius and converted.
+    double t_c = round((t_f - 32.0) * 5.0 / 9.0);
+    return round((t_c * 9.0 / 5.0 + 32.0) * 10.0) / 10.0;
+}
+
+bool
+obs_synth_next(struct ObsSynthStream *stream, struct ObsSynthOb *ob)
+{
+    struct ObsSynthStation const *st = &stream->station;
+    time_t interval = obs_synth_interval(st->cadence);
+
+    while (true) {
+        bool regular = stream->next_regular <= stream->next_special;
+        time_t t = regular ? stream->next_regular : stream->next_special;
+
+        if (t >= stream->tr.end) {
+            return false;
+        }
+
+        if (regular) {
+            stream->next_regular += interval;
+        } else {
+            obs_synth_schedule_special(stream, t);
+            if (t == stream->next_regular) {
+                continue;
+            }
+        }
+
+        if (t >= stream->outage_end) {
+            obs_synth_schedule_outage(stream, stream->outage_end);
+        }
+        if (t >= stream->outage_start && t < stream->outage_end) {
+            continue;
+        }
+
+        obs_synth_advance_rain(stream, t);
+
+        *ob = (struct ObsSynthOb){.valid_time = t, .t_f = NAN, .p_in = NAN};
+        double t_f = obs_synth_temperature(stream, t);
+        if (obs_synth_uniform(&stream->rng) >= OBS_SYNTH_MISSING_T_CHANCE) {
+            ob->t_f = t_f;
+        }
+
+        bool on_the_hour = st->cadence != OBS_SYNTH_FIVE_MINUTE || t % HOURSEC == 0;
+        if (regular && st->has_precip && on_the_hour) {
+            ob->p_in = stream->rain_in;
+        }
+
+        return true;
+    }
+}
+
+size_t
+obs_synth_write_csv(FILE *f, uint64_t seed, size_t first_site, size_t num_sites,
+                    struct ObsTimeRange tr)
+{
+    size_t num_obs = 0;
+
+    for (size_t i = first_site; i < first_site + num_sites; i++) {
+        struct ObsSynthStream stream = {0};
+        obs_synth_stream_init(&stream, seed, i, tr);
+        struct ObsSynthStation const *st = &stream.station;
+
+        fprintf(f, "# STATION: %s\n", st->id);
+        fprintf(f, "# STATION NAME: SYNTHETIC %s\n", st->id);
+        fprintf(f, "# LATITUDE: %.4f\n", 30.0 + (i % 200) * 0.1);
+        fprintf(f, "# LONGITUDE: %.4f\n", -120.0 + (i / 200 % 400) * 0.1);
+        fprintf(f, "# ELEVATION [ft]: %zu\n", (i * 37) % 9000);
+        fprintf(f, "# STATE: MT\n");
+
+        if (st->has_precip) {
+            fputs("Station_ID,Date_Time,air_temp_set_1,precip_accum_one_hour_set_1\n", f);
+            fputs(",,Fahrenheit,Inches\n", f);
+        } else {
+            fputs("Station_ID,Date_Time,air_temp_set_1\n", f);
+            fputs(",,Fahrenheit\n", f);
+        }
+
+        struct ObsSynthOb ob = {0};
+        while (obs_synth_next(&stream, &ob)) {
+            char time_buf[32] = {0};
+            struct tm tm = {0};
+            gmtime_r(&ob.valid_time, &tm);
+            strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+            fprintf(f, "%s,%s,", st->id, time_buf);
+            if (!isnan(ob.t_f)) {
+                fprintf(f, "%.1f", ob.t_f);
+            }
+            if (st->has_precip) {
+                fputc(',', f);
+                if (!isnan(ob.p_in)) {
+                    fprintf(f, "%g", ob.p_in);
+                }
+            }
+            fputc('\n', f);
+
+            num_obs++;
+        }
+    }
+
+    StopIf(ferror(f), return SIZE_MAX, "error writing synthetic observations");
+    return num_obs;
+}
+
+/** Store the observations of one station in a transaction of its own. */
+static size_t
+obs_synth_fill_site(sqlite3 *db, uint64_t seed, size_t index, struct ObsTimeRange tr)
+{
+    struct ObsSynthStream stream = {0};
+    obs_synth_stream_init(&stream, seed, index, tr);
+
+    char site[sizeof(stream.station.id)] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site), site, stream.station.id);
+
+    size_t num_obs = 0;
+
+    int rc = obs_db_start_transaction(db);
+    StopIf(rc, return SIZE_MAX, "unable to start a transaction");
+
+    struct ObsDbInserter *inserter = obs_db_create_inserter(db);
+    StopIf(!inserter, goto ERR_RETURN, "unable to create an inserter");
+
+    struct ObsSynthOb ob = {0};
+    while (obs_synth_next(&stream, &ob)) {
+        // Empty precipitation cells are read as zero, and rows without a temperature or without a
+        // precipitation column are dropped, the same as when a download is parsed.
+        double p_in = isnan(ob.p_in) && stream.station.has_precip ? 0.0 : ob.p_in;
+        if (isnan(ob.t_f) || isnan(p_in)) {
+            continue;
+        }
+
+        rc = obs_db_insert(inserter, ob.valid_time, site, ob.t_f, p_in);
+        StopIf(rc, goto ERR_RETURN, "unable to store a synthetic observation");
+        num_obs++;
+    }
+
+    rc = obs_db_inserter_flush(inserter);
+    StopIf(rc, goto ERR_RETURN, "unable to store the hour bitmaps");
+
+    rc = obs_db_add_coverage(db, site, tr);
+    StopIf(rc, goto ERR_RETURN, "unable to record coverage");
+
+    obs_db_finalize_inserter(inserter);
+
+    rc = obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
+    StopIf(rc, return SIZE_MAX, "unable to commit synthetic observations");
+
+    return num_obs;
+
+ERR_RETURN:
+    if (inserter) {
+        obs_db_finalize_inserter(inserter);
+    }
+    obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+    return SIZE_MAX;
+}
+
+size_t
+obs_synth_fill_store(sqlite3 *db, uint64_t seed, size_t first_site, size_t num_sites,
+                     struct ObsTimeRange tr)
+{
+    size_t num_obs = 0;
+
+    for (size_t i = first_site; i < first_site + num_sites; i++) {
+        size_t num_site_obs = obs_synth_fill_site(db, seed, i, tr);
+        StopIf(num_site_obs == SIZE_MAX, return SIZE_MAX, "unable to fill site %zu", i);
+
+        num_obs += num_site_obs;
+    }
+
+    return num_obs;
+}
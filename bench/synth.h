@@ -0,0 +1,112 @@
+#pragma once
+/** \file synth.h
+ *
+ * \brief Synthetic observations that look like what SynopticLabs sends.
+ *
+ * Every station gets a climate, a reporting cadence and a few quirks from the seed and its index,
+ * so the same seed always produces the same data, and any subset of the stations can be made
+ * without making the others. What the data has in it:
+ *
+ *  - Hourly METARs at :53, with sub-hourly specials that come more often when it is raining.
+ *  - Stations that report every 5 minutes, hourly at some other minute (RAWS), or every 3 hours.
+ *  - Hourly precipitation that comes in wet and dry spells, with trace amounts written as 0.001
+ *    inches. Specials and the 5 minute reports between hours have an empty precipitation cell,
+ *    and some stations have no precipitation column at all.
+ *  - Outages from an hour to a week long, and the occasional missing temperature.
+ *
+ * The temperature is a yearly and daily cycle around the station's climate plus slowly varying
+ * weather noise.
+ */
+#include "obs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sqlite3.h>
+
+/** How often a station reports. */
+enum ObsSynthCadence {
+    OBS_SYNTH_METAR,       /**< Hourly at :53 with specials in between. */
+    OBS_SYNTH_FIVE_MINUTE, /**< Every 5 minutes, precipitation only at the top of the hour. */
+    OBS_SYNTH_RAWS,        /**< Hourly at a minute of its own, always with precipitation. */
+    OBS_SYNTH_SYNOPTIC,    /**< Every 3 hours on the hour, with no precipitation column. */
+};
+
+/** The character of a synthetic station. */
+struct ObsSynthStation {
+    char id[8];                   /**< The station id, like KABC. */
+    enum ObsSynthCadence cadence; /**< How often it reports. */
+    bool has_precip;              /**< Does its data have a precipitation column? */
+    unsigned minute;              /**< The minute of the hour of its regular reports. */
+    double mean_t_f;              /**< The yearly mean temperature. */
+    double annual_range_f;        /**< Half the difference between summer and winter. */
+    double diurnal_range_f;       /**< Half the difference between day and night. */
+    double wet_chance;            /**< The chance a dry hour is followed by a wet one. */
+    double specials_per_day;      /**< How many specials a METAR station sends on a dry day. */
+};
+
+/** A single synthetic observation. */
+struct ObsSynthOb {
+    time_t valid_time; /**< When the observation was taken. */
+    double t_f;        /**< Temperature in Fahrenheit, \c NAN if missing. */
+    double p_in;       /**< Precipitation in the last hour in inches, \c NAN if not reported. */
+};
+
+/** The state of the observations of one station, to produce them in time order. */
+struct ObsSynthStream {
+    struct ObsSynthStation station; /**< The station. */
+    struct ObsTimeRange tr;         /**< Observations are made for this time range. */
+    uint64_t rng;                   /**< Random number generator state. */
+    time_t next_regular;            /**< The time of the next regular report. */
+    time_t next_special;            /**< The time of the next special, or past the end. */
+    time_t outage_start;            /**< The start of the next or current outage. */
+    time_t outage_end;              /**< The end of the next or current outage. */
+    time_t weather_time;            /**< The time \ref weather_f was last updated. */
+    double weather_f;               /**< The departure from the climate, in Fahrenheit. */
+    time_t rain_hour;               /**< The hour (since the epoch) \ref wet is for. */
+    bool wet;                       /**< Is it raining in \ref rain_hour? */
+    double rain_in;                 /**< The rain in \ref rain_hour. */
+};
+
+/** Get the character of a station.
+ *
+ * \param seed picks the data set.
+ * \param index the number of the station in the data set.
+ * \param station is where the station is stored.
+ */
+void obs_synth_station(uint64_t seed, size_t index, struct ObsSynthStation *station);
+
+/** Start producing the observations of a station for a time range. */
+void obs_synth_stream_init(struct ObsSynthStream *stream, uint64_t seed, size_t index,
+                           struct ObsTimeRange tr);
+
+/** Get the next observation of a station.
+ *
+ * \returns \c false when there are no more in the time range.
+ */
+bool obs_synth_next(struct ObsSynthStream *stream, struct ObsSynthOb *ob);
+
+/** Write the observations of some stations as a SynopticLabs CSV response.
+ *
+ * \param f where to write.
+ * \param seed picks the data set.
+ * \param first_site the index of the first station to write.
+ * \param num_sites the number of stations to write.
+ * \param tr the time range of the observations.
+ *
+ * \returns the number of observations written, or \c SIZE_MAX on a write error.
+ */
+size_t obs_synth_write_csv(FILE *f, uint64_t seed, size_t first_site, size_t num_sites,
+                           struct ObsTimeRange tr);
+
+/** Store the observations of some stations straight into a local store.
+ *
+ * Each station is stored in a transaction of its own, and the whole time range is recorded as
+ * covered so it won't be downloaded again. What is stored is what a download of the same data
+ * would store, so stations without a precipitation column end up with no observations.
+ *
+ * \returns the number of observations stored, or \c SIZE_MAX on failure.
+ */
+size_t obs_synth_fill_store(sqlite3 *db, uint64_t seed, size_t first_site, size_t num_sites,
+                            struct ObsTimeRange tr);
@@ -0,0 +1,452 @@
+/** \file obsd.c
+ *
+ * \brief A daemon that owns a single ObsStore and serves queries to other processes.
+ *
+ * Usage: obsd SYNOPTIC_LABS_API_KEY
+ *
+ * The daemon listens on the Unix domain socket given by obsd_socket_path(). Clients linked with
+ * the obsd client library use the same API as obs.h, but share this process's database connection,
+ * download handle and throughput measurements, and it keeps working through any queued backfill
+ * jobs in the background. It also runs obs_maintenance() when it is due.
+ *
+ * An ObsStore is not thread safe, so requests are served one at a time from a single thread.
+ */
+#include "obs.h"
+#include "obsd_protocol.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** The most clients that can be connected at the same time. */
+#define OBSD_MAX_CLIENTS 64
+
+/** How long (in seconds) to wait for the rest of a request before giving up on a client. */
+#define OBSD_CLIENT_TIMEOUT_SEC 5
+
+/** How often (in seconds) to check whether the store is due for maintenance. */
+#define OBSD_MAINTENANCE_CHECK_SEC 3600
+
+/** Set by the signal handler to shut down the daemon. */
+static volatile sig_atomic_t obsd_stop = 0;
+
+static void
+obsd_handle_signal(int signal)
+{
+    (void)signal;
+    obsd_stop = 1;
+}
+
+/** Create the listening socket.
+ *
+ * \returns the socket, or -1 if there is an error.
+ */
+static int
+obsd_listen(char const *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    StopIf(strlen(path) >= sizeof(addr.sun_path), return -1, "socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    StopIf(fd < 0, return -1, "unable to create socket: %s", strerror(errno));
+
+    // A socket file left behind by a crash is removed, but not one that a live daemon is using.
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "obsd is already running on %s\n", path);
+        goto ERR_RETURN;
+    }
+    unlink(path);
+
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    StopIf(fd < 0, return -1, "unable to create socket: %s", strerror(errno));
+
+    // Only this user may connect.
+    mode_t old_mask = umask(0077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    StopIf(rc, goto ERR_RETURN, "unable to bind %s: %s", path, strerror(errno));
+
+    rc = listen(fd, OBSD_MAX_CLIENTS);
+    StopIf(rc, goto ERR_RETURN, "unable to listen on %s: %s", path, strerror(errno));
+
+    return fd;
+
+ERR_RETURN:
+    close(fd);
+    return -1;
+}
+
+/** Send a response, \a records is \a count records of \a record_size bytes each. */
+static int
+obsd_send_response(int fd, uint16_t op, int32_t status, uint32_t count, size_t record_size,
+                   void const *records)
+{
+    struct ObsdResponseHeader header = {
+        .magic = OBSD_MAGIC, .version = OBSD_VERSION, .op = op, .status = status, .count = count};
+
+    int rc = obsd_write_all(fd, &header, sizeof(header));
+    if (!rc && count) {
+        rc = obsd_write_all(fd, records, count * record_size);
+    }
+
+    return rc;
+}
+
+/** Check that a site name from a client is something the store can handle. */
+static bool
+obsd_valid_site(char site[32])
+{
+    // The store copies site names into 32 byte buffers and insists on a byte to spare.
+    site[31] = 0;
+    size_t len = strlen(site);
+    return len > 0 && len + 1 < 32;
+}
+
+static int
+obsd_serve_query(ObsStore *store, int fd, uint16_t op, struct ObsdQueryRequest *req)
+{
+    struct ObsTimeRange tr = {.start = req->start, .end = req->end};
+
+    // The API asserts on bad arguments, they have to be caught here instead.
+    bool valid = obsd_valid_site(req->site) && tr.start < tr.end;
+    if (op == OBSD_OP_QUERY_PRECIP || op == OBSD_OP_QUERY_PRECIP_COMPACT) {
+        valid = valid && req->arg[2] <= 24;
+    } else {
+        valid = valid && req->arg[0] <= 24;
+    }
+
+    if (!valid) {
+        return obsd_send_response(fd, op, -1, 0, 0, 0);
+    }
+
+    int status = 0;
+    size_t num_results = 0;
+    struct ObsdValue *values = 0;
+
+    if (op == OBSD_OP_QUERY_PRECIP) {
+        struct ObsPrecipitation *results = 0;
+        status = obs_query_precipitation(store, req->site, tr, req->arg[0], req->arg[1],
+                                         req->arg[2], &results, &num_results);
+
+        values = calloc(num_results, sizeof(*values));
+        for (size_t i = 0; values && i < num_results; i++) {
+            values[i] = (struct ObsdValue){results[i].valid_time, results[i].precip_in};
+        }
+        free(results);
+    } else if (op == OBSD_OP_QUERY_MAX_T || op == OBSD_OP_QUERY_MIN_T) {
+        struct ObsTemperature *results = 0;
+        if (op == OBSD_OP_QUERY_MAX_T) {
+            status = obs_query_max_t(store, req->site, tr, req->arg[0], req->arg[1], &results,
+                                     &num_results);
+        } else {
+            status = obs_query_min_t(store, req->site, tr, req->arg[0], req->arg[1], &results,
+                                     &num_results);
+        }
+
+        values = calloc(num_results, sizeof(*values));
+        for (size_t i = 0; values && i < num_results; i++) {
+            values[i] = (struct ObsdValue){results[i].valid_time, results[i].temperature_f};
+        }
+        free(results);
+    }
+
+    if (num_results > OBSD_MAX_RESULTS || (num_results && !values)) {
+        status = -1;
+        num_results = 0;
+    }
+
+    int rc = obsd_send_response(fd, op, status, num_results, sizeof(*values), values);
+    free(values);
+    return rc;
+}
+
+/** Answer a compact query, the results are sent as they are, 8 bytes each. */
+static int
+obsd_serve_query_compact(ObsStore *store, int fd, uint16_t op, struct ObsdQueryRequest *req)
+{
+    struct ObsTimeRange tr = {.start = req->start, .end = req->end};
+
+    // The API asserts on bad arguments, they have to be caught here instead.
+    bool valid = obsd_valid_site(req->site) && tr.start < tr.end;
+    if (op == OBSD_OP_QUERY_PRECIP_COMPACT) {
+        valid = valid && req->arg[2] <= 24;
+    } else {
+        valid = valid && req->arg[0] <= 24;
+    }
+
+    if (!valid) {
+        return obsd_send_response(fd, op, -1, 0, 0, 0);
+    }
+
+    int status = 0;
+    size_t num_results = 0;
+    void *results = 0;
+    size_t result_size = 0;
+
+    if (op == OBSD_OP_QUERY_PRECIP_COMPACT) {
+        struct ObsPrecipitationCompact *precip = 0;
+        status = obs_query_precipitation_compact(store, req->site, tr, req->arg[0], req->arg[1],
+                                                 req->arg[2], &precip, &num_results);
+        results = precip;
+        result_size = sizeof(*precip);
+    } else {
+        struct ObsTemperatureCompact *temps = 0;
+        if (op == OBSD_OP_QUERY_MAX_T_COMPACT) {
+            status = obs_query_max_t_compact(store, req->site, tr, req->arg[0], req->arg[1],
+                                             &temps, &num_results);
+        } else {
+            status = obs_query_min_t_compact(store, req->site, tr, req->arg[0], req->arg[1],
+                                             &temps, &num_results);
+        }
+        results = temps;
+        result_size = sizeof(*temps);
+    }
+
+    if (num_results > OBSD_MAX_RESULTS) {
+        status = -1;
+        num_results = 0;
+    }
+
+    int rc = obsd_send_response(fd, op, status, num_results, result_size, results);
+    free(results);
+    return rc;
+}
+
+static int
+obsd_serve_daily_summary(ObsStore *store, int fd, struct ObsdQueryRequest *req)
+{
+    struct ObsTimeRange tr = {.start = req->start, .end = req->end};
+
+    // The API asserts on bad arguments, they have to be caught here instead.
+    if (!obsd_valid_site(req->site) || tr.start >= tr.end || req->arg[0] > 24) {
+        return obsd_send_response(fd, OBSD_OP_QUERY_DAILY_SUMMARY, -1, 0, 0, 0);
+    }
+
+    struct ObsDailySummary *results = 0;
+    size_t num_results = 0;
+    int status = obs_query_daily_summary(store, req->site, tr, req->arg[0], req->arg[1], &results,
+                                         &num_results);
+
+    struct ObsdSummaryValue *values = calloc(num_results, sizeof(*values));
+    for (size_t i = 0; values && i < num_results; i++) {
+        values[i] = (struct ObsdSummaryValue){results[i].valid_time, results[i].max_t_f,
+                                              results[i].min_t_f, results[i].precip_in};
+    }
+    free(results);
+
+    if (num_results > OBSD_MAX_RESULTS || (num_results && !values)) {
+        status = -1;
+        num_results = 0;
+    }
+
+    int rc = obsd_send_response(fd, OBSD_OP_QUERY_DAILY_SUMMARY, status, num_results,
+                                sizeof(*values), values);
+    free(values);
+    return rc;
+}
+
+static int
+obsd_serve_refresh(ObsStore *store, int fd, struct ObsdRefreshRequest const *req,
+                   char (*site_bufs)[32])
+{
+    struct ObsTimeRange tr = {.start = req->start, .end = req->end};
+
+    char const **sites = calloc(req->num_sites, sizeof(*sites));
+    bool valid = sites || req->num_sites == 0;
+    for (size_t i = 0; valid && i < req->num_sites; i++) {
+        valid = obsd_valid_site(site_bufs[i]);
+        sites[i] = site_bufs[i];
+    }
+
+    int status = -1;
+    if (valid && tr.start < tr.end) {
+        status = obs_refresh(store, req->num_sites, sites, tr);
+    }
+
+    free(sites);
+    return obsd_send_response(fd, OBSD_OP_REFRESH, status, 0, 0, 0);
+}
+
+/** Read a request from a client and answer it.
+ *
+ * \returns 0 if the connection should be kept open, or -1 if it should be closed.
+ */
+static int
+obsd_serve_request(ObsStore *store, int fd)
+{
+    struct ObsdRequestHeader header = {0};
+    if (obsd_read_all(fd, &header, sizeof(header))) {
+        // The client hung up.
+        return -1;
+    }
+
+    StopIf(header.magic != OBSD_MAGIC || header.version != OBSD_VERSION, return -1,
+           "obsd dropping client with bad message header");
+
+    if (header.op == OBSD_OP_REFRESH) {
+        struct ObsdRefreshRequest req = {0};
+        StopIf(header.length < sizeof(req), return -1, "obsd dropping client, short refresh");
+        StopIf(obsd_read_all(fd, &req, sizeof(req)), return -1, "obsd lost client");
+        StopIf(req.num_sites > OBSD_MAX_REFRESH_SITES, return -1, "obsd refresh too large");
+        StopIf(header.length != sizeof(req) + req.num_sites * 32, return -1,
+               "obsd dropping client, refresh length mismatch");
+
+        char(*site_bufs)[32] = calloc(req.num_sites ? req.num_sites : 1, sizeof(*site_bufs));
+        StopIf(!site_bufs, return -1, "out of memory");
+
+        int rc = obsd_read_all(fd, site_bufs, req.num_sites * sizeof(*site_bufs));
+        if (!rc) {
+            rc = obsd_serve_refresh(store, fd, &req, site_bufs);
+        }
+
+        free(site_bufs);
+        return rc;
+    }
+
+    if (header.op == OBSD_OP_QUERY_MAX_T || header.op == OBSD_OP_QUERY_MIN_T ||
+        header.op == OBSD_OP_QUERY_PRECIP) {
+        struct ObsdQueryRequest req = {0};
+        StopIf(header.length != sizeof(req), return -1, "obsd dropping client, bad query length");
+        StopIf(obsd_read_all(fd, &req, sizeof(req)), return -1, "obsd lost client");
+
+        return obsd_serve_query(store, fd, header.op, &req);
+    }
+
+    if (header.op == OBSD_OP_QUERY_MAX_T_COMPACT || header.op == OBSD_OP_QUERY_MIN_T_COMPACT ||
+        header.op == OBSD_OP_QUERY_PRECIP_COMPACT) {
+        struct ObsdQueryRequest req = {0};
+        StopIf(header.length != sizeof(req), return -1, "obsd dropping client, bad query length");
+        StopIf(obsd_read_all(fd, &req, sizeof(req)), return -1, "obsd lost client");
+
+        return obsd_serve_query_compact(store, fd, header.op, &req);
+    }
+
+    if (header.op == OBSD_OP_QUERY_DAILY_SUMMARY) {
+        struct ObsdQueryRequest req = {0};
+        StopIf(header.length != sizeof(req), return -1, "obsd dropping client, bad query length");
+        StopIf(obsd_read_all(fd, &req, sizeof(req)), return -1, "obsd lost client");
+
+        return obsd_serve_daily_summary(store, fd, &req);
+    }
+
+    fprintf(stderr, "obsd dropping client, unknown op %u\n", (unsigned)header.op);
+    return -1;
+}
+
+/** Accept a new client and add it to the list of connections being watched. */
+static void
+obsd_accept(int listen_fd, struct pollfd fds[static 1 + OBSD_MAX_CLIENTS], size_t *num_fds)
+{
+    int fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+    StopIf(fd < 0, return, "obsd unable to accept client: %s", strerror(errno));
+
+    StopIf(*num_fds == 1 + OBSD_MAX_CLIENTS, close(fd); return, "obsd has too many clients");
+
+    // Don't let a client that stops in the middle of a request hold up everyone else.
+    struct timeval timeout = {.tv_sec = OBSD_CLIENT_TIMEOUT_SEC};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    fds[*num_fds] = (struct pollfd){.fd = fd, .events = POLLIN};
+    *num_fds += 1;
+}
+
+int
+main(int argc, char *argv[argc + 1])
+{
+    StopIf(argc != 2, return EXIT_FAILURE, "usage: %s SYNOPTIC_LABS_API_KEY", argv[0]);
+
+    char path[108] = {0};
+    StopIf(obsd_socket_path(sizeof(path), path), return EXIT_FAILURE, "no socket path");
+
+    struct sigaction action = {.sa_handler = obsd_handle_signal};
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    int exit_code = EXIT_FAILURE;
+    ObsBackfill *backfill = 0;
+    struct pollfd fds[1 + OBSD_MAX_CLIENTS] = {{0}};
+    size_t num_fds = 0;
+
+    ObsStore *store = obs_connect(argv[1]);
+    StopIf(!store, return EXIT_FAILURE, "obsd unable to open the store");
+
+    int listen_fd = obsd_listen(path);
+    StopIf(listen_fd < 0, goto CLEAN_UP, "obsd unable to listen");
+
+    // Pick up any backfill jobs queued by earlier runs.
+    backfill = obs_backfill_start(store, 0, 0);
+
+    fds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    num_fds = 1;
+
+    time_t next_maintenance = 0;
+
+    while (!obsd_stop) {
+        time_t now = time(0);
+        if (now >= next_maintenance) {
+            if (obs_maintenance(store, false) < 0) {
+                fprintf(stderr, "obsd maintenance failed\n");
+            }
+            next_maintenance = now + OBSD_MAINTENANCE_CHECK_SEC;
+        }
+
+        int num_ready = poll(fds, num_fds, (next_maintenance - now) * 1000);
+        if (num_ready < 0 && errno == EINTR) {
+            continue;
+        }
+        StopIf(num_ready < 0, goto CLEAN_UP, "obsd poll failed: %s", strerror(errno));
+
+        for (size_t i = num_fds - 1; i > 0; i--) {
+            if (!fds[i].revents) {
+                continue;
+            }
+
+            if ((fds[i].revents & POLLIN) == 0 || obsd_serve_request(store, fds[i].fd)) {
+                close(fds[i].fd);
+                num_fds--;
+                fds[i] = fds[num_fds];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            obsd_accept(listen_fd, fds, &num_fds);
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+CLEAN_UP:
+
+    for (size_t i = 1; i < num_fds; i++) {
+        close(fds[i].fd);
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path);
+    }
+
+    if (backfill) {
+        obs_backfill_stop(&backfill);
+    }
+
+    obs_close(&store);
+
+    return exit_code;
+}
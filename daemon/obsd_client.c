@@ -0,0 +1,649 @@
+/** \file obsd_client.c
+ *
+ * \brief The obsd client library, an implementation of the obs.h query API that forwards requests
+ * to a running obsd.
+ *
+ * Programs link this library instead of libobs.a to share the daemon's store. Only refreshing and
+ * the queries are forwarded. The rest of obs.h is defined here too, so programs written against
+ * libobs.a still link, but those functions print a message and fail: snapshots, backups,
+ * replication, exports, watchlists, backfills, the storage settings, the slow query log, latency
+ * stats and maintenance, which the daemon does on its own.
+ */
+#include "obs.h"
+#include "obsd_protocol.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** A connection to obsd. */
+struct ObsStore {
+    int fd; /**< The connected socket. */
+};
+
+struct ObsStore *
+obs_connect(char const *const synoptic_labs_api_key)
+{
+    // The daemon downloads with its own key.
+    (void)synoptic_labs_api_key;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    StopIf(obsd_socket_path(sizeof(addr.sun_path), addr.sun_path), return 0, "no socket path");
+
+    struct ObsStore *new = calloc(1, sizeof(*new));
+    StopIf(!new, return 0, "Memory allocation error.");
+
+    new->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    StopIf(new->fd < 0, goto ERR_RETURN, "unable to create socket: %s", strerror(errno));
+
+#ifdef SO_NOSIGPIPE
+    // Where send() has no MSG_NOSIGNAL, keep a restarted obsd from killing the program.
+    setsockopt(new->fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int));
+#endif
+
+    int rc = connect(new->fd, (struct sockaddr *)&addr, sizeof(addr));
+    StopIf(rc, goto ERR_RETURN, "unable to connect to obsd at %s: %s", addr.sun_path,
+           strerror(errno));
+
+    return new;
+
+ERR_RETURN:
+
+    if (new->fd >= 0) {
+        close(new->fd);
+    }
+    free(new);
+    return 0;
+}
+
+void
+obs_close(struct ObsStore **store)
+{
+    StopIf(!store || !(*store), return, "Warning NULL passed for obs_close.");
+
+    close((*store)->fd);
+    free(*store);
+
+    *store = 0;
+}
+
+/** Send a request to the daemon and wait for the answer.
+ *
+ * \param store is the connection to use.
+ * \param op is the request type, one of the \ref ObsdOp values.
+ * \param num_parts is the number of pieces in the request body.
+ * \param parts are the pieces of the request body, sent one after the other.
+ * \param part_lens are the lengths of \a parts.
+ * \param record_size is the size of each record in the response, it depends on \a op.
+ * \param records is where the allocated array of returned records is stored, it may be \c NULL if
+ * the request doesn't return any records.
+ * \param num_records is where the number of \a records is stored.
+ *
+ * \returns the status sent by the daemon, or -1 if the request couldn't be completed.
+ */
+static int
+obsd_client_request(struct ObsStore *store, uint16_t op, size_t num_parts,
+                    void const *const parts[num_parts], size_t const part_lens[num_parts],
+                    size_t record_size, void **records, size_t *num_records)
+{
+    struct ObsdRequestHeader header = {.magic = OBSD_MAGIC, .version = OBSD_VERSION, .op = op};
+    for (size_t i = 0; i < num_parts; i++) {
+        header.length += part_lens[i];
+    }
+
+    int rc = obsd_write_all(store->fd, &header, sizeof(header));
+    for (size_t i = 0; !rc && i < num_parts; i++) {
+        rc = obsd_write_all(store->fd, parts[i], part_lens[i]);
+    }
+    StopIf(rc, return -1, "error sending request to obsd");
+
+    struct ObsdResponseHeader response = {0};
+    rc = obsd_read_all(store->fd, &response, sizeof(response));
+    StopIf(rc, return -1, "error reading response from obsd");
+    StopIf(response.magic != OBSD_MAGIC || response.version != OBSD_VERSION || response.op != op,
+           return -1, "bad response from obsd");
+    StopIf(response.count > OBSD_MAX_RESULTS || (response.count && !records), return -1,
+           "unexpected values in response from obsd");
+
+    if (response.count) {
+        *records = calloc(response.count, record_size);
+        StopIf(!*records, return -1, "out of memory");
+
+        rc = obsd_read_all(store->fd, *records, response.count * record_size);
+        StopIf(rc, free(*records); *records = 0; return -1, "error reading values from obsd");
+
+        *num_records = response.count;
+    }
+
+    return response.status;
+}
+
+int
+obs_refresh(struct ObsStore *store, size_t num_sites, char const *const sites[],
+            struct ObsTimeRange tr)
+{
+    assert(store);
+    assert(sites || num_sites == 0);
+    assert(tr.start < tr.end && "backwards time range");
+
+    StopIf(num_sites > OBSD_MAX_REFRESH_SITES, return -1, "too many sites for obsd refresh");
+
+    struct ObsdRefreshRequest req = {.start = tr.start, .end = tr.end, .num_sites = num_sites};
+
+    char(*site_bufs)[32] = calloc(num_sites ? num_sites : 1, sizeof(*site_bufs));
+    StopIf(!site_bufs, return -1, "out of memory");
+
+    for (size_t i = 0; i < num_sites; i++) {
+        strncpy(site_bufs[i], sites[i], sizeof(site_bufs[i]) - 1);
+    }
+
+    void const *const parts[2] = {&req, site_bufs};
+    size_t const part_lens[2] = {sizeof(req), num_sites * sizeof(*site_bufs)};
+    int rc = obsd_client_request(store, OBSD_OP_REFRESH, 2, parts, part_lens, 0, 0, 0);
+
+    free(site_bufs);
+    return rc;
+}
+
+/** Send a query and unpack the results.
+ *
+ * \param record_size is the size of each record in the response, it depends on \a op.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+static int
+obsd_client_query(struct ObsStore *store, uint16_t op, char const *const site,
+                  struct ObsTimeRange tr, uint32_t arg0, uint32_t arg1, uint32_t arg2,
+                  size_t record_size, void **records, size_t *num_records)
+{
+    struct ObsdQueryRequest req = {.start = tr.start, .end = tr.end, .arg = {arg0, arg1, arg2}};
+    strncpy(req.site, site, sizeof(req.site) - 1);
+
+    void const *const parts[1] = {&req};
+    size_t const part_lens[1] = {sizeof(req)};
+    int rc = obsd_client_request(store, op, 1, parts, part_lens, record_size, records,
+                                 num_records);
+    if (rc < 0) {
+        free(*records);
+        *records = 0;
+        *num_records = 0;
+    }
+
+    return rc;
+}
+
+/** Internal implementation of obs_query_max_t() and obs_query_min_t(). */
+static int
+obsd_client_query_t(struct ObsStore *store, uint16_t op, char const *const site,
+                    struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
+                    struct ObsTemperature **results, size_t *num_results)
+{
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
+    assert(results && !*results && num_results && !*num_results);
+
+    struct ObsdValue *values = 0;
+    size_t num_values = 0;
+    int rc = obsd_client_query(store, op, site, tr, window_end, window_length, 0,
+                               sizeof(*values), (void **)&values, &num_values);
+    StopIf(rc < 0, return rc, "temperature query failed.");
+
+    if (num_values) {
+        *results = calloc(num_values, sizeof(**results));
+        StopIf(!*results, free(values); return -1, "out of memory");
+
+        for (size_t i = 0; i < num_values; i++) {
+            (*results)[i] = (struct ObsTemperature){.valid_time = values[i].valid_time,
+                                                    .temperature_f = values[i].value};
+        }
+        *num_results = num_values;
+    }
+
+    free(values);
+    return rc;
+}
+
+int
+obs_query_max_t(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                unsigned window_end, unsigned window_length, struct ObsTemperature **results,
+                size_t *num_results)
+{
+    return obsd_client_query_t(store, OBSD_OP_QUERY_MAX_T, site, tr, window_end, window_length,
+                               results, num_results);
+}
+
+int
+obs_query_min_t(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                unsigned window_end, unsigned window_length, struct ObsTemperature **results,
+                size_t *num_results)
+{
+    return obsd_client_query_t(store, OBSD_OP_QUERY_MIN_T, site, tr, window_end, window_length,
+                               results, num_results);
+}
+
+int
+obs_query_precipitation(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_length, unsigned window_increment, unsigned window_offset,
+                        struct ObsPrecipitation **results, size_t *num_results)
+{
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_offset <= 24 && "there is only 24 hours in a day");
+    assert(num_results && !*num_results && results && !*results);
+
+    struct ObsdValue *values = 0;
+    size_t num_values = 0;
+    int rc = obsd_client_query(store, OBSD_OP_QUERY_PRECIP, site, tr, window_length,
+                               window_increment, window_offset, sizeof(*values),
+                               (void **)&values, &num_values);
+    StopIf(rc < 0, return rc, "precipitation query failed.");
+
+    if (num_values) {
+        *results = calloc(num_values, sizeof(**results));
+        StopIf(!*results, free(values); return -1, "out of memory");
+
+        for (size_t i = 0; i < num_values; i++) {
+            (*results)[i] = (struct ObsPrecipitation){.valid_time = values[i].valid_time,
+                                                      .precip_in = values[i].value};
+        }
+        *num_results = num_values;
+    }
+
+    free(values);
+    return rc;
+}
+
+/** Internal implementation of obs_query_max_t_compact() and obs_query_min_t_compact(). */
+static int
+obsd_client_query_t_compact(struct ObsStore *store, uint16_t op, char const *const site,
+                            struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
+                            struct ObsTemperatureCompact **results, size_t *num_results)
+{
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
+    assert(results && !*results && num_results && !*num_results);
+
+    // The daemon sends the compact results as they are, so they need no unpacking.
+    int rc = obsd_client_query(store, op, site, tr, window_end, window_length, 0,
+                               sizeof(**results), (void **)results, num_results);
+    StopIf(rc < 0, return rc, "temperature query failed.");
+
+    return rc;
+}
+
+int
+obs_query_max_t_compact(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsTemperatureCompact **results, size_t *num_results)
+{
+    return obsd_client_query_t_compact(store, OBSD_OP_QUERY_MAX_T_COMPACT, site, tr, window_end,
+                                       window_length, results, num_results);
+}
+
+int
+obs_query_min_t_compact(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsTemperatureCompact **results, size_t *num_results)
+{
+    return obsd_client_query_t_compact(store, OBSD_OP_QUERY_MIN_T_COMPACT, site, tr, window_end,
+                                       window_length, results, num_results);
+}
+
+int
+obs_query_precipitation_compact(struct ObsStore *store, char const *const site,
+                                struct ObsTimeRange tr, unsigned window_length,
+                                unsigned window_increment, unsigned window_offset,
+                                struct ObsPrecipitationCompact **results, size_t *num_results)
+{
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_offset <= 24 && "there is only 24 hours in a day");
+    assert(num_results && !*num_results && results && !*results);
+
+    int rc = obsd_client_query(store, OBSD_OP_QUERY_PRECIP_COMPACT, site, tr, window_length,
+                               window_increment, window_offset, sizeof(**results),
+                               (void **)results, num_results);
+    StopIf(rc < 0, return rc, "precipitation query failed.");
+
+    return rc;
+}
+
+int
+obs_query_daily_summary(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsDailySummary **results, size_t *num_results)
+{
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
+    assert(results && !*results && num_results && !*num_results);
+
+    struct ObsdSummaryValue *values = 0;
+    size_t num_values = 0;
+    int rc = obsd_client_query(store, OBSD_OP_QUERY_DAILY_SUMMARY, site, tr, window_end,
+                               window_length, 0, sizeof(*values), (void **)&values, &num_values);
+    StopIf(rc < 0, return rc, "daily summary query failed.");
+
+    if (num_values) {
+        *results = calloc(num_values, sizeof(**results));
+        StopIf(!*results, free(values); return -1, "out of memory");
+
+        for (size_t i = 0; i < num_values; i++) {
+            (*results)[i] = (struct ObsDailySummary){.valid_time = values[i].valid_time,
+                                                     .max_t_f = values[i].max_t_f,
+                                                     .min_t_f = values[i].min_t_f,
+                                                     .precip_in = values[i].precip_in};
+        }
+        *num_results = num_values;
+    }
+
+    free(values);
+    return rc;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                       The rest of obs.h, which obsd doesn't serve.
+ *-----------------------------------------------------------------------------------------------*/
+/** Say that a function of obs.h can't be used through the daemon. */
+static void
+obsd_client_unsupported(char const *name)
+{
+    fprintf(stderr, "%s is not available through obsd\n", name);
+}
+
+struct ObsStoreConfig
+obs_store_config_profile(enum ObsStoreProfile profile)
+{
+    // The daemon's store has its own settings, these would be ignored.
+    (void)profile;
+    obsd_client_unsupported(__func__);
+    return (struct ObsStoreConfig){0};
+}
+
+struct ObsStore *
+obs_connect_with_config(char const *const synoptic_labs_api_key,
+                        struct ObsStoreConfig const *config)
+{
+    // The daemon's store has its own settings.
+    (void)config;
+    return obs_connect(synoptic_labs_api_key);
+}
+
+struct ObsStore *
+obs_connect_snapshot(char const *path, struct ObsStoreConfig const *config)
+{
+    (void)path;
+    (void)config;
+    obsd_client_unsupported(__func__);
+    return 0;
+}
+
+int
+obs_write_snapshot(struct ObsStore *store, char const *path)
+{
+    (void)store;
+    (void)path;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+struct ObsBackup *
+obs_backup_start(struct ObsStore *store, char const *path)
+{
+    (void)store;
+    (void)path;
+    obsd_client_unsupported(__func__);
+    return 0;
+}
+
+int
+obs_backup_step(struct ObsBackup *backup, int num_pages, size_t *remaining, size_t *total)
+{
+    (void)backup;
+    (void)num_pages;
+    (void)remaining;
+    (void)total;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_backup_finish(struct ObsBackup **backup)
+{
+    (void)backup;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_store_backup(struct ObsStore *store, char const *path, int pages_per_step, unsigned pause_ms)
+{
+    (void)store;
+    (void)path;
+    (void)pages_per_step;
+    (void)pause_ms;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+long
+obs_backup_update(struct ObsStore *store, char const *path)
+{
+    (void)store;
+    (void)path;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+long
+obs_export_changes(struct ObsStore *store, char const *path, int64_t after_seq, int64_t *last_seq)
+{
+    (void)store;
+    (void)path;
+    (void)after_seq;
+    (void)last_seq;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+long
+obs_import_changes(struct ObsStore *store, char const *path, int64_t *last_seq)
+{
+    (void)store;
+    (void)path;
+    (void)last_seq;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_replication_watermark(struct ObsStore *store, int64_t *last_seq)
+{
+    (void)store;
+    (void)last_seq;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_store_configure(struct ObsStore *store, struct ObsStoreConfig const *config)
+{
+    (void)store;
+    (void)config;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_maintenance(struct ObsStore *store, bool force)
+{
+    (void)store;
+    (void)force;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_attach_shared_cache(struct ObsStore *store)
+{
+    (void)store;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_set_slow_query_log(struct ObsStore *store, char const *path, double threshold_ms,
+                       size_t max_bytes)
+{
+    (void)store;
+    (void)path;
+    (void)threshold_ms;
+    (void)max_bytes;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_latency_export(ObsLatencyExportCallback callback, void *ctx)
+{
+    (void)callback;
+    (void)ctx;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_latency_write(char const *path)
+{
+    (void)path;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+void
+obs_latency_reset(void)
+{
+    obsd_client_unsupported(__func__);
+}
+
+struct ObsWatchlist *
+obs_watchlist_start(struct ObsStore *store, unsigned poll_interval_sec)
+{
+    (void)store;
+    (void)poll_interval_sec;
+    obsd_client_unsupported(__func__);
+    return 0;
+}
+
+void
+obs_watchlist_stop(struct ObsWatchlist **watchlist)
+{
+    (void)watchlist;
+    obsd_client_unsupported(__func__);
+}
+
+int
+obs_watchlist_add(struct ObsWatchlist *watchlist, char const *const site)
+{
+    (void)watchlist;
+    (void)site;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_watchlist_remove(struct ObsWatchlist *watchlist, char const *const site)
+{
+    (void)watchlist;
+    (void)site;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_watchlist_subscribe(struct ObsWatchlist *watchlist, ObsWatchlistCallback callback,
+                        void *user_data)
+{
+    (void)watchlist;
+    (void)callback;
+    (void)user_data;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+void
+obs_watchlist_poll_now(struct ObsWatchlist *watchlist)
+{
+    (void)watchlist;
+    obsd_client_unsupported(__func__);
+}
+
+struct ObsBackfill *
+obs_backfill_start(struct ObsStore *store, ObsBackfillCallback callback, void *user_data)
+{
+    (void)store;
+    (void)callback;
+    (void)user_data;
+    obsd_client_unsupported(__func__);
+    return 0;
+}
+
+void
+obs_backfill_stop(struct ObsBackfill **backfill)
+{
+    (void)backfill;
+    obsd_client_unsupported(__func__);
+}
+
+long
+obs_backfill_submit(struct ObsBackfill *backfill, size_t num_sites, char const *const sites[],
+                    struct ObsTimeRange tr)
+{
+    (void)backfill;
+    (void)num_sites;
+    (void)sites;
+    (void)tr;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+int
+obs_backfill_progress(struct ObsBackfill *backfill, long job_id, size_t *num_done,
+                      size_t *num_failed, size_t *num_chunks)
+{
+    (void)backfill;
+    (void)job_id;
+    (void)num_done;
+    (void)num_failed;
+    (void)num_chunks;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
+
+long
+obs_export(struct ObsStore *store, char const *path, size_t num_sites, char const *const sites[],
+           struct ObsTimeRange tr, unsigned num_threads)
+{
+    (void)store;
+    (void)path;
+    (void)num_sites;
+    (void)sites;
+    (void)tr;
+    (void)num_threads;
+    obsd_client_unsupported(__func__);
+    return -1;
+}
@@ -0,0 +1,81 @@
+/** \file obsd_protocol.c
+ *
+ * \brief Helpers shared by obsd and its client library.
+ */
+#include "obsd_protocol.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Without MSG_NOSIGNAL, the client sets SO_NOSIGPIPE on its socket instead.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+int
+obsd_socket_path(size_t buf_size, char buf[buf_size])
+{
+    int len = 0;
+
+    char const *path = getenv(OBSD_SOCKET_ENV);
+    char const *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (path && *path) {
+        len = snprintf(buf, buf_size, "%s", path);
+    } else if (runtime_dir && *runtime_dir) {
+        len = snprintf(buf, buf_size, "%s/obsd.sock", runtime_dir);
+    } else {
+        len = snprintf(buf, buf_size, "/tmp/obsd-%u.sock", (unsigned)getuid());
+    }
+
+    StopIf(len < 0 || (size_t)len >= buf_size, return -1, "obsd socket path too long");
+
+    return 0;
+}
+
+int
+obsd_read_all(int fd, void *buf, size_t len)
+{
+    char *next = buf;
+    while (len > 0) {
+        ssize_t num_read = read(fd, next, len);
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (num_read <= 0) {
+            return -1;
+        }
+
+        next += num_read;
+        len -= num_read;
+    }
+
+    return 0;
+}
+
+int
+obsd_write_all(int fd, void const *buf, size_t len)
+{
+    char const *next = buf;
+    while (len > 0) {
+        // A closed connection is an error to report, not a SIGPIPE that kills the client.
+        ssize_t num_written = send(fd, next, len, MSG_NOSIGNAL);
+        if (num_written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (num_written <= 0) {
+            return -1;
+        }
+
+        next += num_written;
+        len -= num_written;
+    }
+
+    return 0;
+}
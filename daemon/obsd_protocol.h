@@ -0,0 +1,146 @@
+#pragma once
+/** \file obsd_protocol.h
+ *
+ * \brief The binary protocol spoken between obsd and its clients over a Unix domain socket.
+ *
+ * Every message is a fixed size header followed by a body. Both ends are on the same machine, so
+ * integers and doubles are sent in native byte order, and every message struct is laid out without
+ * padding so it can be sent as is.
+ *
+ * A client sends a \ref ObsdRequestHeader followed by the body for its op, and the daemon answers
+ * with a \ref ObsdResponseHeader followed by \c count records. The records are \ref ObsdValue
+ * unless the op says otherwise. A connection may be used for any number of requests, one at a
+ * time.
+ */
+#include "obs.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Marks the start of every message, "OBSD" in ASCII. */
+#define OBSD_MAGIC 0x4F425344u
+
+/** Bumped whenever the layout of a message changes. */
+#define OBSD_VERSION 1
+
+/** The environment variable that overrides the socket path. */
+#define OBSD_SOCKET_ENV "OBSD_SOCKET"
+
+/** The largest number of sites allowed in a single refresh request. */
+#define OBSD_MAX_REFRESH_SITES 4096
+
+/** The largest number of values allowed in a single response. */
+#define OBSD_MAX_RESULTS (16 * 1024 * 1024)
+
+/** The requests the daemon understands. */
+enum ObsdOp {
+    OBSD_OP_QUERY_MAX_T = 1,  /**< obs_query_max_t(), body is \ref ObsdQueryRequest. */
+    OBSD_OP_QUERY_MIN_T = 2,  /**< obs_query_min_t(), body is \ref ObsdQueryRequest. */
+    OBSD_OP_QUERY_PRECIP = 3, /**< obs_query_precipitation(), body is \ref ObsdQueryRequest. */
+    OBSD_OP_REFRESH = 4,      /**< obs_refresh(), body is \ref ObsdRefreshRequest. */
+
+    /** obs_query_max_t_compact(), body is \ref ObsdQueryRequest, answered with
+     * \ref ObsdCompactValue records. */
+    OBSD_OP_QUERY_MAX_T_COMPACT = 5,
+    /** obs_query_min_t_compact(), body is \ref ObsdQueryRequest, answered with
+     * \ref ObsdCompactValue records. */
+    OBSD_OP_QUERY_MIN_T_COMPACT = 6,
+    /** obs_query_precipitation_compact(), body is \ref ObsdQueryRequest, answered with
+     * \ref ObsdCompactValue records. */
+    OBSD_OP_QUERY_PRECIP_COMPACT = 7,
+    /** obs_query_daily_summary(), body is \ref ObsdQueryRequest, answered with
+     * \ref ObsdSummaryValue records. */
+    OBSD_OP_QUERY_DAILY_SUMMARY = 8,
+};
+
+/** Sent before every request. */
+struct ObsdRequestHeader {
+    uint32_t magic;   /**< Always \ref OBSD_MAGIC. */
+    uint16_t version; /**< Always \ref OBSD_VERSION. */
+    uint16_t op;      /**< One of the \ref ObsdOp values. */
+    uint32_t length;  /**< The number of bytes in the body that follows. */
+};
+
+/** The body of a query request. */
+struct ObsdQueryRequest {
+    char site[32];   /**< The site identifier, nul terminated. */
+    int64_t start;   /**< The start of the time range. */
+    int64_t end;     /**< The end of the time range. */
+    uint32_t arg[4]; /**< The window arguments of the query, in the order the API takes them. */
+};
+
+/** The body of a refresh request, followed by \c num_sites nul terminated 32 byte site names. */
+struct ObsdRefreshRequest {
+    int64_t start;      /**< The start of the time range. */
+    int64_t end;        /**< The end of the time range. */
+    uint32_t num_sites; /**< The number of sites that follow. */
+    uint32_t reserved;  /**< Always 0. */
+};
+
+/** Sent before every response. */
+struct ObsdResponseHeader {
+    uint32_t magic;   /**< Always \ref OBSD_MAGIC. */
+    uint16_t version; /**< Always \ref OBSD_VERSION. */
+    uint16_t op;      /**< The op of the request being answered. */
+    int32_t status;   /**< The return value of the API function that served the request. */
+    uint32_t count;   /**< The number of records that follow. */
+};
+
+/** A single result, either a temperature or a precipitation amount. */
+struct ObsdValue {
+    int64_t valid_time; /**< The valid time of the result. */
+    double value;       /**< The temperature in Fahrenheit or precipitation in inches. */
+};
+
+/** A single result of a compact query, laid out like \ref ObsTemperatureCompact and
+ * \ref ObsPrecipitationCompact. */
+struct ObsdCompactValue {
+    int32_t valid_hour; /**< The valid time in hours since the epoch. */
+    float value;        /**< The temperature in Fahrenheit or precipitation in inches. */
+};
+
+/** A single result of a daily summary query. */
+struct ObsdSummaryValue {
+    int64_t valid_time; /**< The valid time of the result. */
+    double max_t_f;     /**< The maximum temperature in Fahrenheit. */
+    double min_t_f;     /**< The minimum temperature in Fahrenheit. */
+    double precip_in;   /**< The precipitation accumulation in inches. */
+};
+
+static_assert(sizeof(struct ObsdRequestHeader) == 12, "padding in ObsdRequestHeader");
+static_assert(sizeof(struct ObsdQueryRequest) == 64, "padding in ObsdQueryRequest");
+static_assert(sizeof(struct ObsdRefreshRequest) == 24, "padding in ObsdRefreshRequest");
+static_assert(sizeof(struct ObsdResponseHeader) == 16, "padding in ObsdResponseHeader");
+static_assert(sizeof(struct ObsdValue) == 16, "padding in ObsdValue");
+static_assert(sizeof(struct ObsdCompactValue) == 8, "padding in ObsdCompactValue");
+static_assert(sizeof(struct ObsdSummaryValue) == 32, "padding in ObsdSummaryValue");
+static_assert(sizeof(struct ObsdCompactValue) == sizeof(struct ObsTemperatureCompact) &&
+                  sizeof(struct ObsdCompactValue) == sizeof(struct ObsPrecipitationCompact),
+              "compact results can't be sent as they are");
+
+/** Get the path of the daemon's socket.
+ *
+ * This is the value of the \ref OBSD_SOCKET_ENV environment variable if it is set, otherwise it is
+ * \c obsd.sock in \c $XDG_RUNTIME_DIR, or in \c /tmp with the user id in the name.
+ *
+ * \param buf_size is the size of \a buf.
+ * \param buf is where the path is stored.
+ *
+ * \returns 0 on success, or a negative number if the path doesn't fit in \a buf.
+ */
+int obsd_socket_path(size_t buf_size, char buf[buf_size]);
+
+/** Read exactly \a len bytes, retrying after interruptions and short reads.
+ *
+ * \returns 0 on success, or a negative number on error or if the other end hung up.
+ */
+int obsd_read_all(int fd, void *buf, size_t len);
+
+/** Write exactly \a len bytes to a socket, retrying after interruptions and short writes.
+ *
+ * Writing to a connection the other end closed returns an error instead of raising SIGPIPE.
+ *
+ * \returns 0 on success, or a negative number on error.
+ */
+int obsd_write_all(int fd, void const *buf, size_t len);
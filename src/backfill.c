@@ -0,0 +1,344 @@
+/** \file backfill.c
+ *
+ * \brief Implementation of the ObsBackfill, which downloads long stretches of historical data in
+ * the background.
+ */
+#include "download.h"
+#include "obs.h"
+#include "obs_db.h"
+#include "obs_store.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <sqlite3.h>
+
+/** How many times to try a chunk before giving up on it. */
+#define OBS_BACKFILL_MAX_ATTEMPTS 5
+
+/** How long (in seconds) to pause between downloads so other work gets a turn. */
+#define OBS_BACKFILL_PAUSE_SEC 1
+
+/** How long (in seconds) to wait before checking an empty queue again, or retrying a failure. */
+#define OBS_BACKFILL_IDLE_SEC 60
+
+/** The nice value for the background thread, the lowest priority. */
+#define OBS_BACKFILL_NICE 19
+
+/** Shared state between the thread that owns the scheduler and the background downloader. */
+struct ObsBackfill {
+    pthread_t thread;     /**< The background downloader. */
+    pthread_mutex_t lock; /**< Protects \ref wake_now and \ref stop. */
+    pthread_cond_t wake;  /**< Signaled to wake the downloader early. */
+
+    /** The store jobs are planned with. This is an alias, do not free. */
+    struct ObsStore *store;
+
+    /** Storage settings for the downloader's connection, copied from \ref store. */
+    struct ObsStoreConfig config;
+
+    ObsBackfillCallback callback; /**< Progress reports go here, may be \c NULL. */
+    void *user_data;              /**< Passed through to \ref callback. */
+
+    bool wake_now; /**< Skip the rest of the wait, there is new work. */
+    bool stop;     /**< Shut down the downloader. */
+};
+
+/** Wait for \a seconds, or until woken up.
+ *
+ * \returns \c true if the downloader should stop.
+ */
+static bool
+obs_backfill_wait(struct ObsBackfill *bf, unsigned seconds)
+{
+    pthread_mutex_lock(&bf->lock);
+
+    struct timespec deadline = {0};
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+
+    while (!bf->stop && !bf->wake_now) {
+        if (pthread_cond_timedwait(&bf->wake, &bf->lock, &deadline)) {
+            break;
+        }
+    }
+
+    bf->wake_now = false;
+    bool stop = bf->stop;
+
+    pthread_mutex_unlock(&bf->lock);
+
+    return stop;
+}
+
+/** Tell the owner how far along a job is. */
+static void
+obs_backfill_report(struct ObsBackfill *bf, sqlite3 *db, long job_id)
+{
+    if (!bf->callback) {
+        return;
+    }
+
+    size_t num_done = 0, num_failed = 0, num_chunks = 0;
+    int found = obs_db_backfill_job_status(db, job_id, OBS_BACKFILL_MAX_ATTEMPTS, &num_done,
+                                           &num_failed, &num_chunks);
+    StopIf(found <= 0, return, "error getting status for backfill job %ld", job_id);
+
+    bf->callback(job_id, num_done, num_failed, num_chunks, bf->user_data);
+}
+
+/** Download the next group of chunks in the queue.
+ *
+ * \returns 1 if something was downloaded, 0 if the queue is empty, and -1 if the download failed
+ * or there is an error.
+ */
+static int
+obs_backfill_step(struct ObsBackfill *bf, struct ObsDbShards *shards, CURL **curl,
+                  struct ObsDownloadTuning *tuning)
+{
+    // The queue is in the main file.
+    sqlite3 *db = shards->dbs[0];
+
+    struct ObsDbBackfillChunk chunks[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST] = {{0}};
+    size_t num_chunks = obs_db_backfill_next(db, OBS_BACKFILL_MAX_ATTEMPTS,
+                                             OBS_DOWNLOAD_MAX_SITES_PER_REQUEST, chunks);
+    StopIf(num_chunks == SIZE_MAX, return -1, "error reading the backfill queue");
+
+    if (num_chunks == 0) {
+        return 0;
+    }
+
+    char const *sites[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST] = {0};
+    for (size_t i = 0; i < num_chunks; i++) {
+        sites[i] = chunks[i].site;
+    }
+
+    int rc = obs_download_sharded(shards, curl, bf->store->synoptic_labs_api_key, num_chunks, sites,
+                                  chunks[0].time_range, tuning);
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        int err = obs_db_backfill_finish_chunk(db, &chunks[i], rc == 0);
+        StopIf(err, return -1, "error updating the backfill queue");
+    }
+
+    obs_backfill_report(bf, db, chunks[0].job_id);
+
+    return rc ? -1 : 1;
+}
+
+static void *
+obs_backfill_thread(void *arg)
+{
+    struct ObsBackfill *bf = arg;
+
+    // Only lowers the priority of this thread, on Linux each thread has its own nice value.
+    if (setpriority(PRIO_PROCESS, gettid(), OBS_BACKFILL_NICE)) {
+        fprintf(stderr, "unable to lower backfill thread priority\n");
+    }
+
+    sqlite3 *db = obs_db_open_create(&bf->config);
+    StopIf(!db, return 0, "backfill unable to connect to sqlite");
+
+    struct ObsDbShards shards = {0};
+    StopIf(obs_db_shards_init(&shards, db, &bf->config), obs_db_close(db);
+           return 0, "backfill unable to find the shards");
+
+    CURL *curl = 0;
+    struct ObsDownloadTuning tuning = {0};
+    obs_download_tuning_load(db, &tuning);
+
+    bool stop = false;
+    while (!stop) {
+        int rc = obs_backfill_step(bf, &shards, &curl, &tuning);
+
+        // Back off after an error or when there is nothing to do.
+        stop = obs_backfill_wait(bf, rc > 0 ? OBS_BACKFILL_PAUSE_SEC : OBS_BACKFILL_IDLE_SEC);
+    }
+
+    obs_download_tuning_save(db, &tuning);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+
+    obs_db_shards_close(&shards);
+
+    return 0;
+}
+
+struct ObsBackfill *
+obs_backfill_start(struct ObsStore *store, ObsBackfillCallback callback, void *user_data)
+{
+    assert(store);
+    StopIf(store->snapshot_path, return 0, "a snapshot is read only, it can't be backfilled");
+
+    struct ObsBackfill *bf = calloc(1, sizeof(*bf));
+    StopIf(!bf, return 0, "Memory allocation error.");
+
+    bf->store = store;
+    bf->config = store->config;
+    bf->callback = callback;
+    bf->user_data = user_data;
+
+    pthread_mutex_init(&bf->lock, 0);
+    pthread_cond_init(&bf->wake, 0);
+
+    int rc = pthread_create(&bf->thread, 0, obs_backfill_thread, bf);
+    StopIf(rc, goto ERR_RETURN, "unable to start backfill thread");
+
+    return bf;
+
+ERR_RETURN:
+
+    pthread_cond_destroy(&bf->wake);
+    pthread_mutex_destroy(&bf->lock);
+    free(bf);
+    return 0;
+}
+
+void
+obs_backfill_stop(struct ObsBackfill **backfill)
+{
+    StopIf(!backfill || !*backfill, return, "Warning NULL passed for obs_backfill_stop.");
+
+    struct ObsBackfill *bf = *backfill;
+
+    pthread_mutex_lock(&bf->lock);
+    bf->stop = true;
+    pthread_cond_signal(&bf->wake);
+    pthread_mutex_unlock(&bf->lock);
+
+    pthread_join(bf->thread, 0);
+
+    pthread_cond_destroy(&bf->wake);
+    pthread_mutex_destroy(&bf->lock);
+    free(bf);
+
+    *backfill = 0;
+}
+
+/** Plan the chunks needed to fill in the missing data for one site.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+static int
+obs_backfill_plan_site(struct ObsStore *store, char const *site, struct ObsTimeRange tr,
+                       struct ObsDbBackfillChunk **chunks, size_t *num_chunks,
+                       size_t *chunks_capacity)
+{
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsTimeRangeSet missing = {0};
+    struct ObsTimeRange *planned = 0;
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "unable to open the local store for %s", site_buf);
+
+    int rc = obs_db_missing_ranges(db, site_buf, tr, &missing);
+    StopIf(rc < 0, goto ERR_RETURN, "error checking inventory for %s", site_buf);
+
+    if (missing.len == 0) {
+        return 0;
+    }
+
+    size_t num_planned = obs_download_plan(&store->tuning, 1, missing.len, missing.ranges,
+                                            &planned);
+    StopIf(num_planned == 0, goto ERR_RETURN, "error planning backfill for %s", site_buf);
+
+    if (*num_chunks + num_planned > *chunks_capacity) {
+        size_t new_capacity = *chunks_capacity ? *chunks_capacity : 16;
+        while (new_capacity < *num_chunks + num_planned) {
+            new_capacity *= 2;
+        }
+
+        struct ObsDbBackfillChunk *new_chunks =
+            realloc(*chunks, new_capacity * sizeof(*new_chunks));
+        StopIf(!new_chunks, goto ERR_RETURN, "out of memory");
+
+        *chunks = new_chunks;
+        *chunks_capacity = new_capacity;
+    }
+
+    for (size_t i = 0; i < num_planned; i++) {
+        struct ObsDbBackfillChunk *chunk = &(*chunks)[*num_chunks + i];
+        *chunk = (struct ObsDbBackfillChunk){.time_range = planned[i]};
+        strcpy(chunk->site, site_buf);
+    }
+    *num_chunks += num_planned;
+
+    obs_time_range_set_free(&missing);
+    free(planned);
+    return 0;
+
+ERR_RETURN:
+    obs_time_range_set_free(&missing);
+    free(planned);
+    return -1;
+}
+
+long
+obs_backfill_submit(struct ObsBackfill *bf, size_t num_sites, char const *const sites[],
+                    struct ObsTimeRange tr)
+{
+    assert(bf);
+    assert(sites || num_sites == 0);
+    assert(tr.start < tr.end);
+
+    sqlite3 *db = obs_store_db(bf->store);
+    StopIf(!db, return -1, "backfill submit aborted, unable to open the local store");
+
+    struct ObsDbBackfillChunk *chunks = 0;
+    size_t num_chunks = 0;
+    size_t chunks_capacity = 0;
+
+    for (size_t i = 0; i < num_sites; i++) {
+        int rc = obs_backfill_plan_site(bf->store, sites[i], tr, &chunks, &num_chunks,
+                                        &chunks_capacity);
+        StopIf(rc, goto ERR_RETURN, "error planning backfill job");
+    }
+
+    if (num_chunks == 0) {
+        free(chunks);
+        return 0;
+    }
+
+    long job_id = 0;
+    int rc = obs_db_backfill_add_job(db, num_chunks, chunks, &job_id);
+    StopIf(rc, goto ERR_RETURN, "error queueing backfill job");
+
+    free(chunks);
+
+    pthread_mutex_lock(&bf->lock);
+    bf->wake_now = true;
+    pthread_cond_signal(&bf->wake);
+    pthread_mutex_unlock(&bf->lock);
+
+    return job_id;
+
+ERR_RETURN:
+    free(chunks);
+    return -1;
+}
+
+int
+obs_backfill_progress(struct ObsBackfill *bf, long job_id, size_t *num_done, size_t *num_failed,
+                      size_t *num_chunks)
+{
+    assert(bf);
+
+    sqlite3 *db = obs_store_db(bf->store);
+    StopIf(!db, return -1, "unable to open the local store");
+
+    return obs_db_backfill_job_status(db, job_id, OBS_BACKFILL_MAX_ATTEMPTS, num_done, num_failed,
+                                      num_chunks);
+}
@@ -0,0 +1,244 @@
+/** \file backup.c
+ *
+ * \brief Implementation of the ObsBackup, which copies the local archive with the sqlite online
+ * backup API while it is in use.
+ */
+#include "obs.h"
+#include "obs_db.h"
+#include "obs_store.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+/** How many pages obs_store_backup() copies at a time if it isn't told. */
+#define OBS_BACKUP_DEFAULT_PAGES_PER_STEP 256
+
+/** How many times a backup starts over because of writes from other connections before the rest
+ * is copied in one step. */
+#define OBS_BACKUP_MAX_RESTARTS 3
+
+/** A backup in progress. */
+struct ObsBackup {
+    sqlite3_backup *backup; /**< The sqlite backup, from the store's connection to \ref dest. */
+    sqlite3 *dest;          /**< The temporary file the backup is written to. */
+    char *path;             /**< Where the backup goes when it is complete. */
+    char *tmp_path;         /**< The temporary file. */
+    size_t num_copied;      /**< The number of pages copied after the last step. */
+    unsigned num_restarts;  /**< How many times the copy has started over. */
+    bool done;              /**< Has every page been copied? */
+};
+
+struct ObsBackup *
+obs_backup_start(struct ObsStore *store, char const *path)
+{
+    assert(store && path);
+    StopIf(store->snapshot_path, return 0, "%s is a snapshot, copy the file instead",
+           store->snapshot_path);
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return 0, "backup aborted, unable to open the local store.");
+    StopIf(store->shards.num_shards > 1, return 0,
+           "a sharded store can't be backed up to one file");
+
+    struct ObsBackup *bk = calloc(1, sizeof(*bk));
+    StopIf(!bk, return 0, "Memory allocation error.");
+
+    bk->path = strdup(path);
+    StopIf(!bk->path || asprintf(&bk->tmp_path, "%s.tmp", path) < 0, bk->tmp_path = 0;
+           goto ERR_RETURN, "Memory allocation error.");
+
+    // Start from nothing, a leftover from a failed backup would be overwritten page by page.
+    remove(bk->tmp_path);
+
+    int rc = sqlite3_open_v2(bk->tmp_path, &bk->dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                             0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "unable to create %s: %s", bk->tmp_path,
+           sqlite3_errstr(rc));
+
+    bk->backup = sqlite3_backup_init(bk->dest, "main", db, "main");
+    StopIf(!bk->backup, goto ERR_RETURN, "unable to start the backup: %s",
+           sqlite3_errmsg(bk->dest));
+
+    return bk;
+
+ERR_RETURN:
+    obs_backup_finish(&bk);
+    return 0;
+}
+
+int
+obs_backup_step(struct ObsBackup *bk, int num_pages, size_t *remaining, size_t *total)
+{
+    assert(bk);
+
+    if (!bk->done) {
+        // Writers that keep restarting the copy have to wait for the rest of it this time.
+        if (bk->num_restarts >= OBS_BACKUP_MAX_RESTARTS) {
+            num_pages = -1;
+        }
+
+        int rc = sqlite3_backup_step(bk->backup, num_pages);
+        if (rc == SQLITE_DONE) {
+            bk->done = true;
+        } else {
+            // Busy and locked mean another connection has the archive, try again next step.
+            StopIf(rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED, return -1,
+                   "backup step failed: %s", sqlite3_errstr(rc));
+        }
+
+        // A write from another connection sends the copy back to the first page.
+        size_t num_copied = sqlite3_backup_pagecount(bk->backup) -
+                            sqlite3_backup_remaining(bk->backup);
+        if (num_copied < bk->num_copied) {
+            bk->num_restarts++;
+            if (bk->num_restarts == OBS_BACKUP_MAX_RESTARTS) {
+                fprintf(stderr, "backup to %s restarted %u times, copying the rest at once\n",
+                        bk->path, bk->num_restarts);
+            }
+        }
+        bk->num_copied = num_copied;
+    }
+
+    if (remaining) {
+        *remaining = sqlite3_backup_remaining(bk->backup);
+    }
+    if (total) {
+        *total = sqlite3_backup_pagecount(bk->backup);
+    }
+
+    return bk->done;
+}
+
+int
+obs_backup_finish(struct ObsBackup **backup)
+{
+    StopIf(!backup || !*backup, return -1, "Warning NULL passed for obs_backup_finish.");
+
+    struct ObsBackup *bk = *backup;
+    int result = bk->done ? 0 : -1;
+
+    if (bk->backup) {
+        int rc = sqlite3_backup_finish(bk->backup);
+        StopIf(rc != SQLITE_OK, result = -1, "error finishing the backup: %s", sqlite3_errstr(rc));
+    }
+
+    if (result == 0) {
+        // The copy has the whole change log, so it knows where obs_backup_update() picks up.
+        int64_t first = 0;
+        int64_t last = 0;
+        int rc = obs_db_change_log_range(bk->dest, &first, &last);
+        rc |= obs_db_set_setting(bk->dest, OBS_DB_BACKUP_WATERMARK_SETTING, last);
+        StopIf(rc, result = -1, "error recording the last change in the backup");
+    }
+
+    if (bk->dest) {
+        int rc = sqlite3_close(bk->dest);
+        StopIf(rc != SQLITE_OK, result = -1, "error closing %s: %s", bk->tmp_path,
+               sqlite3_errstr(rc));
+    }
+
+    if (bk->tmp_path) {
+        if (result == 0) {
+            StopIf(rename(bk->tmp_path, bk->path), result = -1, "unable to replace %s", bk->path);
+        }
+        if (result) {
+            remove(bk->tmp_path);
+        }
+    }
+
+    free(bk->path);
+    free(bk->tmp_path);
+    free(bk);
+    *backup = 0;
+
+    return result;
+}
+
+int
+obs_store_backup(struct ObsStore *store, char const *path, int pages_per_step, unsigned pause_ms)
+{
+    if (pages_per_step <= 0) {
+        pages_per_step = OBS_BACKUP_DEFAULT_PAGES_PER_STEP;
+    }
+
+    struct ObsBackup *bk = obs_backup_start(store, path);
+    StopIf(!bk, return -1, "unable to start a backup to %s", path);
+
+    struct timespec const pause = {.tv_sec = pause_ms / 1000,
+                                   .tv_nsec = (pause_ms % 1000) * 1000000L};
+
+    int rc = 0;
+    while ((rc = obs_backup_step(bk, pages_per_step, 0, 0)) == 0) {
+        if (pause_ms) {
+            nanosleep(&pause, 0);
+        }
+    }
+
+    StopIf(obs_backup_finish(&bk) || rc < 0, return -1, "backup to %s failed", path);
+
+    return 0;
+}
+
+long
+obs_backup_update(struct ObsStore *store, char const *path)
+{
+    assert(store && path);
+    StopIf(store->snapshot_path, return -1, "%s is a snapshot, copy the file instead",
+           store->snapshot_path);
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "backup aborted, unable to open the local store.");
+    StopIf(store->shards.num_shards > 1, return -1,
+           "a sharded store can't be backed up to one file");
+
+    long num_rows = -1;
+    sqlite3 *dest = 0;
+    char *delta_path = 0;
+
+    // Don't create a file, an empty one is not a backup to bring up to date.
+    int rc = sqlite3_open_v2(path, &dest, SQLITE_OPEN_READWRITE, 0);
+    StopIf(rc != SQLITE_OK, goto CLEAN_UP, "unable to open backup %s: %s", path,
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_busy_timeout(dest, OBS_DB_BUSY_TIMEOUT_MS);
+    StopIf(rc != SQLITE_OK, goto CLEAN_UP, "unable to set busy timeout: %s", sqlite3_errstr(rc));
+
+    double value = 0.0;
+    int found = obs_db_get_setting(dest, OBS_DB_BACKUP_WATERMARK_SETTING, &value);
+    StopIf(found <= 0, goto CLEAN_UP, "%s was not written by obs_store_backup()", path);
+    int64_t watermark = (int64_t)value;
+
+    // Maintenance trims the change log, the changes right after the backup have to be there.
+    int64_t first = 0;
+    int64_t last = 0;
+    rc = obs_db_change_log_range(db, &first, &last);
+    StopIf(rc, goto CLEAN_UP, "unable to read the change log");
+    StopIf(first > watermark + 1, goto CLEAN_UP,
+           "the change log no longer goes back to backup %s, take a new backup", path);
+
+    StopIf(asprintf(&delta_path, "%s.delta", path) < 0, delta_path = 0;
+           goto CLEAN_UP, "Memory allocation error.");
+
+    int64_t delta_last = 0;
+    long num_exported = obs_db_export_changes(db, delta_path, watermark, &delta_last);
+    StopIf(num_exported < 0, goto CLEAN_UP, "unable to write the changes for backup %s", path);
+
+    num_rows = obs_db_import_changes(dest, delta_path, OBS_DB_BACKUP_WATERMARK_SETTING, 0);
+    StopIf(num_rows < 0, goto CLEAN_UP, "unable to apply the changes to backup %s", path);
+
+CLEAN_UP:
+    if (delta_path) {
+        remove(delta_path);
+    }
+    free(delta_path);
+    sqlite3_close(dest);
+
+    return num_rows;
+}
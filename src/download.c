@@ -2,11 +2,15 @@
  * \brief Implementation of the download module.
  */
 #include "download.h"
+#include "latency.h"
 #include "obs_db.h"
+#include "probes.h"
+#include "shm_cache.h"
 #include "utils.h"
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <tgmath.h>
 
@@ -14,65 +18,402 @@
 #include <curl/curl.h>
 #include <sqlite3.h>
 
+/** Observations this recent (in seconds) may not have made it into the SynopticLabs archive yet. */
+#define OBS_DOWNLOAD_LATENCY_SEC (2 * HOURSEC)
+
+/** Commit the open transaction after this many rows, so a failure doesn't lose all the progress. */
+#define OBS_DOWNLOAD_CHECKPOINT_ROWS 10000
+
+/** Parsed rows are stored this many at a time, so timing the inserts doesn't cost a clock read for
+ * every row. */
+#define OBS_DOWNLOAD_INSERT_BATCH_ROWS 256
+
+/** How many times to try a download before giving up, including the first try. */
+#define OBS_DOWNLOAD_MAX_ATTEMPTS 3
+
+/** How long to wait (in milliseconds) before retrying a download that failed for a reason that
+ * should pass, like a server outage. The wait doubles with each retry. */
+#define OBS_DOWNLOAD_RETRY_DELAY_MS 2000
+
+/** Failed downloads are split in half until they are this short (in seconds), then the range is
+ * recorded as bad and skipped. */
+#define OBS_DOWNLOAD_MIN_BISECT_SEC HOURSEC
+
+/** The weight of the newest measurement in the running averages of \ref ObsDownloadTuning. */
+#define OBS_DOWNLOAD_TUNING_WEIGHT 0.2
+
+/** Split time ranges into chunks that should take about this many seconds to transfer. */
+#define OBS_DOWNLOAD_TARGET_CHUNK_SEC 20.0
+
+/** The shortest chunk (in hours) a long time range will be split into. */
+#define OBS_DOWNLOAD_MIN_CHUNK_HOURS 24.0
+
+/** The longest chunk (in hours) that will be requested at once. */
+#define OBS_DOWNLOAD_MAX_CHUNK_HOURS (2.0 * 366.0 * 24.0)
+
+/** The most chunks to download at the same time. */
+#define OBS_DOWNLOAD_MAX_PARALLEL 4
+
 /*-------------------------------------------------------------------------------------------------
  *                       CSV Parsers and insert into sqlite database.
  *-----------------------------------------------------------------------------------------------*/
+/** A row of a response that has been parsed but not stored yet. */
+struct CsvRow {
+    time_t valid_time; /**< The valid time of the observation. */
+    size_t site_idx;   /**< The index of the site of the observation. */
+    double t_f;        /**< Temperature in Fahrenheit. */
+    double p_in;       /**< Precipitation in inches. */
+};
+
 /** Holds state for callbacks for libcsv, which are passing data to sqlite3.*/
 struct CsvToSqliteState {
-    sqlite3_stmt *insert_stmt; /**< The database we'll be storing this into. */
+    /** The files of the local store. Each row goes to the file its site is kept in. */
+    struct ObsDbShards *shards;
+
+    /** An inserter, with an open transaction, for each shard a requested site is kept in. The
+     * other entries are \c NULL. */
+    struct ObsDbInserter *inserters[OBS_STORE_MAX_SHARDS];
+
+    unsigned *site_shards; /**< The shard of each requested site. */
 
     bool header_parsed; /**< Has the header row been parsed? So we have values for vt_col, t_col */
     size_t col;         /**< Current column. */
 
-    size_t vt_col; /**< The column number for the valid time. */
-    size_t t_col;  /**< The column number for the temperature data. */
-    size_t p_col;  /**< The column number for the precipitation data. */
+    /* The column numbers of the values in the current station section, \c SIZE_MAX if the section
+     * header doesn't have them. */
+    size_t stid_col; /**< The column number for the station id. */
+    size_t vt_col;   /**< The column number for the valid time. */
+    size_t t_col;    /**< The column number for the temperature data. */
+    size_t p_col;    /**< The column number for the precipitation data. */
+
+    struct ObsTimeRange tr;   /**< The time range in the request. */
+    size_t num_sites;         /**< The number of sites in the request. */
+    char const *const *sites; /**< The sites in the request, these are aliases, do not free. */
+
+    /** The index of the site named in the comment header of the current station section of the
+     * response, \c SIZE_MAX if there isn't one. */
+    size_t section_site_idx;
+
+    /** For each site, the last valid time inserted in the open transaction. It only becomes the
+     * end of \ref tr once the whole response has been parsed. */
+    time_t *pending_through;
+
+    /** Same as \ref pending_through, but for the data that has already been committed. */
+    time_t *committed_through;
+
+    size_t num_pending_rows; /**< The number of rows inserted since the last checkpoint. */
+    double store_ms;         /**< Time spent storing rows, so it isn't counted as parsing. */
+    size_t num_rows;         /**< The number of rows stored from the response. */
+    size_t last_site_idx;    /**< The index of the site in the last row for a requested site. */
+
+    struct CsvRow batch[OBS_DOWNLOAD_INSERT_BATCH_ROWS]; /**< Rows waiting to be stored. */
+    size_t num_batched;                                  /**< The number of rows in \ref batch. */
 
     time_t valid_time; /**< The valid time of the observation. */
-    char const *site;  /**< The site name from the query, this is an alias, do not free. */
+    size_t site_idx;   /**< The index of the site of the observation, \c SIZE_MAX if unknown. */
     double t_f;        /**< Temperature in Fahrenheit. */
     double p_in;       /**< Precipitation in inches. */
 
-    bool error; /**< Whether an error has occurred. */
+    bool error;       /**< Whether an error has occurred in the current row. */
+    bool failed;      /**< Whether an unrecoverable error has occurred, abort the download. */
+    bool bad_content; /**< Whether the failure was caused by the contents of the response. */
 };
 
+/** Wrap a single connection so it can be used where the shards of an archive are expected. */
+static struct ObsDbShards
+obs_download_single_db(sqlite3 *local_store)
+{
+    return (struct ObsDbShards){.num_shards = 1, .dbs = {local_store}};
+}
+
+/** Roll back and close the open transactions of a csv state. */
+static void
+obs_download_rollback_shards(struct CsvToSqliteState *st)
+{
+    for (unsigned i = 0; i < st->shards->num_shards; i++) {
+        if (st->inserters[i]) {
+            obs_db_finalize_inserter(st->inserters[i]);
+            st->inserters[i] = 0;
+            obs_db_finish_transaction(st->shards->dbs[i], OBS_DB_TRANSACTION_ROLLBACK);
+        }
+    }
+}
+
 static struct CsvToSqliteState
-obs_download_init_csv_state(sqlite3 *local_store, char const *site_id)
+obs_download_init_csv_state(struct ObsDbShards *shards, size_t num_sites,
+                            char const *const sites[num_sites], struct ObsTimeRange tr)
 {
+    struct CsvToSqliteState st = {.shards = shards,
+                                  .header_parsed = false,
+                                  .col = 0,
+                                  .stid_col = SIZE_MAX,
+                                  .vt_col = SIZE_MAX,
+                                  .t_col = SIZE_MAX,
+                                  .p_col = SIZE_MAX,
+                                  .tr = tr,
+                                  .num_sites = num_sites,
+                                  .sites = sites,
+                                  .section_site_idx = SIZE_MAX,
+                                  .num_pending_rows = 0,
+                                  .store_ms = 0.0,
+                                  .num_rows = 0,
+                                  .last_site_idx = SIZE_MAX,
+                                  .num_batched = 0,
+                                  .valid_time = 0,
+                                  .site_idx = SIZE_MAX,
+                                  .t_f = NAN,
+                                  .p_in = NAN,
+                                  .error = false,
+                                  .failed = false,
+                                  .bad_content = false};
+
+    time_t *through = calloc(2 * num_sites, sizeof(time_t));
+    st.site_shards = calloc(num_sites, sizeof(unsigned));
+    StopIf(!through || !st.site_shards, goto ERR_RETURN, "out of memory");
+
+    for (size_t i = 0; i < 2 * num_sites; i++) {
+        through[i] = tr.start;
+    }
+
+    // One transaction for each shard in the request, however many rows go to it.
+    for (size_t i = 0; i < num_sites; i++) {
+        unsigned shard = obs_db_shard_of(sites[i], shards->num_shards);
+        st.site_shards[i] = shard;
+
+        if (!st.inserters[shard]) {
+            sqlite3 *db = obs_db_shards_get(shards, shard);
+            StopIf(!db, goto ERR_RETURN_ROLLBACK, "unable to open shard %u", shard);
 
-    int rc = obs_db_start_transaction(local_store);
-    StopIf(rc, goto ERR_RETURN, "error starting transaction");
+            int rc = obs_db_start_transaction(db);
+            StopIf(rc, goto ERR_RETURN_ROLLBACK, "error starting transaction");
 
-    sqlite3_stmt *insert_stmt = obs_db_create_insert_statement(local_store);
-    StopIf(!insert_stmt, goto ERR_RETURN, "error creating insert statement");
+            st.inserters[shard] = obs_db_create_inserter(db);
+            StopIf(!st.inserters[shard], obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+                   goto ERR_RETURN_ROLLBACK, "error creating inserter");
+        }
+    }
+
+    st.pending_through = through;
+    st.committed_through = through + num_sites;
+
+    return st;
 
-    return (struct CsvToSqliteState){.insert_stmt = insert_stmt,
-                                     .header_parsed = false,
-                                     .col = 0,
-                                     .t_col = 0,
-                                     .p_col = 0,
-                                     .valid_time = 0,
-                                     .site = site_id,
-                                     .t_f = NAN,
-                                     .p_in = NAN,
-                                     .error = false};
+ERR_RETURN_ROLLBACK:
+
+    obs_download_rollback_shards(&st);
 
 ERR_RETURN:
 
-    return (struct CsvToSqliteState){.error = true};
+    free(st.site_shards);
+    free(through);
+    return (struct CsvToSqliteState){.error = true, .failed = true};
+}
+
+/** Record how far each site has gotten in the coverage table, as part of the open transaction. */
+static int
+obs_download_record_coverage(struct CsvToSqliteState *st)
+{
+    // Don't claim the most recent hours, they may not be in the archive yet.
+    time_t settled = time(0) - OBS_DOWNLOAD_LATENCY_SEC;
+
+    for (size_t i = 0; i < st->num_sites; i++) {
+        if (st->pending_through[i] <= st->committed_through[i]) {
+            continue;
+        }
+
+        struct ObsTimeRange covered = {.start = st->tr.start, .end = st->pending_through[i]};
+        if (covered.end > settled) {
+            covered.end = settled;
+        }
+
+        if (covered.start < covered.end) {
+            sqlite3 *db = st->shards->dbs[st->site_shards[i]];
+            int rc = obs_db_add_coverage(db, st->sites[i], covered);
+            StopIf(rc, return -1, "error recording coverage for %s", st->sites[i]);
+        }
+    }
+
+    return 0;
 }
 
+/** Commit what was inserted into each shard and note which sites made it.
+ *
+ * \param action is \ref OBS_DB_TRANSACTION_COMMIT or \ref OBS_DB_TRANSACTION_ROLLBACK. Shards that
+ * fail to save their hour bitmaps are rolled back.
+ * \param finalize if \c true the inserters are finalized, otherwise a new transaction is started
+ * on each shard for the rest of the download.
+ *
+ * \returns 0 if every shard was committed, a negative value otherwise.
+ */
 static int
-obs_download_finalize_csv_state(sqlite3 *local_store, struct CsvToSqliteState *csv_state)
+obs_download_commit_shards(struct CsvToSqliteState *st, int action, bool finalize)
 {
-    obs_db_finalize_insert_statement(csv_state->insert_stmt);
+    bool committed[OBS_STORE_MAX_SHARDS] = {0};
+    int result = action == OBS_DB_TRANSACTION_COMMIT ? 0 : -1;
+
+    for (unsigned i = 0; i < st->shards->num_shards; i++) {
+        if (!st->inserters[i]) {
+            continue;
+        }
+
+        sqlite3 *db = st->shards->dbs[i];
+        int shard_action = action;
+        if (shard_action == OBS_DB_TRANSACTION_COMMIT && obs_db_inserter_flush(st->inserters[i])) {
+            fprintf(stderr, "error saving hour bitmaps for shard %u\n", i);
+            shard_action = OBS_DB_TRANSACTION_ROLLBACK;
+        }
+
+        if (finalize) {
+            obs_db_finalize_inserter(st->inserters[i]);
+            st->inserters[i] = 0;
+        }
+
+        int rc = obs_db_finish_transaction(db, shard_action);
+        committed[i] = !rc && shard_action == OBS_DB_TRANSACTION_COMMIT;
+        if (!committed[i]) {
+            result = -1;
+        }
+
+        if (!finalize) {
+            rc = obs_db_start_transaction(db);
+            StopIf(rc, result = -1, "error starting transaction after checkpoint");
+        }
+    }
+
+    // Only the sites in shards that were committed have moved forward, let other processes sharing
+    // the result cache know about them.
+    for (size_t i = 0; i < st->num_sites; i++) {
+        if (committed[st->site_shards[i]]) {
+            if (st->pending_through[i] > st->committed_through[i]) {
+                obs_shm_cache_site_changed(st->sites[i]);
+            }
+            st->committed_through[i] = st->pending_through[i];
+        }
+    }
+
+    return result;
+}
+
+/** Commit everything inserted so far and open a new transaction for the rest of the download. */
+static int
+obs_download_checkpoint(struct CsvToSqliteState *st)
+{
+    int rc = obs_download_record_coverage(st);
+    StopIf(rc, return -1, "error recording checkpoint coverage");
+
+    rc = obs_download_commit_shards(st, OBS_DB_TRANSACTION_COMMIT, false);
+    StopIf(rc, return -1, "error committing checkpoint");
+
+    st->num_pending_rows = 0;
+
+    return 0;
+}
+
+/** Keep track of how far along each site is, and checkpoint if it has been a while.
+ *
+ * A site is only known to be finished when the whole response has been parsed, the server doesn't
+ * promise each station shows up in one piece. Until then it is done through its last valid time.
+ */
+static void
+obs_download_track_progress(struct CsvToSqliteState *st, struct CsvRow const *row)
+{
+    // Rows outside the request don't say anything about what was covered.
+    time_t *through = &st->pending_through[row->site_idx];
+    if (row->valid_time > *through && row->valid_time <= st->tr.end) {
+        *through = row->valid_time;
+    }
+
+    st->num_pending_rows++;
+    if (st->num_pending_rows >= OBS_DOWNLOAD_CHECKPOINT_ROWS) {
+        int rc = obs_download_checkpoint(st);
+        StopIf(rc, st->failed = true, "checkpoint failed, aborting download");
+    }
+}
+
+/** Insert the rows waiting in the batch, timing them as one measurement. */
+static void
+obs_download_store_batch(struct CsvToSqliteState *st)
+{
+    if (st->num_batched == 0) {
+        return;
+    }
+
+    double start = obs_util_monotonic_ms();
+
+    for (size_t i = 0; i < st->num_batched && !st->failed; i++) {
+        struct CsvRow const *row = &st->batch[i];
+
+        // Ignore errors from this function and just keep going. A row that didn't make it in
+        // will leave a gap that gets picked up by the next inventory check.
+        struct ObsDbInserter *inserter = st->inserters[st->site_shards[row->site_idx]];
+        int rc = obs_db_insert(inserter, row->valid_time, st->sites[row->site_idx], row->t_f,
+                               row->p_in);
+        if (!rc) {
+            st->num_rows++;
+            obs_download_track_progress(st, row);
+        }
+    }
+
+    st->num_batched = 0;
+
+    double elapsed = obs_util_monotonic_ms() - start;
+    obs_latency_record(OBS_LATENCY_INSERT, elapsed);
+    st->store_ms += elapsed;
+}
+
+/** Finish the download, committing the open transaction on success or rolling it back on failure.
+ *
+ * \param csv_state is the state to clean up.
+ * \param complete is \c true if the whole response was received, in which case every site in the
+ * request is marked as covered for the whole time range.
+ * \param committed_through if not \c NULL, the last committed valid time for each site is copied
+ * into this array. Sites that are finished will have the end of the time range.
+ *
+ * \returns 0 if everything was committed, a negative value otherwise.
+ */
+static int
+obs_download_finalize_csv_state(struct CsvToSqliteState *csv_state, bool complete,
+                                time_t *committed_through)
+{
+    if (!csv_state->pending_through) {
+        // Initialization failed, nothing to clean up.
+        return -1;
+    }
+
+    int rc = 0;
+    if (complete) {
+        // A failed transfer is rolled back anyway, so only a complete one stores its last rows.
+        obs_download_store_batch(csv_state);
+        complete = !csv_state->failed;
+    }
+
+    if (complete) {
+        for (size_t i = 0; i < csv_state->num_sites; i++) {
+            csv_state->pending_through[i] = csv_state->tr.end;
+        }
+
+        rc = obs_download_record_coverage(csv_state);
+    }
 
     int action = OBS_DB_TRANSACTION_COMMIT;
-    if (csv_state->error) {
+    if (!complete || rc) {
         action = OBS_DB_TRANSACTION_ROLLBACK;
     }
 
-    int rc = obs_db_finish_transaction(local_store, action);
+    if (obs_download_commit_shards(csv_state, action, true)) {
+        rc = -1;
+    }
+
+    if (committed_through) {
+        memcpy(committed_through, csv_state->committed_through,
+               csv_state->num_sites * sizeof(time_t));
+    }
+
+    free(csv_state->pending_through);
+    free(csv_state->site_shards);
+    csv_state->pending_through = 0;
+    csv_state->committed_through = 0;
+    csv_state->site_shards = 0;
 
     // Return 0 if everything went well, a negative value otherwise
     return rc;
@@ -143,11 +484,86 @@ ERR_RETURN:
     return 0;
 }
 
+/** Find the requested site matching a station id from the response.
+ *
+ * \returns an index into the list of requested sites, or \c SIZE_MAX if the station wasn't
+ * requested.
+ */
+static size_t
+obs_download_find_site(char const *txt, struct CsvToSqliteState *st)
+{
+    char site_buf[32] = {0};
+    if (!txt || strlen(txt) + 1 >= sizeof(site_buf)) {
+        return SIZE_MAX;
+    }
+
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, txt);
+
+    // Responses are grouped by station, so the site of the last row is almost always the answer.
+    size_t last = st->last_site_idx;
+    if (last != SIZE_MAX && strcmp(st->sites[last], site_buf) == 0) {
+        return last;
+    }
+
+    for (size_t i = 0; i < st->num_sites; i++) {
+        if (strcmp(st->sites[i], site_buf) == 0) {
+            return i;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+static size_t
+col_callback_parse_site(char const *txt, struct CsvToSqliteState *st)
+{
+    size_t site_idx = obs_download_find_site(txt, st);
+    if (site_idx == SIZE_MAX) {
+        st->error = true;
+    }
+
+    return site_idx;
+}
+
+static void
+col_callback_parse_comment(char const *txt, struct CsvToSqliteState *st)
+{
+    // Each station in a multi-station response starts with a comment block like "# STATION: KMSO"
+    // followed by its own column header.
+    static char const *const station_tag = "# STATION:";
+
+    if (st->col != 0) {
+        return;
+    }
+
+    if (strncmp(txt, station_tag, strlen(station_tag)) == 0) {
+        char const *id = txt + strlen(station_tag);
+        while (*id && isspace(*id)) {
+            id++;
+        }
+
+        // Every station has its own header, don't read its values from the last station's columns.
+        st->section_site_idx = obs_download_find_site(id, st);
+        st->header_parsed = false;
+        st->stid_col = SIZE_MAX;
+        st->vt_col = SIZE_MAX;
+        st->t_col = SIZE_MAX;
+        st->p_col = SIZE_MAX;
+    } else if (st->header_parsed) {
+        // Comments only belong before the column header, this response is mangled.
+        fprintf(stderr, "unexpected comment in the middle of the data: %s\n", txt);
+        st->bad_content = true;
+        st->failed = true;
+    }
+}
+
 static void
 col_callback_parse_col_header(char const *txt, struct CsvToSqliteState *st)
 {
     if (txt) {
-        if (strstr(txt, "Date_Time") != 0) {
+        if (strstr(txt, "Station_ID") != 0) {
+            st->stid_col = st->col;
+        } else if (strstr(txt, "Date_Time") != 0) {
             st->vt_col = st->col;
         } else if (strstr(txt, "air_temp_set_1") != 0) {
             st->t_col = st->col;
@@ -166,15 +582,22 @@ col_callback(void *data, size_t num_bytes, void *userdata)
     char *txt = data;
 
     // Skip (without counting) rows that start with #
-    if (st->error || (txt && txt[0] == '#')) {
+    if (txt && txt[0] == '#') {
+        col_callback_parse_comment(txt, st);
         st->error = true;
         return;
     }
 
+    if (st->error) {
+        return;
+    }
+
     if (!st->header_parsed) {
         col_callback_parse_col_header(txt, st);
     } else {
-        if (st->col == st->vt_col) {
+        if (st->col == st->stid_col) {
+            st->site_idx = col_callback_parse_site(txt, st);
+        } else if (st->col == st->vt_col) {
             st->valid_time = col_callback_parse_valid_time(txt, st);
         } else if (st->col == st->t_col) {
             st->t_f = col_callback_parse_double(txt, st);
@@ -193,23 +616,61 @@ row_callback_is_error_condition(struct CsvToSqliteState *st)
     return st->error || isnan(st->t_f) || isnan(st->p_in) || st->valid_time == 0;
 }
 
+/** Decide which requested site the current row belongs to.
+ *
+ * \returns an index into the list of requested sites, or \c SIZE_MAX if it can't be determined.
+ */
+static size_t
+row_callback_site(struct CsvToSqliteState *st)
+{
+    if (st->stid_col != SIZE_MAX) {
+        return st->site_idx;
+    } else if (st->section_site_idx != SIZE_MAX) {
+        return st->section_site_idx;
+    } else if (st->num_sites == 1) {
+        return 0;
+    }
+
+    return SIZE_MAX;
+}
+
 static void
 row_callback(int cause_char, void *userdata)
 {
     struct CsvToSqliteState *st = userdata;
+    OBS_PROBE1(row_callback_entry, st->num_rows);
 
-    if (!st->header_parsed && !st->error) {
+    char const *stored_site = 0;
+
+    if (st->failed) {
+        // Nothing else will be committed, don't bother.
+    } else if (!st->header_parsed && !st->error) {
         // We just updated the column header indexes so we know what column has which values.
         st->header_parsed = true;
     } else if (!row_callback_is_error_condition(st)) {
-        // Ignore errors from this function and just keep going. The callback nature of
-        // libcsv doesn't give us a way to abort even if we wanted to.
-        obs_db_insert(st->insert_stmt, st->valid_time, st->site, st->t_f, st->p_in);
+        size_t site_idx = row_callback_site(st);
+        if (site_idx != SIZE_MAX) {
+            st->last_site_idx = site_idx;
+            stored_site = st->sites[site_idx];
+
+            st->batch[st->num_batched] = (struct CsvRow){.valid_time = st->valid_time,
+                                                         .site_idx = site_idx,
+                                                         .t_f = st->t_f,
+                                                         .p_in = st->p_in};
+            st->num_batched++;
+
+            if (st->num_batched == OBS_DOWNLOAD_INSERT_BATCH_ROWS) {
+                obs_download_store_batch(st);
+            }
+        }
     }
 
+    OBS_PROBE3(row_callback_return, stored_site, st->valid_time, stored_site != 0);
+
     st->col = 0;
 
     st->valid_time = 0;
+    st->site_idx = SIZE_MAX;
     st->t_f = NAN;
     st->p_in = NAN;
     st->error = false;
@@ -257,22 +718,194 @@ curl_callback(char *ptr, size_t size, size_t nmember, void *userdata)
     struct CurlToCsvState *curl_state = userdata;
     size_t num_bytes = size * nmember;
 
+    OBS_PROBE1(curl_callback_entry, num_bytes);
+
+    double start = obs_util_monotonic_ms();
+    curl_state->csv_state->store_ms = 0.0;
+
     size_t bytes_processed = csv_parse(&curl_state->parser, ptr, num_bytes, col_callback,
                                        row_callback, curl_state->csv_state);
 
+    double parse_ms = obs_util_monotonic_ms() - start - curl_state->csv_state->store_ms;
+    obs_latency_record(OBS_LATENCY_PARSE, parse_ms);
+
     if (bytes_processed != num_bytes) {
         fprintf(stderr, "error parsing csv file: %s\n",
                 csv_strerror(csv_error(&curl_state->parser)));
+        curl_state->csv_state->bad_content = true;
+    }
+
+    OBS_PROBE2(curl_callback_return, bytes_processed, curl_state->csv_state->num_rows);
+
+    if (curl_state->csv_state->failed) {
+        // Returning a short count makes cURL abort the transfer.
+        return 0;
     }
 
     return bytes_processed;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ *                            Throughput measurement and request sizing.
+ *-----------------------------------------------------------------------------------------------*/
+/** Names of the settings used to save \ref ObsDownloadTuning in the local store. */
+static char const *const tuning_latency_name = "download_latency_sec";
+static char const *const tuning_rate_name = "download_bytes_per_sec";
+static char const *const tuning_size_name = "download_bytes_per_site_hour";
+static char const *const tuning_samples_name = "download_num_samples";
+
+void
+obs_download_tuning_load(sqlite3 *local_store, struct ObsDownloadTuning *tuning)
+{
+    // Conservative guesses until there are some measurements.
+    *tuning = (struct ObsDownloadTuning){.latency_sec = 1.0,
+                                         .bytes_per_sec = 100000.0,
+                                         .bytes_per_site_hour = 50.0,
+                                         .num_samples = 0.0,
+                                         .modified = false};
+
+    obs_db_get_setting(local_store, tuning_latency_name, &tuning->latency_sec);
+    obs_db_get_setting(local_store, tuning_rate_name, &tuning->bytes_per_sec);
+    obs_db_get_setting(local_store, tuning_size_name, &tuning->bytes_per_site_hour);
+    obs_db_get_setting(local_store, tuning_samples_name, &tuning->num_samples);
+}
+
+int
+obs_download_tuning_save(sqlite3 *local_store, struct ObsDownloadTuning *tuning)
+{
+    if (!tuning->modified) {
+        return 0;
+    }
+
+    int rc = obs_db_set_setting(local_store, tuning_latency_name, tuning->latency_sec);
+    rc |= obs_db_set_setting(local_store, tuning_rate_name, tuning->bytes_per_sec);
+    rc |= obs_db_set_setting(local_store, tuning_size_name, tuning->bytes_per_site_hour);
+    rc |= obs_db_set_setting(local_store, tuning_samples_name, tuning->num_samples);
+    StopIf(rc, return -1, "error saving download tuning");
+
+    tuning->modified = false;
+
+    return 0;
+}
+
+static double
+obs_download_tuning_average(double average, double sample, double num_samples)
+{
+    if (num_samples < 1.0) {
+        return sample;
+    }
+
+    return (1.0 - OBS_DOWNLOAD_TUNING_WEIGHT) * average + OBS_DOWNLOAD_TUNING_WEIGHT * sample;
+}
+
+/** Update the running averages with the measurements from a finished transfer. */
+static void
+obs_download_tuning_update(struct ObsDownloadTuning *tuning, CURL *handle, size_t num_sites,
+                           struct ObsTimeRange tr)
+{
+    if (!tuning) {
+        return;
+    }
+
+    curl_off_t num_bytes = 0;
+    double first_byte_sec = 0.0;
+    double total_sec = 0.0;
+
+    CURLcode res = curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &num_bytes);
+    res |= curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &first_byte_sec);
+    res |= curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total_sec);
+    StopIf(res, return, "error retrieving transfer statistics");
+
+    double hours = difftime(tr.end, tr.start) / HOURSEC;
+    if (num_bytes <= 0 || hours <= 0.0) {
+        return;
+    }
+
+    double n = tuning->num_samples;
+    tuning->latency_sec = obs_download_tuning_average(tuning->latency_sec, first_byte_sec, n);
+    tuning->bytes_per_site_hour = obs_download_tuning_average(
+        tuning->bytes_per_site_hour, num_bytes / (hours * num_sites), n);
+
+    // Tiny responses arrive all at once, so they say nothing about the transfer rate.
+    double transfer_sec = total_sec - first_byte_sec;
+    if (transfer_sec > 0.05) {
+        tuning->bytes_per_sec =
+            obs_download_tuning_average(tuning->bytes_per_sec, num_bytes / transfer_sec, n);
+    }
+
+    tuning->num_samples += 1.0;
+    tuning->modified = true;
+}
+
+size_t
+obs_download_plan(struct ObsDownloadTuning const *tuning, size_t num_sites, size_t num_ranges,
+                  struct ObsTimeRange const ranges[num_ranges], struct ObsTimeRange **chunks)
+{
+    assert(num_sites > 0);
+    assert(num_ranges > 0);
+
+    // Seconds of transfer time for each hour of data requested.
+    double sec_per_hour = num_sites * tuning->bytes_per_site_hour / tuning->bytes_per_sec;
+
+    double max_hours = OBS_DOWNLOAD_TARGET_CHUNK_SEC / sec_per_hour;
+    max_hours = fmax(max_hours, OBS_DOWNLOAD_MIN_CHUNK_HOURS);
+    max_hours = fmin(max_hours, OBS_DOWNLOAD_MAX_CHUNK_HOURS);
+    time_t const max_chunk_sec = (time_t)(max_hours * HOURSEC);
+
+    size_t capacity = num_ranges;
+    size_t num_chunks = 0;
+    *chunks = calloc(capacity, sizeof(**chunks));
+    StopIf(!*chunks, return 0, "out of memory");
+
+    size_t i = 0;
+    while (i < num_ranges) {
+        struct ObsTimeRange merged = ranges[i];
+        i++;
+
+        while (i < num_ranges) {
+            double gap_hours = difftime(ranges[i].start, merged.end) / HOURSEC;
+            if (gap_hours * sec_per_hour > tuning->latency_sec) {
+                break;
+            }
+
+            if (ranges[i].end > merged.end) {
+                merged.end = ranges[i].end;
+            }
+            i++;
+        }
+
+        for (time_t start = merged.start; start < merged.end; start += max_chunk_sec) {
+            if (num_chunks == capacity) {
+                capacity *= 2;
+                struct ObsTimeRange *new_chunks = realloc(*chunks, capacity * sizeof(**chunks));
+                StopIf(!new_chunks, goto ERR_RETURN, "out of memory");
+                *chunks = new_chunks;
+            }
+
+            time_t end = start + max_chunk_sec;
+            if (end > merged.end) {
+                end = merged.end;
+            }
+
+            (*chunks)[num_chunks] = (struct ObsTimeRange){.start = start, .end = end};
+            num_chunks++;
+        }
+    }
+
+    return num_chunks;
+
+ERR_RETURN:
+    free(*chunks);
+    *chunks = 0;
+    return 0;
+}
+
 /*-------------------------------------------------------------------------------------------------
  *                                         CURL set up.
  *-----------------------------------------------------------------------------------------------*/
 static char *
-obs_download_create_synoptic_labs_url(char const *const api_key, char const *site_id,
+obs_download_create_synoptic_labs_url(char const *const api_key, size_t num_sites,
+                                      char const *const site_ids[num_sites],
                                       struct ObsTimeRange tr)
 {
     static char const *const base_url = "https://api.synopticdata.com/v2/stations/timeseries?"
@@ -294,10 +927,27 @@ obs_download_create_synoptic_labs_url(char const *const api_key, char const *sit
     num_chars = strftime(end_str, sizeof(end_str), "%Y%m%d%H%M", &end_tm);
     StopIf(num_chars == 0, exit(EXIT_FAILURE), "impossible memory error formatting time");
 
+    // The timeseries endpoint takes a comma separated list of stations.
+    size_t stid_len = 1;
+    for (size_t i = 0; i < num_sites; i++) {
+        stid_len += strlen(site_ids[i]) + 1;
+    }
+
+    char *stid = calloc(stid_len, sizeof(char));
+    StopIf(!stid, exit(EXIT_FAILURE), "memory allocation error!");
+    for (size_t i = 0; i < num_sites; i++) {
+        if (i > 0) {
+            strcat(stid, ",");
+        }
+        strcat(stid, site_ids[i]);
+    }
+
     char *url = 0;
-    int num_printed = asprintf(&url, base_url, site_id, start_str, end_str, api_key);
+    int num_printed = asprintf(&url, base_url, stid, start_str, end_str, api_key);
     StopIf(num_printed < strlen(base_url), exit(EXIT_FAILURE), "memory allocation error!");
 
+    free(stid);
+
     return url;
 }
 
@@ -312,7 +962,7 @@ obs_download_init_check_curl(CURL **curl, struct CurlToCsvState *curl_state)
         StopIf(res, goto ERR_RETURN, "Failed to initialize curl");
 
         CURL *curl_init = curl_easy_init();
-        StopIf(!curl, goto ERR_RETURN, "curl_easy_init failed.");
+        StopIf(!curl_init, goto ERR_RETURN, "curl_easy_init failed.");
 
         res = curl_easy_setopt(curl_init, CURLOPT_FAILONERROR, true);
         StopIf(res, goto ERR_RETURN, "curl_easy_setopt failed to set fail on error.");
@@ -326,8 +976,10 @@ obs_download_init_check_curl(CURL **curl, struct CurlToCsvState *curl_state)
         *curl = curl_init;
     }
 
-    res = curl_easy_setopt(*curl, CURLOPT_WRITEDATA, curl_state);
-    StopIf(res, goto ERR_RETURN, "curl_easy_setopt failed to set the user data.");
+    if (curl_state) {
+        res = curl_easy_setopt(*curl, CURLOPT_WRITEDATA, curl_state);
+        StopIf(res, goto ERR_RETURN, "curl_easy_setopt failed to set the user data.");
+    }
 
     return *curl;
 
@@ -341,33 +993,212 @@ ERR_RETURN:
 int
 obs_download(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
              char const *site_id, struct ObsTimeRange tr)
+{
+    char const *const site_ids[1] = {site_id};
+
+    return obs_download_multi(local_store, curl, synoptic_labs_api_key, 1, site_ids, tr, 0);
+}
+
+/** Did the server refuse part of the request?
+ *
+ * Authorization failures and rate limiting are not about the range that was requested, so they
+ * don't count. Neither do the 5xx codes for an overloaded or unavailable server, those are
+ * retried after a pause and never split into smaller requests.
+ */
+static bool
+obs_download_is_server_error(CURL *handle, CURLcode res)
+{
+    if (res != CURLE_HTTP_RETURNED_ERROR) {
+        return false;
+    }
+
+    long http_code = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+
+    switch (http_code) {
+    case 401:
+    case 403:
+    case 429:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/** Wait before a retry, longer each time, so a struggling server gets a chance to recover.
+ *
+ * \param retry is the number of retries already made, 0 for the first one.
+ */
+static void
+obs_download_backoff(unsigned retry)
+{
+    long delay_ms = (long)OBS_DOWNLOAD_RETRY_DELAY_MS << retry;
+    struct timespec const pause = {.tv_sec = delay_ms / 1000,
+                                   .tv_nsec = (delay_ms % 1000) * 1000000L};
+
+    nanosleep(&pause, 0);
+}
+
+/** Parse and store a response that has already been downloaded into memory.
+ *
+ * \param chunk_size the response is handed to the parser this many bytes at a time, the way cURL
+ * would deliver it.
+ * \param committed_through is an array with an element for each site. The last valid time that was
+ * committed to the local store for each site is stored here, even if storing the data fails.
+ * \param bad_content is set to \c true if the failure was caused by the contents of \a data.
+ * \param stats if not \c NULL, the time spent parsing and storing is added to it.
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+static int
+obs_download_ingest(struct ObsDbShards *shards, size_t num_sites,
+                    char const *const site_ids[num_sites], struct ObsTimeRange tr, char *data,
+                    size_t len, size_t chunk_size, time_t committed_through[num_sites],
+                    bool *bad_content, struct ObsDownloadReplayStats *stats)
 {
+    int return_code = 0;
+    struct CurlToCsvState curl_state = {.error = true};
+    double parse_ms = 0.0;
+    double store_ms = 0.0;
+
+    struct CsvToSqliteState csv_state =
+        obs_download_init_csv_state(shards, num_sites, site_ids, tr);
+    StopIf(csv_state.failed, goto ERR_RETURN, "error initializing csv_state.");
+
+    curl_state = obs_download_init_curl_state(&csv_state);
+    StopIf(curl_state.error, goto ERR_RETURN, "error initializing csv parser.");
+
+    for (size_t offset = 0; offset < len; offset += chunk_size) {
+        size_t num_bytes = len - offset < chunk_size ? len - offset : chunk_size;
+
+        double start = obs_util_monotonic_ms();
+        size_t bytes_processed = curl_callback(data + offset, 1, num_bytes, &curl_state);
+        double elapsed = obs_util_monotonic_ms() - start;
+
+        parse_ms += elapsed - csv_state.store_ms;
+        store_ms += csv_state.store_ms;
+        StopIf(bytes_processed != num_bytes, goto ERR_RETURN, "error storing downloaded data.");
+    }
+
+    csv_fini(&curl_state.parser, col_callback, row_callback, &csv_state);
+    StopIf(csv_state.failed, goto ERR_RETURN, "error storing the end of the download.");
+
+RETURN:
+
+    *bad_content = csv_state.bad_content;
+
+    if (!curl_state.error) {
+        obs_download_finalize_curl_state(&curl_state);
+    }
+
+    double start = obs_util_monotonic_ms();
+    int rc = obs_download_finalize_csv_state(&csv_state, return_code == 0, committed_through);
+    if (rc) {
+        return_code = -1;
+    }
+
+    if (stats) {
+        stats->num_bytes += len;
+        stats->num_rows += csv_state.num_rows;
+        stats->parse_ms += parse_ms;
+        stats->store_ms += store_ms + obs_util_monotonic_ms() - start;
+    }
+
+    return return_code;
+
+ERR_RETURN:
+    return_code = -1;
+    goto RETURN;
+}
+
+int
+obs_download_replay(sqlite3 *local_store, size_t num_sites, char const *const site_ids[num_sites],
+                    struct ObsTimeRange time_range, char *data, size_t len, size_t chunk_size,
+                    struct ObsDownloadReplayStats *stats)
+{
+    assert(num_sites > 0 && chunk_size > 0);
+
+    time_t *committed_through = calloc(num_sites, sizeof(time_t));
+    StopIf(!committed_through, return -1, "out of memory");
+
+    bool bad_content = false;
+    struct ObsDbShards single = obs_download_single_db(local_store);
+    int rc = obs_download_ingest(&single, num_sites, site_ids, time_range, data, len,
+                                 chunk_size, committed_through, &bad_content, stats);
+
+    free(committed_through);
+
+    return rc;
+}
+
+/** Make a single attempt at downloading data for a group of sites.
+ *
+ * \param committed_through is an array with an element for each site. The last valid time that was
+ * committed to the local store for each site is stored here, even if the attempt fails.
+ * \param bad_content is set to \c true if the attempt failed because of the response the server
+ * sent, as opposed to a network or local error. Those are the failures that will happen again if
+ * the same range is requested again.
+ *
+ * All other parameters are the same as obs_download_multi().
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+static int
+obs_download_attempt(struct ObsDbShards *shards, CURL **curl,
+                     char const *const synoptic_labs_api_key, size_t num_sites,
+                     char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                     time_t committed_through[num_sites], struct ObsDownloadTuning *tuning,
+                     bool *bad_content)
+{
+    *bad_content = false;
+
     int return_code = 0;
 
     char *url = 0;
+    struct CurlToCsvState curl_state = {.error = true};
 
-    struct CsvToSqliteState csv_state = obs_download_init_csv_state(local_store, site_id);
-    StopIf(csv_state.error, goto ERR_RETURN, "error initializing csv_state.");
+    struct CsvToSqliteState csv_state =
+        obs_download_init_csv_state(shards, num_sites, site_ids, tr);
+    StopIf(csv_state.failed, goto ERR_RETURN, "error initializing csv_state.");
 
-    struct CurlToCsvState curl_state = obs_download_init_curl_state(&csv_state);
+    curl_state = obs_download_init_curl_state(&csv_state);
     StopIf(curl_state.error, goto ERR_RETURN, "error initializing cURL state.");
 
     CURL *c_handle = obs_download_init_check_curl(curl, &curl_state);
     StopIf(!c_handle, goto ERR_RETURN, "error initializing cURL");
 
-    url = obs_download_create_synoptic_labs_url(synoptic_labs_api_key, site_id, tr);
+    url = obs_download_create_synoptic_labs_url(synoptic_labs_api_key, num_sites, site_ids, tr);
     assert(url);
 
     int res = curl_easy_setopt(c_handle, CURLOPT_URL, url);
     StopIf(res, goto ERR_RETURN, "curl_easy_setopt failed to set the url.");
 
     res = curl_easy_perform(c_handle);
+    *bad_content = csv_state.bad_content || obs_download_is_server_error(c_handle, res);
     StopIf(res, goto ERR_RETURN, "curl_easy_perform failed: %s", curl_easy_strerror(res));
 
+    obs_download_tuning_update(tuning, c_handle, num_sites, tr);
+
+    // Flush the last row in case the response didn't end with a new line.
+    csv_fini(&curl_state.parser, col_callback, row_callback, &csv_state);
+    *bad_content = csv_state.bad_content;
+    StopIf(csv_state.failed, goto ERR_RETURN, "error storing the end of the download.");
+
 RETURN:
 
-    obs_download_finalize_curl_state(&curl_state);
-    obs_download_finalize_csv_state(local_store, &csv_state);
+    if (!curl_state.error) {
+        obs_download_finalize_curl_state(&curl_state);
+    }
+
+    int rc = obs_download_finalize_csv_state(&csv_state, return_code == 0, committed_through);
+    if (rc) {
+        return_code = -1;
+    }
+
     free(url);
 
     return return_code;
@@ -376,3 +1207,527 @@ ERR_RETURN:
     return_code = -1;
     goto RETURN;
 }
+
+/** Download a range for a single site, splitting it in half when the response is bad.
+ *
+ * Each half is downloaded separately, so the good data on either side of a bad spot makes it into
+ * the store. Once a failing range is shorter than \ref OBS_DOWNLOAD_MIN_BISECT_SEC it is recorded
+ * as a bad range and skipped from then on.
+ *
+ * All parameters are the same as obs_download_multi().
+ *
+ * \returns 0 if everything in \a tr was stored or recorded as bad, and -1 on failure.
+ */
+static int
+obs_download_bisect(struct ObsDbShards *shards, CURL **curl,
+                    char const *const synoptic_labs_api_key, char const *const *site_id,
+                    struct ObsTimeRange tr, struct ObsDownloadTuning *tuning)
+{
+    time_t committed_through[1] = {0};
+    bool bad_content = false;
+
+    int rc = obs_download_attempt(shards, curl, synoptic_labs_api_key, 1, site_id, tr,
+                                  committed_through, tuning, &bad_content);
+    if (rc == 0) {
+        return 0;
+    }
+
+    // Network trouble would fail every piece of the range, don't mistake it for bad data.
+    StopIf(!bad_content, return -1, "download failed, not splitting the request");
+
+    if (committed_through[0] > tr.start) {
+        tr.start = committed_through[0];
+    }
+
+    if (difftime(tr.end, tr.start) <= OBS_DOWNLOAD_MIN_BISECT_SEC) {
+        // One line on stderr, this may be running on a background thread of someone's program.
+        struct tm start_tm = {0};
+        struct tm end_tm = {0};
+        char start_buf[32] = {0};
+        char end_buf[32] = {0};
+        strftime(start_buf, sizeof(start_buf), "%Y-%m-%d %H%M", gmtime_r(&tr.start, &start_tm));
+        strftime(end_buf, sizeof(end_buf), "%Y-%m-%d %H%M", gmtime_r(&tr.end, &end_tm));
+        fprintf(stderr, "skipping bad data for %s: [%s -> %s]\n", *site_id, start_buf, end_buf);
+
+        sqlite3 *local_store = obs_db_shards_site(shards, *site_id);
+        StopIf(!local_store, return -1, "unable to open the shard for %s", *site_id);
+
+        rc = obs_db_start_transaction(local_store);
+        StopIf(rc, return -1, "error starting transaction");
+
+        rc = obs_db_add_bad_range(local_store, *site_id, tr, "unusable response");
+
+        int action = rc ? OBS_DB_TRANSACTION_ROLLBACK : OBS_DB_TRANSACTION_COMMIT;
+        rc |= obs_db_finish_transaction(local_store, action);
+        StopIf(rc, return -1, "error recording bad range");
+
+        return 0;
+    }
+
+    time_t mid = tr.start + (tr.end - tr.start) / 2;
+    struct ObsTimeRange first = {.start = tr.start, .end = mid};
+    struct ObsTimeRange second = {.start = mid, .end = tr.end};
+
+    rc = obs_download_bisect(shards, curl, synoptic_labs_api_key, site_id, first, tuning);
+    rc |= obs_download_bisect(shards, curl, synoptic_labs_api_key, site_id, second, tuning);
+
+    return rc ? -1 : 0;
+}
+
+// obs_download_group() and obs_download_resume() call each other.
+static int obs_download_group(struct ObsDbShards *shards, CURL **curl,
+                              char const *const synoptic_labs_api_key, size_t num_sites,
+                              char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                              unsigned attempts_left, struct ObsDownloadTuning *tuning);
+
+/** Download what a failed request for a group of sites left unfinished.
+ *
+ * A response that couldn't be parsed would be the same if it were requested again, so instead the
+ * rest of each unfinished site's range is handed straight to obs_download_bisect() to salvage what
+ * it can. Otherwise sites that were part way through resume from their last checkpoint, and the
+ * sites that were never reached are requested together again.
+ *
+ * \param committed_through is how far each site got in the failed request.
+ * \param bad_content is \c true if the request failed because of the response.
+ * \param attempts_left is the number of tries left for each of the new requests.
+ *
+ * All other parameters are the same as obs_download_group().
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+static int
+obs_download_resume(struct ObsDbShards *shards, CURL **curl,
+                    char const *const synoptic_labs_api_key, size_t num_sites,
+                    char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                    time_t const committed_through[num_sites], bool bad_content,
+                    unsigned attempts_left, struct ObsDownloadTuning *tuning)
+{
+    int return_code = 0;
+
+    char const *not_started[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST] = {0};
+    size_t num_not_started = 0;
+
+    for (size_t i = 0; i < num_sites; i++) {
+        if (committed_through[i] >= tr.end) {
+            continue;
+        }
+
+        struct ObsTimeRange rest = {.start = committed_through[i], .end = tr.end};
+
+        int rc = 0;
+        if (bad_content) {
+            if (rest.start < tr.start) {
+                rest.start = tr.start;
+            }
+
+            rc = obs_download_bisect(shards, curl, synoptic_labs_api_key, &site_ids[i], rest,
+                                     tuning);
+        } else if (rest.start > tr.start) {
+            rc = obs_download_group(shards, curl, synoptic_labs_api_key, 1, &site_ids[i], rest,
+                                    attempts_left, tuning);
+        } else {
+            not_started[num_not_started] = site_ids[i];
+            num_not_started++;
+        }
+
+        if (rc) {
+            return_code = -1;
+        }
+    }
+
+    if (num_not_started > 0) {
+        int rc = obs_download_group(shards, curl, synoptic_labs_api_key, num_not_started,
+                                    not_started, tr, attempts_left, tuning);
+        if (rc) {
+            return_code = -1;
+        }
+    }
+
+    return return_code;
+}
+
+/** Download data for a group of sites, retrying failures from the last checkpoint.
+ *
+ * Retries after network errors and server outages wait a little longer each time, and failures
+ * caused by a bad response are bisected right away, see obs_download_resume().
+ *
+ * \param attempts_left is the number of tries left, including this one.
+ * \param tuning if not \c NULL, is updated with measurements from the transfers.
+ *
+ * All other parameters are the same as obs_download_multi().
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+static int
+obs_download_group(struct ObsDbShards *shards, CURL **curl,
+                   char const *const synoptic_labs_api_key, size_t num_sites,
+                   char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                   unsigned attempts_left, struct ObsDownloadTuning *tuning)
+{
+    time_t committed_through[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST] = {0};
+    bool bad_content = false;
+
+    int rc = obs_download_attempt(shards, curl, synoptic_labs_api_key, num_sites, site_ids, tr,
+                                  committed_through, tuning, &bad_content);
+    if (rc == 0) {
+        return 0;
+    }
+
+    if (!bad_content) {
+        attempts_left--;
+        StopIf(attempts_left == 0, return -1, "giving up on download after %d attempts",
+               OBS_DOWNLOAD_MAX_ATTEMPTS);
+
+        obs_download_backoff(OBS_DOWNLOAD_MAX_ATTEMPTS - attempts_left - 1);
+    }
+
+    return obs_download_resume(shards, curl, synoptic_labs_api_key, num_sites, site_ids, tr,
+                               committed_through, bad_content, attempts_left, tuning);
+}
+
+int
+obs_download_multi(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
+                   size_t num_sites, char const *const site_ids[num_sites],
+                   struct ObsTimeRange tr, struct ObsDownloadTuning *tuning)
+{
+    assert(num_sites > 0 && num_sites <= OBS_DOWNLOAD_MAX_SITES_PER_REQUEST);
+
+    OBS_PROBE4(download_entry, site_ids[0], num_sites, tr.start, tr.end);
+    double start = obs_util_monotonic_ms();
+
+    struct ObsDbShards single = obs_download_single_db(local_store);
+    int rc = obs_download_group(&single, curl, synoptic_labs_api_key, num_sites, site_ids, tr,
+                                OBS_DOWNLOAD_MAX_ATTEMPTS, tuning);
+
+    obs_latency_record(OBS_LATENCY_DOWNLOAD, obs_util_monotonic_ms() - start);
+    OBS_PROBE3(download_return, site_ids[0], num_sites, rc);
+    return rc;
+}
+
+int
+obs_download_sharded(struct ObsDbShards *shards, CURL **curl,
+                     char const *const synoptic_labs_api_key, size_t num_sites,
+                     char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                     struct ObsDownloadTuning *tuning)
+{
+    assert(num_sites > 0 && num_sites <= OBS_DOWNLOAD_MAX_SITES_PER_REQUEST);
+
+    OBS_PROBE4(download_entry, site_ids[0], num_sites, tr.start, tr.end);
+    double start = obs_util_monotonic_ms();
+
+    // One request for the whole batch, each row is stored in the shard its site is kept in.
+    int rc = obs_download_group(shards, curl, synoptic_labs_api_key, num_sites, site_ids, tr,
+                                OBS_DOWNLOAD_MAX_ATTEMPTS, tuning);
+
+    obs_latency_record(OBS_LATENCY_DOWNLOAD, obs_util_monotonic_ms() - start);
+    OBS_PROBE3(download_return, site_ids[0], num_sites, rc);
+    return rc;
+}
+
+/** A download into memory, for when several are running at the same time. */
+struct ObsDownloadTransfer {
+    CURL *handle;     /**< The cURL easy handle for this transfer, reused for the next chunk. */
+    char *url;        /**< The url being downloaded. */
+    char *data;       /**< The response body. */
+    size_t len;       /**< The number of bytes in \ref data. */
+    size_t capacity;  /**< The allocated size of \ref data. */
+    size_t chunk_idx; /**< The index of the chunk being downloaded. */
+    bool busy;        /**< Is a download in progress? */
+};
+
+static size_t
+obs_download_transfer_callback(char *ptr, size_t size, size_t nmember, void *userdata)
+{
+    struct ObsDownloadTransfer *transfer = userdata;
+    size_t num_bytes = size * nmember;
+
+    if (transfer->len + num_bytes > transfer->capacity) {
+        size_t new_capacity = transfer->capacity ? transfer->capacity : 64 * 1024;
+        while (new_capacity < transfer->len + num_bytes) {
+            new_capacity *= 2;
+        }
+
+        char *new_data = realloc(transfer->data, new_capacity);
+        StopIf(!new_data, return 0, "out of memory");
+
+        transfer->data = new_data;
+        transfer->capacity = new_capacity;
+    }
+
+    memcpy(transfer->data + transfer->len, ptr, num_bytes);
+    transfer->len += num_bytes;
+
+    return num_bytes;
+}
+
+static int
+obs_download_transfer_start(CURLM *multi, struct ObsDownloadTransfer *transfer,
+                            char const *const synoptic_labs_api_key, size_t num_sites,
+                            char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                            size_t chunk_idx)
+{
+    CURLcode res = CURLE_OK;
+    if (!transfer->handle) {
+        transfer->handle = curl_easy_init();
+        StopIf(!transfer->handle, return -1, "curl_easy_init failed.");
+
+        res |= curl_easy_setopt(transfer->handle, CURLOPT_FAILONERROR, true);
+        res |= curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION,
+                                obs_download_transfer_callback);
+        res |= curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer);
+        res |= curl_easy_setopt(transfer->handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+        StopIf(res, return -1, "curl_easy_setopt failed setting up a parallel transfer.");
+    }
+
+    free(transfer->url);
+    transfer->url =
+        obs_download_create_synoptic_labs_url(synoptic_labs_api_key, num_sites, site_ids, tr);
+    assert(transfer->url);
+
+    res = curl_easy_setopt(transfer->handle, CURLOPT_URL, transfer->url);
+    StopIf(res, return -1, "curl_easy_setopt failed to set the url.");
+
+    transfer->len = 0;
+    transfer->chunk_idx = chunk_idx;
+
+    CURLMcode mres = curl_multi_add_handle(multi, transfer->handle);
+    StopIf(mres, return -1, "curl_multi_add_handle failed: %s", curl_multi_strerror(mres));
+
+    transfer->busy = true;
+
+    return 0;
+}
+
+/** A chunk of a parallel download that has to be tried again once the others are finished. */
+struct ObsDownloadFailure {
+    struct ObsTimeRange tr; /**< The time range of the chunk. */
+    bool bad_content;       /**< Was the response bad, rather than the transfer? */
+
+    /** How far each site got before the chunk failed. */
+    time_t committed_through[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST];
+};
+
+/** Parse and store a finished in memory transfer.
+ *
+ * This runs between the steps of the other transfers, so it never goes back to the network. How
+ * far a failed chunk got is put in \a failure so the rest can be downloaded after the others are
+ * done.
+ *
+ * \returns 0 on success and -1 if the chunk failed.
+ */
+static int
+obs_download_transfer_finish(struct ObsDbShards *shards, size_t num_sites,
+                             char const *const site_ids[num_sites], struct ObsTimeRange tr,
+                             struct ObsDownloadTransfer *transfer, CURLcode result,
+                             struct ObsDownloadTuning *tuning, struct ObsDownloadFailure *failure)
+{
+    transfer->busy = false;
+
+    *failure = (struct ObsDownloadFailure){.tr = tr};
+    for (size_t i = 0; i < num_sites; i++) {
+        failure->committed_through[i] = tr.start;
+    }
+
+    if (result == CURLE_OK) {
+        obs_download_tuning_update(tuning, transfer->handle, num_sites, tr);
+
+        int rc = obs_download_ingest(shards, num_sites, site_ids, tr, transfer->data,
+                                     transfer->len, transfer->len, failure->committed_through,
+                                     &failure->bad_content, 0);
+        if (rc == 0) {
+            return 0;
+        }
+    } else {
+        fprintf(stderr, "parallel download failed: %s\n", curl_easy_strerror(result));
+        failure->bad_content = obs_download_is_server_error(transfer->handle, result);
+    }
+
+    return -1;
+}
+
+/** Download what is left of the chunks that failed during a parallel download.
+ *
+ * Asking again for a response that couldn't be parsed won't help, so those are bisected. The
+ * others failed in transit or on the server and are retried after a pause.
+ */
+static int
+obs_download_retry_failures(struct ObsDbShards *shards, CURL **curl,
+                            char const *const synoptic_labs_api_key, size_t num_sites,
+                            char const *const site_ids[num_sites], size_t num_failures,
+                            struct ObsDownloadFailure const failures[],
+                            struct ObsDownloadTuning *tuning)
+{
+    int return_code = 0;
+    bool backed_off = false;
+
+    for (size_t i = 0; i < num_failures; i++) {
+        // They probably failed for the same reason, so one pause is enough for all of them.
+        if (!failures[i].bad_content && !backed_off) {
+            obs_download_backoff(0);
+            backed_off = true;
+        }
+
+        int rc = obs_download_resume(shards, curl, synoptic_labs_api_key, num_sites, site_ids,
+                                     failures[i].tr, failures[i].committed_through,
+                                     failures[i].bad_content, OBS_DOWNLOAD_MAX_ATTEMPTS - 1,
+                                     tuning);
+        if (rc) {
+            return_code = -1;
+        }
+    }
+
+    return return_code;
+}
+
+/** Download chunks for a group of sites several at a time, storing each one as it finishes. */
+static int
+obs_download_parallel(struct ObsDbShards *shards, CURL **curl,
+                      char const *const synoptic_labs_api_key, size_t num_sites,
+                      char const *const site_ids[num_sites], size_t num_chunks,
+                      struct ObsTimeRange const chunks[num_chunks],
+                      struct ObsDownloadTuning *tuning)
+{
+    int return_code = 0;
+    struct ObsDownloadTransfer transfers[OBS_DOWNLOAD_MAX_PARALLEL] = {{0}};
+    size_t num_failures = 0;
+
+    struct ObsDownloadFailure *failures = calloc(num_chunks, sizeof(*failures));
+    StopIf(!failures, return -1, "out of memory");
+
+    CURLM *multi = curl_multi_init();
+    StopIf(!multi, free(failures); return -1, "curl_multi_init failed.");
+
+    size_t next_chunk = 0;
+    size_t num_busy = 0;
+    while (next_chunk < num_chunks || num_busy > 0) {
+
+        for (size_t i = 0; i < OBS_DOWNLOAD_MAX_PARALLEL && next_chunk < num_chunks; i++) {
+            if (transfers[i].busy) {
+                continue;
+            }
+
+            int rc = obs_download_transfer_start(multi, &transfers[i], synoptic_labs_api_key,
+                                                 num_sites, site_ids, chunks[next_chunk],
+                                                 next_chunk);
+            StopIf(rc, goto ERR_RETURN, "error starting parallel download.");
+
+            next_chunk++;
+            num_busy++;
+        }
+
+        int still_running = 0;
+        CURLMcode mres = curl_multi_perform(multi, &still_running);
+        StopIf(mres, goto ERR_RETURN, "curl_multi_perform failed: %s", curl_multi_strerror(mres));
+
+        CURLMsg *msg = 0;
+        int msgs_left = 0;
+        while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            struct ObsDownloadTransfer *transfer = 0;
+            for (size_t i = 0; i < OBS_DOWNLOAD_MAX_PARALLEL; i++) {
+                if (transfers[i].busy && transfers[i].handle == msg->easy_handle) {
+                    transfer = &transfers[i];
+                }
+            }
+            assert(transfer);
+
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, transfer->handle);
+            num_busy--;
+
+            int rc = obs_download_transfer_finish(shards, num_sites, site_ids,
+                                                  chunks[transfer->chunk_idx], transfer, result,
+                                                  tuning, &failures[num_failures]);
+            if (rc) {
+                num_failures++;
+            }
+        }
+
+        if (num_busy > 0) {
+            mres = curl_multi_poll(multi, 0, 0, 1000, 0);
+            StopIf(mres, goto ERR_RETURN, "curl_multi_poll failed: %s", curl_multi_strerror(mres));
+        }
+    }
+
+    // Retry once the parallel transfers are done, so they aren't held up waiting for these.
+    return_code = obs_download_retry_failures(shards, curl, synoptic_labs_api_key, num_sites,
+                                              site_ids, num_failures, failures, tuning);
+
+RETURN:
+
+    for (size_t i = 0; i < OBS_DOWNLOAD_MAX_PARALLEL; i++) {
+        if (transfers[i].handle) {
+            if (transfers[i].busy) {
+                curl_multi_remove_handle(multi, transfers[i].handle);
+            }
+            curl_easy_cleanup(transfers[i].handle);
+        }
+        free(transfers[i].url);
+        free(transfers[i].data);
+    }
+    curl_multi_cleanup(multi);
+    free(failures);
+
+    return return_code;
+
+ERR_RETURN:
+    return_code = -1;
+    goto RETURN;
+}
+
+int
+obs_download_sharded_ranges(struct ObsDbShards *shards, CURL **curl,
+                            char const *const synoptic_labs_api_key, size_t num_sites,
+                            char const *const site_ids[num_sites], size_t num_ranges,
+                            struct ObsTimeRange const time_ranges[num_ranges],
+                            struct ObsDownloadTuning *tuning)
+{
+    assert(num_sites > 0 && num_sites <= OBS_DOWNLOAD_MAX_SITES_PER_REQUEST);
+
+    if (num_ranges == 0) {
+        return 0;
+    }
+
+    OBS_PROBE4(download_entry, site_ids[0], num_sites, time_ranges[0].start,
+               time_ranges[num_ranges - 1].end);
+    double start = obs_util_monotonic_ms();
+
+    struct ObsTimeRange *chunks = 0;
+    size_t num_chunks = obs_download_plan(tuning, num_sites, num_ranges, time_ranges, &chunks);
+    StopIf(num_chunks == 0, return -1, "error planning downloads");
+
+    int rc = 0;
+    if (num_chunks == 1) {
+        rc = obs_download_group(shards, curl, synoptic_labs_api_key, num_sites, site_ids,
+                                chunks[0], OBS_DOWNLOAD_MAX_ATTEMPTS, tuning);
+    } else {
+        // Make sure cURL is initialized before creating more handles.
+        StopIf(!obs_download_init_check_curl(curl, 0), rc = -1; goto RETURN,
+               "error initializing cURL");
+
+        rc = obs_download_parallel(shards, curl, synoptic_labs_api_key, num_sites, site_ids,
+                                   num_chunks, chunks, tuning);
+    }
+
+RETURN:
+    obs_latency_record(OBS_LATENCY_DOWNLOAD, obs_util_monotonic_ms() - start);
+    OBS_PROBE3(download_return, site_ids[0], num_sites, rc);
+    free(chunks);
+    return rc;
+}
+
+int
+obs_download_ranges(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
+                    char const *site_id, size_t num_ranges,
+                    struct ObsTimeRange const time_ranges[num_ranges],
+                    struct ObsDownloadTuning *tuning)
+{
+    char const *const site_ids[1] = {site_id};
+    struct ObsDbShards single = obs_download_single_db(local_store);
+
+    return obs_download_sharded_ranges(&single, curl, synoptic_labs_api_key, 1, site_ids,
+                                       num_ranges, time_ranges, tuning);
+}
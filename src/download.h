@@ -5,9 +5,56 @@
 
 #include "obs.h"
 
+#include <stdbool.h>
+
 #include <curl/curl.h>
 #include <sqlite3.h>
 
+/** Measurements of how long downloads take, used to decide how to break up large requests.
+ *
+ * These are running averages, updated after every download and saved in the local store so they
+ * carry over between runs.
+ */
+struct ObsDownloadTuning {
+    double latency_sec;         /**< Time from sending a request until the first byte arrives. */
+    double bytes_per_sec;       /**< Transfer rate, including parsing and storing the data. */
+    double bytes_per_site_hour; /**< Size of a response per site for each hour requested. */
+    double num_samples;         /**< The number of downloads measured so far. */
+    bool modified;              /**< Has it changed since it was loaded or saved? */
+};
+
+/** Load the download measurements from the local store.
+ *
+ * If there are no saved measurements, \a tuning is initialized with reasonable defaults.
+ */
+void obs_download_tuning_load(sqlite3 *local_store, struct ObsDownloadTuning *tuning);
+
+/** Save the download measurements in the local store if they have changed.
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+int obs_download_tuning_save(sqlite3 *local_store, struct ObsDownloadTuning *tuning);
+
+/** Split and merge the time ranges that need downloading into request sized chunks.
+ *
+ * Neighboring ranges are merged when downloading the gap between them costs less than making
+ * another request, and ranges that would take much longer than about 20 seconds to download are
+ * split so the pieces can be downloaded in parallel or in the background.
+ *
+ * \param tuning has the current throughput measurements.
+ * \param num_sites is the number of sites that will be requested together, a request for more sites
+ * takes longer so its chunks are shorter.
+ * \param num_ranges is the number of ranges in \a ranges, it must be at least 1.
+ * \param ranges are the time ranges to download, sorted by start time and not overlapping, such as
+ * the ranges of a \ref ObsTimeRangeSet.
+ * \param chunks is where the allocated array of chunks is returned, free it with \c free().
+ *
+ * \returns the number of chunks, or 0 if there was an error.
+ */
+size_t obs_download_plan(struct ObsDownloadTuning const *tuning, size_t num_sites,
+                         size_t num_ranges, struct ObsTimeRange const ranges[num_ranges],
+                         struct ObsTimeRange **chunks);
+
 /** Download data and save it in the local store.
  *
  * \param local_store is a handle to the local store. Downloaded observations will be added here for
@@ -19,7 +66,142 @@
  * identifier.
  * \param time_range is the time range to request data for.
  *
+ * Long downloads are committed to the local store in checkpoints as they are parsed, and the
+ * coverage table records how far the download got. If the transfer fails it is retried from the
+ * last checkpoint, and if it still fails, the next inventory check will only find the tail that is
+ * missing.
+ *
  * \returns 0 on success and -1 on failure.
  */
 int obs_download(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
                  char const *site_id, struct ObsTimeRange time_range);
+
+/** The most sites to request from the SynopticLabs API at one time with obs_download_multi(). */
+#define OBS_DOWNLOAD_MAX_SITES_PER_REQUEST 50
+
+/** Download data for several sites with a single request and save it in the local store.
+ *
+ * The response contains a section for each station, and the observations are sorted into the
+ * matching site as they are parsed. Every site in the request has \a time_range recorded as
+ * downloaded, so stations with no data for the period are not requested again. Checkpoints and
+ * retries work the same as obs_download(), only the sites that didn't finish are requested again.
+ *
+ * \param local_store is a handle to the local store.
+ * \param curl is a pointer to a \c CURL handle, same as obs_download().
+ * \param synoptic_labs_api_key is a \c NULL terminated string with the SynopticLabs API key.
+ * \param num_sites is the number of sites in \a site_ids, it must be between 1 and
+ * \ref OBS_DOWNLOAD_MAX_SITES_PER_REQUEST.
+ * \param site_ids is an array of \c NULL terminated strings, all lowercase, with the SynopticLabs
+ * site identifiers.
+ * \param time_range is the time range to request data for.
+ * \param tuning if not \c NULL, is updated with measurements from the downloads.
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+int obs_download_multi(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
+                       size_t num_sites, char const *const site_ids[num_sites],
+                       struct ObsTimeRange time_range, struct ObsDownloadTuning *tuning);
+
+struct ObsDbShards;
+
+/** Download data for several sites into the shards of the local store they are kept in.
+ *
+ * The sites are requested together, the same as obs_download_multi(), and each row of the response
+ * is stored in the shard its site is kept in. Every shard in the request has its own transaction,
+ * so a site's progress is kept if its shard was committed.
+ *
+ * \param shards are the connections to the local store.
+ * \param curl is a pointer to a \c CURL handle, same as obs_download().
+ * \param synoptic_labs_api_key is a \c NULL terminated string with the SynopticLabs API key.
+ * \param num_sites is the number of sites in \a site_ids, it must be between 1 and
+ * \ref OBS_DOWNLOAD_MAX_SITES_PER_REQUEST.
+ * \param site_ids is an array of \c NULL terminated strings, all lowercase, with the SynopticLabs
+ * site identifiers.
+ * \param time_range is the time range to request data for.
+ * \param tuning if not \c NULL, is updated with measurements from the downloads.
+ *
+ * \returns 0 on success and -1 if any of the downloads failed.
+ */
+int obs_download_sharded(struct ObsDbShards *shards, CURL **curl,
+                         char const *const synoptic_labs_api_key, size_t num_sites,
+                         char const *const site_ids[num_sites], struct ObsTimeRange time_range,
+                         struct ObsDownloadTuning *tuning);
+
+/** Download several time ranges for a group of sites, sizing the requests by the measured
+ * throughput.
+ *
+ * The ranges are planned with obs_download_plan() and every chunk requests all the sites at once,
+ * with each row stored in the shard its site is kept in like obs_download_sharded(). When there is
+ * more than one chunk they are downloaded in parallel, and chunks that fail are retried once the
+ * others are finished.
+ *
+ * \param shards are the connections to the local store.
+ * \param curl is a pointer to a \c CURL handle, same as obs_download().
+ * \param synoptic_labs_api_key is a \c NULL terminated string with the SynopticLabs API key.
+ * \param num_sites is the number of sites in \a site_ids, it must be between 1 and
+ * \ref OBS_DOWNLOAD_MAX_SITES_PER_REQUEST.
+ * \param site_ids is an array of \c NULL terminated strings, all lowercase, with the SynopticLabs
+ * site identifiers.
+ * \param num_ranges is the number of time ranges in \a time_ranges.
+ * \param time_ranges are the time ranges to download, sorted by start time and not overlapping.
+ * \param tuning has the throughput measurements, it is updated with the new downloads.
+ *
+ * \returns 0 on success and -1 if any of the downloads failed.
+ */
+int obs_download_sharded_ranges(struct ObsDbShards *shards, CURL **curl,
+                                char const *const synoptic_labs_api_key, size_t num_sites,
+                                char const *const site_ids[num_sites], size_t num_ranges,
+                                struct ObsTimeRange const time_ranges[num_ranges],
+                                struct ObsDownloadTuning *tuning);
+
+/** Download several time ranges for a site, sizing the requests by the measured throughput.
+ *
+ * Ranges separated by short gaps are merged into a single request when downloading the gap is
+ * cheaper than the overhead of another request. Ranges that would take a long time to download are
+ * split into chunks that are downloaded in parallel and stored as each one finishes.
+ *
+ * \param local_store is a handle to the local store.
+ * \param curl is a pointer to a \c CURL handle, same as obs_download().
+ * \param synoptic_labs_api_key is a \c NULL terminated string with the SynopticLabs API key.
+ * \param site_id is a \c NULL terminated string, all lowercase, with the SynopticLabs site
+ * identifier.
+ * \param num_ranges is the number of time ranges in \a time_ranges.
+ * \param time_ranges are the time ranges to download, sorted by start time.
+ * \param tuning has the throughput measurements, it is updated with the new downloads.
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+int obs_download_ranges(sqlite3 *local_store, CURL **curl, char const *const synoptic_labs_api_key,
+                        char const *site_id, size_t num_ranges,
+                        struct ObsTimeRange const time_ranges[num_ranges],
+                        struct ObsDownloadTuning *tuning);
+
+/** Time spent by obs_download_replay(), added up over calls. */
+struct ObsDownloadReplayStats {
+    size_t num_bytes; /**< The size of the responses. */
+    size_t num_rows;  /**< The number of rows stored. */
+    double parse_ms;  /**< Time in the CSV parser and its callbacks, not counting storing rows. */
+    double store_ms;  /**< Time inserting rows, in checkpoints, and in the final commit. */
+};
+
+/** Parse and store a response read from somewhere other than the network.
+ *
+ * This is the same path a download takes from the cURL write callback on, so it can be measured
+ * without the network, and responses that were saved to disk can be loaded into a store.
+ *
+ * \param local_store is a handle to the local store.
+ * \param num_sites is the number of sites in \a site_ids.
+ * \param site_ids are the sites that were requested, same as obs_download_multi().
+ * \param time_range is the time range that was requested, it is recorded as covered on success.
+ * \param data is the response, it isn't modified.
+ * \param len is the number of bytes in \a data.
+ * \param chunk_size is the number of bytes handed to the parser at a time. cURL usually delivers
+ * 16 KiB (\c CURL_MAX_WRITE_SIZE) at a time.
+ * \param stats if not \c NULL, the measurements are added to it.
+ *
+ * \returns 0 on success and -1 on failure.
+ */
+int obs_download_replay(sqlite3 *local_store, size_t num_sites,
+                        char const *const site_ids[num_sites], struct ObsTimeRange time_range,
+                        char *data, size_t len, size_t chunk_size,
+                        struct ObsDownloadReplayStats *stats);
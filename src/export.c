@@ -0,0 +1,386 @@
+/** \file export.c
+ *
+ * \brief Implementation of obs_export(), which writes the archive out as a columnar file.
+ */
+#include "obs.h"
+#include "obs_columnar.h"
+#include "obs_db.h"
+#include "obs_store.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+/** The most threads obs_export() uses, more than this and sqlite is the bottleneck. */
+#define OBS_EXPORT_MAX_THREADS 16
+
+_Static_assert(sizeof(struct ObsColumnarHeader) == OBS_COLUMNAR_ALIGN, "header must be aligned");
+_Static_assert(sizeof(OBS_COLUMNAR_MAGIC) == 9, "magic must be 8 characters");
+
+/** The size of a column of a full batch, rounded up to the alignment. */
+#define OBS_EXPORT_COLUMN_BYTES (OBS_COLUMNAR_BATCH_ROWS * sizeof(double))
+
+/** State shared by the threads of an export. */
+struct ObsExport {
+    atomic_bool failed; /**< Has any thread failed? Stops the others. */
+
+    pthread_mutex_t lock; /**< Protects everything below it. */
+
+    int fd;                  /**< The file being written. */
+    uint64_t end_offset;     /**< Where the next batch goes in the file. */
+    size_t next_site;        /**< The index of the next site to read. */
+    uint64_t num_rows;       /**< The number of observations written so far. */
+    size_t num_batches;      /**< The number of entries in \ref batches. */
+    size_t batches_capacity; /**< The allocated length of \ref batches. */
+
+    /** The index, in the order the batches were written. */
+    struct ObsColumnarBatch *batches;
+
+    struct ObsStore const *store; /**< The threads open connections like this store's. */
+    struct ObsTimeRange tr;       /**< The time range to export. */
+    size_t num_sites;             /**< The number of sites in \ref sites. */
+    char const *const *sites;     /**< The sites to export, lowercase. */
+};
+
+static uint64_t
+obs_export_align(uint64_t offset)
+{
+    return (offset + OBS_COLUMNAR_ALIGN - 1) / OBS_COLUMNAR_ALIGN * OBS_COLUMNAR_ALIGN;
+}
+
+/** Write all of a buffer at an offset in the file. */
+static int
+obs_export_pwrite(int fd, void const *buf, size_t len, uint64_t offset)
+{
+    char const *bytes = buf;
+    while (len > 0) {
+        ssize_t num_written = pwrite(fd, bytes, len, offset);
+        if (num_written < 0 && errno == EINTR) {
+            continue;
+        }
+        StopIf(num_written <= 0, return -1, "error writing export: %s", strerror(errno));
+
+        bytes += num_written;
+        len -= num_written;
+        offset += num_written;
+    }
+
+    return 0;
+}
+
+/** Write a batch held in \a columns, laid out the way it goes in the file.
+ *
+ * The space in the file is reserved with the lock held, and the batch is written without it so
+ * the threads write at the same time.
+ */
+static int
+obs_export_write_batch(struct ObsExport *ex, char const *site, size_t num_rows, char *columns)
+{
+    uint64_t column_bytes = obs_export_align(num_rows * sizeof(double));
+
+    // The columns were read a full batch apart, close the gaps if the batch is short.
+    if (column_bytes < OBS_EXPORT_COLUMN_BYTES) {
+        for (size_t c = 0; c < 3; c++) {
+            char *padding = columns + c * OBS_EXPORT_COLUMN_BYTES + num_rows * sizeof(double);
+            memset(padding, 0, column_bytes - num_rows * sizeof(double));
+        }
+        memmove(columns + column_bytes, columns + OBS_EXPORT_COLUMN_BYTES, column_bytes);
+        memmove(columns + 2 * column_bytes, columns + 2 * OBS_EXPORT_COLUMN_BYTES, column_bytes);
+    }
+
+    int64_t const *valid_times = (int64_t const *)columns;
+    struct ObsColumnarBatch batch = {.num_rows = num_rows,
+                                     .first_valid_time = valid_times[0],
+                                     .last_valid_time = valid_times[num_rows - 1]};
+    strcpy(batch.site, site);
+
+    pthread_mutex_lock(&ex->lock);
+
+    if (ex->num_batches == ex->batches_capacity) {
+        size_t capacity = ex->batches_capacity ? 2 * ex->batches_capacity : 64;
+        struct ObsColumnarBatch *batches = realloc(ex->batches, capacity * sizeof(*batches));
+        if (!batches) {
+            pthread_mutex_unlock(&ex->lock);
+            StopIf(true, return -1, "out of memory");
+        }
+        ex->batches = batches;
+        ex->batches_capacity = capacity;
+    }
+
+    batch.valid_time_offset = ex->end_offset;
+    batch.t_f_offset = batch.valid_time_offset + column_bytes;
+    batch.precip_in_offset = batch.t_f_offset + column_bytes;
+    ex->end_offset += 3 * column_bytes;
+
+    ex->batches[ex->num_batches] = batch;
+    ex->num_batches++;
+    ex->num_rows += num_rows;
+
+    pthread_mutex_unlock(&ex->lock);
+
+    return obs_export_pwrite(ex->fd, columns, 3 * column_bytes, batch.valid_time_offset);
+}
+
+/** Read a site from the archive and write it in batches. */
+static int
+obs_export_site(struct ObsExport *ex, sqlite3 *db, char const *site, char *columns)
+{
+    struct ObsDbReader *reader = obs_db_create_reader(db, site, ex->tr);
+    StopIf(!reader, return -1, "unable to read %s", site);
+
+    int64_t *valid_times = (int64_t *)columns;
+    double *t_f = (double *)(columns + OBS_EXPORT_COLUMN_BYTES);
+    double *precip_in = (double *)(columns + 2 * OBS_EXPORT_COLUMN_BYTES);
+
+    int rc = 0;
+    while (!atomic_load(&ex->failed)) {
+        size_t num_rows =
+            obs_db_read(reader, OBS_COLUMNAR_BATCH_ROWS, valid_times, t_f, precip_in);
+        StopIf(num_rows == SIZE_MAX, rc = -1; break, "error reading %s", site);
+
+        if (num_rows == 0) {
+            break;
+        }
+
+        rc = obs_export_write_batch(ex, site, num_rows, columns);
+        StopIf(rc, break, "error writing %s", site);
+    }
+
+    obs_db_finalize_reader(reader);
+
+    return rc;
+}
+
+/** A thread that takes sites off the list until they are all done. */
+static void *
+obs_export_thread(void *arg)
+{
+    struct ObsExport *ex = arg;
+
+    struct ObsDbShards shards = {0};
+    unsigned num_reading = 0;
+    char *columns = aligned_alloc(OBS_COLUMNAR_ALIGN, 3 * OBS_EXPORT_COLUMN_BYTES);
+    StopIf(!columns, goto ERR_RETURN, "out of memory");
+
+    sqlite3 *db = obs_store_open_connection(ex->store);
+    StopIf(!db, goto ERR_RETURN, "unable to connect to the local store");
+
+    int rc = obs_db_shards_init(&shards, db, &ex->store->config);
+    StopIf(rc, obs_db_close(db); goto ERR_RETURN, "unable to find the shards");
+
+    // Read in one transaction per file so the thread sees a single snapshot while the archive is
+    // written.
+    for (unsigned i = 0; i < shards.num_shards; i++) {
+        db = obs_db_shards_get(&shards, i);
+        StopIf(!db, goto ERR_RETURN_ROLLBACK, "unable to open shard %u", i);
+
+        rc = obs_db_start_transaction(db);
+        StopIf(rc, goto ERR_RETURN_ROLLBACK, "unable to start a read transaction");
+        num_reading++;
+    }
+
+    while (true) {
+        pthread_mutex_lock(&ex->lock);
+        size_t i = ex->next_site;
+        ex->next_site++;
+        pthread_mutex_unlock(&ex->lock);
+
+        if (i >= ex->num_sites || atomic_load(&ex->failed)) {
+            break;
+        }
+
+        db = obs_db_shards_site(&shards, ex->sites[i]);
+        rc = obs_export_site(ex, db, ex->sites[i], columns);
+        StopIf(rc, goto ERR_RETURN_ROLLBACK, "unable to export %s", ex->sites[i]);
+    }
+
+    for (unsigned j = 0; j < num_reading; j++) {
+        obs_db_finish_transaction(shards.dbs[j], OBS_DB_TRANSACTION_ROLLBACK);
+    }
+    obs_db_shards_close(&shards);
+    free(columns);
+
+    return 0;
+
+ERR_RETURN_ROLLBACK:
+    for (unsigned j = 0; j < num_reading; j++) {
+        obs_db_finish_transaction(shards.dbs[j], OBS_DB_TRANSACTION_ROLLBACK);
+    }
+    obs_db_shards_close(&shards);
+ERR_RETURN:
+    atomic_store(&ex->failed, true);
+    free(columns);
+
+    return 0;
+}
+
+static int
+obs_export_compare_batches(void const *a, void const *b)
+{
+    struct ObsColumnarBatch const *x = a;
+    struct ObsColumnarBatch const *y = b;
+
+    int cmp = strcmp(x->site, y->site);
+    if (cmp) {
+        return cmp;
+    }
+
+    int64_t x_time = x->first_valid_time;
+    int64_t y_time = y->first_valid_time;
+    return (x_time > y_time) - (x_time < y_time);
+}
+
+/** Write the header, the index and the footer once all the batches are written. */
+static int
+obs_export_finish_file(struct ObsExport *ex)
+{
+    struct ObsColumnarHeader header = {.version = OBS_COLUMNAR_VERSION,
+                                       .byte_order = OBS_COLUMNAR_BYTE_ORDER,
+                                       .start = ex->tr.start,
+                                       .end = ex->tr.end,
+                                       .created = time(0)};
+    memcpy(header.magic, OBS_COLUMNAR_MAGIC, sizeof(header.magic));
+
+    int rc = obs_export_pwrite(ex->fd, &header, sizeof(header), 0);
+    StopIf(rc, return -1, "error writing the header");
+
+    qsort(ex->batches, ex->num_batches, sizeof(*ex->batches), obs_export_compare_batches);
+
+    uint64_t index_offset = obs_export_align(ex->end_offset);
+    rc = obs_export_pwrite(ex->fd, ex->batches, ex->num_batches * sizeof(*ex->batches),
+                           index_offset);
+    StopIf(rc, return -1, "error writing the index");
+
+    struct ObsColumnarFooter footer = {.index_offset = index_offset,
+                                       .num_batches = ex->num_batches,
+                                       .num_rows = ex->num_rows,
+                                       .version = OBS_COLUMNAR_VERSION,
+                                       .byte_order = OBS_COLUMNAR_BYTE_ORDER};
+    memcpy(footer.magic, OBS_COLUMNAR_MAGIC, sizeof(footer.magic));
+
+    rc = obs_export_pwrite(ex->fd, &footer, sizeof(footer),
+                           index_offset + ex->num_batches * sizeof(*ex->batches));
+    StopIf(rc, return -1, "error writing the footer");
+
+    return 0;
+}
+
+long
+obs_export(struct ObsStore *store, char const *path, size_t num_sites, char const *const sites[],
+           struct ObsTimeRange tr, unsigned num_threads)
+{
+    assert(store && path);
+
+    long num_exported = -1;
+    char *tmp_path = 0;
+    char(*all_sites)[OBS_DB_SITE_ID_LEN] = 0;
+    char(*site_bufs)[OBS_DB_SITE_ID_LEN] = 0;
+    char const **site_ids = 0;
+    pthread_t threads[OBS_EXPORT_MAX_THREADS] = {0};
+    size_t num_started = 0;
+
+    struct ObsExport ex = {.fd = -1,
+                           .end_offset = sizeof(struct ObsColumnarHeader),
+                           .store = store,
+                           .tr = tr};
+    pthread_mutex_init(&ex.lock, 0);
+
+    if (num_sites == 0) {
+        StopIf(!obs_store_db(store), goto CLEAN_UP, "unable to open the local store");
+
+        // Each site is in exactly one shard, so the lists don't overlap.
+        for (unsigned i = 0; i < store->shards.num_shards; i++) {
+            sqlite3 *db = obs_db_shards_get(&store->shards, i);
+            StopIf(!db, goto CLEAN_UP, "unable to open shard %u", i);
+
+            char(*shard_sites)[OBS_DB_SITE_ID_LEN] = 0;
+            size_t num_shard_sites = obs_db_list_sites(db, &shard_sites);
+            StopIf(num_shard_sites == SIZE_MAX, goto CLEAN_UP, "unable to list the sites");
+
+            if (num_shard_sites > 0) {
+                char(*new_sites)[OBS_DB_SITE_ID_LEN] =
+                    realloc(all_sites, (num_sites + num_shard_sites) * sizeof(*all_sites));
+                StopIf(!new_sites, free(shard_sites); goto CLEAN_UP, "out of memory");
+                all_sites = new_sites;
+
+                memcpy(all_sites[num_sites], shard_sites, num_shard_sites * sizeof(*all_sites));
+                num_sites += num_shard_sites;
+            }
+            free(shard_sites);
+        }
+    }
+
+    site_bufs = calloc(num_sites ? num_sites : 1, sizeof(*site_bufs));
+    site_ids = calloc(num_sites ? num_sites : 1, sizeof(*site_ids));
+    StopIf(!site_bufs || !site_ids, goto CLEAN_UP, "out of memory");
+
+    for (size_t i = 0; i < num_sites; i++) {
+        char const *site = all_sites ? all_sites[i] : sites[i];
+        obs_util_strcpy_to_lowercase(sizeof(site_bufs[i]), site_bufs[i], site);
+        site_ids[i] = site_bufs[i];
+    }
+    ex.num_sites = num_sites;
+    ex.sites = site_ids;
+
+    StopIf(asprintf(&tmp_path, "%s.tmp", path) < 0, tmp_path = 0; goto CLEAN_UP, "out of memory");
+    ex.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    StopIf(ex.fd < 0, goto CLEAN_UP, "unable to open %s: %s", tmp_path, strerror(errno));
+
+    if (num_threads == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = num_cpus > 0 ? num_cpus : 1;
+    }
+    num_threads = num_threads > OBS_EXPORT_MAX_THREADS ? OBS_EXPORT_MAX_THREADS : num_threads;
+    num_threads = num_threads > num_sites ? num_sites : num_threads;
+
+    for (num_started = 0; num_started < num_threads; num_started++) {
+        int rc = pthread_create(&threads[num_started], 0, obs_export_thread, &ex);
+        StopIf(rc, atomic_store(&ex.failed, true); break, "unable to start an export thread");
+    }
+
+    for (size_t i = 0; i < num_started; i++) {
+        pthread_join(threads[i], 0);
+    }
+    StopIf(atomic_load(&ex.failed), goto CLEAN_UP, "export failed");
+
+    StopIf(obs_export_finish_file(&ex), goto CLEAN_UP, "unable to finish %s", tmp_path);
+
+    int rc = close(ex.fd);
+    ex.fd = -1;
+    StopIf(rc, goto CLEAN_UP, "unable to write %s: %s", tmp_path, strerror(errno));
+
+    StopIf(rename(tmp_path, path), goto CLEAN_UP, "unable to replace %s: %s", path,
+           strerror(errno));
+
+    num_exported = ex.num_rows;
+
+CLEAN_UP:
+    if (ex.fd >= 0) {
+        close(ex.fd);
+    }
+    if (num_exported < 0 && tmp_path) {
+        remove(tmp_path);
+    }
+
+    pthread_mutex_destroy(&ex.lock);
+    free(ex.batches);
+    free(tmp_path);
+    free(site_ids);
+    free(site_bufs);
+    free(all_sites);
+
+    return num_exported;
+}
@@ -0,0 +1,230 @@
+/** \file latency.c
+ *
+ * \brief Implementation of the latency histograms and their Prometheus export.
+ *
+ * Values are recorded in nanoseconds. Values below twice \ref OBS_LATENCY_SUB_BUCKETS get a bucket
+ * each, after that a value with its highest set bit at position e goes in one of the
+ * \ref OBS_LATENCY_SUB_BUCKETS buckets for [2^e, 2^(e+1)), picked by the next four bits.
+ */
+#include "latency.h"
+#include "obs.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** log2(\ref OBS_LATENCY_SUB_BUCKETS) */
+#define OBS_LATENCY_SUB_BUCKET_BITS 4
+
+/** The largest shift, values of 2^(44) ns (about 4.9 hours) or more go in the last bucket. */
+#define OBS_LATENCY_MAX_SHIFT 40
+
+/** The number of buckets in a histogram. */
+#define OBS_LATENCY_NUM_BUCKETS ((OBS_LATENCY_MAX_SHIFT + 2) * OBS_LATENCY_SUB_BUCKETS)
+
+/** A latency histogram. */
+struct ObsLatencyHistogram {
+    _Atomic uint64_t counts[OBS_LATENCY_NUM_BUCKETS]; /**< The number of values in each bucket. */
+    _Atomic uint64_t count;                           /**< The number of values recorded. */
+    _Atomic uint64_t sum_ns;                          /**< The sum of the values recorded. */
+};
+
+/** The histograms for this process, zero filled is empty. */
+static struct ObsLatencyHistogram obs_latency_histograms[OBS_LATENCY_NUM_METRICS];
+
+/** How each histogram is exported, the metric family and the value of its label. */
+static struct {
+    char const *family;
+    char const *label;
+    char const *value;
+} const obs_latency_names[OBS_LATENCY_NUM_METRICS] = {
+    [OBS_LATENCY_QUERY_MAX_T] = {"obsdb_api_latency_seconds", "api", "obs_query_max_t"},
+    [OBS_LATENCY_QUERY_MIN_T] = {"obsdb_api_latency_seconds", "api", "obs_query_min_t"},
+    [OBS_LATENCY_QUERY_PRECIPITATION] = {"obsdb_api_latency_seconds", "api",
+                                         "obs_query_precipitation"},
+    [OBS_LATENCY_QUERY_DAILY_SUMMARY] = {"obsdb_api_latency_seconds", "api",
+                                         "obs_query_daily_summary"},
+    [OBS_LATENCY_QUERY_MAX_T_COMPACT] = {"obsdb_api_latency_seconds", "api",
+                                         "obs_query_max_t_compact"},
+    [OBS_LATENCY_QUERY_MIN_T_COMPACT] = {"obsdb_api_latency_seconds", "api",
+                                         "obs_query_min_t_compact"},
+    [OBS_LATENCY_QUERY_PRECIPITATION_COMPACT] = {"obsdb_api_latency_seconds", "api",
+                                                 "obs_query_precipitation_compact"},
+    [OBS_LATENCY_REFRESH] = {"obsdb_api_latency_seconds", "api", "obs_refresh"},
+    [OBS_LATENCY_INVENTORY] = {"obsdb_phase_latency_seconds", "phase", "inventory"},
+    [OBS_LATENCY_DOWNLOAD] = {"obsdb_phase_latency_seconds", "phase", "download"},
+    [OBS_LATENCY_PARSE] = {"obsdb_phase_latency_seconds", "phase", "parse"},
+    [OBS_LATENCY_INSERT] = {"obsdb_phase_latency_seconds", "phase", "insert"},
+    [OBS_LATENCY_FETCH] = {"obsdb_phase_latency_seconds", "phase", "fetch"},
+    [OBS_LATENCY_WINDOW] = {"obsdb_phase_latency_seconds", "phase", "window"},
+};
+
+/** The quantiles that are exported. */
+static double const obs_latency_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static size_t
+obs_latency_bucket(uint64_t ns)
+{
+    if (ns < 2 * OBS_LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+
+    unsigned shift = 63 - __builtin_clzll(ns) - OBS_LATENCY_SUB_BUCKET_BITS;
+    if (shift > OBS_LATENCY_MAX_SHIFT) {
+        return OBS_LATENCY_NUM_BUCKETS - 1;
+    }
+
+    return shift * OBS_LATENCY_SUB_BUCKETS + (ns >> shift);
+}
+
+/** The largest value, in nanoseconds, that goes in a bucket. */
+static uint64_t
+obs_latency_bucket_highest(size_t bucket)
+{
+    if (bucket < 2 * OBS_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    size_t shift = bucket / OBS_LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = bucket - shift * OBS_LATENCY_SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+obs_latency_record(enum ObsLatencyMetric metric, double ms)
+{
+    uint64_t ns = ms > 0.0 ? (uint64_t)(ms * 1.0e6) : 0;
+
+    struct ObsLatencyHistogram *hist = &obs_latency_histograms[metric];
+    atomic_fetch_add_explicit(&hist->counts[obs_latency_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+
+void
+obs_latency_reset(void)
+{
+    for (size_t m = 0; m < OBS_LATENCY_NUM_METRICS; m++) {
+        struct ObsLatencyHistogram *hist = &obs_latency_histograms[m];
+        for (size_t b = 0; b < OBS_LATENCY_NUM_BUCKETS; b++) {
+            atomic_store_explicit(&hist->counts[b], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&hist->sum_ns, 0, memory_order_relaxed);
+    }
+}
+
+/** Write one histogram as the samples of a Prometheus summary. */
+static void
+obs_latency_write_summary(FILE *f, enum ObsLatencyMetric metric)
+{
+    struct ObsLatencyHistogram *hist = &obs_latency_histograms[metric];
+    char const *family = obs_latency_names[metric].family;
+    char const *label = obs_latency_names[metric].label;
+    char const *value = obs_latency_names[metric].value;
+
+    // Take a copy, recording may carry on while it is exported. The total is taken from the copy so
+    // the quantiles are consistent with it.
+    uint64_t counts[OBS_LATENCY_NUM_BUCKETS];
+    uint64_t total = 0;
+    for (size_t b = 0; b < OBS_LATENCY_NUM_BUCKETS; b++) {
+        counts[b] = atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+        total += counts[b];
+    }
+    uint64_t sum_ns = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+
+    size_t num_quantiles = sizeof(obs_latency_quantiles) / sizeof(obs_latency_quantiles[0]);
+    size_t bucket = 0;
+    uint64_t cumulative = 0;
+    for (size_t q = 0; q < num_quantiles; q++) {
+        fprintf(f, "%s{%s=\"%s\",quantile=\"%g\"} ", family, label, value,
+                obs_latency_quantiles[q]);
+
+        if (total == 0) {
+            fputs("NaN\n", f);
+            continue;
+        }
+
+        // The quantiles are in increasing order, so carry on from where the last one stopped.
+        uint64_t rank = (uint64_t)(obs_latency_quantiles[q] * total + 0.5);
+        rank = rank < 1 ? 1 : rank;
+        while (bucket < OBS_LATENCY_NUM_BUCKETS && cumulative + counts[bucket] < rank) {
+            cumulative += counts[bucket];
+            bucket++;
+        }
+
+        size_t b = bucket < OBS_LATENCY_NUM_BUCKETS ? bucket : OBS_LATENCY_NUM_BUCKETS - 1;
+        fprintf(f, "%.9g\n", obs_latency_bucket_highest(b) / 1.0e9);
+    }
+
+    fprintf(f, "%s_sum{%s=\"%s\"} %.9g\n", family, label, value, sum_ns / 1.0e9);
+    fprintf(f, "%s_count{%s=\"%s\"} %llu\n", family, label, value, (unsigned long long)total);
+}
+
+int
+obs_latency_export(ObsLatencyExportCallback callback, void *ctx)
+{
+    char *text = 0;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    StopIf(!f, return -1, "unable to format latency metrics: %s", strerror(errno));
+
+    char const *last_family = 0;
+    for (size_t m = 0; m < OBS_LATENCY_NUM_METRICS; m++) {
+        char const *family = obs_latency_names[m].family;
+        if (family != last_family) {
+            fprintf(f, "# HELP %s Latency of obsdb %s.\n", family,
+                    strcmp(obs_latency_names[m].label, "api") == 0 ? "API calls" : "query phases");
+            fprintf(f, "# TYPE %s summary\n", family);
+            last_family = family;
+        }
+
+        obs_latency_write_summary(f, m);
+    }
+
+    StopIf(fclose(f), free(text); return -1, "unable to format latency metrics");
+
+    callback(text, len, ctx);
+    free(text);
+
+    return 0;
+}
+
+/** An \ref ObsLatencyExportCallback that writes to a FILE. */
+static void
+obs_latency_write_callback(char const *text, size_t len, void *ctx)
+{
+    FILE *f = ctx;
+    fwrite(text, 1, len, f);
+}
+
+int
+obs_latency_write(char const *path)
+{
+    char *tmp_path = 0;
+    StopIf(asprintf(&tmp_path, "%s.tmp", path) < 0, return -1, "out of memory");
+
+    FILE *f = fopen(tmp_path, "w");
+    StopIf(!f, goto ERR_RETURN, "unable to open %s: %s", tmp_path, strerror(errno));
+
+    int rc = obs_latency_export(obs_latency_write_callback, f);
+    StopIf(fclose(f) || rc, goto ERR_REMOVE, "unable to write %s", tmp_path);
+
+    // Replace the old file in one step, so a scraper never sees half of it.
+    StopIf(rename(tmp_path, path), goto ERR_REMOVE, "unable to replace %s: %s", path,
+           strerror(errno));
+
+    free(tmp_path);
+    return 0;
+
+ERR_REMOVE:
+    remove(tmp_path);
+ERR_RETURN:
+    free(tmp_path);
+    return -1;
+}
@@ -0,0 +1,40 @@
+#pragma once
+/** \file latency.h
+ *
+ * \brief Internal latency histograms for the public API and the phases of a query.
+ *
+ * The histograms are log-linear, in the style of HdrHistogram: every power of two is split into
+ * \ref OBS_LATENCY_SUB_BUCKETS equal buckets, so any recorded value is known to within about 6%
+ * from 1 ns up to several hours. Recording is a couple of relaxed atomic adds, so it never takes a
+ * lock and any thread may record at any time. There is one set of histograms per process, shared
+ * by every store.
+ */
+
+/** The number of buckets each power of two is split into. */
+#define OBS_LATENCY_SUB_BUCKETS 16
+
+/** What is being timed. */
+enum ObsLatencyMetric {
+    OBS_LATENCY_QUERY_MAX_T,         /**< obs_query_max_t() */
+    OBS_LATENCY_QUERY_MIN_T,         /**< obs_query_min_t() */
+    OBS_LATENCY_QUERY_PRECIPITATION, /**< obs_query_precipitation() */
+    OBS_LATENCY_QUERY_DAILY_SUMMARY, /**< obs_query_daily_summary() */
+    OBS_LATENCY_QUERY_MAX_T_COMPACT, /**< obs_query_max_t_compact() */
+    OBS_LATENCY_QUERY_MIN_T_COMPACT, /**< obs_query_min_t_compact() */
+    OBS_LATENCY_QUERY_PRECIPITATION_COMPACT, /**< obs_query_precipitation_compact() */
+    OBS_LATENCY_REFRESH,             /**< obs_refresh() */
+    OBS_LATENCY_INVENTORY,           /**< Checking what is in the local store for a site. */
+    OBS_LATENCY_DOWNLOAD,            /**< Downloading and storing data, however many requests. */
+    OBS_LATENCY_PARSE,               /**< Parsing a piece of a response, not counting storing it. */
+    OBS_LATENCY_INSERT,              /**< Storing a batch of rows from a response. */
+    OBS_LATENCY_FETCH,               /**< Reading hourly values for a query from the local store. */
+    OBS_LATENCY_WINDOW,              /**< Combining hourly values into windows for a query. */
+    OBS_LATENCY_NUM_METRICS
+};
+
+/** Add a measurement to a histogram.
+ *
+ * \param metric what was measured.
+ * \param ms how long it took in milliseconds, from obs_util_monotonic_ms().
+ */
+void obs_latency_record(enum ObsLatencyMetric metric, double ms);
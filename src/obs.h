@@ -7,6 +7,8 @@
  * necessary and back fill the archive.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 /** A time range. */
@@ -43,6 +45,44 @@ struct ObsPrecipitation {
     double precip_in;
 };
 
+/** A day's maximum and minimum temperature and precipitation, from obs_query_daily_summary(). */
+struct ObsDailySummary {
+    /** The time at the END of the window the values are for. */
+    time_t valid_time;
+
+    double max_t_f;   /**< The maximum temperature in Fahrenheit. */
+    double min_t_f;   /**< The minimum temperature in Fahrenheit. */
+    double precip_in; /**< The precipitation accumulation in inches. */
+};
+
+/** A temperature in the 8 byte form returned by the compact queries.
+ *
+ * Half the size of an \ref ObsTemperature, for large result sets. The values are rounded to single
+ * precision, a few millionths of a degree.
+ */
+struct ObsTemperatureCompact {
+    /** The valid time in hours since the epoch, multiply by 3600 for a \c time_t.
+     *
+     * Windows always end on the hour, so nothing is lost.
+     */
+    int32_t valid_hour;
+
+    /** The temperature in Fahrenheit. */
+    float temperature_f;
+};
+
+/** A precipitation accumulation in the 8 byte form returned by the compact queries.
+ *
+ * Half the size of an \ref ObsPrecipitation, for large result sets.
+ */
+struct ObsPrecipitationCompact {
+    /** The time of the END of the accumulation period in hours since the epoch. */
+    int32_t valid_hour;
+
+    /** The precipitation accumulation in inches. */
+    float precip_in;
+};
+
 /** A handle to an object that stores observations.
  *
  * The store may have the data stored locally, or it may request more data over the internet if
@@ -67,19 +107,342 @@ struct ObsTimeRange *obs_time_range_init(struct ObsTimeRange *tr, time_t start,
  */
 void obs_time_range_print(struct ObsTimeRange tr);
 
+/** Named sets of storage settings for different workloads, see obs_store_config_profile(). */
+enum ObsStoreProfile {
+    OBS_STORE_PROFILE_DEFAULT = 0, /**< The sqlite defaults. */
+    OBS_STORE_PROFILE_READ_HEAVY,  /**< A large page cache and memory mapped reads for queries. */
+    OBS_STORE_PROFILE_BULK_INGEST, /**< Unsynced writes and bigger pages for loading data. */
+};
+
+/** The most database files an archive can be split into, see \ref ObsStoreConfig::num_shards. */
+#define OBS_STORE_MAX_SHARDS 64
+
+/** Storage settings for the local archive.
+ *
+ * Start from obs_store_config_profile() and change any fields that should be different. A zero
+ * initialized config is the same as \ref OBS_STORE_PROFILE_DEFAULT.
+ */
+struct ObsStoreConfig {
+    /** The size of the page cache in KiB, 0 for the sqlite default of about 2 MiB. */
+    int cache_size_kib;
+
+    /** How many bytes of the database file to read through a memory map, 0 to not use one. */
+    long long mmap_size;
+
+    /** The page size in bytes, a power of two from 512 to 65536, or 0 for the default.
+     *
+     * This only takes effect when the database file is created.
+     */
+    int page_size;
+
+    /** Keep the temporary tables and indexes used by queries in memory instead of in files. */
+    bool temp_store_memory;
+
+    /** Don't wait for writes to reach the disk when committing.
+     *
+     * The archive survives the program crashing, but an operating system crash or power failure
+     * in the middle of a download may corrupt it.
+     */
+    bool synchronous_off;
+
+    /** How many database files to split the observations into, from 2 to
+     * \ref OBS_STORE_MAX_SHARDS, or 0 for one file.
+     *
+     * Each site is kept in the file picked by a hash of its identifier, and every file has its own
+     * write lock, so downloads of sites in different files are stored at the same time. This only
+     * takes effect when the archive is created, or on an archive from before schema versions that
+     * has no data yet. After that the number it was created with is used. Larger values are an
+     * error.
+     */
+    unsigned num_shards;
+};
+
+/** Get the settings for a named profile.
+ *
+ * \returns the settings, or the default settings if \a profile isn't a known profile.
+ */
+struct ObsStoreConfig obs_store_config_profile(enum ObsStoreProfile profile);
+
 /** Connect to the default \c ObsStore.
+ *
+ * The store is configured with the profile named by the \c OBS_STORE_PROFILE environment variable,
+ * which may be \c default, \c read-heavy or \c bulk-ingest. If it isn't set the default profile is
+ * used.
  *
  * \param synoptic_labs_api_key is a \c NULL terminated string to a key for working with the
  * SynopticLabs API. This will be stored as an alias, so the argument must not be freed before the
  * returned ObsStore object is destroyed with obs_close().
  *
+ * The local archive isn't opened until the first call that needs it, so connecting is cheap.
+ *
  * \returns an opaque pointer to the store. If there is a failure it will return \c NULL.
  */
 ObsStore *obs_connect(char const *const synoptic_labs_api_key);
 
-/** Close the connection to the observation store performing any necessary cleanup. */
+/** Connect to the default \c ObsStore with the given storage settings.
+ *
+ * \param synoptic_labs_api_key is the same as for obs_connect().
+ * \param config is the storage settings to use, if it is \c NULL this is the same as
+ * obs_connect().
+ *
+ * \returns an opaque pointer to the store. If there is a failure it will return \c NULL.
+ */
+ObsStore *obs_connect_with_config(char const *const synoptic_labs_api_key,
+                                  struct ObsStoreConfig const *config);
+
+/** Open a snapshot written by obs_write_snapshot(), read only.
+ *
+ * The snapshot is opened as immutable: sqlite takes no locks and keeps no journal, so any number
+ * of processes can read it at once at full speed, sharing the operating system's page cache. The
+ * store never downloads anything, queries return whatever the snapshot has, and obs_refresh(),
+ * obs_maintenance(), obs_attach_shared_cache(), watchlists and backfills fail. A snapshot must
+ * never be changed in place, write a new one with obs_write_snapshot() instead, which replaces
+ * the file in one step while stores already reading the old one carry on with it.
+ *
+ * \param path is the snapshot file.
+ * \param config is the storage settings to use, if it is \c NULL the read heavy profile is used,
+ * with the memory map big enough for the whole file.
+ *
+ * \returns an opaque pointer to the store, or \c NULL if the snapshot couldn't be opened or it was
+ * written by a version of obsdb with a different schema.
+ */
+ObsStore *obs_connect_snapshot(char const *path, struct ObsStoreConfig const *config);
+
+/** Write a compacted, read only copy of the archive for obs_connect_snapshot().
+ *
+ * The copy is a consistent view of the archive at one moment, even if other processes are writing
+ * to it.
+ *
+ * \param store the store to copy, it can't be a snapshot, copy the file instead.
+ * \param path is where to write the snapshot.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_write_snapshot(ObsStore *store, char const *path);
+
+/** A backup of the local archive that is copied a few pages at a time.
+ *
+ * Each step holds a read lock on the archive only while it copies its pages, so downloads and
+ * queries carry on between steps. Changes made through the store being backed up are copied into
+ * the backup as they happen. A change committed by any other connection, like a watchlist or
+ * backfill thread or another process, makes the next step start the copy over. After 3 restarts
+ * the rest is copied in a single step, which makes writers wait until it is done, so the backup
+ * always finishes.
+ *
+ * A complete backup can be brought up to date later with obs_backup_update(), which only copies
+ * the changes since.
+ */
+typedef struct ObsBackup ObsBackup;
+
+/** Start a backup of the local archive.
+ *
+ * The backup is written to a temporary file next to \a path, which replaces \a path in one step
+ * when obs_backup_finish() is called after the last page is copied.
+ *
+ * \param store the store to back up. It must not be closed until the backup is finished, and the
+ * backup must be stepped from the same thread that uses the store.
+ * \param path is where to write the backup.
+ *
+ * \returns a handle to the backup, or \c NULL if there is an error.
+ */
+ObsBackup *obs_backup_start(ObsStore *store, char const *path);
+
+/** Copy the next few pages of a backup.
+ *
+ * \param backup is the backup to continue.
+ * \param num_pages is the most pages to copy, a negative number copies the rest in one step.
+ * \param remaining if not \c NULL, the number of pages left to copy is stored here.
+ * \param total if not \c NULL, the number of pages in the archive is stored here.
+ *
+ * \returns 1 when every page has been copied, 0 if there is more to do, including when the archive
+ * was busy and the step should be tried again, or a negative number on failure.
+ */
+int obs_backup_step(ObsBackup *backup, int num_pages, size_t *remaining, size_t *total);
+
+/** Finish a backup, putting it in place if it is complete or throwing it away if it isn't.
+ *
+ * \returns 0 if the backup was complete and is now at its path, or a negative number otherwise.
+ */
+int obs_backup_finish(ObsBackup **backup);
+
+/** Back up the local archive, copying a few pages at a time with pauses in between.
+ *
+ * \param store the store to back up.
+ * \param path is where to write the backup.
+ * \param pages_per_step is how many pages to copy at a time, 0 for the default of 256.
+ * \param pause_ms is how long to pause between steps, so other work can get the archive.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_store_backup(ObsStore *store, char const *path, int pages_per_step, unsigned pause_ms);
+
+/** Bring a backup written by obs_store_backup() up to date, copying only the changes since.
+ *
+ * The changes made after the backup, or after its last update, are read from the store's change
+ * log and applied to the backup in a single transaction. Observations removed from the store by
+ * obs_maintenance() stay in the backup. If maintenance has already trimmed the change log past the
+ * backup, this fails and a new backup is needed.
+ *
+ * \param store the store the backup was taken from.
+ * \param path is the backup to update.
+ *
+ * \returns the number of observations applied to the backup, or a negative number on failure.
+ */
+long obs_backup_update(ObsStore *store, char const *path);
+
+/** Write the changes to the archive after a point in its change log to a delta file.
+ *
+ * The archive numbers its changes, the observations stored and the time ranges downloaded, in the
+ * order they are made. A delta holds the changes after a number the receiver already has, so one
+ * node can download from SynopticLabs and the others can keep up by applying its deltas with
+ * obs_import_changes() instead of downloading the same data. A new receiver should start from a
+ * delta of the whole log, which goes back as far as the archive.
+ *
+ * \param store the store to read the changes from.
+ * \param path is where to write the delta, it is replaced in one step when complete.
+ * \param after_seq is the last change the receiver has, usually the value obs_import_changes()
+ * returned for the last delta it applied, 0 for everything.
+ * \param last_seq is where the number of the last change in the delta is stored.
+ *
+ * \returns the number of observations in the delta, or a negative number on failure.
+ */
+long obs_export_changes(ObsStore *store, char const *path, int64_t after_seq, int64_t *last_seq);
+
+/** Apply a delta written by obs_export_changes() to the archive.
+ *
+ * The delta is applied in a single transaction, and the observations and time ranges in it are
+ * not downloaded again. Apply the deltas from a store in the order they were written, a delta that
+ * starts after the last change applied is refused because the changes in between would be lost.
+ *
+ * \param store the store to apply the delta to, it can't be a snapshot.
+ * \param path is the delta file.
+ * \param last_seq if not \c NULL, the number of the last change in the delta is stored here. The
+ * store keeps the highest one it has applied, see obs_replication_watermark().
+ *
+ * \returns the number of observations applied, or a negative number on failure.
+ */
+long obs_import_changes(ObsStore *store, char const *path, int64_t *last_seq);
+
+/** Find the number of the newest change applied with obs_import_changes().
+ *
+ * \param store the store that applied the changes.
+ * \param last_seq is where the number is stored, 0 if no changes have been applied.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_replication_watermark(ObsStore *store, int64_t *last_seq);
+
+/** Change the storage settings of an open store.
+ *
+ * A watchlist or backfill scheduler that is already running keeps the settings it was started
+ * with, the new settings apply to ones started afterwards.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_store_configure(ObsStore *store, struct ObsStoreConfig const *config);
+
+/** Close the connection to the observation store performing any necessary cleanup.
+ *
+ * Old data is not removed here, see obs_maintenance().
+ */
 void obs_close(ObsStore **store);
 
+/** Remove data that is too old to keep from the local archive.
+ *
+ * Observations, download records and finished backfill jobs older than about 555 days are deleted.
+ * Nothing does this automatically, programs that use the store should call this from time to
+ * time. With \a force set to \c false it is cheap to call on every run, the work is only done if
+ * no process has done it in the last day.
+ *
+ * \param store the data store to clean up.
+ * \param force if \c true, do the work even if it was done recently.
+ *
+ * \returns 1 if old data was removed, 0 if it wasn't due yet, or a negative number on failure.
+ */
+int obs_maintenance(ObsStore *store, bool force);
+
+/** Share query results with every other store on this machine that does the same.
+ *
+ * Results are kept in a shared memory segment, so a query repeated by another process is answered
+ * from memory without touching the database. Cached results are dropped whenever a store using
+ * the cache downloads new data for their site.
+ *
+ * \returns 0 on success, or a negative number if the shared memory couldn't be set up, in which
+ * case the store keeps working without it.
+ */
+int obs_attach_shared_cache(ObsStore *store);
+
+/** Log queries that take longer than a threshold.
+ *
+ * Every obs_query_* call that takes at least \a threshold_ms milliseconds is appended to \a path
+ * as a line of JSON with its parameters, the time spent in each phase (cache, inventory,
+ * download, fetch and window), the number of rows involved, and each SQL statement it ran with
+ * the query plan sqlite used. When the file reaches \a max_bytes it is renamed with a ".1" suffix
+ * and a new one is started, so at most two files are kept.
+ *
+ * \param store the store to log queries from.
+ * \param path the file to append to, or \c NULL to stop logging.
+ * \param threshold_ms the shortest query that is logged, 0 logs every query.
+ * \param max_bytes the size at which the file is rotated, 0 for the default of 10 MiB.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_set_slow_query_log(ObsStore *store, char const *path, double threshold_ms,
+                           size_t max_bytes);
+
+/** Receives the text of obs_latency_export().
+ *
+ * \param text the metrics, not nul terminated. It is freed when the callback returns.
+ * \param len the number of bytes in \a text.
+ * \param ctx the pointer passed to obs_latency_export().
+ */
+typedef void (*ObsLatencyExportCallback)(char const *text, size_t len, void *ctx);
+
+/** Export latency distributions in the Prometheus text format.
+ *
+ * Every obs_query_* and obs_refresh() call in this process is timed, along with the phases that
+ * do the work: checking the inventory, downloading, parsing responses, inserting rows, fetching
+ * hourly values and combining them into windows. They are exported as the summaries
+ * \c obsdb_api_latency_seconds (labeled by \c api) and \c obsdb_phase_latency_seconds (labeled
+ * by \c phase), with the 0.5, 0.9, 0.99 and 0.999 quantiles, a sum and a count. Quantiles are
+ * accurate to within about 6%.
+ *
+ * The measurements are shared by every store in the process and kept until obs_latency_reset().
+ *
+ * \returns 0 on success, or a negative number if the text couldn't be formatted.
+ */
+int obs_latency_export(ObsLatencyExportCallback callback, void *ctx);
+
+/** Write the output of obs_latency_export() to a file.
+ *
+ * The file is replaced in a single step, so it can be read by the node exporter textfile
+ * collector at any time.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_latency_write(char const *path);
+
+/** Forget all the latency measurements made so far in this process. */
+void obs_latency_reset(void);
+
+/** Make sure the store has data for many sites, downloading anything that is missing.
+ *
+ * Sites that are missing data are requested from the SynopticLabs API in groups, so refreshing
+ * hundreds of sites takes a handful of web requests instead of one per site. Sites are grouped by
+ * the time ranges they are missing, and a group only requests those ranges, so a site missing an
+ * hour isn't downloaded again for the months another site is missing.
+ *
+ * \param store the data store to update.
+ * \param num_sites is the number of sites in \a sites.
+ * \param sites is an array of site identifiers.
+ * \param time_range is the \ref ObsTimeRange to fill in for every site.
+ *
+ * \returns 0 on success, or a negative number if there was an error checking or downloading any
+ * of the sites.
+ */
+int obs_refresh(ObsStore *store, size_t num_sites, char const *const sites[],
+                struct ObsTimeRange time_range);
+
 /** Get the daily maximum temperatures.
  *
  * \param store the data store to query.
@@ -149,3 +512,201 @@ int obs_query_precipitation(ObsStore *store, char const *const site, struct ObsT
                             unsigned window_length, unsigned window_increment,
                             unsigned window_offset, struct ObsPrecipitation **results,
                             size_t *num_results);
+
+/** Get the daily maximum and minimum temperatures and precipitation in one query.
+ *
+ * \param store the data store to query.
+ * \param site is the site identifier.
+ * \param time_range is the \ref ObsTimeRange which the end time of all windows will fall into.
+ * \param window_end the UTC hour of the day that the observation window ends.
+ * \param window_length the window length in hours.
+ * \param results will be stored in an array returned here. This returned array will need to be
+ * freed with \c free(). It must be \c NULL when passed in to ensure there is no memory leak.
+ * \param num_results will be the number of \ref ObsDailySummary objects stored in \a results.
+ * This must be 0 when passed in so it is consistent with the length of \a results.
+ *
+ * \returns 0 on success, or a negative number upon failure.
+ *
+ * The values are the same as obs_query_max_t() and obs_query_min_t() with these arguments and
+ * obs_query_precipitation() with a \a window_increment of 24 and a \a window_offset of
+ * \a window_end, but the local store is checked and any missing data is downloaded once, and the
+ * temperatures and precipitation are read together. The shared result cache isn't used.
+ */
+int obs_query_daily_summary(ObsStore *store, char const *const site, struct ObsTimeRange time_range,
+                            unsigned window_end, unsigned window_length,
+                            struct ObsDailySummary **results, size_t *num_results);
+
+/** Get the daily maximum temperatures as \ref ObsTemperatureCompact values.
+ *
+ * The same as obs_query_max_t(), but the results and the hourly values they are made from take
+ * half the memory. The shared result cache isn't used.
+ */
+int obs_query_max_t_compact(ObsStore *store, char const *const site, struct ObsTimeRange time_range,
+                            unsigned window_end, unsigned window_length,
+                            struct ObsTemperatureCompact **results, size_t *num_results);
+
+/** Get the daily minimum temperatures as \ref ObsTemperatureCompact values.
+ *
+ * The same as obs_query_min_t(), but the results and the hourly values they are made from take
+ * half the memory. The shared result cache isn't used.
+ */
+int obs_query_min_t_compact(ObsStore *store, char const *const site, struct ObsTimeRange time_range,
+                            unsigned window_end, unsigned window_length,
+                            struct ObsTemperatureCompact **results, size_t *num_results);
+
+/** Get the accumulated precipitation as \ref ObsPrecipitationCompact values.
+ *
+ * The same as obs_query_precipitation(), but the results and the hourly values they are made from
+ * take half the memory. The shared result cache isn't used.
+ */
+int obs_query_precipitation_compact(ObsStore *store, char const *const site,
+                                    struct ObsTimeRange time_range, unsigned window_length,
+                                    unsigned window_increment, unsigned window_offset,
+                                    struct ObsPrecipitationCompact **results, size_t *num_results);
+
+/** A set of sites that are kept up to date by a background thread.
+ *
+ * The watchlist polls the SynopticLabs API for observations newer than the last ones stored for
+ * each site, so the store always has the most recent data without every query looking for it.
+ */
+typedef struct ObsWatchlist ObsWatchlist;
+
+/** Called by a \ref ObsWatchlist when new observations are stored for a site.
+ *
+ * This is called from the watchlist's background thread, so it must be thread safe and it should
+ * return quickly, the next poll waits for it.
+ *
+ * \param site is the lowercase site identifier.
+ * \param newest_valid_time is the valid time of the newest observation now in the store.
+ * \param num_new_rows is the number of observations that were added.
+ * \param user_data is the pointer passed to obs_watchlist_subscribe().
+ */
+typedef void (*ObsWatchlistCallback)(char const *site, time_t newest_valid_time,
+                                     size_t num_new_rows, void *user_data);
+
+/** Start a watchlist that polls for new data in the background.
+ *
+ * The watchlist uses its own connection to the same local archive as \a store, so they can be used
+ * at the same time from different threads.
+ *
+ * \param store is the store to keep up to date. It must not be closed until after the watchlist is
+ * stopped with obs_watchlist_stop().
+ * \param poll_interval_sec is how many seconds to wait between polls.
+ *
+ * \returns a handle to the watchlist, or \c NULL if there is an error.
+ */
+ObsWatchlist *obs_watchlist_start(ObsStore *store, unsigned poll_interval_sec);
+
+/** Stop polling, wait for the background thread to finish, and free the watchlist. */
+void obs_watchlist_stop(ObsWatchlist **watchlist);
+
+/** Add a site to the watchlist.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_watchlist_add(ObsWatchlist *watchlist, char const *const site);
+
+/** Remove a site from the watchlist.
+ *
+ * \returns 0 on success, or a negative number if the site wasn't in the watchlist.
+ */
+int obs_watchlist_remove(ObsWatchlist *watchlist, char const *const site);
+
+/** Register a function to be called when new data lands for any site in the watchlist.
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_watchlist_subscribe(ObsWatchlist *watchlist, ObsWatchlistCallback callback,
+                            void *user_data);
+
+/** Poll right away instead of waiting for the rest of the poll interval. */
+void obs_watchlist_poll_now(ObsWatchlist *watchlist);
+
+/** A background scheduler that fills in historical data for long time ranges.
+ *
+ * Backfill jobs are planned into request sized chunks using what is already in the store, and the
+ * queue of chunks is saved in the local archive. Jobs that are not finished when the scheduler is
+ * stopped, or the program exits, are picked up again the next time a scheduler is started.
+ */
+typedef struct ObsBackfill ObsBackfill;
+
+/** Called by a \ref ObsBackfill after each download it makes for a job.
+ *
+ * This is called from the scheduler's background thread, so it must be thread safe and it should
+ * return quickly.
+ *
+ * \param job_id is the id returned by obs_backfill_submit().
+ * \param num_done is the number of chunks in the job that have been downloaded.
+ * \param num_failed is the number of chunks in the job that gave up after repeated failures.
+ * \param num_chunks is the total number of chunks in the job.
+ * \param user_data is the pointer passed to obs_backfill_start().
+ */
+typedef void (*ObsBackfillCallback)(long job_id, size_t num_done, size_t num_failed,
+                                    size_t num_chunks, void *user_data);
+
+/** Start the backfill scheduler, resuming any jobs left in the queue.
+ *
+ * The scheduler downloads with its own connection to the same local archive as \a store at a low
+ * thread priority, and it pauses between requests so it doesn't crowd out other work.
+ *
+ * \param store is the store to fill in. It must not be closed until after the scheduler is stopped
+ * with obs_backfill_stop().
+ * \param callback is called with progress reports, it may be \c NULL.
+ * \param user_data is passed through to \a callback.
+ *
+ * \returns a handle to the scheduler, or \c NULL if there is an error.
+ */
+ObsBackfill *obs_backfill_start(ObsStore *store, ObsBackfillCallback callback, void *user_data);
+
+/** Stop the scheduler after the current download and wait for it to finish.
+ *
+ * Unfinished jobs stay queued in the local archive.
+ */
+void obs_backfill_stop(ObsBackfill **backfill);
+
+/** Queue a backfill job.
+ *
+ * This plans the job using the store passed to obs_backfill_start(), so it must be called from the
+ * same thread that uses the store.
+ *
+ * \param backfill is the scheduler.
+ * \param num_sites is the number of sites in \a sites.
+ * \param sites are the site identifiers to fill in.
+ * \param time_range is the time range to fill in for every site.
+ *
+ * \returns the id of the new job, 0 if the store already has all the data, or a negative number
+ * on failure.
+ */
+long obs_backfill_submit(ObsBackfill *backfill, size_t num_sites, char const *const sites[],
+                         struct ObsTimeRange time_range);
+
+/** Find out how far along a backfill job is.
+ *
+ * This must be called from the same thread that uses the store passed to obs_backfill_start().
+ *
+ * \returns 1 if the job was found, 0 if it wasn't, and a negative number on failure.
+ */
+int obs_backfill_progress(ObsBackfill *backfill, long job_id, size_t *num_done, size_t *num_failed,
+                          size_t *num_chunks);
+
+/** Export observations from the local archive to a columnar file.
+ *
+ * The file holds the hourly observations of each site in batches of columns that can be mapped
+ * into memory and used in place. Its layout is described in \c obs_columnar.h. Only what is
+ * already in the archive is exported, nothing is downloaded.
+ *
+ * Sites are read in parallel, each thread with its own connection to the archive, and each thread
+ * holds one batch at a time, so memory use doesn't depend on the size of the export. The file is
+ * written under a temporary name and renamed when it is complete.
+ *
+ * \param store the store to export from.
+ * \param path the file to write.
+ * \param num_sites the number of sites in \a sites, 0 to export every site in the archive.
+ * \param sites the sites to export.
+ * \param time_range the time range to export, inclusive at both ends.
+ * \param num_threads the number of sites to read at once, 0 for one per processor.
+ *
+ * \returns the number of observations exported, or a negative number on failure.
+ */
+long obs_export(ObsStore *store, char const *path, size_t num_sites, char const *const sites[],
+                struct ObsTimeRange time_range, unsigned num_threads);
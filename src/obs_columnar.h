@@ -0,0 +1,74 @@
+#pragma once
+/** \file obs_columnar.h
+ *
+ * \brief The layout of the columnar files written by obs_export().
+ *
+ * The file is meant to be mapped into memory and used in place, there is nothing to parse. It is
+ * laid out as
+ *
+ *     struct ObsColumnarHeader
+ *     the data of each batch
+ *     struct ObsColumnarBatch index[num_batches]
+ *     struct ObsColumnarFooter
+ *
+ * A batch holds up to \ref OBS_COLUMNAR_BATCH_ROWS observations of one site in time order, stored
+ * as three columns one after the other: the valid times as \c int64_t seconds since the epoch,
+ * the temperatures in Fahrenheit as \c double, and the 1-hour precipitation in inches as
+ * \c double. Missing values are \c NAN. Every column starts at a multiple of
+ * \ref OBS_COLUMNAR_ALIGN bytes from the start of the file.
+ *
+ * The footer is the last \c sizeof(struct ObsColumnarFooter) bytes of the file and says where the
+ * index is. The index is sorted by site and then by time, so a reader can binary search it for a
+ * site and take the column offsets from the entries it finds.
+ *
+ * Numbers are in the byte order of the machine that wrote the file. Readers should check
+ * \ref ObsColumnarFooter::byte_order against \ref OBS_COLUMNAR_BYTE_ORDER.
+ */
+#include <stdint.h>
+
+/** The first and last 8 bytes of the file. */
+#define OBS_COLUMNAR_MAGIC "OBSCOLv1"
+
+/** The version of the layout. */
+#define OBS_COLUMNAR_VERSION 1
+
+/** Written as a \c uint32_t, it reads back as this value only with the writer's byte order. */
+#define OBS_COLUMNAR_BYTE_ORDER 0x01020304
+
+/** The alignment in bytes of every column, enough for any vector load. */
+#define OBS_COLUMNAR_ALIGN 64
+
+/** The most observations in a batch. */
+#define OBS_COLUMNAR_BATCH_ROWS 65536
+
+/** The start of the file. */
+struct ObsColumnarHeader {
+    char magic[8];       /**< \ref OBS_COLUMNAR_MAGIC, not nul terminated. */
+    uint32_t version;    /**< \ref OBS_COLUMNAR_VERSION. */
+    uint32_t byte_order; /**< \ref OBS_COLUMNAR_BYTE_ORDER. */
+    int64_t start;       /**< The start of the time range that was exported. */
+    int64_t end;         /**< The end of the time range that was exported. */
+    int64_t created;     /**< When the file was written, in seconds since the epoch. */
+    char reserved[24];   /**< Zeros, pads the header to \ref OBS_COLUMNAR_ALIGN bytes. */
+};
+
+/** An entry in the index, describing one batch. */
+struct ObsColumnarBatch {
+    char site[32];              /**< The lowercase site identifier, nul terminated. */
+    uint64_t num_rows;          /**< The number of observations in the batch. */
+    int64_t first_valid_time;   /**< The valid time of the first observation. */
+    int64_t last_valid_time;    /**< The valid time of the last observation. */
+    uint64_t valid_time_offset; /**< The offset in the file of the valid time column. */
+    uint64_t t_f_offset;        /**< The offset in the file of the temperature column. */
+    uint64_t precip_in_offset;  /**< The offset in the file of the precipitation column. */
+};
+
+/** The end of the file. */
+struct ObsColumnarFooter {
+    uint64_t index_offset; /**< The offset in the file of the index. */
+    uint64_t num_batches;  /**< The number of entries in the index. */
+    uint64_t num_rows;     /**< The number of observations in all the batches. */
+    uint32_t version;      /**< \ref OBS_COLUMNAR_VERSION. */
+    uint32_t byte_order;   /**< \ref OBS_COLUMNAR_BYTE_ORDER. */
+    char magic[8];         /**< \ref OBS_COLUMNAR_MAGIC, not nul terminated. */
+};
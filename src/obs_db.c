@@ -4,11 +4,17 @@
  */
 #include "obs_db.h"
 #include "obs.h"
+#include "latency.h"
+#include "probes.h"
+#include "shm_cache.h"
+#include "time_range.h"
 #include "utils.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tgmath.h>
@@ -18,790 +24,3388 @@
 
 #include <sqlite3.h>
 
-/** Retrieve the full path to a database file for the local store. */
-static char const *
-get_or_create_db_path(void)
-{
-    static char path[64] = {0};
+/** The number of hours covered by each row of the hour_bitmaps table. */
+#define OBS_DB_BITMAP_BLOCK_HOURS 4096
 
-    char const *home = getenv("HOME");
-    StopIf(!home, exit(EXIT_FAILURE), "could not find user's home directory.");
+/** The size (in bytes) of the bitmap stored in each row of the hour_bitmaps table. */
+#define OBS_DB_BITMAP_BLOCK_BYTES (OBS_DB_BITMAP_BLOCK_HOURS / 8)
 
-    sprintf(path, "%s/.local/", home);
+/** The most blocks to collect in memory while building the hour bitmaps from existing data. */
+#define OBS_DB_BITMAP_BUILD_BATCH 1024
 
-    struct stat st = {0};
-    if (stat(path, &st) == -1) {
-        mkdir(path, 0774);
-    }
+/** The version of the delta files written by obs_db_export_changes(). */
+#define OBS_DB_DELTA_VERSION 1
 
-    sprintf(path, "%s/.local/share/", home);
-    if (stat(path, &st) == -1) {
-        mkdir(path, 0774);
-    }
+/** The sqlite default page cache size in KiB, used when a config doesn't set one. */
+#define OBS_DB_DEFAULT_CACHE_SIZE_KIB 2000
 
-    sprintf(path, "%s/.local/share/obsdb/", home);
-    if (stat(path, &st) == -1) {
-        mkdir(path, 0774);
-    }
+/** One row of the hour_bitmaps table. */
+struct ObsDbBitmapBlock {
+    char site[32];                                 /**< The lowercase site identifier. */
+    sqlite3_int64 block;                           /**< The block number, hour / block size. */
+    unsigned char bits[OBS_DB_BITMAP_BLOCK_BYTES]; /**< One bit per hour, little endian. */
+};
+
+/** The rows inserted for a site, waiting to be written to the change log. */
+struct ObsDbChange {
+    char site[32]; /**< The site identifier, as it was inserted. */
+    time_t start;  /**< The earliest valid time inserted. */
+    time_t end;    /**< The latest valid time inserted. */
+};
 
-    sprintf(path, "%s/.local/share/obsdb/wxobs.sqlite", home);
+static int obs_db_build_hour_bitmaps(sqlite3 *db);
 
-    return path;
+/** Retrieve the full path to a database file for the local store.
+ *
+ * The path is written to a buffer from the caller, threads open different shards at once.
+ *
+ * \param shard is which file, 0 for the main file that also holds everything that isn't kept by
+ * site.
+ * \param path_len is the size of \a path.
+ * \param path is where the path is written.
+ */
+static void
+obs_db_path(unsigned shard, size_t path_len, char path[path_len])
+{
+    char const *home = getenv("HOME");
+    StopIf(!home, exit(EXIT_FAILURE), "could not find user's home directory.");
+
+    int len = shard == 0
+                  ? snprintf(path, path_len, "%s/.local/share/obsdb/wxobs.sqlite", home)
+                  : snprintf(path, path_len, "%s/.local/share/obsdb/wxobs-shard%u.sqlite", home,
+                             shard);
+    StopIf(len < 0 || (size_t)len >= path_len, exit(EXIT_FAILURE),
+           "path to the local store is too long.");
 }
 
-sqlite3 *
-obs_db_open_create(void)
+/** Create the directories the database file goes in. */
+static void
+obs_db_create_dirs(void)
 {
-    sqlite3 *err_return = 0;
-    sqlite3_stmt *statement = 0;
-    sqlite3 *db = err_return;
-    int res = SQLITE_OK;
+    char path[256] = {0};
 
-    char const *path = get_or_create_db_path();
+    char const *home = getenv("HOME");
+    StopIf(!home, exit(EXIT_FAILURE), "could not find user's home directory.");
 
-    res = sqlite3_open(path, &db);
-    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR, "unable to open download cache: %s",
-           sqlite3_errstr(res));
+    char const *const dirs[] = {"/.local/", "/.local/share/", "/.local/share/obsdb/"};
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", home, dirs[i]);
 
-    char *sql = "CREATE TABLE IF NOT EXISTS obs (                                     \n"
-                "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
-                "  valid_time     INTEGER NOT NULL, -- unix time stamp of valid time. \n"
-                "  t_f            REAL,             -- temperature in Fahrenheit      \n"
-                "  precip_in_1hr  REAL,             -- precipitation in inches        \n"
-                "  PRIMARY KEY (site, valid_time));                                   \n";
+        struct stat st = {0};
+        if (stat(path, &st) == -1) {
+            mkdir(path, 0774);
+        }
+    }
+}
+
+/** Execute a single statement that creates part of the schema. */
+static int
+obs_db_exec_schema_sql(sqlite3 *db, char const *sql)
+{
+    sqlite3_stmt *statement = 0;
 
-    res = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
-    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR,
-           "error preparing cache initialization sql: %s", sqlite3_errstr(res));
+    int res = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(res != SQLITE_OK, goto ERR_RETURN, "error preparing cache initialization sql: %s",
+           sqlite3_errstr(res));
 
     res = sqlite3_step(statement);
-    StopIf(res != SQLITE_DONE, goto CLEAN_UP_AND_RETURN_ERROR,
-           "error executing cache initialization sql: %s", sqlite3_errstr(res));
+    StopIf(res != SQLITE_DONE, goto ERR_RETURN, "error executing cache initialization sql: %s",
+           sqlite3_errstr(res));
 
     res = sqlite3_finalize(statement);
-    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR,
-           "error finalizing cache initialization sql: %s", sqlite3_errstr(res));
+    StopIf(res != SQLITE_OK, return -1, "error finalizing cache initialization sql: %s",
+           sqlite3_errstr(res));
 
-    return db;
+    return 0;
 
-CLEAN_UP_AND_RETURN_ERROR:
+ERR_RETURN:
 
     res = sqlite3_finalize(statement);
     if (res != SQLITE_OK) {
         fprintf(stderr, "error finalizing cache initialization sql: %s", sqlite3_errstr(res));
     }
 
-    res = sqlite3_close(db);
-    if (res != SQLITE_OK) {
-        fprintf(stderr, "error closing sqlite3 database: %s", sqlite3_errstr(res));
-    }
-    return err_return;
+    return -1;
 }
 
 int
-obs_db_close(sqlite3 *db)
+obs_db_apply_config(sqlite3 *db, struct ObsStoreConfig const *config)
 {
-    int const err_return_val = -1;
-    int const success_return_val = 0;
+    struct ObsStoreConfig defaults = {0};
+    if (!config) {
+        config = &defaults;
+    }
 
-    int res = SQLITE_OK;
+    // Every setting is given, so switching back to the defaults undoes an earlier profile.
+    char sql[256] = {0};
+    int len = sprintf(sql,
+                      "PRAGMA cache_size = -%d; "
+                      "PRAGMA mmap_size = %lld; "
+                      "PRAGMA temp_store = %s; "
+                      "PRAGMA synchronous = %s; ",
+                      config->cache_size_kib > 0 ? config->cache_size_kib
+                                                 : OBS_DB_DEFAULT_CACHE_SIZE_KIB,
+                      config->mmap_size > 0 ? config->mmap_size : 0,
+                      config->temp_store_memory ? "MEMORY" : "DEFAULT",
+                      config->synchronous_off ? "OFF" : "FULL");
+
+    if (config->page_size > 0) {
+        sprintf(sql + len, "PRAGMA page_size = %d;", config->page_size);
+    }
 
-    time_t now = time(0);
-    time_t too_old = now - 60 * 60 * 24 * 555; // About 555 days. That's over 1.5 years!
+    char *sqlite_error_message = 0;
+    sqlite3_exec(db, sql, 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, goto ERR_RETURN, "error applying store config: %s",
+           sqlite_error_message);
 
-    char *sql = "DELETE FROM obs WHERE valid_time < ?";
+    return 0;
 
-    sqlite3_stmt *statement = 0;
-    res = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
-    StopIf(res != SQLITE_OK, return err_return_val, "error preparing delete statement: %s",
-           sqlite3_errstr(res));
+ERR_RETURN:
 
-    res = sqlite3_bind_int64(statement, 1, too_old);
-    StopIf(res != SQLITE_OK, return err_return_val, "error binding init_time in delete: %s",
-           sqlite3_errstr(res));
+    sqlite3_free(sqlite_error_message);
+    return -1;
+}
 
-    res = sqlite3_step(statement);
-    StopIf(res != SQLITE_ROW && res != SQLITE_DONE, return err_return_val,
-           "error executing select sql: %s", sqlite3_errstr(res));
+/** Create the original tables, for archives made before the schema was versioned they may
+ * already be there. */
+static int
+obs_db_migrate_to_1(sqlite3 *db)
+{
+    char const *obs_sql =
+        "CREATE TABLE IF NOT EXISTS obs (                                     \n"
+        "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
+        "  valid_time     INTEGER NOT NULL, -- unix time stamp of valid time. \n"
+        "  t_f            REAL,             -- temperature in Fahrenheit      \n"
+        "  precip_in_1hr  REAL,             -- precipitation in inches        \n"
+        "  PRIMARY KEY (site, valid_time));                                   \n";
+
+    int res = obs_db_exec_schema_sql(db, obs_sql);
+    StopIf(res, return -1, "error creating obs table");
+
+    char const *coverage_sql =
+        "CREATE TABLE IF NOT EXISTS coverage (                                \n"
+        "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
+        "  start          INTEGER NOT NULL, -- unix time, start of download   \n"
+        "  end            INTEGER NOT NULL, -- unix time, end of download     \n"
+        "  PRIMARY KEY (site, start, end));                                   \n";
+
+    res = obs_db_exec_schema_sql(db, coverage_sql);
+    StopIf(res, return -1, "error creating coverage table");
+
+    char const *settings_sql =
+        "CREATE TABLE IF NOT EXISTS settings (                                \n"
+        "  name           TEXT    PRIMARY KEY, -- name of the setting         \n"
+        "  value          REAL);               -- value of the setting        \n";
+
+    res = obs_db_exec_schema_sql(db, settings_sql);
+    StopIf(res, return -1, "error creating settings table");
+
+    char const *bad_ranges_sql =
+        "CREATE TABLE IF NOT EXISTS bad_ranges (                              \n"
+        "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
+        "  start          INTEGER NOT NULL, -- unix time, start of bad data   \n"
+        "  end            INTEGER NOT NULL, -- unix time, end of bad data     \n"
+        "  reason         TEXT,             -- why the download failed        \n"
+        "  PRIMARY KEY (site, start, end));                                   \n";
+
+    res = obs_db_exec_schema_sql(db, bad_ranges_sql);
+    StopIf(res, return -1, "error creating bad_ranges table");
 
-    res = sqlite3_finalize(statement);
-    StopIf(res != SQLITE_OK, return err_return_val, "error finalizing delete statement: %s",
-           sqlite3_errstr(res));
+    return 0;
+}
 
-    res = sqlite3_close(db);
-    StopIf(res != SQLITE_OK, return err_return_val, "error closing sqlite3 database: %s",
-           sqlite3_errstr(res));
+/** Add the backfill queue. */
+static int
+obs_db_migrate_to_2(sqlite3 *db)
+{
+    char const *backfill_jobs_sql =
+        "CREATE TABLE IF NOT EXISTS backfill_jobs (                           \n"
+        "  job_id         INTEGER PRIMARY KEY, -- id returned on submission   \n"
+        "  num_chunks     INTEGER NOT NULL,    -- chunks planned for the job  \n"
+        "  submitted      INTEGER NOT NULL);   -- unix time of submission     \n";
+
+    int res = obs_db_exec_schema_sql(db, backfill_jobs_sql);
+    StopIf(res, return -1, "error creating backfill_jobs table");
+
+    char const *backfill_chunks_sql =
+        "CREATE TABLE IF NOT EXISTS backfill_chunks (                         \n"
+        "  job_id         INTEGER NOT NULL, -- job this chunk belongs to      \n"
+        "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
+        "  start          INTEGER NOT NULL, -- unix time, start of chunk      \n"
+        "  end            INTEGER NOT NULL, -- unix time, end of chunk        \n"
+        "  attempts       INTEGER NOT NULL DEFAULT 0, -- failed downloads     \n"
+        "  PRIMARY KEY (job_id, site, start));                                \n";
+
+    res = obs_db_exec_schema_sql(db, backfill_chunks_sql);
+    StopIf(res, return -1, "error creating backfill_chunks table");
+
+    return 0;
+}
+
+/** Add the hourly inventory bitmaps and fill them in from the data already stored. */
+static int
+obs_db_migrate_to_3(sqlite3 *db)
+{
+    char const *hour_bitmaps_sql =
+        "CREATE TABLE IF NOT EXISTS hour_bitmaps (                            \n"
+        "  site           TEXT    NOT NULL, -- Synoptic Labs API site id      \n"
+        "  block          INTEGER NOT NULL, -- hours since epoch / 4096       \n"
+        "  bits           BLOB    NOT NULL, -- 1 bit per hour with data       \n"
+        "  PRIMARY KEY (site, block));                                        \n";
+
+    int res = obs_db_exec_schema_sql(db, hour_bitmaps_sql);
+    StopIf(res, return -1, "error creating hour_bitmaps table");
+
+    res = obs_db_build_hour_bitmaps(db);
+    StopIf(res, return -1, "error building hour bitmaps");
+
+    return 0;
+}
+
+/** Add the change log used for replication, starting it with everything already stored. */
+static int
+obs_db_migrate_to_4(sqlite3 *db)
+{
+    char const *changes_sql =
+        "CREATE TABLE IF NOT EXISTS changes (                                 \n"
+        "  seq    INTEGER PRIMARY KEY AUTOINCREMENT, -- order of the changes  \n"
+        "  kind   INTEGER NOT NULL, -- rows stored or coverage added          \n"
+        "  site   TEXT    NOT NULL, -- Synoptic Labs API site id              \n"
+        "  start  INTEGER NOT NULL, -- unix time, start of the change         \n"
+        "  end    INTEGER NOT NULL);-- unix time, end of the change           \n";
+
+    int res = obs_db_exec_schema_sql(db, changes_sql);
+    StopIf(res, return -1, "error creating changes table");
+
+    char seed_sql[256] = {0};
+    sprintf(seed_sql,
+            "INSERT INTO changes (kind, site, start, end)                       \n"
+            "  SELECT %d, site, MIN(valid_time), MAX(valid_time)                \n"
+            "  FROM obs GROUP BY site;                                          \n",
+            OBS_DB_CHANGE_ROWS);
+
+    res = obs_db_exec_schema_sql(db, seed_sql);
+    StopIf(res, return -1, "error logging the stored rows");
+
+    sprintf(seed_sql,
+            "INSERT INTO changes (kind, site, start, end)                       \n"
+            "  SELECT %d, site, start, end FROM coverage ORDER BY site, start;  \n",
+            OBS_DB_CHANGE_COVERAGE);
+
+    res = obs_db_exec_schema_sql(db, seed_sql);
+    StopIf(res, return -1, "error logging the coverage");
 
-    return success_return_val;
+    return 0;
 }
 
-/** Find out how many rows will be returned.
+/** Upgrades the schema by one version, each is run in the same transaction as the version bump. */
+typedef int (*ObsDbMigration)(sqlite3 *db);
+
+/** The migrations in order, the one at index \c i upgrades from version \c i to \c i + 1. */
+static ObsDbMigration const obs_db_migrations[] = {
+    obs_db_migrate_to_1,
+    obs_db_migrate_to_2,
+    obs_db_migrate_to_3,
+    obs_db_migrate_to_4,
+};
+
+/** The schema version of the archive, kept in PRAGMA user_version. */
+#define OBS_DB_SCHEMA_VERSION ((int)(sizeof(obs_db_migrations) / sizeof(obs_db_migrations[0])))
+
+/** Read the schema version of the archive.
  *
- * \returns the number of rows that will be returned from a query for the same site and time range.
- * If there is an error it returns \c SIZE_MAX
+ * \returns the version, or -1 if there is an error.
  */
-static size_t
-obs_db_count_rows_in_range(sqlite3 *db, char const *const site, struct ObsTimeRange tr)
+static int
+obs_db_user_version(sqlite3 *db)
 {
     sqlite3_stmt *statement = 0;
 
-    char query[256] = {0};
-    sprintf(query,
-            "SELECT COUNT(valid_time) "
-            "FROM obs "
-            "WHERE site='%s' "
-            "    AND valid_time >= %ld "
-            "    AND valid_time <= %ld;",
-            site, tr.start, tr.end);
-
-    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
-           query, sqlite3_errstr(rc));
+    int rc = sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing version check: %s",
+           sqlite3_errstr(rc));
 
     rc = sqlite3_step(statement);
-    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN,
-           "error executing select: %s\n %s\n", query, sqlite3_errstr(rc));
-
-    int col_type = sqlite3_column_type(statement, 0);
-    StopIf(col_type != SQLITE_INTEGER, goto ERR_RETURN, "impossible non-integer returned");
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "error reading schema version: %s",
+           sqlite3_errstr(rc));
 
-    static_assert(sizeof(sqlite3_int64) <= sizeof(size_t), "size_t too small");
-    sqlite3_int64 count = sqlite3_column_int64(statement, 0);
-    assert(count >= 0);
+    int version = sqlite3_column_int(statement, 0);
 
     sqlite3_finalize(statement);
-    return count;
+    return version;
 
 ERR_RETURN:
     sqlite3_finalize(statement);
-    return SIZE_MAX;
+    return -1;
 }
 
+/** Check if an archive has no observations or coverage, so it can still be split into shards.
+ *
+ * \returns 1 if it is empty, 0 if not, or -1 on error.
+ */
 static int
-obs_db_have_inventory_step_row(sqlite3_stmt *statement, time_t t1[static 1])
+obs_db_is_empty(sqlite3 *db)
 {
-    int rc = sqlite3_step(statement);
-    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto EARLY_RETURN, "error executing select: %s\n",
-           sqlite3_errstr(rc));
-
-    if (rc == SQLITE_DONE) {
-        goto EARLY_RETURN;
-    }
+    sqlite3_stmt *statement = 0;
 
-    int col_type = sqlite3_column_type(statement, 0);
-    StopIf(col_type != SQLITE_INTEGER, goto EARLY_RETURN, "impossible non-integer returned");
+    int rc = sqlite3_prepare_v2(db,
+                                "SELECT NOT EXISTS (SELECT 1 FROM obs) "
+                                "    AND NOT EXISTS (SELECT 1 FROM coverage)",
+                                -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing empty check: %s",
+           sqlite3_errstr(rc));
 
-    static_assert(sizeof(sqlite3_int64) <= sizeof(time_t), "time_t too small");
-    sqlite3_int64 timestamp = sqlite3_column_int64(statement, 0);
-    *t1 = timestamp;
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "error checking for data: %s", sqlite3_errstr(rc));
 
-    return rc;
+    int empty = sqlite3_column_int(statement, 0);
 
-EARLY_RETURN:
+    sqlite3_finalize(statement);
+    return empty;
 
-    *t1 = 0;
-    return rc;
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
 }
 
-int
-obs_db_have_inventory(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
-                      struct ObsTimeRange **missing_ranges, size_t *num_missing_ranges)
+/** Bring the schema up to \ref OBS_DB_SCHEMA_VERSION.
+ *
+ * \param num_shards is the number of files to split a new archive into, it is recorded in the
+ * \ref OBS_DB_NUM_SHARDS_SETTING setting along with the new schema. It must be at most
+ * \ref OBS_STORE_MAX_SHARDS.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_migrate(sqlite3 *db, unsigned num_shards)
 {
-    assert(db && "null db");
-    assert(site && "null site");
-    assert(tr.start < tr.end && "time range ends before it starts!");
-    assert(num_missing_ranges && !*num_missing_ranges && missing_ranges && !*missing_ranges);
-
-    sqlite3_stmt *statement = 0;
-
-    StopIf(missing_ranges && !num_missing_ranges, goto ERR_RETURN,
-           "A pointer was supplied to return missing time ranges, but not a pointer\n"
-           "for the number of missing time ranges: num_missing_ranges is NULL");
-
-    size_t num_tr = 0;
-    struct ObsTimeRange trs[100] = {{0}};
-
-    char query[256] = {0};
-    sprintf(query,
-            "SELECT valid_time "
-            "FROM obs "
-            "WHERE site='%s' "
-            "    AND valid_time >= %ld "
-            "    AND valid_time <= %ld "
-            "ORDER BY valid_time ASC",
-            site, tr.start, tr.end);
-
-    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
-           query, sqlite3_errstr(rc));
+    char *sqlite_error_message = 0;
 
-    time_t t1 = {0};
+    // Take the write lock right away, so only one process migrates and the rest wait for it.
+    sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, goto ERR_RETURN, "error starting migration: %s",
+           sqlite_error_message);
 
-    rc = obs_db_have_inventory_step_row(statement, &t1);
-    if (rc != SQLITE_ROW) {
-        // There is no data in the database yet, so the whole time range is missing.
-        trs[num_tr] = tr;
-        num_tr++;
-        goto ALLOCATE_AND_RETURN;
-    }
+    int version = obs_db_user_version(db);
+    StopIf(version < 0, goto ERR_RETURN_ROLLBACK, "unable to read the schema version");
 
-    if (t1 > tr.start && difftime(t1, tr.start) > 4000.0) {
-        // Missing a chunk at the beginning.
-        trs[num_tr] = (struct ObsTimeRange){.start = tr.start, .end = t1};
-        num_tr++;
+    for (int next = version; next < OBS_DB_SCHEMA_VERSION; next++) {
+        int rc = obs_db_migrations[next](db);
+        StopIf(rc, goto ERR_RETURN_ROLLBACK, "error migrating schema to version %d", next + 1);
     }
 
-    while (true) {
-        time_t t0 = t1;
+    // Only an empty archive can be split, the sites already stored would be in the wrong files.
+    // An archive from before schema versions has version 0 too, so look at what is in it.
+    if (version == 0 && num_shards > 1) {
+        StopIf(num_shards > OBS_STORE_MAX_SHARDS, goto ERR_RETURN_ROLLBACK,
+               "%u shards requested, the most supported is %d", num_shards,
+               OBS_STORE_MAX_SHARDS);
 
-        rc = obs_db_have_inventory_step_row(statement, &t1);
-        if (rc != SQLITE_ROW || t1 == 0) {
-            // We're done, clean up and prepare to check ending
-            t1 = t0;
-            break;
-        }
+        int empty = obs_db_is_empty(db);
+        StopIf(empty < 0, goto ERR_RETURN_ROLLBACK, "unable to check the archive for data");
 
-        double gap_seconds = difftime(t1, t0);
-        if (gap_seconds > 4000.0) {
-            trs[num_tr] = (struct ObsTimeRange){.start = t0, .end = t1};
-            num_tr++;
-            if (num_tr >= sizeof(trs) / sizeof(trs[0])) {
-                // We're out of space, do the best you can. This is crazy.
-                goto ALLOCATE_AND_RETURN;
-            }
+        if (empty) {
+            int rc = obs_db_set_setting(db, OBS_DB_NUM_SHARDS_SETTING, num_shards);
+            StopIf(rc, goto ERR_RETURN_ROLLBACK, "error recording the number of shards");
+        } else {
+            fprintf(stderr, "the local store already has data, it is not split into shards\n");
         }
     }
 
-    if (tr.end > t1 && difftime(tr.end, t1) > 4000.0) {
-        // Missing a chunk at the end.
-        trs[num_tr] = (struct ObsTimeRange){.start = t1, .end = tr.end};
-        num_tr++;
+    if (version < OBS_DB_SCHEMA_VERSION) {
+        char sql[64] = {0};
+        sprintf(sql, "PRAGMA user_version = %d;", OBS_DB_SCHEMA_VERSION);
+
+        sqlite3_exec(db, sql, 0, 0, &sqlite_error_message);
+        StopIf(sqlite_error_message, goto ERR_RETURN_ROLLBACK, "error setting schema version: %s",
+               sqlite_error_message);
     }
 
-ALLOCATE_AND_RETURN:
+    return obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
 
-    sqlite3_finalize(statement);
+ERR_RETURN_ROLLBACK:
 
-    if (num_tr == 0) {
-        // There was no missing time ranges, nothing to allocate
-        *num_missing_ranges = 0;
-        *missing_ranges = 0;
-        return 1;
-    } else {
-        *num_missing_ranges = num_tr;
-        *missing_ranges = calloc(num_tr, sizeof(struct ObsTimeRange));
-        StopIf(!*missing_ranges, goto ERR_RETURN, "out of memory");
-        memcpy(*missing_ranges, trs, num_tr * sizeof(trs[0]));
-        return 0;
-    }
+    obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
 
 ERR_RETURN:
 
-    sqlite3_finalize(statement);
-    *num_missing_ranges = 0;
-    *missing_ranges = 0;
+    sqlite3_free(sqlite_error_message);
     return -1;
 }
 
-static size_t
-obs_db_query_calculate_num_results(struct ObsTimeRange tr, unsigned window_increment)
+/** Open one of the database files of the local store, creating it if needed.
+ *
+ * \param shard is which file, 0 for the main file.
+ * \param config is the storage settings for the connection, \c NULL for the defaults.
+ *
+ * \returns \c 0 on error.
+ */
+static sqlite3 *
+obs_db_open_file(unsigned shard, struct ObsStoreConfig const *config)
 {
-    double diff_seconds = difftime(tr.end, tr.start);
-    StopIf(diff_seconds < 0.0, return SIZE_MAX, "backwards ObsTimeRange");
+    sqlite3 *err_return = 0;
+    sqlite3 *db = err_return;
+    int res = SQLITE_OK;
 
-    double num_results = (diff_seconds + 1) / HOURSEC / window_increment;
-    StopIf(num_results >= (double)SIZE_MAX / 2.0, return SIZE_MAX,
-           "too many results, something wrong");
+    char path[256] = {0};
+    obs_db_path(shard, sizeof(path), path);
+    int const flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
-    return (size_t)num_results;
-}
+    res = sqlite3_open_v2(path, &db, flags, 0);
+    if (res == SQLITE_CANTOPEN) {
+        // Only the first run needs the directories made.
+        sqlite3_close(db);
+        obs_db_create_dirs();
+        res = sqlite3_open_v2(path, &db, flags, 0);
+    }
+    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR, "unable to open download cache: %s",
+           sqlite3_errstr(res));
 
-static int
-obs_db_query_temperatures_get_hourlies_step_row(sqlite3_stmt *statement,
-                                                struct ObsTemperature ob[static 1])
-{
-    int rc = sqlite3_step(statement);
-    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto EARLY_RETURN, "error executing select: %s\n",
-           sqlite3_errstr(rc));
+    // Background threads and other processes may be writing at the same time, wait for them.
+    res = sqlite3_busy_timeout(db, OBS_DB_BUSY_TIMEOUT_MS);
+    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR, "unable to set busy timeout: %s",
+           sqlite3_errstr(res));
 
-    if (rc == SQLITE_DONE) {
-        goto EARLY_RETURN;
-    }
+    // Before the schema is created, so the page size applies to a new database.
+    res = obs_db_apply_config(db, config);
+    StopIf(res, goto CLEAN_UP_AND_RETURN_ERROR, "unable to configure the store");
 
-    int col_type = sqlite3_column_type(statement, 0);
-    StopIf(col_type != SQLITE_INTEGER, goto EARLY_RETURN, "impossible non-integer returned");
+    int version = obs_db_user_version(db);
+    StopIf(version < 0, goto CLEAN_UP_AND_RETURN_ERROR, "unable to read the schema version");
+    StopIf(version > OBS_DB_SCHEMA_VERSION, goto CLEAN_UP_AND_RETURN_ERROR,
+           "the local store was created by a newer version of obsdb (schema %d > %d)", version,
+           OBS_DB_SCHEMA_VERSION);
 
-    col_type = sqlite3_column_type(statement, 1);
-    StopIf(col_type != SQLITE_FLOAT, goto EARLY_RETURN, "impossible non-float returned");
+    if (version < OBS_DB_SCHEMA_VERSION) {
+        unsigned num_shards = shard == 0 && config ? config->num_shards : 0;
+        res = obs_db_migrate(db, num_shards);
+        StopIf(res, goto CLEAN_UP_AND_RETURN_ERROR, "unable to upgrade the local store");
+    }
 
-    static_assert(sizeof(sqlite3_int64) <= sizeof(time_t), "time_t too small");
-    sqlite3_int64 timestamp_sql = sqlite3_column_int64(statement, 0);
-    time_t timestamp = timestamp_sql;
+    return db;
 
-    double temperature_f = sqlite3_column_double(statement, 1);
+CLEAN_UP_AND_RETURN_ERROR:
 
-    ob->valid_time = timestamp;
-    ob->temperature_f = temperature_f;
+    res = sqlite3_close(db);
+    if (res != SQLITE_OK) {
+        fprintf(stderr, "error closing sqlite3 database: %s", sqlite3_errstr(res));
+    }
+    return err_return;
+}
 
-    return rc;
+sqlite3 *
+obs_db_open_create(struct ObsStoreConfig const *config)
+{
+    return obs_db_open_file(0, config);
+}
 
-EARLY_RETURN:
+unsigned
+obs_db_shard_of(char const *const site, unsigned num_shards)
+{
+    if (num_shards <= 1) {
+        return 0;
+    }
 
-    *ob = (struct ObsTemperature){0};
-    return rc;
+    // FNV-1a, it only has to spread sites evenly and never change.
+    uint32_t hash = 2166136261u;
+    for (char const *c = site; *c; c++) {
+        hash ^= (unsigned char)tolower(*c);
+        hash *= 16777619u;
+    }
+
+    return hash % num_shards;
 }
 
-static int
-obs_db_query_temperatures_get_hourlies(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
-                                       struct ObsTemperature **hourlies, size_t *num_hourlies)
+int
+obs_db_shards_init(struct ObsDbShards *shards, sqlite3 *main_db,
+                   struct ObsStoreConfig const *config)
 {
-    sqlite3_stmt *statement = 0;
+    *shards = (struct ObsDbShards){.num_shards = 1};
+    shards->dbs[0] = main_db;
+    if (config) {
+        shards->config = *config;
+    }
 
-    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
-    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
+    double value = 0.0;
+    int found = obs_db_get_setting(main_db, OBS_DB_NUM_SHARDS_SETTING, &value);
+    StopIf(found < 0, return -1, "unable to read the number of shards");
+    StopIf(found && (value < 1 || value > OBS_STORE_MAX_SHARDS), return -1,
+           "the local store has %g shards, the most supported is %d", value,
+           OBS_STORE_MAX_SHARDS);
 
-    *hourlies = calloc(num_rows, sizeof(**hourlies));
-    StopIf(!*hourlies, goto ERR_RETURN, "out of memory");
-    struct ObsTemperature *lcl_hourlies = *hourlies;
+    if (found) {
+        shards->num_shards = value;
+    }
 
-    char query[256] = {0};
-    sprintf(query,
-            "SELECT valid_time, t_f "
-            "FROM obs "
-            "WHERE site='%s' "
-            "    AND valid_time >= %ld "
-            "    AND valid_time <= %ld "
-            "ORDER BY valid_time ASC",
-            site, tr.start, tr.end);
+    return 0;
+}
 
-    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
-           query, sqlite3_errstr(rc));
+sqlite3 *
+obs_db_shards_get(struct ObsDbShards *shards, unsigned shard)
+{
+    assert(shard < shards->num_shards);
 
-    while (*num_hourlies < num_rows) {
-        rc = obs_db_query_temperatures_get_hourlies_step_row(statement,
-                                                             &lcl_hourlies[*num_hourlies]);
+    if (!shards->dbs[shard]) {
+        shards->dbs[shard] = obs_db_open_file(shard, &shards->config);
+        StopIf(!shards->dbs[shard], return 0, "unable to open shard %u", shard);
+    }
 
-        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
-               sqlite3_errstr(rc));
+    return shards->dbs[shard];
+}
 
-        if (rc != SQLITE_ROW) {
-            break;
+sqlite3 *
+obs_db_shards_site(struct ObsDbShards *shards, char const *const site)
+{
+    return obs_db_shards_get(shards, obs_db_shard_of(site, shards->num_shards));
+}
+
+void
+obs_db_shards_close(struct ObsDbShards *shards)
+{
+    for (unsigned i = 0; i < OBS_STORE_MAX_SHARDS; i++) {
+        if (shards->dbs[i]) {
+            obs_db_close(shards->dbs[i]);
+            shards->dbs[i] = 0;
         }
+    }
+}
 
-        *num_hourlies += 1;
+/** Make a URI for a file that opens it read only and immutable.
+ *
+ * \returns the URI, which the caller must free with sqlite3_free(), or \c NULL if out of memory.
+ */
+static char *
+obs_db_snapshot_uri(char const *path)
+{
+    // Escape the characters that have a meaning in a URI, the rest are taken literally.
+    size_t len = strlen(path);
+    char *escaped = sqlite3_malloc64(3 * len + 1);
+    StopIf(!escaped, return 0, "out of memory");
+
+    char *c = escaped;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] == '%' || path[i] == '?' || path[i] == '#') {
+            c += sprintf(c, "%%%02X", (unsigned char)path[i]);
+        } else {
+            *c++ = path[i];
+        }
+    }
+    *c = '\0';
+
+    char *uri = sqlite3_mprintf("file:%s?mode=ro&immutable=1", escaped);
+    sqlite3_free(escaped);
+
+    return uri;
+}
+
+sqlite3 *
+obs_db_open_snapshot(char const *path, struct ObsStoreConfig const *config)
+{
+    sqlite3 *db = 0;
+
+    char *uri = obs_db_snapshot_uri(path);
+    StopIf(!uri, return 0, "unable to make a URI for %s", path);
+
+    int res = sqlite3_open_v2(uri, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, 0);
+    sqlite3_free(uri);
+    StopIf(res != SQLITE_OK, goto CLEAN_UP_AND_RETURN_ERROR, "unable to open snapshot %s: %s",
+           path, sqlite3_errstr(res));
+
+    res = obs_db_apply_config(db, config);
+    StopIf(res, goto CLEAN_UP_AND_RETURN_ERROR, "unable to configure the snapshot");
+
+    char *sqlite_error_message = 0;
+    sqlite3_exec(db, "PRAGMA query_only = 1;", 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, sqlite3_free(sqlite_error_message);
+           goto CLEAN_UP_AND_RETURN_ERROR, "unable to make the snapshot query only");
+
+    // A snapshot can't be migrated, it has to be written again by this version.
+    int version = obs_db_user_version(db);
+    StopIf(version != OBS_DB_SCHEMA_VERSION, goto CLEAN_UP_AND_RETURN_ERROR,
+           "snapshot %s has schema %d, this version of obsdb needs %d", path, version,
+           OBS_DB_SCHEMA_VERSION);
+
+    return db;
+
+CLEAN_UP_AND_RETURN_ERROR:
+
+    res = sqlite3_close(db);
+    if (res != SQLITE_OK) {
+        fprintf(stderr, "error closing sqlite3 database: %s", sqlite3_errstr(res));
     }
+    return 0;
+}
+
+int
+obs_db_write_snapshot(sqlite3 *db, char const *path)
+{
+    sqlite3_stmt *statement = 0;
+
+    char *tmp_path = sqlite3_mprintf("%s.tmp", path);
+    StopIf(!tmp_path, return -1, "out of memory");
+
+    // VACUUM INTO won't write over a file, even a leftover from a failed attempt.
+    remove(tmp_path);
+
+    int rc = sqlite3_prepare_v2(db, "VACUUM INTO ?", -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing snapshot: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, tmp_path, -1, SQLITE_STATIC);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding path: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_REMOVE, "error writing snapshot: %s", sqlite3_errmsg(db));
 
     sqlite3_finalize(statement);
+    statement = 0;
+
+    StopIf(rename(tmp_path, path), goto ERR_REMOVE, "unable to replace %s", path);
 
+    sqlite3_free(tmp_path);
     return 0;
 
+ERR_REMOVE:
+    remove(tmp_path);
 ERR_RETURN:
-    free(*hourlies);
-    *hourlies = 0;
-    *num_hourlies = 0;
     sqlite3_finalize(statement);
-
+    sqlite3_free(tmp_path);
     return -1;
 }
 
-static double
-obs_db_query_temperatures_max_min_in_window(struct ObsTemperature **last_start, size_t *len,
-                                            time_t start, time_t end, int max_min_mode)
+/** Clear the hours before \a too_old from the hour bitmaps, to match the rows deleted from obs.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_trim_hour_bitmaps(sqlite3 *db, time_t too_old)
 {
-    double max_min_val = NAN;
+    sqlite3_stmt *statement = 0;
+    struct ObsDbBitmapBlock *edges = 0;
+    size_t num_edges = 0;
 
-    struct ObsTemperature *end_ptr = *last_start + *len;
+    // Only the rows before too_old are deleted, the hour it falls in may still have data.
+    sqlite3_int64 first_hour = too_old / HOURSEC;
+    sqlite3_int64 edge_block = first_hour / OBS_DB_BITMAP_BLOCK_HOURS;
+    size_t first_bit = first_hour % OBS_DB_BITMAP_BLOCK_HOURS;
 
-    for (struct ObsTemperature *next = *last_start; next < end_ptr; next++) {
-        time_t vt = next->valid_time;
-        double val = next->temperature_f;
+    char const *sql = "DELETE FROM hour_bitmaps WHERE block < ?";
 
-        // Remember points that are in the past so we can skip them next time.
-        if (vt < start) {
-            *last_start += 1;
-            *len -= 1;
-            continue;
-        }
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap delete: %s",
+           sqlite3_errstr(rc));
 
-        if (vt > end) {
-            break;
-        }
+    rc = sqlite3_bind_int64(statement, 1, edge_block);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
 
-        if (isnan(max_min_val)) {
-            max_min_val = val;
-        } else if (max_min_mode == OBS_DB_MAX_MODE && val > max_min_val) {
-            max_min_val = val;
-        } else if (max_min_mode == OBS_DB_MIN_MODE && val < max_min_val) {
-            max_min_val = val;
-        }
-    }
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error deleting bitmaps: %s", sqlite3_errstr(rc));
 
-    return max_min_val;
-}
+    sqlite3_finalize(statement);
+    statement = 0;
 
-int
-obs_db_query_temperatures(sqlite3 *db, int max_min_mode, char const *const site,
-                          struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
-                          struct ObsTemperature **results, size_t *num_results)
-{
-    assert(results && !*results && "results is null or points to non-null pointer");
-    assert(*num_results == 0 && "*num_results not initalized to zero");
+    // Collect the blocks straddling the cutoff before changing any of them.
+    sql = "SELECT site, bits FROM hour_bitmaps WHERE block = ?";
 
-    struct ObsTemperature *hourlies = 0;
-    size_t num_hourlies = 0;
+    rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap select: %s",
+           sqlite3_errstr(rc));
 
-    int rc = obs_db_query_temperatures_get_hourlies(db, site, tr, &hourlies, &num_hourlies);
-    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly temperatures");
+    rc = sqlite3_bind_int64(statement, 1, edge_block);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
 
-    size_t calc_num_res = obs_db_query_calculate_num_results(tr, 24);
-    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+    while (first_bit > 0 && (rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        unsigned char const *site = sqlite3_column_text(statement, 0);
+        unsigned char const *bits = sqlite3_column_blob(statement, 1);
+        size_t num_bytes = sqlite3_column_bytes(statement, 1);
+        if (!site || !bits) {
+            continue;
+        }
 
-    *results = calloc(calc_num_res, sizeof(**results));
-    StopIf(!*results, goto ERR_RETURN, "out of memory");
+        struct ObsDbBitmapBlock *new_edges = realloc(edges, (num_edges + 1) * sizeof(*edges));
+        StopIf(!new_edges, goto ERR_RETURN, "out of memory");
+        edges = new_edges;
 
-    struct tm end_prd_tm = *gmtime(&tr.start);
-    end_prd_tm.tm_hour = window_end;
-    end_prd_tm.tm_min = 0;
-    end_prd_tm.tm_sec = 0;
+        struct ObsDbBitmapBlock *edge = &edges[num_edges];
+        num_edges++;
 
-    time_t end_prd = timegm(&end_prd_tm);
-    while (end_prd < tr.start) {
-        end_prd += HOURSEC * 24;
+        *edge = (struct ObsDbBitmapBlock){.block = edge_block};
+        obs_util_strcpy_to_lowercase(sizeof(edge->site), edge->site, (char const *)site);
+        memcpy(edge->bits, bits, num_bytes < sizeof(edge->bits) ? num_bytes : sizeof(edge->bits));
+
+        memset(edge->bits, 0, first_bit / 8);
+        edge->bits[first_bit / 8] &= 0xFFu << (first_bit % 8);
     }
+    StopIf(first_bit > 0 && rc != SQLITE_DONE, goto ERR_RETURN, "error executing bitmap select: %s",
+           sqlite3_errstr(rc));
 
-    struct ObsTemperature *lcl_results = *results;
-    struct ObsTemperature *last_start = hourlies;
-    size_t last_start_size = num_hourlies;
-    while (end_prd < tr.end && *num_results < calc_num_res) {
-        time_t str_prd = end_prd - HOURSEC * window_length;
+    sqlite3_finalize(statement);
+    statement = 0;
 
-        double max_min_t = obs_db_query_temperatures_max_min_in_window(
-            &last_start, &last_start_size, str_prd, end_prd, max_min_mode);
+    sql = "UPDATE hour_bitmaps SET bits = ? WHERE site = ? AND block = ?";
 
-        lcl_results[*num_results].valid_time = end_prd;
-        lcl_results[*num_results].temperature_f = max_min_t;
-        *num_results += 1;
+    rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap update: %s",
+           sqlite3_errstr(rc));
 
-        end_prd += HOURSEC * 24;
-    }
+    for (size_t i = 0; i < num_edges; i++) {
+        sqlite3_reset(statement);
 
-    free(hourlies);
+        rc = sqlite3_bind_blob(statement, 1, edges[i].bits, sizeof(edges[i].bits), 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding bits: %s", sqlite3_errstr(rc));
 
-    return 0;
+        rc = sqlite3_bind_text(statement, 2, edges[i].site, -1, 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
 
-ERR_RETURN:
+        rc = sqlite3_bind_int64(statement, 3, edges[i].block);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
 
-    free(hourlies);
+        rc = sqlite3_step(statement);
+        StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error updating bitmap: %s",
+               sqlite3_errstr(rc));
+    }
 
-    *num_results = 0;
-    free(*results);
-    *results = 0;
+    sqlite3_finalize(statement);
+    free(edges);
+    return 0;
 
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    free(edges);
     return -1;
 }
 
-static int
-obs_db_query_pecipitation_get_hourlies_step_row(sqlite3_stmt *statement,
-                                                struct ObsPrecipitation ob[static 1])
+int
+obs_db_close(sqlite3 *db)
 {
-    int rc = sqlite3_step(statement);
-    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto EARLY_RETURN, "error executing select: %s\n",
-           sqlite3_errstr(rc));
-
-    if (rc == SQLITE_DONE) {
-        goto EARLY_RETURN;
-    }
+    int res = sqlite3_close(db);
+    StopIf(res != SQLITE_OK, return -1, "error closing sqlite3 database: %s", sqlite3_errstr(res));
 
-    int col_type = sqlite3_column_type(statement, 0);
-    StopIf(col_type != SQLITE_INTEGER, goto EARLY_RETURN, "impossible non-integer returned");
+    return 0;
+}
 
-    col_type = sqlite3_column_type(statement, 1);
-    StopIf(col_type != SQLITE_FLOAT, goto EARLY_RETURN, "impossible non-float returned");
+int
+obs_db_maintenance(sqlite3 *db, time_t now)
+{
+    sqlite3_stmt *statement = 0;
 
-    static_assert(sizeof(sqlite3_int64) <= sizeof(time_t), "time_t too small");
-    sqlite3_int64 timestamp_sql = sqlite3_column_int64(statement, 0);
-    time_t timestamp = timestamp_sql;
+    time_t too_old = now - 60 * 60 * 24 * 555; // About 555 days. That's over 1.5 years!
 
-    double precip = sqlite3_column_double(statement, 1);
+    char const *const delete_sql[] = {
+        "DELETE FROM obs WHERE valid_time < ?",
+        "DELETE FROM coverage WHERE end <= ?",
+        // Rows straddling the cutoff would claim the hours deleted above are still stored.
+        "UPDATE OR REPLACE coverage SET start = ?1 WHERE start < ?1 AND end > ?1",
+        "DELETE FROM bad_ranges WHERE end < ?",
+        "DELETE FROM changes WHERE end < ?",
+        "DELETE FROM backfill_jobs "
+        "WHERE submitted < ? AND job_id NOT IN (SELECT job_id FROM backfill_chunks)",
+    };
+
+    int res = obs_db_start_transaction(db);
+    StopIf(res, return -1, "error starting maintenance transaction");
+
+    for (size_t i = 0; i < sizeof(delete_sql) / sizeof(delete_sql[0]); i++) {
+        res = sqlite3_prepare_v2(db, delete_sql[i], -1, &statement, 0);
+        StopIf(res != SQLITE_OK, goto ERR_RETURN, "error preparing delete statement: %s",
+               sqlite3_errstr(res));
+
+        res = sqlite3_bind_int64(statement, 1, too_old);
+        StopIf(res != SQLITE_OK, goto ERR_RETURN, "error binding time in delete: %s",
+               sqlite3_errstr(res));
+
+        res = sqlite3_step(statement);
+        StopIf(res != SQLITE_ROW && res != SQLITE_DONE, goto ERR_RETURN,
+               "error executing delete sql: %s", sqlite3_errstr(res));
+
+        sqlite3_finalize(statement);
+        statement = 0;
+    }
 
-    ob->valid_time = timestamp;
-    ob->precip_in = precip;
+    res = obs_db_trim_hour_bitmaps(db, too_old);
+    StopIf(res, goto ERR_RETURN, "error trimming hour bitmaps");
 
-    return rc;
+    res = obs_db_set_setting(db, OBS_DB_LAST_MAINTENANCE_SETTING, now);
+    StopIf(res, goto ERR_RETURN, "error recording maintenance time");
 
-EARLY_RETURN:
+    return obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
 
-    *ob = (struct ObsPrecipitation){0};
-    return rc;
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+    return -1;
 }
 
-static int
-obs_db_query_precipitation_get_hourlies(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
-                                        struct ObsPrecipitation **hourlies, size_t *num_hourlies)
+size_t
+obs_db_count_rows_in_range(sqlite3 *db, char const *const site, struct ObsTimeRange tr)
 {
     sqlite3_stmt *statement = 0;
 
-    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
-    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
-
-    *hourlies = calloc(num_rows, sizeof(**hourlies));
-    StopIf(!*hourlies, goto ERR_RETURN, "out of memory");
-    struct ObsPrecipitation *lcl_hourlies = *hourlies;
-
     char query[256] = {0};
     sprintf(query,
-            "SELECT valid_time, precip_in_1hr "
+            "SELECT COUNT(valid_time) "
             "FROM obs "
             "WHERE site='%s' "
             "    AND valid_time >= %ld "
-            "    AND valid_time <= %ld "
-            "ORDER BY valid_time ASC",
+            "    AND valid_time <= %ld;",
             site, tr.start, tr.end);
 
     int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
     StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
            query, sqlite3_errstr(rc));
 
-    while (*num_hourlies < num_rows) {
-        rc = obs_db_query_pecipitation_get_hourlies_step_row(statement,
-                                                             &lcl_hourlies[*num_hourlies]);
-
-        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
-               sqlite3_errstr(rc));
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN,
+           "error executing select: %s\n %s\n", query, sqlite3_errstr(rc));
 
-        if (rc != SQLITE_ROW) {
-            break;
-        }
+    int col_type = sqlite3_column_type(statement, 0);
+    StopIf(col_type != SQLITE_INTEGER, goto ERR_RETURN, "impossible non-integer returned");
 
-        *num_hourlies += 1;
-    }
+    static_assert(sizeof(sqlite3_int64) <= sizeof(size_t), "size_t too small");
+    sqlite3_int64 count = sqlite3_column_int64(statement, 0);
+    assert(count >= 0);
 
     sqlite3_finalize(statement);
-
-    return 0;
+    return count;
 
 ERR_RETURN:
-    free(*hourlies);
-    *hourlies = 0;
-    *num_hourlies = 0;
     sqlite3_finalize(statement);
-
-    return -1;
+    return SIZE_MAX;
 }
 
-static double
-obs_db_query_precipitation_accumulation_in_window(struct ObsPrecipitation **last_start, size_t *len,
-                                                  time_t start, time_t end)
+int
+obs_db_last_valid_time(sqlite3 *db, char const *const site, time_t *valid_time)
 {
-    double sum_val = 0.0;
-    int last_hour = -1;
-    double last_hour_val = 0.0;
-    bool trace_flag = false;
+    sqlite3_stmt *statement = 0;
 
-    struct ObsPrecipitation *end_ptr = *last_start + *len;
+    char const *const sql = "SELECT MAX(valid_time) FROM obs WHERE site = ?";
 
-    for (struct ObsPrecipitation *next = *last_start; next < end_ptr; next++) {
-        time_t vt = next->valid_time;
-        double val = next->precip_in;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement: %s",
+           sqlite3_errstr(rc));
 
-        // Remember points that are in the past so we can skip them next time.
-        if (vt < start) {
-            *last_start += 1;
-            *len -= 1;
+    rc = sqlite3_bind_text(statement, 1, site, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "error executing select: %s", sqlite3_errstr(rc));
+
+    int found = 0;
+    if (sqlite3_column_type(statement, 0) == SQLITE_INTEGER) {
+        *valid_time = sqlite3_column_int64(statement, 0);
+        found = 1;
+    }
+
+    sqlite3_finalize(statement);
+    return found;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+/** Load the recorded downloads that overlap a time range.
+ *
+ * A range that was downloaded successfully but has gaps in the data (for instance a station
+ * outage) should not be requested again every time it is queried.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_load_coverage(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                     struct ObsTimeRangeSet *covered)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql = "SELECT start, end FROM coverage "
+                            "WHERE site = ? AND start <= ? AND end >= ?";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing coverage select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        struct ObsTimeRange downloaded = {.start = sqlite3_column_int64(statement, 0),
+                                          .end = sqlite3_column_int64(statement, 1)};
+
+        int err = obs_time_range_set_insert(covered, downloaded);
+        StopIf(err, goto ERR_RETURN, "error collecting coverage");
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error executing coverage select: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+/** Load a site's hour bitmaps for a run of blocks.
+ *
+ * \param bits has room for \ref OBS_DB_BITMAP_BLOCK_BYTES bytes for each block from \a first_block
+ * to \a last_block and is zero filled, blocks that aren't stored are left as zeros.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_load_hour_bits(sqlite3 *db, char const *const site, sqlite3_int64 first_block,
+                      sqlite3_int64 last_block, unsigned char *bits)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql =
+        "SELECT block, bits FROM hour_bitmaps WHERE site = ? AND block >= ? AND block <= ?";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, first_block);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, last_block);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
+
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        sqlite3_int64 block = sqlite3_column_int64(statement, 0);
+        unsigned char const *block_bits = sqlite3_column_blob(statement, 1);
+        size_t num_bytes = sqlite3_column_bytes(statement, 1);
+        if (!block_bits) {
             continue;
         }
 
-        if (vt > end) {
+        if (num_bytes > OBS_DB_BITMAP_BLOCK_BYTES) {
+            num_bytes = OBS_DB_BITMAP_BLOCK_BYTES;
+        }
+
+        memcpy(bits + (block - first_block) * OBS_DB_BITMAP_BLOCK_BYTES, block_bits, num_bytes);
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error executing bitmap select: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+/** Get 64 bits of a little endian bitmap, bit \a word * 64 ends up as the lowest bit. */
+static uint64_t
+obs_db_bits_word(unsigned char const *bits, size_t word)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++) {
+        value |= (uint64_t)bits[8 * word + i] << (8 * i);
+    }
+
+    return value;
+}
+
+/** A mask of the bits in the word holding bit \a index from that bit up. */
+static uint64_t
+obs_db_bits_mask_from(size_t index)
+{
+    return UINT64_MAX << (index % 64);
+}
+
+/** Count the set bits from \a start up to, but not including, \a end. */
+static size_t
+obs_db_bits_count(unsigned char const *bits, size_t start, size_t end)
+{
+    size_t count = 0;
+    for (size_t word = start / 64; word * 64 < end; word++) {
+        uint64_t value = obs_db_bits_word(bits, word);
+        if (word == start / 64) {
+            value &= obs_db_bits_mask_from(start);
+        }
+        if ((word + 1) * 64 > end) {
+            value &= ~obs_db_bits_mask_from(end);
+        }
+
+        count += __builtin_popcountll(value);
+    }
+
+    return count;
+}
+
+/** Find the first bit from \a start up to \a end that is set (or clear if \a set is \c false).
+ *
+ * \returns the index of the bit, or \a end if there isn't one.
+ */
+static size_t
+obs_db_bits_find(unsigned char const *bits, size_t start, size_t end, bool set)
+{
+    for (size_t word = start / 64; word * 64 < end; word++) {
+        uint64_t value = obs_db_bits_word(bits, word);
+        if (!set) {
+            value = ~value;
+        }
+        if (word == start / 64) {
+            value &= obs_db_bits_mask_from(start);
+        }
+
+        if (value) {
+            size_t found = word * 64 + __builtin_ctzll(value);
+            return found < end ? found : end;
+        }
+    }
+
+    return end;
+}
+
+int
+obs_db_missing_ranges(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                      struct ObsTimeRangeSet *missing)
+{
+    assert(db && "null db");
+    assert(site && "null site");
+    assert(tr.start < tr.end && "time range ends before it starts!");
+    assert(tr.start >= 0 && "hour bitmaps only cover times after the epoch");
+    assert(missing && missing->len == 0);
+
+    unsigned char *bits = 0;
+    struct ObsTimeRangeSet covered = {0};
+
+    // Every hour that overlaps the time range, including the one the end falls in.
+    sqlite3_int64 first_block = (tr.start / HOURSEC) / OBS_DB_BITMAP_BLOCK_HOURS;
+    sqlite3_int64 last_block = (tr.end / HOURSEC) / OBS_DB_BITMAP_BLOCK_HOURS;
+    sqlite3_int64 base_hour = first_block * OBS_DB_BITMAP_BLOCK_HOURS;
+    size_t start = tr.start / HOURSEC - base_hour;
+    size_t end = tr.end / HOURSEC - base_hour + 1;
+
+    bits = calloc(last_block - first_block + 1, OBS_DB_BITMAP_BLOCK_BYTES);
+    StopIf(!bits, goto ERR_RETURN, "out of memory");
+
+    int rc = obs_db_load_hour_bits(db, site, first_block, last_block, bits);
+    StopIf(rc, goto ERR_RETURN, "error loading hour bitmaps");
+
+    if (obs_db_bits_count(bits, start, end) == end - start) {
+        // Every hour has data.
+        free(bits);
+        return 0;
+    }
+
+    // Each run of hours without data is a missing range, clipped to the query.
+    size_t gap_start = obs_db_bits_find(bits, start, end, false);
+    while (gap_start < end) {
+        size_t gap_end = obs_db_bits_find(bits, gap_start, end, true);
+
+        struct ObsTimeRange gap = {.start = (base_hour + gap_start) * HOURSEC,
+                                   .end = (base_hour + gap_end) * HOURSEC};
+        if (gap.start < tr.start) {
+            gap.start = tr.start;
+        }
+        if (gap.end > tr.end) {
+            gap.end = tr.end;
+        }
+
+        if (gap.start < gap.end) {
+            int err = obs_time_range_set_insert(missing, gap);
+            StopIf(err, goto ERR_RETURN, "error collecting missing ranges");
+        }
+
+        gap_start = obs_db_bits_find(bits, gap_end, end, false);
+    }
+
+    free(bits);
+    bits = 0;
+
+    if (missing->len == 0) {
+        return 0;
+    }
+
+    // Remove anything an earlier download already covered, there is no data to get for it. What
+    // is left at the edges of the covered ranges, or at the ends of the query, only matters if it
+    // is at least a whole hour.
+    rc = obs_db_load_coverage(db, site, tr, &covered);
+    StopIf(rc, goto ERR_RETURN, "error checking download coverage");
+
+    rc = obs_time_range_set_difference(missing, &covered);
+    StopIf(rc, goto ERR_RETURN, "error removing covered ranges");
+
+    obs_time_range_set_remove_shorter_than(missing, HOURSEC);
+
+    obs_time_range_set_free(&covered);
+    return 0;
+
+ERR_RETURN:
+
+    free(bits);
+    obs_time_range_set_free(&covered);
+    obs_time_range_set_free(missing);
+    return -1;
+}
+
+int
+obs_db_have_inventory(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                      struct ObsTimeRange **missing_ranges, size_t *num_missing_ranges)
+{
+    assert(num_missing_ranges && !*num_missing_ranges && missing_ranges && !*missing_ranges);
+
+    OBS_PROBE3(inventory_entry, site, tr.start, tr.end);
+    double start = obs_util_monotonic_ms();
+
+    int have_data = -1;
+
+    struct ObsTimeRangeSet missing = {0};
+    int rc = obs_db_missing_ranges(db, site, tr, &missing);
+    StopIf(rc, goto RETURN, "error finding missing data");
+
+    obs_latency_record(OBS_LATENCY_INVENTORY, obs_util_monotonic_ms() - start);
+
+    if (missing.len == 0) {
+        // There was no missing time ranges, nothing to return.
+        obs_time_range_set_free(&missing);
+        have_data = 1;
+    } else {
+        // Hand over the set's array.
+        *missing_ranges = missing.ranges;
+        *num_missing_ranges = missing.len;
+        have_data = 0;
+    }
+
+RETURN:
+    OBS_PROBE3(inventory_return, site, *num_missing_ranges, have_data);
+    return have_data;
+}
+
+static size_t
+obs_db_query_calculate_num_results(struct ObsTimeRange tr, unsigned window_increment)
+{
+    double diff_seconds = difftime(tr.end, tr.start);
+    StopIf(diff_seconds < 0.0, return SIZE_MAX, "backwards ObsTimeRange");
+
+    double num_results = (diff_seconds + 1) / HOURSEC / window_increment;
+    StopIf(num_results >= (double)SIZE_MAX / 2.0, return SIZE_MAX,
+           "too many results, something wrong");
+
+    return (size_t)num_results;
+}
+
+static int
+obs_db_query_temperatures_get_hourlies_step_row(sqlite3_stmt *statement,
+                                                struct ObsTemperature ob[static 1])
+{
+    int rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto EARLY_RETURN, "error executing select: %s\n",
+           sqlite3_errstr(rc));
+
+    if (rc == SQLITE_DONE) {
+        goto EARLY_RETURN;
+    }
+
+    int col_type = sqlite3_column_type(statement, 0);
+    StopIf(col_type != SQLITE_INTEGER, goto EARLY_RETURN, "impossible non-integer returned");
+
+    col_type = sqlite3_column_type(statement, 1);
+    StopIf(col_type != SQLITE_FLOAT, goto EARLY_RETURN, "impossible non-float returned");
+
+    static_assert(sizeof(sqlite3_int64) <= sizeof(time_t), "time_t too small");
+    sqlite3_int64 timestamp_sql = sqlite3_column_int64(statement, 0);
+    time_t timestamp = timestamp_sql;
+
+    double temperature_f = sqlite3_column_double(statement, 1);
+
+    ob->valid_time = timestamp;
+    ob->temperature_f = temperature_f;
+
+    return rc;
+
+EARLY_RETURN:
+
+    *ob = (struct ObsTemperature){0};
+    return rc;
+}
+
+static int
+obs_db_query_temperatures_get_hourlies(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                                       struct ObsTemperature **hourlies, size_t *num_hourlies)
+{
+    sqlite3_stmt *statement = 0;
+
+    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
+    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
+
+    *hourlies = calloc(num_rows, sizeof(**hourlies));
+    StopIf(!*hourlies, goto ERR_RETURN, "out of memory");
+    struct ObsTemperature *lcl_hourlies = *hourlies;
+
+    char query[256] = {0};
+    sprintf(query,
+            "SELECT valid_time, t_f "
+            "FROM obs "
+            "WHERE site='%s' "
+            "    AND valid_time >= %ld "
+            "    AND valid_time <= %ld "
+            "ORDER BY valid_time ASC",
+            site, tr.start, tr.end);
+
+    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
+           query, sqlite3_errstr(rc));
+
+    while (*num_hourlies < num_rows) {
+        rc = obs_db_query_temperatures_get_hourlies_step_row(statement,
+                                                             &lcl_hourlies[*num_hourlies]);
+
+        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
+               sqlite3_errstr(rc));
+
+        if (rc != SQLITE_ROW) {
             break;
         }
 
-        if (val < 0.01 && val > 0.0) {
-            trace_flag = true;
-        } else {
-            struct tm vt_tm = *gmtime(&vt);
-            int hour = vt_tm.tm_hour;
-            if (hour != last_hour) {
-                sum_val += last_hour_val;
-            }
-            last_hour = hour;
-            last_hour_val = val;
+        *num_hourlies += 1;
+    }
+
+    sqlite3_finalize(statement);
+
+    return 0;
+
+ERR_RETURN:
+    free(*hourlies);
+    *hourlies = 0;
+    *num_hourlies = 0;
+    sqlite3_finalize(statement);
+
+    return -1;
+}
+
+static double
+obs_db_query_temperatures_max_min_in_window(struct ObsTemperature **last_start, size_t *len,
+                                            time_t start, time_t end, int max_min_mode)
+{
+    double max_min_val = NAN;
+
+    struct ObsTemperature *end_ptr = *last_start + *len;
+
+    for (struct ObsTemperature *next = *last_start; next < end_ptr; next++) {
+        time_t vt = next->valid_time;
+        double val = next->temperature_f;
+
+        // Remember points that are in the past so we can skip them next time.
+        if (vt < start) {
+            *last_start += 1;
+            *len -= 1;
+            continue;
+        }
+
+        if (vt > end) {
+            break;
+        }
+
+        if (isnan(max_min_val)) {
+            max_min_val = val;
+        } else if (max_min_mode == OBS_DB_MAX_MODE && val > max_min_val) {
+            max_min_val = val;
+        } else if (max_min_mode == OBS_DB_MIN_MODE && val < max_min_val) {
+            max_min_val = val;
+        }
+    }
+
+    return max_min_val;
+}
+
+int
+obs_db_query_temperatures(sqlite3 *db, int max_min_mode, char const *const site,
+                          struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
+                          struct ObsTemperature **results, size_t *num_results,
+                          struct ObsDbQueryStats *stats)
+{
+    assert(results && !*results && "results is null or points to non-null pointer");
+    assert(*num_results == 0 && "*num_results not initalized to zero");
+
+    struct ObsTemperature *hourlies = 0;
+    size_t num_hourlies = 0;
+
+    double fetch_start = obs_util_monotonic_ms();
+
+    int rc = obs_db_query_temperatures_get_hourlies(db, site, tr, &hourlies, &num_hourlies);
+    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly temperatures");
+
+    double window_start = obs_util_monotonic_ms();
+
+    size_t calc_num_res = obs_db_query_calculate_num_results(tr, 24);
+    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+
+    *results = calloc(calc_num_res, sizeof(**results));
+    StopIf(!*results, goto ERR_RETURN, "out of memory");
+
+    struct tm end_prd_tm = *gmtime(&tr.start);
+    end_prd_tm.tm_hour = window_end;
+    end_prd_tm.tm_min = 0;
+    end_prd_tm.tm_sec = 0;
+
+    time_t end_prd = timegm(&end_prd_tm);
+    while (end_prd < tr.start) {
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_entry, site, num_hourlies);
+
+    struct ObsTemperature *lcl_results = *results;
+    struct ObsTemperature *last_start = hourlies;
+    size_t last_start_size = num_hourlies;
+    while (end_prd < tr.end && *num_results < calc_num_res) {
+        time_t str_prd = end_prd - HOURSEC * window_length;
+
+        double max_min_t = obs_db_query_temperatures_max_min_in_window(
+            &last_start, &last_start_size, str_prd, end_prd, max_min_mode);
+
+        lcl_results[*num_results].valid_time = end_prd;
+        lcl_results[*num_results].temperature_f = max_min_t;
+        *num_results += 1;
+
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_return, site, *num_results);
+
+    double fetch_ms = window_start - fetch_start;
+    double window_ms = obs_util_monotonic_ms() - window_start;
+    obs_latency_record(OBS_LATENCY_FETCH, fetch_ms);
+    obs_latency_record(OBS_LATENCY_WINDOW, window_ms);
+
+    if (stats) {
+        *stats = (struct ObsDbQueryStats){
+            .fetch_ms = fetch_ms, .window_ms = window_ms, .num_rows = num_hourlies};
+    }
+
+    free(hourlies);
+
+    return 0;
+
+ERR_RETURN:
+
+    free(hourlies);
+
+    *num_results = 0;
+    free(*results);
+    *results = 0;
+
+    return -1;
+}
+
+static int
+obs_db_query_pecipitation_get_hourlies_step_row(sqlite3_stmt *statement,
+                                                struct ObsPrecipitation ob[static 1])
+{
+    int rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto EARLY_RETURN, "error executing select: %s\n",
+           sqlite3_errstr(rc));
+
+    if (rc == SQLITE_DONE) {
+        goto EARLY_RETURN;
+    }
+
+    int col_type = sqlite3_column_type(statement, 0);
+    StopIf(col_type != SQLITE_INTEGER, goto EARLY_RETURN, "impossible non-integer returned");
+
+    col_type = sqlite3_column_type(statement, 1);
+    StopIf(col_type != SQLITE_FLOAT, goto EARLY_RETURN, "impossible non-float returned");
+
+    static_assert(sizeof(sqlite3_int64) <= sizeof(time_t), "time_t too small");
+    sqlite3_int64 timestamp_sql = sqlite3_column_int64(statement, 0);
+    time_t timestamp = timestamp_sql;
+
+    double precip = sqlite3_column_double(statement, 1);
+
+    ob->valid_time = timestamp;
+    ob->precip_in = precip;
+
+    return rc;
+
+EARLY_RETURN:
+
+    *ob = (struct ObsPrecipitation){0};
+    return rc;
+}
+
+static int
+obs_db_query_precipitation_get_hourlies(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                                        struct ObsPrecipitation **hourlies, size_t *num_hourlies)
+{
+    sqlite3_stmt *statement = 0;
+
+    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
+    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
+
+    *hourlies = calloc(num_rows, sizeof(**hourlies));
+    StopIf(!*hourlies, goto ERR_RETURN, "out of memory");
+    struct ObsPrecipitation *lcl_hourlies = *hourlies;
+
+    char query[256] = {0};
+    sprintf(query,
+            "SELECT valid_time, precip_in_1hr "
+            "FROM obs "
+            "WHERE site='%s' "
+            "    AND valid_time >= %ld "
+            "    AND valid_time <= %ld "
+            "ORDER BY valid_time ASC",
+            site, tr.start, tr.end);
+
+    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
+           query, sqlite3_errstr(rc));
+
+    while (*num_hourlies < num_rows) {
+        rc = obs_db_query_pecipitation_get_hourlies_step_row(statement,
+                                                             &lcl_hourlies[*num_hourlies]);
+
+        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
+               sqlite3_errstr(rc));
+
+        if (rc != SQLITE_ROW) {
+            break;
+        }
+
+        *num_hourlies += 1;
+    }
+
+    sqlite3_finalize(statement);
+
+    return 0;
+
+ERR_RETURN:
+    free(*hourlies);
+    *hourlies = 0;
+    *num_hourlies = 0;
+    sqlite3_finalize(statement);
+
+    return -1;
+}
+
+static double
+obs_db_query_precipitation_accumulation_in_window(struct ObsPrecipitation **last_start, size_t *len,
+                                                  time_t start, time_t end)
+{
+    double sum_val = 0.0;
+    int last_hour = -1;
+    double last_hour_val = 0.0;
+    bool trace_flag = false;
+
+    struct ObsPrecipitation *end_ptr = *last_start + *len;
+
+    for (struct ObsPrecipitation *next = *last_start; next < end_ptr; next++) {
+        time_t vt = next->valid_time;
+        double val = next->precip_in;
+
+        // Remember points that are in the past so we can skip them next time.
+        if (vt < start) {
+            *last_start += 1;
+            *len -= 1;
+            continue;
+        }
+
+        if (vt > end) {
+            break;
+        }
+
+        if (val < 0.01 && val > 0.0) {
+            trace_flag = true;
+        } else {
+            struct tm vt_tm = *gmtime(&vt);
+            int hour = vt_tm.tm_hour;
+            if (hour != last_hour) {
+                sum_val += last_hour_val;
+            }
+            last_hour = hour;
+            last_hour_val = val;
+        }
+    }
+
+    sum_val += last_hour_val;
+
+    if (trace_flag && sum_val < 0.005) {
+        return 0.001;
+    }
+
+    return sum_val;
+}
+
+int
+obs_db_query_precipitation(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                           unsigned window_length, unsigned window_increment,
+                           unsigned window_offset, struct ObsPrecipitation **results,
+                           size_t *num_results, struct ObsDbQueryStats *stats)
+{
+    assert(results && !*results && "results is null or points to non-null pointer");
+    assert(*num_results == 0 && "*num_results not initalized to zero");
+
+    struct ObsPrecipitation *hourlies = 0;
+    size_t num_hourlies = 0;
+
+    double fetch_start = obs_util_monotonic_ms();
+
+    int rc = obs_db_query_precipitation_get_hourlies(db, site, tr, &hourlies, &num_hourlies);
+    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly precipitation");
+
+    double window_start = obs_util_monotonic_ms();
+
+    size_t calc_num_res = obs_db_query_calculate_num_results(tr, window_increment);
+    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+
+    *results = calloc(calc_num_res, sizeof(**results));
+    StopIf(!*results, goto ERR_RETURN, "out of memory");
+
+    struct tm end_prd_tm = *gmtime(&tr.start);
+    end_prd_tm.tm_hour = window_offset;
+    end_prd_tm.tm_min = 0;
+    end_prd_tm.tm_sec = 0;
+
+    time_t end_prd = timegm(&end_prd_tm);
+    while (end_prd > tr.start) {
+        end_prd -= HOURSEC * window_increment;
+    }
+    while (end_prd < tr.start) {
+        end_prd += HOURSEC * window_increment;
+    }
+
+    OBS_PROBE2(window_precipitation_entry, site, num_hourlies);
+
+    struct ObsPrecipitation *lcl_results = *results;
+    struct ObsPrecipitation *last_start = hourlies;
+    size_t last_start_size = num_hourlies;
+    while (end_prd < tr.end && *num_results < calc_num_res) {
+        time_t str_prd = end_prd - HOURSEC * window_length;
+        double pcp_accum = obs_db_query_precipitation_accumulation_in_window(
+            &last_start, &last_start_size, str_prd, end_prd);
+
+        lcl_results[*num_results].valid_time = end_prd;
+        lcl_results[*num_results].precip_in = pcp_accum;
+        *num_results += 1;
+
+        end_prd += HOURSEC * window_increment;
+    }
+
+    OBS_PROBE2(window_precipitation_return, site, *num_results);
+
+    double fetch_ms = window_start - fetch_start;
+    double window_ms = obs_util_monotonic_ms() - window_start;
+    obs_latency_record(OBS_LATENCY_FETCH, fetch_ms);
+    obs_latency_record(OBS_LATENCY_WINDOW, window_ms);
+
+    if (stats) {
+        *stats = (struct ObsDbQueryStats){
+            .fetch_ms = fetch_ms, .window_ms = window_ms, .num_rows = num_hourlies};
+    }
+
+    free(hourlies);
+
+    return 0;
+
+ERR_RETURN:
+
+    free(hourlies);
+
+    *num_results = 0;
+    free(*results);
+    *results = 0;
+
+    return -1;
+}
+
+/** Read the temperatures and precipitation of a site in one pass over its rows.
+ *
+ * Rows where a value is \c NULL are left out of that value's array, so the arrays can have
+ * different lengths.
+ *
+ * \returns the number of rows read, or \c SIZE_MAX on error with both arrays set to \c NULL and
+ * their lengths to 0.
+ */
+static size_t
+obs_db_query_daily_summary_get_hourlies(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                                        struct ObsTemperature **temps, size_t *num_temps,
+                                        struct ObsPrecipitation **precip, size_t *num_precip)
+{
+    sqlite3_stmt *statement = 0;
+
+    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
+    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
+
+    *temps = calloc(num_rows ? num_rows : 1, sizeof(**temps));
+    *precip = calloc(num_rows ? num_rows : 1, sizeof(**precip));
+    StopIf(!*temps || !*precip, goto ERR_RETURN, "out of memory");
+
+    char const *const query = "SELECT valid_time, t_f, precip_in_1hr "
+                              "FROM obs "
+                              "WHERE site = ? AND valid_time >= ? AND valid_time <= ? "
+                              "ORDER BY valid_time ASC";
+
+    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
+           query, sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site, -1, SQLITE_STATIC);
+    rc = rc == SQLITE_OK ? sqlite3_bind_int64(statement, 2, tr.start) : rc;
+    rc = rc == SQLITE_OK ? sqlite3_bind_int64(statement, 3, tr.end) : rc;
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding select: %s", sqlite3_errstr(rc));
+
+    size_t num_read = 0;
+    rc = SQLITE_DONE;
+    while (num_read < num_rows && (rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        time_t valid_time = sqlite3_column_int64(statement, 0);
+
+        if (sqlite3_column_type(statement, 1) != SQLITE_NULL) {
+            (*temps)[*num_temps] = (struct ObsTemperature){
+                .valid_time = valid_time, .temperature_f = sqlite3_column_double(statement, 1)};
+            *num_temps += 1;
+        }
+
+        if (sqlite3_column_type(statement, 2) != SQLITE_NULL) {
+            (*precip)[*num_precip] = (struct ObsPrecipitation){
+                .valid_time = valid_time, .precip_in = sqlite3_column_double(statement, 2)};
+            *num_precip += 1;
+        }
+
+        num_read++;
+    }
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+
+    return num_read;
+
+ERR_RETURN:
+    free(*temps);
+    free(*precip);
+    *temps = 0;
+    *precip = 0;
+    *num_temps = 0;
+    *num_precip = 0;
+    sqlite3_finalize(statement);
+
+    return SIZE_MAX;
+}
+
+int
+obs_db_query_daily_summary(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                           unsigned window_end, unsigned window_length,
+                           struct ObsDailySummary **results, size_t *num_results,
+                           struct ObsDbQueryStats *stats)
+{
+    assert(results && !*results && "results is null or points to non-null pointer");
+    assert(*num_results == 0 && "*num_results not initalized to zero");
+
+    struct ObsTemperature *temps = 0;
+    size_t num_temps = 0;
+    struct ObsPrecipitation *precip = 0;
+    size_t num_precip = 0;
+
+    double fetch_start = obs_util_monotonic_ms();
+
+    size_t num_rows = obs_db_query_daily_summary_get_hourlies(db, site, tr, &temps, &num_temps,
+                                                              &precip, &num_precip);
+    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error getting hourly values");
+
+    double window_start = obs_util_monotonic_ms();
+
+    size_t calc_num_res = obs_db_query_calculate_num_results(tr, 24);
+    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+
+    *results = calloc(calc_num_res ? calc_num_res : 1, sizeof(**results));
+    StopIf(!*results, goto ERR_RETURN, "out of memory");
+
+    struct tm end_prd_tm = *gmtime(&tr.start);
+    end_prd_tm.tm_hour = window_end;
+    end_prd_tm.tm_min = 0;
+    end_prd_tm.tm_sec = 0;
+
+    time_t end_prd = timegm(&end_prd_tm);
+    while (end_prd < tr.start) {
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_entry, site, num_temps);
+    OBS_PROBE2(window_precipitation_entry, site, num_precip);
+
+    // The maximum and minimum share a starting point, the first call skips past the old values.
+    struct ObsDailySummary *lcl_results = *results;
+    struct ObsTemperature *t_start = temps;
+    size_t t_start_size = num_temps;
+    struct ObsPrecipitation *p_start = precip;
+    size_t p_start_size = num_precip;
+    while (end_prd < tr.end && *num_results < calc_num_res) {
+        time_t str_prd = end_prd - HOURSEC * window_length;
+
+        double max_t = obs_db_query_temperatures_max_min_in_window(&t_start, &t_start_size, str_prd,
+                                                                   end_prd, OBS_DB_MAX_MODE);
+        double min_t = obs_db_query_temperatures_max_min_in_window(&t_start, &t_start_size, str_prd,
+                                                                   end_prd, OBS_DB_MIN_MODE);
+        double pcp_accum = obs_db_query_precipitation_accumulation_in_window(
+            &p_start, &p_start_size, str_prd, end_prd);
+
+        lcl_results[*num_results] = (struct ObsDailySummary){
+            .valid_time = end_prd, .max_t_f = max_t, .min_t_f = min_t, .precip_in = pcp_accum};
+        *num_results += 1;
+
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_return, site, *num_results);
+    OBS_PROBE2(window_precipitation_return, site, *num_results);
+
+    double fetch_ms = window_start - fetch_start;
+    double window_ms = obs_util_monotonic_ms() - window_start;
+    obs_latency_record(OBS_LATENCY_FETCH, fetch_ms);
+    obs_latency_record(OBS_LATENCY_WINDOW, window_ms);
+
+    if (stats) {
+        *stats = (struct ObsDbQueryStats){
+            .fetch_ms = fetch_ms, .window_ms = window_ms, .num_rows = num_rows};
+    }
+
+    free(temps);
+    free(precip);
+
+    return 0;
+
+ERR_RETURN:
+
+    free(temps);
+    free(precip);
+
+    *num_results = 0;
+    free(*results);
+    *results = 0;
+
+    return -1;
+}
+
+/** An hourly value in the layout used by the compact queries.
+ *
+ * It is half the size of an \ref ObsTemperature, so the window loops read half as many bytes.
+ */
+struct ObsDbCompactHourly {
+    uint32_t offset; /**< The valid time in seconds after the start of the range that was read. */
+    float value;     /**< The temperature in Fahrenheit or precipitation in inches. */
+};
+
+/** Read one column of a site's observations into the compact layout.
+ *
+ * \param column is \c "t_f" or \c "precip_in_1hr". Rows where it is \c NULL are left out.
+ *
+ * \returns 0 on success, or -1 on error with \a hourlies set to \c NULL and \a num_hourlies to 0.
+ */
+static int
+obs_db_query_get_compact_hourlies(sqlite3 *db, char const *const site, char const *const column,
+                                  struct ObsTimeRange tr, struct ObsDbCompactHourly **hourlies,
+                                  size_t *num_hourlies)
+{
+    sqlite3_stmt *statement = 0;
+
+    StopIf(difftime(tr.end, tr.start) > UINT32_MAX, goto ERR_RETURN,
+           "time range too long for a compact query");
+
+    size_t num_rows = obs_db_count_rows_in_range(db, site, tr);
+    StopIf(num_rows == SIZE_MAX, goto ERR_RETURN, "error counting number of rows");
+
+    *hourlies = calloc(num_rows ? num_rows : 1, sizeof(**hourlies));
+    StopIf(!*hourlies, goto ERR_RETURN, "out of memory");
+
+    char query[192] = {0};
+    sprintf(query,
+            "SELECT valid_time, %s "
+            "FROM obs "
+            "WHERE site = ? AND valid_time >= ? AND valid_time <= ? AND %s IS NOT NULL "
+            "ORDER BY valid_time ASC",
+            column, column);
+
+    int rc = sqlite3_prepare_v2(db, query, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing select statement:\n     %s\n     %s",
+           query, sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site, -1, SQLITE_STATIC);
+    rc = rc == SQLITE_OK ? sqlite3_bind_int64(statement, 2, tr.start) : rc;
+    rc = rc == SQLITE_OK ? sqlite3_bind_int64(statement, 3, tr.end) : rc;
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding select: %s", sqlite3_errstr(rc));
+
+    rc = SQLITE_DONE;
+    while (*num_hourlies < num_rows && (rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        time_t valid_time = sqlite3_column_int64(statement, 0);
+        (*hourlies)[*num_hourlies] = (struct ObsDbCompactHourly){
+            .offset = valid_time - tr.start, .value = sqlite3_column_double(statement, 1)};
+        *num_hourlies += 1;
+    }
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN, "database error: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+
+    return 0;
+
+ERR_RETURN:
+    free(*hourlies);
+    *hourlies = 0;
+    *num_hourlies = 0;
+    sqlite3_finalize(statement);
+
+    return -1;
+}
+
+/** The compact version of obs_db_query_temperatures_max_min_in_window().
+ *
+ * \param start and \param end are in seconds after the start of the range that was read.
+ */
+static float
+obs_db_query_compact_max_min_in_window(struct ObsDbCompactHourly **last_start, size_t *len,
+                                       int64_t start, int64_t end, int max_min_mode)
+{
+    float max_min_val = NAN;
+
+    struct ObsDbCompactHourly *end_ptr = *last_start + *len;
+
+    for (struct ObsDbCompactHourly *next = *last_start; next < end_ptr; next++) {
+        int64_t vt = next->offset;
+        float val = next->value;
+
+        // Remember points that are in the past so we can skip them next time.
+        if (vt < start) {
+            *last_start += 1;
+            *len -= 1;
+            continue;
+        }
+
+        if (vt > end) {
+            break;
+        }
+
+        if (isnan(max_min_val)) {
+            max_min_val = val;
+        } else if (max_min_mode == OBS_DB_MAX_MODE && val > max_min_val) {
+            max_min_val = val;
+        } else if (max_min_mode == OBS_DB_MIN_MODE && val < max_min_val) {
+            max_min_val = val;
+        }
+    }
+
+    return max_min_val;
+}
+
+int
+obs_db_query_temperatures_compact(sqlite3 *db, int max_min_mode, char const *const site,
+                                  struct ObsTimeRange tr, unsigned window_end,
+                                  unsigned window_length, struct ObsTemperatureCompact **results,
+                                  size_t *num_results, struct ObsDbQueryStats *stats)
+{
+    assert(results && !*results && "results is null or points to non-null pointer");
+    assert(*num_results == 0 && "*num_results not initalized to zero");
+
+    struct ObsDbCompactHourly *hourlies = 0;
+    size_t num_hourlies = 0;
+
+    double fetch_start = obs_util_monotonic_ms();
+
+    int rc = obs_db_query_get_compact_hourlies(db, site, "t_f", tr, &hourlies, &num_hourlies);
+    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly temperatures");
+
+    double window_start = obs_util_monotonic_ms();
+
+    size_t calc_num_res = obs_db_query_calculate_num_results(tr, 24);
+    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+
+    *results = calloc(calc_num_res ? calc_num_res : 1, sizeof(**results));
+    StopIf(!*results, goto ERR_RETURN, "out of memory");
+
+    struct tm end_prd_tm = *gmtime(&tr.start);
+    end_prd_tm.tm_hour = window_end;
+    end_prd_tm.tm_min = 0;
+    end_prd_tm.tm_sec = 0;
+
+    time_t end_prd = timegm(&end_prd_tm);
+    while (end_prd < tr.start) {
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_entry, site, num_hourlies);
+
+    struct ObsTemperatureCompact *lcl_results = *results;
+    struct ObsDbCompactHourly *last_start = hourlies;
+    size_t last_start_size = num_hourlies;
+    while (end_prd < tr.end && *num_results < calc_num_res) {
+        int64_t end_offset = end_prd - tr.start;
+        int64_t str_offset = end_offset - HOURSEC * window_length;
+
+        float max_min_t = obs_db_query_compact_max_min_in_window(
+            &last_start, &last_start_size, str_offset, end_offset, max_min_mode);
+
+        lcl_results[*num_results].valid_hour = end_prd / HOURSEC;
+        lcl_results[*num_results].temperature_f = max_min_t;
+        *num_results += 1;
+
+        end_prd += HOURSEC * 24;
+    }
+
+    OBS_PROBE2(window_temperature_return, site, *num_results);
+
+    double fetch_ms = window_start - fetch_start;
+    double window_ms = obs_util_monotonic_ms() - window_start;
+    obs_latency_record(OBS_LATENCY_FETCH, fetch_ms);
+    obs_latency_record(OBS_LATENCY_WINDOW, window_ms);
+
+    if (stats) {
+        *stats = (struct ObsDbQueryStats){
+            .fetch_ms = fetch_ms, .window_ms = window_ms, .num_rows = num_hourlies};
+    }
+
+    free(hourlies);
+
+    return 0;
+
+ERR_RETURN:
+
+    free(hourlies);
+
+    *num_results = 0;
+    free(*results);
+    *results = 0;
+
+    return -1;
+}
+
+/** The compact version of obs_db_query_precipitation_accumulation_in_window().
+ *
+ * \param base is the start of the range that was read.
+ * \param start and \param end are in seconds after \a base.
+ */
+static float
+obs_db_query_compact_accumulation_in_window(struct ObsDbCompactHourly **last_start, size_t *len,
+                                            time_t base, int64_t start, int64_t end)
+{
+    // Sum in double so the total is rounded to float only once.
+    double sum_val = 0.0;
+    int last_hour = -1;
+    float last_hour_val = 0.0f;
+    bool trace_flag = false;
+
+    struct ObsDbCompactHourly *end_ptr = *last_start + *len;
+
+    for (struct ObsDbCompactHourly *next = *last_start; next < end_ptr; next++) {
+        int64_t vt = next->offset;
+        float val = next->value;
+
+        // Remember points that are in the past so we can skip them next time.
+        if (vt < start) {
+            *last_start += 1;
+            *len -= 1;
+            continue;
+        }
+
+        if (vt > end) {
+            break;
+        }
+
+        // Compare in float, 0.01 is stored as 0.01f which is below 0.01 as a double.
+        if (val < 0.01f && val > 0.0f) {
+            trace_flag = true;
+        } else {
+            // The hour of the day, the same as gmtime() gives.
+            int hour = ((base + vt) / HOURSEC) % 24;
+            if (hour != last_hour) {
+                sum_val += last_hour_val;
+            }
+            last_hour = hour;
+            last_hour_val = val;
+        }
+    }
+
+    sum_val += last_hour_val;
+
+    if (trace_flag && sum_val < 0.005) {
+        return 0.001f;
+    }
+
+    return sum_val;
+}
+
+int
+obs_db_query_precipitation_compact(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
+                                   unsigned window_length, unsigned window_increment,
+                                   unsigned window_offset, struct ObsPrecipitationCompact **results,
+                                   size_t *num_results, struct ObsDbQueryStats *stats)
+{
+    assert(results && !*results && "results is null or points to non-null pointer");
+    assert(*num_results == 0 && "*num_results not initalized to zero");
+
+    struct ObsDbCompactHourly *hourlies = 0;
+    size_t num_hourlies = 0;
+
+    double fetch_start = obs_util_monotonic_ms();
+
+    int rc = obs_db_query_get_compact_hourlies(db, site, "precip_in_1hr", tr, &hourlies,
+                                               &num_hourlies);
+    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly precipitation");
+
+    double window_start = obs_util_monotonic_ms();
+
+    size_t calc_num_res = obs_db_query_calculate_num_results(tr, window_increment);
+    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+
+    *results = calloc(calc_num_res ? calc_num_res : 1, sizeof(**results));
+    StopIf(!*results, goto ERR_RETURN, "out of memory");
+
+    struct tm end_prd_tm = *gmtime(&tr.start);
+    end_prd_tm.tm_hour = window_offset;
+    end_prd_tm.tm_min = 0;
+    end_prd_tm.tm_sec = 0;
+
+    time_t end_prd = timegm(&end_prd_tm);
+    while (end_prd > tr.start) {
+        end_prd -= HOURSEC * window_increment;
+    }
+    while (end_prd < tr.start) {
+        end_prd += HOURSEC * window_increment;
+    }
+
+    OBS_PROBE2(window_precipitation_entry, site, num_hourlies);
+
+    struct ObsPrecipitationCompact *lcl_results = *results;
+    struct ObsDbCompactHourly *last_start = hourlies;
+    size_t last_start_size = num_hourlies;
+    while (end_prd < tr.end && *num_results < calc_num_res) {
+        int64_t end_offset = end_prd - tr.start;
+        int64_t str_offset = end_offset - HOURSEC * window_length;
+
+        float pcp_accum = obs_db_query_compact_accumulation_in_window(
+            &last_start, &last_start_size, tr.start, str_offset, end_offset);
+
+        lcl_results[*num_results].valid_hour = end_prd / HOURSEC;
+        lcl_results[*num_results].precip_in = pcp_accum;
+        *num_results += 1;
+
+        end_prd += HOURSEC * window_increment;
+    }
+
+    OBS_PROBE2(window_precipitation_return, site, *num_results);
+
+    double fetch_ms = window_start - fetch_start;
+    double window_ms = obs_util_monotonic_ms() - window_start;
+    obs_latency_record(OBS_LATENCY_FETCH, fetch_ms);
+    obs_latency_record(OBS_LATENCY_WINDOW, window_ms);
+
+    if (stats) {
+        *stats = (struct ObsDbQueryStats){
+            .fetch_ms = fetch_ms, .window_ms = window_ms, .num_rows = num_hourlies};
+    }
+
+    free(hourlies);
+
+    return 0;
+
+ERR_RETURN:
+
+    free(hourlies);
+
+    *num_results = 0;
+    free(*results);
+    *results = 0;
+
+    return -1;
+}
+
+int
+obs_db_start_transaction(sqlite3 *db)
+{
+    char *sqlite_error_message = 0;
+    sqlite3_exec(db, "BEGIN TRANSACTION;", 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, goto ERR_RETURN, "error starting transaction: %s",
+           sqlite_error_message);
+
+    return 0;
+
+ERR_RETURN:
+
+    sqlite3_free(sqlite_error_message);
+    return -1;
+}
+
+int
+obs_db_finish_transaction(sqlite3 *db, int action)
+{
+    char *sqlite_error_message = 0;
+    char *sql = 0;
+
+    if (action == OBS_DB_TRANSACTION_ROLLBACK) {
+        sql = "ROLLBACK TRANSACTION;";
+    } else if (action == OBS_DB_TRANSACTION_COMMIT) {
+        sql = "COMMIT TRANSACTION;";
+    } else {
+        StopIf(true, goto ERR_RETURN, "inavlid action in obs_db_finish_transaction");
+    }
+
+    sqlite3_exec(db, sql, 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, goto ERR_RETURN, "error finishing transaction: %s",
+           sqlite_error_message);
+
+    return 0;
+
+ERR_RETURN:
+
+    sqlite3_free(sqlite_error_message);
+    return -1;
+}
+
+struct ObsDbInserter {
+    sqlite3 *db;               /**< The database inserted into. */
+    sqlite3_stmt *insert_stmt; /**< Inserts rows into the obs table. */
+
+    struct ObsDbBitmapBlock *blocks; /**< The bitmap updates that haven't been written yet. */
+    size_t num_blocks;               /**< The number of entries used in \ref blocks. */
+    size_t capacity;                 /**< The allocated length of \ref blocks. */
+
+    struct ObsDbChange *changes; /**< The change log entries that haven't been written yet. */
+    size_t num_changes;          /**< The number of entries used in \ref changes. */
+    size_t changes_capacity;     /**< The allocated length of \ref changes. */
+};
+
+struct ObsDbInserter *
+obs_db_create_inserter(sqlite3 *db)
+{
+    struct ObsDbInserter *inserter = calloc(1, sizeof(*inserter));
+    StopIf(!inserter, return 0, "out of memory");
+
+    inserter->db = db;
+
+    char const *const sql = "INSERT OR REPLACE INTO obs ( \n"
+                            "  valid_time,                \n"
+                            "  site,                      \n"
+                            "  t_f,                       \n"
+                            "  precip_in_1hr)             \n"
+                            "VALUES (?,?,?,?);            \n";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &inserter->insert_stmt, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error creating sqlite3_stmt: %s", sqlite3_errstr(rc));
+
+    return inserter;
+
+ERR_RETURN:
+
+    obs_db_finalize_inserter(inserter);
+    return 0;
+}
+
+void
+obs_db_finalize_inserter(struct ObsDbInserter *inserter)
+{
+    if (inserter) {
+        sqlite3_finalize(inserter->insert_stmt);
+        free(inserter->blocks);
+        free(inserter->changes);
+        free(inserter);
+    }
+
+    return;
+}
+
+/** Set the bit for the hour of \a valid_time in the pending bitmap updates for a site.
+ *
+ * \returns 0 on success, or -1 if memory couldn't be allocated.
+ */
+static int
+obs_db_inserter_mark(struct ObsDbInserter *inserter, char const *const site, time_t valid_time)
+{
+    assert(valid_time >= 0 && "hour bitmaps only cover times after the epoch");
+
+    sqlite3_int64 hour = valid_time / HOURSEC;
+    sqlite3_int64 block = hour / OBS_DB_BITMAP_BLOCK_HOURS;
+    size_t bit = hour % OBS_DB_BITMAP_BLOCK_HOURS;
+
+    // Downloads arrive one site at a time in time order, so this almost always stops right away.
+    struct ObsDbBitmapBlock *entry = 0;
+    for (size_t i = inserter->num_blocks; i > 0; i--) {
+        struct ObsDbBitmapBlock *candidate = &inserter->blocks[i - 1];
+        if (candidate->block == block && strcmp(candidate->site, site) == 0) {
+            entry = candidate;
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (inserter->num_blocks == inserter->capacity) {
+            size_t new_capacity = inserter->capacity ? 2 * inserter->capacity : 8;
+            struct ObsDbBitmapBlock *new_blocks =
+                realloc(inserter->blocks, new_capacity * sizeof(*new_blocks));
+            StopIf(!new_blocks, return -1, "out of memory");
+
+            inserter->blocks = new_blocks;
+            inserter->capacity = new_capacity;
+        }
+
+        entry = &inserter->blocks[inserter->num_blocks];
+        inserter->num_blocks++;
+
+        memset(entry, 0, sizeof(*entry));
+        obs_util_strcpy_to_lowercase(sizeof(entry->site), entry->site, site);
+        entry->block = block;
+    }
+
+    entry->bits[bit / 8] |= 1u << (bit % 8);
+    return 0;
+}
+
+/** Extend the pending change log entry for a site to include \a valid_time.
+ *
+ * \returns 0 on success, or -1 if memory couldn't be allocated.
+ */
+static int
+obs_db_inserter_log(struct ObsDbInserter *inserter, char const *const site, time_t valid_time)
+{
+    // Like the bitmaps, the rows of one site almost always arrive together.
+    struct ObsDbChange *entry = 0;
+    for (size_t i = inserter->num_changes; i > 0; i--) {
+        if (strcmp(inserter->changes[i - 1].site, site) == 0) {
+            entry = &inserter->changes[i - 1];
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (inserter->num_changes == inserter->changes_capacity) {
+            size_t new_capacity = inserter->changes_capacity ? 2 * inserter->changes_capacity : 8;
+            struct ObsDbChange *new_changes =
+                realloc(inserter->changes, new_capacity * sizeof(*new_changes));
+            StopIf(!new_changes, return -1, "out of memory");
+
+            inserter->changes = new_changes;
+            inserter->changes_capacity = new_capacity;
+        }
+
+        entry = &inserter->changes[inserter->num_changes];
+        inserter->num_changes++;
+
+        *entry = (struct ObsDbChange){.start = valid_time, .end = valid_time};
+        snprintf(entry->site, sizeof(entry->site), "%s", site);
+    }
+
+    if (valid_time < entry->start) {
+        entry->start = valid_time;
+    }
+    if (valid_time > entry->end) {
+        entry->end = valid_time;
+    }
+
+    return 0;
+}
+
+/** Add an entry to the change log.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_log_change(sqlite3 *db, int kind, char const *const site_id, struct ObsTimeRange tr)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql = "INSERT INTO changes (kind, site, start, end) VALUES (?,?,?,?)";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing change insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int(statement, 1, kind);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding kind: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 2, site_id, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 4, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error logging change: %s", sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_insert(struct ObsDbInserter *inserter, time_t valid_time, char const *const site_id,
+              double temperature_f, double precip_inches)
+{
+    sqlite3_stmt *insert_stmt = inserter->insert_stmt;
+
+    sqlite3_reset(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+
+    int rc = sqlite3_bind_int64(insert_stmt, 1, valid_time);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding valid_time: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(insert_stmt, 2, site_id, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_double(insert_stmt, 3, temperature_f);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding t_f: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_double(insert_stmt, 4, precip_inches);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding p_in: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(insert_stmt);
+    StopIf(rc != SQLITE_OK && rc != SQLITE_DONE, goto ERR_RETURN,
+           "error stepping sqlite statement: %s", sqlite3_errstr(rc));
+
+    rc = obs_db_inserter_log(inserter, site_id, valid_time);
+    StopIf(rc, goto ERR_RETURN, "error collecting change log entries");
+
+    return obs_db_inserter_mark(inserter, site_id, valid_time);
+
+ERR_RETURN:
+    return -1;
+}
+
+int
+obs_db_inserter_flush(struct ObsDbInserter *inserter)
+{
+    sqlite3_stmt *select_stmt = 0;
+    sqlite3_stmt *replace_stmt = 0;
+
+    // The insert statement must not be in progress when the transaction is committed.
+    sqlite3_reset(inserter->insert_stmt);
+
+    for (size_t i = 0; i < inserter->num_changes; i++) {
+        struct ObsDbChange const *change = &inserter->changes[i];
+        struct ObsTimeRange tr = {.start = change->start, .end = change->end};
+
+        int rc = obs_db_log_change(inserter->db, OBS_DB_CHANGE_ROWS, change->site, tr);
+        StopIf(rc, return -1, "error saving the change log");
+    }
+    inserter->num_changes = 0;
+
+    if (inserter->num_blocks == 0) {
+        return 0;
+    }
+
+    char const *const select_sql = "SELECT bits FROM hour_bitmaps WHERE site = ? AND block = ?";
+    char const *const replace_sql =
+        "INSERT OR REPLACE INTO hour_bitmaps (site, block, bits) VALUES (?,?,?)";
+
+    int rc = sqlite3_prepare_v2(inserter->db, select_sql, -1, &select_stmt, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_prepare_v2(inserter->db, replace_sql, -1, &replace_stmt, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bitmap insert: %s",
+           sqlite3_errstr(rc));
+
+    for (size_t i = 0; i < inserter->num_blocks; i++) {
+        struct ObsDbBitmapBlock *entry = &inserter->blocks[i];
+
+        sqlite3_reset(select_stmt);
+        sqlite3_reset(replace_stmt);
+
+        rc = sqlite3_bind_text(select_stmt, 1, entry->site, -1, 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_int64(select_stmt, 2, entry->block);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_step(select_stmt);
+        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN,
+               "error executing bitmap select: %s", sqlite3_errstr(rc));
+
+        if (rc == SQLITE_ROW) {
+            unsigned char const *old_bits = sqlite3_column_blob(select_stmt, 0);
+            int num_bytes = sqlite3_column_bytes(select_stmt, 0);
+            for (int j = 0; old_bits && j < num_bytes && j < OBS_DB_BITMAP_BLOCK_BYTES; j++) {
+                entry->bits[j] |= old_bits[j];
+            }
+        }
+
+        rc = sqlite3_bind_text(replace_stmt, 1, entry->site, -1, 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_int64(replace_stmt, 2, entry->block);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding block: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_blob(replace_stmt, 3, entry->bits, sizeof(entry->bits), 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding bits: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_step(replace_stmt);
+        StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error saving hour bitmap: %s",
+               sqlite3_errstr(rc));
+    }
+
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(replace_stmt);
+
+    inserter->num_blocks = 0;
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(replace_stmt);
+    return -1;
+}
+
+/** Fill in the hour_bitmaps table from the obs table, for stores created before it existed.
+ *
+ * This is part of a migration, so it must be called inside a transaction.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_build_hour_bitmaps(sqlite3 *db)
+{
+    sqlite3_stmt *statement = 0;
+    struct ObsDbInserter builder = {.db = db};
+
+    // This is the primary key order, so it is a straight walk through the index.
+    char const *const sql = "SELECT site, valid_time FROM obs ORDER BY site, valid_time";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing obs select: %s", sqlite3_errstr(rc));
+
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        unsigned char const *site = sqlite3_column_text(statement, 0);
+        time_t valid_time = sqlite3_column_int64(statement, 1);
+        if (!site || valid_time < 0) {
+            continue;
+        }
+
+        int err = obs_db_inserter_mark(&builder, (char const *)site, valid_time);
+        StopIf(err, goto ERR_RETURN, "error collecting hour bitmaps");
+
+        if (builder.num_blocks >= OBS_DB_BITMAP_BUILD_BATCH) {
+            err = obs_db_inserter_flush(&builder);
+            StopIf(err, goto ERR_RETURN, "error saving hour bitmaps");
+        }
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error executing obs select: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    rc = obs_db_inserter_flush(&builder);
+    StopIf(rc, goto ERR_RETURN, "error saving hour bitmaps");
+
+    free(builder.blocks);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    free(builder.blocks);
+    return -1;
+}
+
+int
+obs_db_add_coverage(sqlite3 *db, char const *const site_id, struct ObsTimeRange tr)
+{
+    sqlite3_stmt *statement = 0;
+
+    // Checkpoints of a long download record longer and longer ranges, only keep the latest one.
+    char const *sql = "DELETE FROM coverage WHERE site = ? AND start >= ? AND end <= ?";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing coverage delete: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site_id, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error deleting coverage: %s", sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    sql = "INSERT OR REPLACE INTO coverage (site, start, end) VALUES (?,?,?)";
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing coverage insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site_id, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error inserting coverage: %s", sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+
+    return obs_db_log_change(db, OBS_DB_CHANGE_COVERAGE, site_id, tr);
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_get_setting(sqlite3 *db, char const *const name, double *value)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql = "SELECT value FROM settings WHERE name = ?";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing settings select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, name, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding name: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN,
+           "error executing settings select: %s", sqlite3_errstr(rc));
+
+    int found = 0;
+    if (rc == SQLITE_ROW && sqlite3_column_type(statement, 0) != SQLITE_NULL) {
+        *value = sqlite3_column_double(statement, 0);
+        found = 1;
+    }
+
+    sqlite3_finalize(statement);
+    return found;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_set_setting(sqlite3 *db, char const *const name, double value)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql = "INSERT OR REPLACE INTO settings (name, value) VALUES (?,?)";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing settings insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, name, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding name: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_double(statement, 2, value);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding value: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error saving setting %s: %s", name,
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_add_bad_range(sqlite3 *db, char const *const site_id, struct ObsTimeRange tr,
+                     char const *const reason)
+{
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql =
+        "INSERT OR REPLACE INTO bad_ranges (site, start, end, reason) VALUES (?,?,?,?)";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing bad range insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 1, site_id, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 4, reason, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding reason: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error inserting bad range: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+
+    // Don't keep trying to download it.
+    return obs_db_add_coverage(db, site_id, tr);
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_backfill_add_job(sqlite3 *db, size_t num_chunks,
+                        struct ObsDbBackfillChunk chunks[num_chunks], long *job_id)
+{
+    assert(db);
+    assert(job_id);
+
+    sqlite3_stmt *statement = 0;
+
+    int rc = obs_db_start_transaction(db);
+    StopIf(rc, return -1, "error starting backfill job transaction");
+
+    char const *const job_sql = "INSERT INTO backfill_jobs (num_chunks, submitted) VALUES (?,?)";
+
+    rc = sqlite3_prepare_v2(db, job_sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing backfill job insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 1, num_chunks);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding num_chunks: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, time(0));
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding submitted: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error inserting backfill job: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    *job_id = sqlite3_last_insert_rowid(db);
+
+    char const *const chunk_sql =
+        "INSERT OR REPLACE INTO backfill_chunks (job_id, site, start, end) VALUES (?,?,?,?)";
+
+    rc = sqlite3_prepare_v2(db, chunk_sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing backfill chunk insert: %s",
+           sqlite3_errstr(rc));
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i].job_id = *job_id;
+
+        rc = sqlite3_bind_int64(statement, 1, chunks[i].job_id);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding job_id: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_text(statement, 2, chunks[i].site, -1, 0);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_int64(statement, 3, chunks[i].time_range.start);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_bind_int64(statement, 4, chunks[i].time_range.end);
+        StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
+
+        rc = sqlite3_step(statement);
+        StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error inserting backfill chunk: %s",
+               sqlite3_errstr(rc));
+
+        sqlite3_reset(statement);
+    }
+
+    sqlite3_finalize(statement);
+
+    return obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+    return -1;
+}
+
+size_t
+obs_db_backfill_next(sqlite3 *db, unsigned max_attempts, size_t max_chunks,
+                     struct ObsDbBackfillChunk chunks[max_chunks])
+{
+    assert(db);
+    assert(max_chunks > 0);
+
+    sqlite3_stmt *statement = 0;
+
+    // Chunks that failed go to the back of the queue, and sites with the same time range in the
+    // same job are handed out together so they can share a request.
+    char const *const sql =
+        "SELECT job_id, site, start, end FROM backfill_chunks "
+        "WHERE attempts < ?1 AND (job_id, start, end) = ("
+        "    SELECT job_id, start, end FROM backfill_chunks "
+        "    WHERE attempts < ?1 "
+        "    ORDER BY attempts ASC, job_id ASC, start ASC LIMIT 1) "
+        "ORDER BY site ASC LIMIT ?2";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing backfill select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int(statement, 1, max_attempts);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding attempts: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, max_chunks);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding limit: %s", sqlite3_errstr(rc));
+
+    size_t num_chunks = 0;
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        struct ObsDbBackfillChunk *chunk = &chunks[num_chunks];
+
+        chunk->job_id = sqlite3_column_int64(statement, 0);
+
+        unsigned char const *site = sqlite3_column_text(statement, 1);
+        StopIf(!site, goto ERR_RETURN, "NULL site in backfill_chunks");
+        obs_util_strcpy_to_lowercase(sizeof(chunk->site), chunk->site, (char const *)site);
+
+        chunk->time_range.start = sqlite3_column_int64(statement, 2);
+        chunk->time_range.end = sqlite3_column_int64(statement, 3);
+
+        num_chunks++;
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error executing backfill select: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return num_chunks;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return SIZE_MAX;
+}
+
+int
+obs_db_backfill_finish_chunk(sqlite3 *db, struct ObsDbBackfillChunk const *chunk, bool success)
+{
+    assert(db);
+    assert(chunk);
+
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql =
+        success ? "DELETE FROM backfill_chunks WHERE job_id = ? AND site = ? AND start = ?"
+                : "UPDATE backfill_chunks SET attempts = attempts + 1 "
+                  "WHERE job_id = ? AND site = ? AND start = ?";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing backfill update: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 1, chunk->job_id);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding job_id: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_text(statement, 2, chunk->site, -1, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, chunk->time_range.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error updating backfill chunk: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+int
+obs_db_backfill_job_status(sqlite3 *db, long job_id, unsigned max_attempts, size_t *num_done,
+                           size_t *num_failed, size_t *num_chunks)
+{
+    assert(db);
+    assert(num_done && num_failed && num_chunks);
+
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql =
+        "SELECT num_chunks, "
+        "    (SELECT COUNT(*) FROM backfill_chunks c WHERE c.job_id = j.job_id), "
+        "    (SELECT COUNT(*) FROM backfill_chunks c WHERE c.job_id = j.job_id "
+        "        AND c.attempts >= ?2) "
+        "FROM backfill_jobs j WHERE j.job_id = ?1";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing backfill status select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 1, job_id);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding job_id: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int(statement, 2, max_attempts);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding attempts: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, goto ERR_RETURN,
+           "error executing backfill status select: %s", sqlite3_errstr(rc));
+
+    int found = 0;
+    if (rc == SQLITE_ROW) {
+        size_t total = sqlite3_column_int64(statement, 0);
+        size_t remaining = sqlite3_column_int64(statement, 1);
+
+        *num_chunks = total;
+        *num_failed = sqlite3_column_int64(statement, 2);
+        *num_done = total > remaining ? total - remaining : 0;
+        found = 1;
+    }
+
+    sqlite3_finalize(statement);
+    return found;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
+
+size_t
+obs_db_list_sites(sqlite3 *db, char (**sites)[OBS_DB_SITE_ID_LEN])
+{
+    assert(db && sites);
+
+    sqlite3_stmt *statement = 0;
+    size_t num_sites = 0;
+    size_t capacity = 0;
+    *sites = 0;
+
+    char const *const sql = "SELECT DISTINCT site FROM obs ORDER BY site";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing site select: %s",
+           sqlite3_errstr(rc));
+
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        if (num_sites == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            char(*new_sites)[OBS_DB_SITE_ID_LEN] = realloc(*sites, capacity * sizeof(**sites));
+            StopIf(!new_sites, goto ERR_RETURN, "out of memory");
+            *sites = new_sites;
         }
-    }
 
-    sum_val += last_hour_val;
+        char const *site = (char const *)sqlite3_column_text(statement, 0);
+        StopIf(!site || strlen(site) >= OBS_DB_SITE_ID_LEN, goto ERR_RETURN,
+               "invalid site in the obs table");
 
-    if (trace_flag && sum_val < 0.005) {
-        return 0.001;
+        strcpy((*sites)[num_sites], site);
+        num_sites++;
     }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error executing site select: %s",
+           sqlite3_errstr(rc));
 
-    return sum_val;
+    sqlite3_finalize(statement);
+    return num_sites;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    free(*sites);
+    *sites = 0;
+    return SIZE_MAX;
 }
 
-int
-obs_db_query_precipitation(sqlite3 *db, char const *const site, struct ObsTimeRange tr,
-                           unsigned window_length, unsigned window_increment,
-                           unsigned window_offset, struct ObsPrecipitation **results,
-                           size_t *num_results)
+struct ObsDbReader {
+    sqlite3_stmt *select_stmt; /**< Selects the rows of the site in time order. */
+    bool done;                 /**< Has the last row been read? */
+};
+
+struct ObsDbReader *
+obs_db_create_reader(sqlite3 *db, char const *const site_id, struct ObsTimeRange tr)
 {
-    assert(results && !*results && "results is null or points to non-null pointer");
-    assert(*num_results == 0 && "*num_results not initalized to zero");
+    struct ObsDbReader *reader = calloc(1, sizeof(*reader));
+    StopIf(!reader, return 0, "out of memory");
 
-    struct ObsPrecipitation *hourlies = 0;
-    size_t num_hourlies = 0;
+    char const *const sql = "SELECT valid_time, t_f, precip_in_1hr FROM obs "
+                            "WHERE site = ? AND valid_time >= ? AND valid_time <= ? "
+                            "ORDER BY valid_time ASC";
 
-    int rc = obs_db_query_precipitation_get_hourlies(db, site, tr, &hourlies, &num_hourlies);
-    StopIf(rc < 0, goto ERR_RETURN, "error getting hourly precipitation");
+    int rc = sqlite3_prepare_v2(db, sql, -1, &reader->select_stmt, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing obs select: %s", sqlite3_errstr(rc));
 
-    size_t calc_num_res = obs_db_query_calculate_num_results(tr, window_increment);
-    StopIf(calc_num_res == SIZE_MAX, goto ERR_RETURN, "unable to calculate number of results");
+    rc = sqlite3_bind_text(reader->select_stmt, 1, site_id, -1, SQLITE_TRANSIENT);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
 
-    *results = calloc(calc_num_res, sizeof(**results));
-    StopIf(!*results, goto ERR_RETURN, "out of memory");
+    rc = sqlite3_bind_int64(reader->select_stmt, 2, tr.start);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding start: %s", sqlite3_errstr(rc));
 
-    struct tm end_prd_tm = *gmtime(&tr.start);
-    end_prd_tm.tm_hour = window_offset;
-    end_prd_tm.tm_min = 0;
-    end_prd_tm.tm_sec = 0;
+    rc = sqlite3_bind_int64(reader->select_stmt, 3, tr.end);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding end: %s", sqlite3_errstr(rc));
 
-    time_t end_prd = timegm(&end_prd_tm);
-    while (end_prd > tr.start) {
-        end_prd -= HOURSEC * window_increment;
-    }
-    while (end_prd < tr.start) {
-        end_prd += HOURSEC * window_increment;
+    return reader;
+
+ERR_RETURN:
+    obs_db_finalize_reader(reader);
+    return 0;
+}
+
+void
+obs_db_finalize_reader(struct ObsDbReader *reader)
+{
+    if (reader) {
+        sqlite3_finalize(reader->select_stmt);
+        free(reader);
     }
 
-    struct ObsPrecipitation *lcl_results = *results;
-    struct ObsPrecipitation *last_start = hourlies;
-    size_t last_start_size = num_hourlies;
-    while (end_prd < tr.end && *num_results < calc_num_res) {
-        time_t str_prd = end_prd - HOURSEC * window_length;
-        double pcp_accum = obs_db_query_precipitation_accumulation_in_window(
-            &last_start, &last_start_size, str_prd, end_prd);
+    return;
+}
 
-        lcl_results[*num_results].valid_time = end_prd;
-        lcl_results[*num_results].precip_in = pcp_accum;
-        *num_results += 1;
+size_t
+obs_db_read(struct ObsDbReader *reader, size_t max_rows, int64_t valid_times[max_rows],
+            double t_f[max_rows], double precip_in[max_rows])
+{
+    size_t num_rows = 0;
 
-        end_prd += HOURSEC * window_increment;
+    while (!reader->done && num_rows < max_rows) {
+        int rc = sqlite3_step(reader->select_stmt);
+        StopIf(rc != SQLITE_ROW && rc != SQLITE_DONE, return SIZE_MAX, "error reading obs: %s",
+               sqlite3_errstr(rc));
+
+        if (rc == SQLITE_DONE) {
+            reader->done = true;
+            break;
+        }
+
+        sqlite3_stmt *statement = reader->select_stmt;
+        valid_times[num_rows] = sqlite3_column_int64(statement, 0);
+        t_f[num_rows] = sqlite3_column_type(statement, 1) == SQLITE_NULL
+                            ? NAN
+                            : sqlite3_column_double(statement, 1);
+        precip_in[num_rows] = sqlite3_column_type(statement, 2) == SQLITE_NULL
+                                  ? NAN
+                                  : sqlite3_column_double(statement, 2);
+        num_rows++;
     }
 
-    free(hourlies);
+    return num_rows;
+}
 
-    return 0;
+/** Attach a database file to a connection as the schema \c delta.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_attach_delta(sqlite3 *db, char const *path)
+{
+    sqlite3_stmt *statement = 0;
 
-ERR_RETURN:
+    int rc = sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS delta", -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing attach: %s", sqlite3_errstr(rc));
 
-    free(hourlies);
+    rc = sqlite3_bind_text(statement, 1, path, -1, SQLITE_STATIC);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding path: %s", sqlite3_errstr(rc));
 
-    *num_results = 0;
-    free(*results);
-    *results = 0;
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "unable to attach %s: %s", path,
+           sqlite3_errmsg(db));
+
+    sqlite3_finalize(statement);
+    return 0;
 
+ERR_RETURN:
+    sqlite3_finalize(statement);
     return -1;
 }
 
 int
-obs_db_start_transaction(sqlite3 *db)
+obs_db_change_log_range(sqlite3 *db, int64_t *first_seq, int64_t *last_seq)
 {
-    char *sqlite_error_message = 0;
-    sqlite3_exec(db, "BEGIN TRANSACTION;", 0, 0, &sqlite_error_message);
-    StopIf(sqlite_error_message, goto ERR_RETURN, "error starting transaction: %s",
-           sqlite_error_message);
+    sqlite3_stmt *statement = 0;
+
+    char const *const sql = "SELECT IFNULL(MIN(seq), 0), IFNULL(MAX(seq), 0) FROM changes";
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing change select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "error reading the change log: %s",
+           sqlite3_errstr(rc));
 
+    *first_seq = sqlite3_column_int64(statement, 0);
+    *last_seq = sqlite3_column_int64(statement, 1);
+
+    sqlite3_finalize(statement);
     return 0;
 
 ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
+}
 
-    sqlite3_free(sqlite_error_message);
+/** Detach the database attached by obs_db_attach_delta(). */
+static void
+obs_db_detach_delta(sqlite3 *db)
+{
+    char *sqlite_error_message = 0;
+    sqlite3_exec(db, "DETACH DATABASE delta;", 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, sqlite3_free(sqlite_error_message),
+           "error detaching delta: %s", sqlite3_errmsg(db));
+}
+
+/** Copy the change log entries of one kind with numbers in (\a after_seq, \a last_seq] into the
+ * attached delta.
+ *
+ * \returns the number of rows written, or -1 on error.
+ */
+static long
+obs_db_export_change_kind(sqlite3 *db, char const *sql, int kind, int64_t after_seq,
+                          int64_t last_seq)
+{
+    sqlite3_stmt *statement = 0;
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing delta insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int(statement, 1, kind);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding kind: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 2, after_seq);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding after_seq: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 3, last_seq);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding last_seq: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error writing delta: %s", sqlite3_errmsg(db));
+
+    sqlite3_finalize(statement);
+    return sqlite3_changes(db);
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
     return -1;
 }
 
-int
-obs_db_finish_transaction(sqlite3 *db, int action)
+long
+obs_db_export_changes(sqlite3 *db, char const *path, int64_t after_seq, int64_t *last_seq)
 {
+    sqlite3_stmt *statement = 0;
     char *sqlite_error_message = 0;
-    char *sql = 0;
+    bool attached = false;
+    bool in_transaction = false;
+
+    char *tmp_path = sqlite3_mprintf("%s.tmp", path);
+    StopIf(!tmp_path, return -1, "out of memory");
+
+    // Attaching a leftover from a failed attempt would add to it instead of starting over.
+    remove(tmp_path);
+
+    int rc = obs_db_attach_delta(db, tmp_path);
+    StopIf(rc, goto ERR_RETURN, "unable to create %s", tmp_path);
+    attached = true;
+
+    rc = obs_db_start_transaction(db);
+    StopIf(rc, goto ERR_RETURN, "error starting export transaction");
+    in_transaction = true;
+
+    char const *const schema_sql =
+        "CREATE TABLE delta.info (                                            \n"
+        "  after_seq      INTEGER NOT NULL, -- last change the receiver had   \n"
+        "  last_seq       INTEGER NOT NULL, -- last change in this delta      \n"
+        "  version        INTEGER NOT NULL, -- layout of this file            \n"
+        "  created        INTEGER NOT NULL);-- unix time this was written     \n"
+        "CREATE TABLE delta.obs (                                             \n"
+        "  site           TEXT    NOT NULL,                                   \n"
+        "  valid_time     INTEGER NOT NULL,                                   \n"
+        "  t_f            REAL,                                               \n"
+        "  precip_in_1hr  REAL,                                               \n"
+        "  PRIMARY KEY (site, valid_time));                                   \n"
+        "CREATE TABLE delta.coverage (                                        \n"
+        "  site           TEXT    NOT NULL,                                   \n"
+        "  start          INTEGER NOT NULL,                                   \n"
+        "  end            INTEGER NOT NULL,                                   \n"
+        "  PRIMARY KEY (site, start, end));                                   \n";
+
+    sqlite3_exec(db, schema_sql, 0, 0, &sqlite_error_message);
+    StopIf(sqlite_error_message, goto ERR_RETURN, "error creating delta tables: %s",
+           sqlite_error_message);
 
-    if (action == OBS_DB_TRANSACTION_ROLLBACK) {
-        sql = "ROLLBACK TRANSACTION;";
-    } else if (action == OBS_DB_TRANSACTION_COMMIT) {
-        sql = "COMMIT TRANSACTION;";
-    } else {
-        StopIf(true, goto ERR_RETURN, "inavlid action in obs_db_finish_transaction");
+    // Changes committed while this runs are left for the next delta.
+    rc = sqlite3_prepare_v2(db, "SELECT MAX(seq) FROM main.changes", -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing change select: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "error reading the change log: %s",
+           sqlite3_errstr(rc));
+
+    int64_t last = sqlite3_column_int64(statement, 0);
+    if (last < after_seq) {
+        last = after_seq;
     }
 
-    sqlite3_exec(db, sql, 0, 0, &sqlite_error_message);
-    StopIf(sqlite_error_message, goto ERR_RETURN, "error finishing transaction: %s",
-           sqlite_error_message);
+    sqlite3_finalize(statement);
+    statement = 0;
 
-    return 0;
+    // The rows are read from obs, so a row replaced since it was logged goes out as it is now.
+    char const *const rows_sql =
+        "INSERT OR IGNORE INTO delta.obs (site, valid_time, t_f, precip_in_1hr)         \n"
+        "  SELECT o.site, o.valid_time, o.t_f, o.precip_in_1hr                          \n"
+        "  FROM main.changes AS c JOIN main.obs AS o                                     \n"
+        "    ON o.site = c.site AND o.valid_time BETWEEN c.start AND c.end               \n"
+        "  WHERE c.kind = ?1 AND c.seq > ?2 AND c.seq <= ?3                              \n";
 
-ERR_RETURN:
+    long num_rows = obs_db_export_change_kind(db, rows_sql, OBS_DB_CHANGE_ROWS, after_seq, last);
+    StopIf(num_rows < 0, goto ERR_RETURN, "error exporting rows");
+
+    char const *const coverage_sql =
+        "INSERT OR IGNORE INTO delta.coverage (site, start, end)                        \n"
+        "  SELECT site, start, end FROM main.changes                                    \n"
+        "  WHERE kind = ?1 AND seq > ?2 AND seq <= ?3                                   \n";
+
+    rc = obs_db_export_change_kind(db, coverage_sql, OBS_DB_CHANGE_COVERAGE, after_seq, last) < 0;
+    StopIf(rc, goto ERR_RETURN, "error exporting coverage");
+
+    char const *const info_sql =
+        "INSERT INTO delta.info (after_seq, last_seq, version, created) VALUES (?,?,?,?)";
+
+    rc = sqlite3_prepare_v2(db, info_sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing info insert: %s",
+           sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 1, after_seq);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding after_seq: %s", sqlite3_errstr(rc));
 
+    rc = sqlite3_bind_int64(statement, 2, last);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding last_seq: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int(statement, 3, OBS_DB_DELTA_VERSION);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding version: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_bind_int64(statement, 4, time(0));
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding created: %s", sqlite3_errstr(rc));
+
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error writing delta info: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    rc = obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
+    StopIf(rc, goto ERR_RETURN, "error committing delta");
+    in_transaction = false;
+
+    attached = false;
+    obs_db_detach_delta(db);
+
+    StopIf(rename(tmp_path, path), goto ERR_RETURN, "unable to replace %s", path);
+
+    sqlite3_free(tmp_path);
+
+    *last_seq = last;
+    return num_rows;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
     sqlite3_free(sqlite_error_message);
+    if (in_transaction) {
+        obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+    }
+    if (attached) {
+        obs_db_detach_delta(db);
+    }
+    remove(tmp_path);
+    sqlite3_free(tmp_path);
     return -1;
 }
 
-sqlite3_stmt *
-obs_db_create_insert_statement(sqlite3 *db)
+/** Apply the coverage ranges in the attached delta.
+ *
+ * \returns 0 on success or -1 on error.
+ */
+static int
+obs_db_import_coverage(sqlite3 *db)
 {
-    sqlite3_stmt *insert_stmt = 0;
-    char const *const sql = "INSERT OR REPLACE INTO obs ( \n"
-                            "  valid_time,                \n"
-                            "  site,                      \n"
-                            "  t_f,                       \n"
-                            "  precip_in_1hr)             \n"
-                            "VALUES (?,?,?,?);            \n";
+    sqlite3_stmt *statement = 0;
 
-    int rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, 0);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error creating sqlite3_stmt: %s", sqlite3_errstr(rc));
+    char const *const sql = "SELECT site, start, end FROM delta.coverage";
 
-    return insert_stmt;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing coverage select: %s",
+           sqlite3_errstr(rc));
 
-ERR_RETURN:
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        char const *site = (char const *)sqlite3_column_text(statement, 0);
+        struct ObsTimeRange tr = {.start = sqlite3_column_int64(statement, 1),
+                                  .end = sqlite3_column_int64(statement, 2)};
+        if (!site) {
+            continue;
+        }
 
-    sqlite3_finalize(insert_stmt);
+        int err = obs_db_add_coverage(db, site, tr);
+        StopIf(err, goto ERR_RETURN, "error applying coverage for %s", site);
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error reading delta coverage: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
     return 0;
+
+ERR_RETURN:
+    sqlite3_finalize(statement);
+    return -1;
 }
 
-void
-obs_db_finalize_insert_statement(sqlite3_stmt *stmt)
+/** Tell the shared result cache about every site with rows in the attached delta. */
+static void
+obs_db_import_invalidate_cache(sqlite3 *db)
 {
-    if (stmt) {
-        sqlite3_finalize(stmt);
+    sqlite3_stmt *statement = 0;
+
+    int rc = sqlite3_prepare_v2(db, "SELECT DISTINCT site FROM delta.obs", -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, return, "error preparing site select: %s", sqlite3_errstr(rc));
+
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        char const *site = (char const *)sqlite3_column_text(statement, 0);
+        if (site) {
+            obs_shm_cache_site_changed(site);
+        }
     }
 
-    return;
+    sqlite3_finalize(statement);
 }
 
-int
-obs_db_insert(sqlite3_stmt *insert_stmt, time_t valid_time, char const *const site_id,
-              double temperature_f, double precip_inches)
+long
+obs_db_import_changes(sqlite3 *db, char const *path, char const *watermark_setting,
+                      int64_t *last_seq)
 {
+    sqlite3_stmt *statement = 0;
+    struct ObsDbInserter *inserter = 0;
+    bool attached = false;
+    bool in_transaction = false;
 
-    sqlite3_reset(insert_stmt);
-    sqlite3_clear_bindings(insert_stmt);
+    // Attaching a file that isn't there would create an empty one.
+    struct stat st = {0};
+    StopIf(stat(path, &st), return -1, "unable to find delta %s", path);
 
-    int rc = sqlite3_bind_int64(insert_stmt, 1, valid_time);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding valid_time: %s", sqlite3_errstr(rc));
+    int rc = obs_db_attach_delta(db, path);
+    StopIf(rc, goto ERR_RETURN, "unable to open delta %s", path);
+    attached = true;
 
-    rc = sqlite3_bind_text(insert_stmt, 2, site_id, -1, 0);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding site: %s", sqlite3_errstr(rc));
+    char const *const info_sql = "SELECT after_seq, last_seq, version FROM delta.info";
 
-    rc = sqlite3_bind_double(insert_stmt, 3, temperature_f);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding t_f: %s", sqlite3_errstr(rc));
+    rc = sqlite3_prepare_v2(db, info_sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "%s is not a delta: %s", path, sqlite3_errmsg(db));
 
-    rc = sqlite3_bind_double(insert_stmt, 4, precip_inches);
-    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error binding p_in: %s", sqlite3_errstr(rc));
+    rc = sqlite3_step(statement);
+    StopIf(rc != SQLITE_ROW, goto ERR_RETURN, "%s is not a delta: %s", path,
+           sqlite3_errstr(rc));
 
-    rc = sqlite3_step(insert_stmt);
-    StopIf(rc != SQLITE_OK && rc != SQLITE_DONE, goto ERR_RETURN,
-           "error stepping sqlite statement: %s", sqlite3_errstr(rc));
+    int64_t after = sqlite3_column_int64(statement, 0);
+    int64_t last = sqlite3_column_int64(statement, 1);
+    int version = sqlite3_column_int(statement, 2);
+    StopIf(version != OBS_DB_DELTA_VERSION, goto ERR_RETURN,
+           "delta %s has version %d, this version of obsdb reads %d", path, version,
+           OBS_DB_DELTA_VERSION);
 
-    return 0;
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    rc = obs_db_start_transaction(db);
+    StopIf(rc, goto ERR_RETURN, "error starting import transaction");
+    in_transaction = true;
+
+    double value = 0.0;
+    int found = obs_db_get_setting(db, watermark_setting, &value);
+    StopIf(found < 0, goto ERR_RETURN, "error reading the watermark");
+    int64_t watermark = found ? (int64_t)value : 0;
+
+    // The changes between the watermark and the start of this delta would never arrive.
+    StopIf(after > watermark, goto ERR_RETURN,
+           "delta %s starts after change %lld, this store only has changes through %lld, a delta "
+           "is missing",
+           path, (long long)after, (long long)watermark);
+
+    inserter = obs_db_create_inserter(db);
+    StopIf(!inserter, goto ERR_RETURN, "unable to create an inserter");
+
+    char const *const rows_sql = "SELECT site, valid_time, t_f, precip_in_1hr FROM delta.obs \n"
+                                 "ORDER BY site, valid_time                                  \n";
+
+    rc = sqlite3_prepare_v2(db, rows_sql, -1, &statement, 0);
+    StopIf(rc != SQLITE_OK, goto ERR_RETURN, "error preparing delta select: %s",
+           sqlite3_errstr(rc));
+
+    long num_rows = 0;
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        char const *site = (char const *)sqlite3_column_text(statement, 0);
+        time_t valid_time = sqlite3_column_int64(statement, 1);
+        double t_f = sqlite3_column_type(statement, 2) == SQLITE_NULL
+                         ? NAN
+                         : sqlite3_column_double(statement, 2);
+        double precip = sqlite3_column_type(statement, 3) == SQLITE_NULL
+                            ? NAN
+                            : sqlite3_column_double(statement, 3);
+        if (!site) {
+            continue;
+        }
+
+        int err = obs_db_insert(inserter, valid_time, site, t_f, precip);
+        StopIf(err, goto ERR_RETURN, "error applying a row for %s", site);
+        num_rows++;
+    }
+    StopIf(rc != SQLITE_DONE, goto ERR_RETURN, "error reading delta rows: %s",
+           sqlite3_errstr(rc));
+
+    sqlite3_finalize(statement);
+    statement = 0;
+
+    rc = obs_db_inserter_flush(inserter);
+    StopIf(rc, goto ERR_RETURN, "error saving hour bitmaps");
+
+    obs_db_finalize_inserter(inserter);
+    inserter = 0;
+
+    rc = obs_db_import_coverage(db);
+    StopIf(rc, goto ERR_RETURN, "error applying coverage");
+
+    // Applying an old delta again is harmless, but it doesn't take back the newer changes.
+    if (last > watermark) {
+        rc = obs_db_set_setting(db, watermark_setting, last);
+        StopIf(rc, goto ERR_RETURN, "error recording the watermark");
+    }
+
+    rc = obs_db_finish_transaction(db, OBS_DB_TRANSACTION_COMMIT);
+    StopIf(rc, goto ERR_RETURN, "error committing import");
+    in_transaction = false;
+
+    obs_db_import_invalidate_cache(db);
+
+    obs_db_detach_delta(db);
+
+    if (last_seq) {
+        *last_seq = last;
+    }
+    return num_rows;
 
 ERR_RETURN:
+    sqlite3_finalize(statement);
+    obs_db_finalize_inserter(inserter);
+    if (in_transaction) {
+        obs_db_finish_transaction(db, OBS_DB_TRANSACTION_ROLLBACK);
+    }
+    if (attached) {
+        obs_db_detach_delta(db);
+    }
     return -1;
 }
@@ -7,25 +7,178 @@
  */
 #include <obs.h>
 
+#include "time_range.h"
+
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <sqlite3.h>
 
+/** How long (in milliseconds) to wait for another connection to finish writing. */
+#define OBS_DB_BUSY_TIMEOUT_MS 10000
+
 /** Connect to the local database storage.
  *
  * If the database does not exist, it will create the full path to the file and the file, then
  * open the database connection.
  *
+ * \param config is the storage settings for the connection, \c NULL for the defaults.
+ *
  * \returns \c 0 on error.
  */
-sqlite3 *obs_db_open_create(void);
+sqlite3 *obs_db_open_create(struct ObsStoreConfig const *config);
+
+/** The name of the setting holding the number of files the archive is split into.
+ *
+ * It is only in the main file, and only if the archive was created with more than one.
+ */
+#define OBS_DB_NUM_SHARDS_SETTING "num_shards"
+
+/** The connections to all the files of the local store.
+ *
+ * An archive created with \ref ObsStoreConfig::num_shards set keeps the observations, coverage,
+ * hour bitmaps and change log of each site in the file picked by obs_db_shard_of(). The main file
+ * is shard 0, it also holds the settings and the backfill queue. Connections are opened when they
+ * are first needed and each file has its own write lock, so different threads and processes can
+ * store sites in different shards at the same time.
+ */
+struct ObsDbShards {
+    struct ObsStoreConfig config;       /**< The settings connections are opened with. */
+    unsigned num_shards;                /**< The number of files, 1 if the archive isn't split. */
+    sqlite3 *dbs[OBS_STORE_MAX_SHARDS]; /**< The connections, \c NULL until they are needed. */
+};
+
+/** Find which shard a site is stored in.
+ *
+ * \param site is the site identifier, the case doesn't matter.
+ * \param num_shards is the number of shards of the archive.
+ *
+ * \returns a shard number less than \a num_shards.
+ */
+unsigned obs_db_shard_of(char const *const site, unsigned num_shards);
+
+/** Set up the connections to the files of the local store.
+ *
+ * \param shards is the set of connections to set up.
+ * \param main_db is a connection to the main file, the set takes it over and closes it along with
+ * the others in obs_db_shards_close().
+ * \param config is the storage settings for the other connections, \c NULL for the defaults.
+ *
+ * \returns 0 on success, less than zero otherwise.
+ */
+int obs_db_shards_init(struct ObsDbShards *shards, sqlite3 *main_db,
+                       struct ObsStoreConfig const *config);
+
+/** Get the connection to one of the files of the local store, opening it if needed.
+ *
+ * \returns the database handle, or \c NULL if it couldn't be opened.
+ */
+sqlite3 *obs_db_shards_get(struct ObsDbShards *shards, unsigned shard);
+
+/** Get the connection to the file a site is stored in, opening it if needed.
+ *
+ * \returns the database handle, or \c NULL if it couldn't be opened.
+ */
+sqlite3 *obs_db_shards_site(struct ObsDbShards *shards, char const *const site);
+
+/** Close every connection that was opened, including the main one. */
+void obs_db_shards_close(struct ObsDbShards *shards);
+
+/** Open a snapshot of the local store written by obs_db_write_snapshot(), read only.
+ *
+ * The file is opened as immutable, so sqlite takes no locks and never looks for a journal. It must
+ * not change while any connection has it open, replace it with a new file instead.
+ *
+ * \param path is the snapshot file.
+ * \param config is the storage settings for the connection, \c NULL for the defaults.
+ *
+ * \returns \c 0 on error, including a snapshot from a different version of the schema.
+ */
+sqlite3 *obs_db_open_snapshot(char const *path, struct ObsStoreConfig const *config);
+
+/** Write a compacted copy of the database that can be opened with obs_db_open_snapshot().
+ *
+ * The copy is written to a temporary file next to \a path and renamed when it is complete, so
+ * connections that have the old snapshot open keep reading it.
+ *
+ * \param db the database handle, it must not be in a transaction.
+ * \param path is where to write the snapshot.
+ *
+ * \returns 0 on success, less than zero otherwise.
+ */
+int obs_db_write_snapshot(sqlite3 *db, char const *path);
+
+/** Apply storage settings to an open connection.
+ *
+ * \param db the database handle, it must not be in a transaction.
+ * \param config is the storage settings, \c NULL for the defaults.
+ *
+ * \returns 0 on success, less than zero otherwise.
+ */
+int obs_db_apply_config(sqlite3 *db, struct ObsStoreConfig const *config);
 
 /** Close down the database.
+ *
+ * This does no other work, old data is removed by obs_db_maintenance().
  *
  * \returns 0 on success, less than zero otherwise.
  */
 int obs_db_close(sqlite3 *db);
 
+/** The name of the setting holding the unix time obs_db_maintenance() last ran. */
+#define OBS_DB_LAST_MAINTENANCE_SETTING "last_maintenance"
+
+/** Remove data that is too old to keep from the local store.
+ *
+ * Observations, download records, change log entries and finished backfill jobs older than about
+ * 555 days are deleted in a single transaction, and the time is recorded in the
+ * \ref OBS_DB_LAST_MAINTENANCE_SETTING setting.
+ *
+ * \param db the database handle.
+ * \param now is the current time.
+ *
+ * \returns 0 on success, less than zero otherwise.
+ */
+int obs_db_maintenance(sqlite3 *db, time_t now);
+
+/** Find out how many rows are stored for a site in a time range.
+ *
+ * \param db the database handle to query.
+ * \param site is the site in question, it must be in all lowercase.
+ * \param time_range the time range to count, the end points are included.
+ *
+ * \returns the number of rows, or \c SIZE_MAX if there is an error.
+ */
+size_t obs_db_count_rows_in_range(sqlite3 *db, char const *const site,
+                                  struct ObsTimeRange time_range);
+
+/** Find the valid time of the newest observation stored for a site.
+ *
+ * \param db the database handle to query.
+ * \param site is the site in question, it must be in all lowercase.
+ * \param valid_time is where the valid time is stored, it is untouched if there is no data.
+ *
+ * \returns 1 if there is data for the site, 0 if there isn't, and -1 if there is an error.
+ */
+int obs_db_last_valid_time(sqlite3 *db, char const *const site, time_t *valid_time);
+
+/** Find the time ranges with missing data for a site.
+ *
+ * The check reads the site's bitmap of hours with data, so missing ranges are made of whole hours
+ * (clipped to \a time_range) and a piece shorter than an hour is not reported. Gaps that are inside
+ * time ranges recorded with obs_db_add_coverage() are not reported as missing.
+ *
+ * \param db the database handle to query.
+ * \param site is the site in question, it must be in all lowercase.
+ * \param time_range the time range to check.
+ * \param missing is where the missing ranges are stored, it must be empty upon entry.
+ *
+ * \returns 0 on success, or -1 if there is an error, in which case \a missing is left empty.
+ */
+int obs_db_missing_ranges(sqlite3 *db, char const *const site, struct ObsTimeRange time_range,
+                          struct ObsTimeRangeSet *missing);
+
 /** Query the database to see if a request can be fulfilled.
  *
  * \param db the database handle to query.
@@ -38,6 +191,9 @@ int obs_db_close(sqlite3 *db);
  * ignored. The number of values returned in \a missing_times will be stored here. If there are no
  * missing times, this will be set to zero.
  *
+ * Gaps that are inside a time range recorded with obs_db_add_coverage() are not reported as
+ * missing.
+ *
  * \returns -1 if there is an error, 0 if not enough data was available, and 1 if enough data is
  * available.
  */
@@ -58,6 +214,13 @@ int obs_db_have_inventory(sqlite3 *db, char const *const site, struct ObsTimeRan
  */
 #define OBS_DB_MIN_MODE 2
 
+/** Where the time goes in obs_db_query_temperatures() and obs_db_query_precipitation(). */
+struct ObsDbQueryStats {
+    double fetch_ms;  /**< Milliseconds spent reading the hourly values from the database. */
+    double window_ms; /**< Milliseconds spent combining the hourly values into windows. */
+    size_t num_rows;  /**< The number of hourly values read. */
+};
+
 /** Execute a query for temperatures.
  *
  * \param db the database handle to query.
@@ -70,6 +233,7 @@ int obs_db_have_inventory(sqlite3 *db, char const *const site, struct ObsTimeRan
  * \param results will be stored in an array returned here. This returned array will need to be
  * freed with \c free().
  * \param num_results will be the number of \ref ObsTemperature objects stored in \a results.
+ * \param stats if not \c NULL, where the time was spent is stored here.
  *
  * \returns 0 on success, or a negative number upon failure. If there is an error \a results will
  * be \c NULL and \a num_results will be set to zero.
@@ -78,7 +242,7 @@ int obs_db_have_inventory(sqlite3 *db, char const *const site, struct ObsTimeRan
 int obs_db_query_temperatures(sqlite3 *db, int max_min_mode, char const *const site,
                               struct ObsTimeRange time_range, unsigned window_end,
                               unsigned window_length, struct ObsTemperature **results,
-                              size_t *num_results);
+                              size_t *num_results, struct ObsDbQueryStats *stats);
 
 /** Execute a query for temperatures.
  *
@@ -93,7 +257,7 @@ int obs_db_query_temperatures(sqlite3 *db, int max_min_mode, char const *const s
  * leak.
  * \param num_results will be the number of \ref ObsPrecipitation objects stored in \a results. This
  * must be 0 when passed in so it is consistent with the length of \a results.
- *
+ * \param stats if not \c NULL, where the time was spent is stored here.
  *
  * \returns 0 on success, or a negative number upon failure. If there is an error \a results will
  * be \c NULL and \a num_results will be set to zero, which should be the same as when they were
@@ -103,7 +267,53 @@ int obs_db_query_temperatures(sqlite3 *db, int max_min_mode, char const *const s
 int obs_db_query_precipitation(sqlite3 *db, char const *const site, struct ObsTimeRange time_range,
                                unsigned window_length, unsigned window_increment,
                                unsigned window_offset, struct ObsPrecipitation **results,
-                               size_t *num_results);
+                               size_t *num_results, struct ObsDbQueryStats *stats);
+
+/** Execute a query for the daily maximum and minimum temperatures and precipitation together.
+ *
+ * The temperatures and precipitation are read in a single pass over the site's rows, and each
+ * window is combined as in obs_db_query_temperatures() and obs_db_query_precipitation() with a
+ * window increment of 24 hours.
+ *
+ * \param db the database handle to query.
+ * \param site is the site in question, it must be in all lowercase.
+ * \param time_range the time range the query will cover.
+ * \param window_end is the hour of the day (UTC) that the window should end.
+ * \param window_length is the number of hours long the window is for each valid time.
+ * \param results will be stored in an array returned here. This returned array will need to be
+ * freed with \c free().
+ * \param num_results will be the number of \ref ObsDailySummary objects stored in \a results.
+ * \param stats if not \c NULL, where the time was spent is stored here.
+ *
+ * \returns 0 on success, or a negative number upon failure. If there is an error \a results will
+ * be \c NULL and \a num_results will be set to zero.
+ */
+int obs_db_query_daily_summary(sqlite3 *db, char const *const site,
+                               struct ObsTimeRange time_range, unsigned window_end,
+                               unsigned window_length, struct ObsDailySummary **results,
+                               size_t *num_results, struct ObsDbQueryStats *stats);
+
+/** The same as obs_db_query_temperatures(), but with compact results.
+ *
+ * The hourly values are read into a compact layout too. The valid times of the whole range must
+ * fit in 32 bits of seconds, about 136 years.
+ */
+int obs_db_query_temperatures_compact(sqlite3 *db, int max_min_mode, char const *const site,
+                                      struct ObsTimeRange time_range, unsigned window_end,
+                                      unsigned window_length,
+                                      struct ObsTemperatureCompact **results, size_t *num_results,
+                                      struct ObsDbQueryStats *stats);
+
+/** The same as obs_db_query_precipitation(), but with compact results.
+ *
+ * The hourly values are read into a compact layout too. The valid times of the whole range must
+ * fit in 32 bits of seconds, about 136 years.
+ */
+int obs_db_query_precipitation_compact(sqlite3 *db, char const *const site,
+                                       struct ObsTimeRange time_range, unsigned window_length,
+                                       unsigned window_increment, unsigned window_offset,
+                                       struct ObsPrecipitationCompact **results,
+                                       size_t *num_results, struct ObsDbQueryStats *stats);
 
 /** Start a transaction on the local store.
  *
@@ -129,30 +339,264 @@ int obs_db_start_transaction(sqlite3 *db);
  */
 int obs_db_finish_transaction(sqlite3 *db, int action);
 
-/** Create an insert statement for the local store.
- *
- * \param db the database to make the prepared statement on.
+/** Inserts observations into the local store.
  *
- * \returns the statement handle or NULL on failure.
+ * Alongside each row, the inserter marks the hour of the observation in a per site bitmap of the
+ * hours that have data, which is what obs_db_missing_ranges() reads. The bitmap updates are
+ * collected in memory and written by obs_db_inserter_flush(), which must be called before the
+ * transaction holding the inserts is committed.
  */
-sqlite3_stmt *obs_db_create_insert_statement(sqlite3 *db);
+struct ObsDbInserter;
 
-/** Finalize and clean up the insert statement.
+/** Create an inserter for the local store.
  *
- * \param stmt is the statement to clean up.
+ * \param db the database to insert into.
+ *
+ * \returns the inserter or \c NULL on failure.
+ */
+struct ObsDbInserter *obs_db_create_inserter(sqlite3 *db);
+
+/** Clean up an inserter, any bitmap updates that were not flushed are discarded.
  *
+ * \param inserter is the inserter to clean up, it may be \c NULL.
  */
-void obs_db_finalize_insert_statement(sqlite3_stmt *stmt);
+void obs_db_finalize_inserter(struct ObsDbInserter *inserter);
 
 /** Insert some values into the local store.
  *
- * \param insert_stmt is a statement returned by \ref obs_db_create_insert_statement()
+ * \param inserter is an inserter returned by \ref obs_db_create_inserter()
  * \param valid_time is the valid time of the observation.
- * \param site_id is the SynopticLabs (mesowest) site id.
+ * \param site_id is the SynopticLabs (mesowest) site id, it must be in all lowercase.
  * \param temperature_f is the temperature in Fahrenheit.
  * \param precip_inches is the 1-hour precipitation in inches.
  *
  * \returns 0 on success or a negative number on failure.
  */
-int obs_db_insert(sqlite3_stmt *insert_stmt, time_t valid_time, char const *const site_id,
+int obs_db_insert(struct ObsDbInserter *inserter, time_t valid_time, char const *const site_id,
                   double temperature_f, double precip_inches);
+
+/** Write the hourly bitmap updates and change log entries for everything inserted so far.
+ *
+ * This also resets the insert statement, so it is not in progress when the transaction is
+ * committed.
+ *
+ * \param inserter is an inserter returned by \ref obs_db_create_inserter()
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_inserter_flush(struct ObsDbInserter *inserter);
+
+/** Record that a time range was successfully downloaded for a site.
+ *
+ * Ranges recorded here are not reported as missing by obs_db_have_inventory(), even if the
+ * station did not report any data for them.
+ *
+ * \param db the database handle.
+ * \param site_id is the SynopticLabs (mesowest) site id, it must be in all lowercase.
+ * \param time_range the time range that was downloaded.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_add_coverage(sqlite3 *db, char const *const site_id, struct ObsTimeRange time_range);
+
+/** A change log entry for observations stored for a site between its start and end times. */
+#define OBS_DB_CHANGE_ROWS 0
+
+/** A change log entry for a time range recorded with obs_db_add_coverage(). */
+#define OBS_DB_CHANGE_COVERAGE 1
+
+/** The name of the setting holding the last change from another store applied by
+ * obs_db_import_changes(). */
+#define OBS_DB_REPLICATION_WATERMARK_SETTING "replication_watermark"
+
+/** The name of the setting in a backup holding the last change of the store it was copied from. */
+#define OBS_DB_BACKUP_WATERMARK_SETTING "backup_watermark"
+
+/** Find the numbers of the oldest and newest entries in the change log.
+ *
+ * \param db the database handle.
+ * \param first_seq is where the number of the oldest entry is stored, 0 if the log is empty.
+ * \param last_seq is where the number of the newest entry is stored, 0 if the log is empty.
+ *
+ * eturns 0 on success or a negative number on failure.
+ */
+int obs_db_change_log_range(sqlite3 *db, int64_t *first_seq, int64_t *last_seq);
+
+/** Write the changes made to the local store after a point in its change log to a delta file.
+ *
+ * Every flush of an inserter and every call to obs_db_add_coverage() adds an entry to the change
+ * log, numbered in the order they were committed. The delta holds the entries numbered after
+ * \a after_seq: the coverage ranges, and the rows currently stored in the ranges that were
+ * inserted. It is a small sqlite database, written next to \a path and renamed when complete.
+ *
+ * \param db the database handle, it must not be in a transaction.
+ * \param path is where to write the delta.
+ * \param after_seq is the last change the receiver already has, 0 for the whole log.
+ * \param last_seq is where the number of the last change in the delta is stored, pass it as
+ * \a after_seq for the next delta.
+ *
+ * \returns the number of rows in the delta, or a negative number on failure.
+ */
+long obs_db_export_changes(sqlite3 *db, char const *path, int64_t after_seq, int64_t *last_seq);
+
+/** Apply a delta written by obs_db_export_changes() to the local store in a single transaction.
+ *
+ * The rows and coverage are stored as if they had been downloaded, so they are added to this
+ * store's own change log too and can be passed on to other stores. The watermark setting holds
+ * the last change applied so far. A delta that starts after it is refused, since the changes in
+ * between would be lost, and a delta that ends before it leaves it where it is.
+ *
+ * \param db the database handle, it must not be in a transaction.
+ * \param path is the delta file.
+ * \param watermark_setting is the name of the setting to keep the watermark in, either
+ * \ref OBS_DB_REPLICATION_WATERMARK_SETTING or \ref OBS_DB_BACKUP_WATERMARK_SETTING.
+ * \param last_seq if not \c NULL, the number of the last change in the delta is stored here.
+ *
+ * \returns the number of rows applied, or a negative number on failure.
+ */
+long obs_db_import_changes(sqlite3 *db, char const *path, char const *watermark_setting,
+                           int64_t *last_seq);
+
+/** Record a time range that can't be downloaded for a site.
+ *
+ * The range is also recorded as covered with obs_db_add_coverage(), so it is not requested again.
+ *
+ * \param db the database handle.
+ * \param site_id is the SynopticLabs (mesowest) site id, it must be in all lowercase.
+ * \param time_range the time range with bad data.
+ * \param reason is a short description of what went wrong.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_add_bad_range(sqlite3 *db, char const *const site_id, struct ObsTimeRange time_range,
+                         char const *const reason);
+
+/** Retrieve a value saved with obs_db_set_setting().
+ *
+ * \param db the database handle.
+ * \param name is the name of the setting.
+ * \param value is where the value is stored if it is found, otherwise it is left untouched.
+ *
+ * \returns 1 if the setting was found, 0 if it was not, and a negative number on failure.
+ */
+int obs_db_get_setting(sqlite3 *db, char const *const name, double *value);
+
+/** Save a value in the local store so it persists between runs.
+ *
+ * \param db the database handle.
+ * \param name is the name of the setting.
+ * \param value is the value to save, it replaces any earlier value.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_set_setting(sqlite3 *db, char const *const name, double value);
+
+/** A piece of a backfill job, one download for one site. */
+struct ObsDbBackfillChunk {
+    long job_id;                    /**< The job this chunk belongs to. */
+    char site[32];                  /**< The lowercase site identifier. */
+    struct ObsTimeRange time_range; /**< The time range to download. */
+};
+
+/** Queue a backfill job in the local store.
+ *
+ * The job and all of its chunks are saved in a single transaction, so a job is never left half
+ * queued.
+ *
+ * \param db the database handle.
+ * \param num_chunks the number of chunks in \a chunks.
+ * \param chunks the planned downloads for the job, their \c job_id is filled in.
+ * \param job_id is where the id of the new job is stored.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_backfill_add_job(sqlite3 *db, size_t num_chunks,
+                            struct ObsDbBackfillChunk chunks[num_chunks], long *job_id);
+
+/** Get the next chunks to download for the queued backfill jobs.
+ *
+ * All the returned chunks belong to the same job and cover the same time range, so they can be
+ * downloaded with a single request.
+ *
+ * \param db the database handle.
+ * \param max_attempts chunks that have failed this many times are skipped.
+ * \param max_chunks the length of \a chunks.
+ * \param chunks is where the chunks are stored.
+ *
+ * \returns the number of chunks stored in \a chunks, 0 if the queue is empty, or \c SIZE_MAX if
+ * there is an error.
+ */
+size_t obs_db_backfill_next(sqlite3 *db, unsigned max_attempts, size_t max_chunks,
+                            struct ObsDbBackfillChunk chunks[max_chunks]);
+
+/** Record the outcome of downloading a backfill chunk.
+ *
+ * \param db the database handle.
+ * \param chunk a chunk returned by obs_db_backfill_next().
+ * \param success if \c true the chunk is removed from the queue, otherwise its attempt count goes
+ * up by one.
+ *
+ * \returns 0 on success or a negative number on failure.
+ */
+int obs_db_backfill_finish_chunk(sqlite3 *db, struct ObsDbBackfillChunk const *chunk, bool success);
+
+/** Find out how far along a backfill job is.
+ *
+ * \param db the database handle.
+ * \param job_id the id returned by obs_db_backfill_add_job().
+ * \param max_attempts chunks that have failed this many times are counted as failed.
+ * \param num_done is where the number of downloaded chunks is stored.
+ * \param num_failed is where the number of chunks that gave up is stored.
+ * \param num_chunks is where the number of chunks in the job is stored.
+ *
+ * \returns 1 if the job was found, 0 if it wasn't, and a negative number on failure.
+ */
+int obs_db_backfill_job_status(sqlite3 *db, long job_id, unsigned max_attempts, size_t *num_done,
+                               size_t *num_failed, size_t *num_chunks);
+
+/** The longest site identifier obs_db_list_sites() returns, including the terminating \c NULL. */
+#define OBS_DB_SITE_ID_LEN 32
+
+/** List the sites that have observations in the local store.
+ *
+ * \param db the database handle.
+ * \param sites is where the array of sites is stored, sorted. The caller must free it.
+ *
+ * \returns the number of sites, or \c SIZE_MAX on failure.
+ */
+size_t obs_db_list_sites(sqlite3 *db, char (**sites)[OBS_DB_SITE_ID_LEN]);
+
+/** Reads the observations of a site in time order, a batch at a time, without holding them all. */
+struct ObsDbReader;
+
+/** Start reading the observations of a site.
+ *
+ * \param db the database handle.
+ * \param site_id is the site to read, it must be in all lowercase.
+ * \param time_range is the time range to read, inclusive at both ends like the queries.
+ *
+ * \returns the reader or \c NULL on failure.
+ */
+struct ObsDbReader *obs_db_create_reader(sqlite3 *db, char const *const site_id,
+                                         struct ObsTimeRange time_range);
+
+/** Clean up a reader.
+ *
+ * \param reader is the reader to clean up, it may be \c NULL.
+ */
+void obs_db_finalize_reader(struct ObsDbReader *reader);
+
+/** Read the next batch of observations into separate arrays for each column.
+ *
+ * Missing values are \c NAN.
+ *
+ * \param reader is a reader returned by obs_db_create_reader().
+ * \param max_rows is the length of the arrays.
+ * \param valid_times is where the valid times are stored.
+ * \param t_f is where the temperatures in Fahrenheit are stored.
+ * \param precip_in is where the 1-hour precipitation in inches is stored.
+ *
+ * \returns the number of rows read, 0 once there are no more, or \c SIZE_MAX on failure.
+ */
+size_t obs_db_read(struct ObsDbReader *reader, size_t max_rows, int64_t valid_times[max_rows],
+                   double t_f[max_rows], double precip_in[max_rows]);
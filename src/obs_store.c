@@ -4,61 +4,295 @@
  */
 
 #include "download.h"
+#include "latency.h"
 #include "obs.h"
 #include "obs_db.h"
+#include "obs_store.h"
+#include "probes.h"
+#include "shm_cache.h"
+#include "slow_log.h"
 #include "utils.h"
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/stat.h>
+
 #include <curl/curl.h>
 #include <sqlite3.h>
 
-/** Abstraction of a data source.
- *
- * Abstracts away whether data is retrieved from a local database or retrieved from the web.
- * Data retrieved from the web will be stored in the local archive so future requests can be
- * fulfilled locally instead of via a web request.
- */
-struct ObsStore {
-    /** Local, on disk storage. */
-    sqlite3 *db;
-
-    /** Handle to cURL object in case a web request is needed. */
-    CURL *curl;
-
-    /** API Key for SynopticLabs API.
-     *
-     * This is an alias, so it must not be freed.
-     */
-    char const *const synoptic_labs_api_key;
-};
+/** How often (in seconds) obs_maintenance() does any work when it isn't forced. */
+#define OBS_STORE_MAINTENANCE_INTERVAL_SEC (24 * HOURSEC)
+
+struct ObsStoreConfig
+obs_store_config_profile(enum ObsStoreProfile profile)
+{
+    switch (profile) {
+    case OBS_STORE_PROFILE_READ_HEAVY:
+        return (struct ObsStoreConfig){.cache_size_kib = 64 * 1024,
+                                       .mmap_size = 256 * 1024 * 1024,
+                                       .temp_store_memory = true};
+
+    case OBS_STORE_PROFILE_BULK_INGEST:
+        return (struct ObsStoreConfig){.cache_size_kib = 32 * 1024,
+                                       .page_size = 16 * 1024,
+                                       .temp_store_memory = true,
+                                       .synchronous_off = true};
+
+    case OBS_STORE_PROFILE_DEFAULT:
+    default:
+        return (struct ObsStoreConfig){0};
+    }
+}
+
+/** Get the profile named by the OBS_STORE_PROFILE environment variable. */
+static struct ObsStoreConfig
+obs_store_config_from_env(void)
+{
+    char const *name = getenv("OBS_STORE_PROFILE");
+    if (!name || strcmp(name, "default") == 0) {
+        return obs_store_config_profile(OBS_STORE_PROFILE_DEFAULT);
+    } else if (strcmp(name, "read-heavy") == 0) {
+        return obs_store_config_profile(OBS_STORE_PROFILE_READ_HEAVY);
+    } else if (strcmp(name, "bulk-ingest") == 0) {
+        return obs_store_config_profile(OBS_STORE_PROFILE_BULK_INGEST);
+    }
+
+    fprintf(stderr, "unknown OBS_STORE_PROFILE %s, using the default\n", name);
+    return obs_store_config_profile(OBS_STORE_PROFILE_DEFAULT);
+}
 
 struct ObsStore *
 obs_connect(char const *const synoptic_labs_api_key)
+{
+    return obs_connect_with_config(synoptic_labs_api_key, 0);
+}
+
+struct ObsStore *
+obs_connect_with_config(char const *const synoptic_labs_api_key,
+                        struct ObsStoreConfig const *config)
 {
     struct ObsStore *new = calloc(1, sizeof(*new));
     StopIf(!new, return 0, "Memory allocation error.");
 
-    sqlite3 *db = obs_db_open_create();
-    StopIf(!db, goto ERR_RETURN, "unable to connect to sqlite");
-
-    struct ObsStore new_static = {
-        .synoptic_labs_api_key = synoptic_labs_api_key, .db = db, .curl = 0};
+    // The database isn't opened until it is needed, a query answered from the shared cache never
+    // touches it.
+    struct ObsStore new_static = {.synoptic_labs_api_key = synoptic_labs_api_key,
+                                  .curl = 0,
+                                  .config = config ? *config : obs_store_config_from_env()};
 
     memcpy(new, &new_static, sizeof(*new));
 
+    return new;
+}
+
+struct ObsStore *
+obs_connect_snapshot(char const *path, struct ObsStoreConfig const *config)
+{
+    assert(path);
+
+    struct ObsStoreConfig snapshot_config = obs_store_config_profile(OBS_STORE_PROFILE_READ_HEAVY);
+    if (config) {
+        snapshot_config = *config;
+    } else {
+        // Map the whole file, it never changes so there is nothing to keep coherent.
+        struct stat st = {0};
+        if (stat(path, &st) == 0 && st.st_size > snapshot_config.mmap_size) {
+            snapshot_config.mmap_size = st.st_size;
+        }
+    }
+
+    struct ObsStore *new = obs_connect_with_config("", &snapshot_config);
+    StopIf(!new, return 0, "Memory allocation error.");
+
+    new->snapshot_path = strdup(path);
+    StopIf(!new->snapshot_path, goto ERR_RETURN, "Memory allocation error.");
+
+    // Open it right away, so a missing or incompatible snapshot is found here.
+    StopIf(!obs_store_db(new), goto ERR_RETURN, "unable to open snapshot %s", path);
+
     return new;
 
 ERR_RETURN:
+    obs_close(&new);
+    return 0;
+}
+
+int
+obs_write_snapshot(struct ObsStore *store, char const *path)
+{
+    assert(store && path);
+    StopIf(store->snapshot_path, return -1, "%s is already a snapshot, copy the file instead",
+           store->snapshot_path);
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "snapshot aborted, unable to open the local store.");
+    StopIf(store->shards.num_shards > 1, return -1, "a sharded store can't be written to one file");
+
+    int rc = obs_db_write_snapshot(db, path);
+    StopIf(rc, return -1, "unable to write snapshot %s", path);
+
+    return 0;
+}
+
+long
+obs_export_changes(struct ObsStore *store, char const *path, int64_t after_seq,
+                   int64_t *last_seq)
+{
+    assert(store && path && last_seq);
+    StopIf(store->snapshot_path, return -1,
+           "a snapshot is read only, export from the store it came from");
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "export aborted, unable to open the local store.");
+    StopIf(store->shards.num_shards > 1, return -1, "a sharded store doesn't replicate changes");
+
+    long num_rows = obs_db_export_changes(db, path, after_seq, last_seq);
+    StopIf(num_rows < 0, return -1, "unable to write delta %s", path);
+
+    return num_rows;
+}
+
+long
+obs_import_changes(struct ObsStore *store, char const *path, int64_t *last_seq)
+{
+    assert(store && path);
+    StopIf(store->snapshot_path, return -1, "a snapshot is read only, it can't import changes");
 
-    free(new);
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "import aborted, unable to open the local store.");
+    StopIf(store->shards.num_shards > 1, return -1, "a sharded store doesn't replicate changes");
+
+    long num_rows = obs_db_import_changes(db, path, OBS_DB_REPLICATION_WATERMARK_SETTING, last_seq);
+    StopIf(num_rows < 0, return -1, "unable to apply delta %s", path);
+
+    return num_rows;
+}
+
+int
+obs_replication_watermark(struct ObsStore *store, int64_t *last_seq)
+{
+    assert(store && last_seq);
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "unable to open the local store.");
+
+    double value = 0.0;
+    int found = obs_db_get_setting(db, OBS_DB_REPLICATION_WATERMARK_SETTING, &value);
+    StopIf(found < 0, return -1, "unable to read the replication watermark");
+
+    *last_seq = found ? (int64_t)value : 0;
     return 0;
 }
 
+sqlite3 *
+obs_store_open_connection(struct ObsStore const *store)
+{
+    if (store->snapshot_path) {
+        return obs_db_open_snapshot(store->snapshot_path, &store->config);
+    }
+
+    return obs_db_open_create(&store->config);
+}
+
+sqlite3 *
+obs_store_db(struct ObsStore *store)
+{
+    if (!store->shards.dbs[0]) {
+        sqlite3 *db = obs_store_open_connection(store);
+        StopIf(!db, return 0, "unable to connect to sqlite");
+
+        int rc = obs_db_shards_init(&store->shards, db, &store->config);
+        StopIf(rc, obs_db_shards_close(&store->shards); return 0, "unable to find the shards");
+
+        if (!store->snapshot_path) {
+            obs_download_tuning_load(db, &store->tuning);
+        }
+    }
+
+    return store->shards.dbs[0];
+}
+
+sqlite3 *
+obs_store_site_db(struct ObsStore *store, char const *const site)
+{
+    StopIf(!obs_store_db(store), return 0, "unable to open the local store");
+
+    return obs_db_shards_site(&store->shards, site);
+}
+
+int
+obs_store_is_sharded(struct ObsStore *store)
+{
+    StopIf(!obs_store_db(store), return -1, "unable to open the local store");
+
+    return store->shards.num_shards > 1;
+}
+
+/** Get the file a site's queries use if it is already open, for the slow query log. */
+static sqlite3 *
+obs_store_open_site_db(struct ObsStore const *store, char const *const site)
+{
+    return store->shards.dbs[obs_db_shard_of(site, store->shards.num_shards)];
+}
+
+int
+obs_store_configure(struct ObsStore *store, struct ObsStoreConfig const *config)
+{
+    assert(store);
+    assert(config);
+
+    for (unsigned i = 0; i < OBS_STORE_MAX_SHARDS; i++) {
+        if (store->shards.dbs[i]) {
+            int rc = obs_db_apply_config(store->shards.dbs[i], config);
+            StopIf(rc, return -1, "unable to change the store config");
+        }
+    }
+
+    store->config = *config;
+    store->shards.config = *config;
+    return 0;
+}
+
+int
+obs_maintenance(struct ObsStore *store, bool force)
+{
+    assert(store);
+    StopIf(store->snapshot_path, return -1, "a snapshot is read only, it can't be maintained");
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "maintenance aborted, unable to open the local store.");
+
+    time_t now = time(0);
+
+    if (!force) {
+        double last = 0.0;
+        int found = obs_db_get_setting(db, OBS_DB_LAST_MAINTENANCE_SETTING, &last);
+        StopIf(found < 0, return -1, "unable to check when maintenance last ran");
+
+        if (found && difftime(now, (time_t)last) < OBS_STORE_MAINTENANCE_INTERVAL_SEC) {
+            return 0;
+        }
+    }
+
+    for (unsigned i = 0; i < store->shards.num_shards; i++) {
+        sqlite3 *shard_db = obs_db_shards_get(&store->shards, i);
+        StopIf(!shard_db, return -1, "maintenance aborted, unable to open shard %u", i);
+
+        int rc = obs_db_maintenance(shard_db, now);
+        StopIf(rc, obs_shm_cache_all_changed(); return -1, "maintenance failed");
+    }
+
+    // Cached results may include the observations that were just removed.
+    obs_shm_cache_all_changed();
+
+    return 1;
+}
+
 void
 obs_close(struct ObsStore **store)
 {
@@ -66,88 +300,386 @@ obs_close(struct ObsStore **store)
 
     struct ObsStore *ptr = *store;
 
-    int result = obs_db_close(ptr->db);
-    if (result != SQLITE_OK) {
-        fprintf(stderr, "ERROR closing ObsStore.\n");
+    if (ptr->shards.dbs[0] && !ptr->snapshot_path) {
+        obs_download_tuning_save(ptr->shards.dbs[0], &ptr->tuning);
+    }
+    obs_db_shards_close(&ptr->shards);
+
+    if (ptr->shared_cache) {
+        obs_shm_cache_detach();
     }
 
+    obs_slow_log_free(&ptr->slow_log);
+    free(ptr->snapshot_path);
+
     // Clean up curl if necessary.
     if (ptr->curl) {
         curl_easy_cleanup(ptr->curl);
         curl_global_cleanup();
     }
 
+    free(ptr);
+
     // Nullify the pointer.
     *store = 0;
 
     return;
 }
 
+int
+obs_attach_shared_cache(struct ObsStore *store)
+{
+    assert(store);
+    StopIf(store->snapshot_path, return -1, "a snapshot doesn't use the shared result cache");
+
+    if (store->shared_cache) {
+        return 0;
+    }
+
+    int rc = obs_shm_cache_attach();
+    StopIf(rc, return -1, "unable to attach the shared result cache");
+
+    store->shared_cache = true;
+    return 0;
+}
+
+int
+obs_set_slow_query_log(struct ObsStore *store, char const *path, double threshold_ms,
+                       size_t max_bytes)
+{
+    assert(store);
+
+    int rc = obs_slow_log_set(&store->slow_log, path, threshold_ms, max_bytes);
+    StopIf(rc, return -1, "unable to set up the slow query log");
+
+    return 0;
+}
+
+/** The shared cache op for precipitation queries, temperature queries use their max_min_mode. */
+#define OBS_STORE_CACHE_PRECIP 3
+
+/** Download the missing data for a group of sites, requesting them all together.
+ *
+ * \param store is the store to download into.
+ * \param num_sites is the number of sites in \a sites.
+ * \param sites are the lowercase site identifiers.
+ * \param missing are the time ranges missing for any of the sites. They are split and merged into
+ * requests by obs_download_plan(), and emptied afterwards.
+ *
+ * \returns the result of obs_download_sharded_ranges(), or 0 if there was nothing to do.
+ */
+static int
+obs_store_refresh_group(struct ObsStore *store, size_t num_sites, char const *sites[num_sites],
+                        struct ObsTimeRangeSet *missing)
+{
+    if (num_sites == 0 || missing->len == 0) {
+        obs_time_range_set_free(missing);
+        return 0;
+    }
+
+    int rc = obs_download_sharded_ranges(&store->shards, &store->curl,
+                                         store->synoptic_labs_api_key, num_sites, sites,
+                                         missing->len, missing->ranges, &store->tuning);
+    obs_time_range_set_free(missing);
+
+    return rc;
+}
+
+/** The total number of seconds covered by a set of time ranges. */
+static time_t
+obs_store_set_seconds(struct ObsTimeRangeSet const *set)
+{
+    time_t total = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        total += set->ranges[i].end - set->ranges[i].start;
+    }
+
+    return total;
+}
+
+/** Count the seconds in \a set that are not in \a other.
+ *
+ * \returns the number of seconds, or a negative number if memory couldn't be allocated.
+ */
+static time_t
+obs_store_seconds_not_in(struct ObsTimeRangeSet const *set, struct ObsTimeRangeSet const *other)
+{
+    struct ObsTimeRangeSet extra = {0};
+    if (obs_time_range_set_union(&extra, set) || obs_time_range_set_difference(&extra, other)) {
+        obs_time_range_set_free(&extra);
+        return -1;
+    }
+
+    time_t seconds = obs_store_set_seconds(&extra);
+    obs_time_range_set_free(&extra);
+
+    return seconds;
+}
+
+/** Sites that will be downloaded in the same requests, and the ranges missing for any of them. */
+struct ObsStoreRefreshGroup {
+    char const *sites[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST];
+    size_t num_sites;
+    struct ObsTimeRangeSet missing;
+};
+
+/** Find the group a site's downloads fit in best.
+ *
+ * Joining a group means every site in it is also requested for the site's missing ranges, and the
+ * site is requested for the ranges the group is missing. A site only joins a group when
+ * downloading that extra data takes less time than the separate requests it saves.
+ *
+ * \returns the index of the group, \a num_groups if the site should start a new group, or a
+ * negative number if memory couldn't be allocated.
+ */
+static ptrdiff_t
+obs_store_refresh_pick_group(struct ObsDownloadTuning const *tuning, size_t num_groups,
+                             struct ObsStoreRefreshGroup const groups[num_groups],
+                             struct ObsTimeRangeSet const *site_missing)
+{
+    double const sec_per_site_hour = tuning->bytes_per_site_hour / tuning->bytes_per_sec;
+
+    ptrdiff_t best = num_groups;
+    double best_waste_sec = tuning->latency_sec;
+
+    for (size_t g = 0; g < num_groups; g++) {
+        time_t group_only = obs_store_seconds_not_in(&groups[g].missing, site_missing);
+        time_t site_only = obs_store_seconds_not_in(site_missing, &groups[g].missing);
+        if (group_only < 0 || site_only < 0) {
+            return -1;
+        }
+
+        double wasted_site_hours = (group_only + site_only * (double)groups[g].num_sites) / 3600.0;
+        double waste_sec = wasted_site_hours * sec_per_site_hour;
+        if (waste_sec <= best_waste_sec) {
+            best = g;
+            best_waste_sec = waste_sec;
+        }
+    }
+
+    return best;
+}
+
+int
+obs_refresh(struct ObsStore *store, size_t num_sites, char const *const sites[],
+            struct ObsTimeRange tr)
+{
+    assert(store);
+    assert(sites || num_sites == 0);
+    assert(tr.start < tr.end && "backwards time range");
+    StopIf(store->snapshot_path, return -1, "a snapshot is read only, it can't be refreshed");
+
+    double start = obs_util_monotonic_ms();
+
+    sqlite3 *db = obs_store_db(store);
+    StopIf(!db, return -1, "refresh aborted, unable to open the local store.");
+
+    int rc = 0;
+
+    char(*site_bufs)[32] = calloc(num_sites, sizeof(*site_bufs));
+    StopIf(num_sites && !site_bufs, return -1, "out of memory");
+
+    // Sites are grouped by the ranges they are missing, so a site missing an hour isn't
+    // downloaded again for the years another site is missing.
+    struct ObsStoreRefreshGroup *groups = 0;
+    size_t num_groups = 0;
+
+    for (size_t i = 0; i < num_sites; i++) {
+        obs_util_strcpy_to_lowercase(sizeof(site_bufs[i]), site_bufs[i], sites[i]);
+
+        struct ObsTimeRange *missing_ranges = 0;
+        size_t num_missing_ranges = 0;
+
+        sqlite3 *site_db = obs_db_shards_site(&store->shards, site_bufs[i]);
+        int have_data = site_db ? obs_db_have_inventory(site_db, site_bufs[i], tr, &missing_ranges,
+                                                        &num_missing_ranges)
+                                : -1;
+        if (have_data < 0) {
+            fprintf(stderr, "refresh skipping %s, database error.\n", site_bufs[i]);
+            rc = -1;
+            continue;
+        }
+
+        if (have_data) {
+            continue;
+        }
+
+        struct ObsTimeRangeSet site_missing = {.ranges = missing_ranges,
+                                               .len = num_missing_ranges,
+                                               .capacity = num_missing_ranges};
+
+        ptrdiff_t g = obs_store_refresh_pick_group(&store->tuning, num_groups, groups,
+                                                   &site_missing);
+        if (g == (ptrdiff_t)num_groups) {
+            struct ObsStoreRefreshGroup *new_groups =
+                realloc(groups, (num_groups + 1) * sizeof(*groups));
+            if (new_groups) {
+                groups = new_groups;
+                groups[num_groups] = (struct ObsStoreRefreshGroup){0};
+                num_groups++;
+            } else {
+                g = -1;
+            }
+        }
+
+        // Request the ranges missing for any site in the group, not the gaps between them.
+        int union_rc = g < 0 ? -1 : obs_time_range_set_union(&groups[g].missing, &site_missing);
+        obs_time_range_set_free(&site_missing);
+        StopIf(union_rc, rc = -1; break, "out of memory");
+
+        struct ObsStoreRefreshGroup *group = &groups[g];
+        group->sites[group->num_sites] = site_bufs[i];
+        group->num_sites++;
+
+        if (group->num_sites == OBS_DOWNLOAD_MAX_SITES_PER_REQUEST) {
+            int dl_rc = obs_store_refresh_group(store, group->num_sites, group->sites,
+                                                &group->missing);
+            StopIf(dl_rc < 0, rc = -1, "Error downloading data.");
+            group->num_sites = 0;
+        }
+    }
+
+    for (size_t g = 0; g < num_groups; g++) {
+        int dl_rc = obs_store_refresh_group(store, groups[g].num_sites, groups[g].sites,
+                                            &groups[g].missing);
+        StopIf(dl_rc < 0, rc = -1, "Error downloading data.");
+    }
+
+    free(groups);
+    free(site_bufs);
+
+    obs_latency_record(OBS_LATENCY_REFRESH, obs_util_monotonic_ms() - start);
+    return rc;
+}
+
+/** Make sure a site's observations for a time range are stored, downloading what is missing.
+ *
+ * \param db is the file the site is stored in.
+ * \param site_buf is the lowercase site identifier.
+ * \param tr is the time range the hourly values are needed for.
+ * \param profile is where the timings and counts for the slow query log are recorded.
+ *
+ * \returns 1 if everything was already stored, 0 if the missing ranges were downloaded, or a
+ * negative number on error.
+ */
+static int
+obs_store_ensure_data(struct ObsStore *store, sqlite3 *db, char const *const site_buf,
+                      struct ObsTimeRange tr, struct ObsQueryProfile *profile)
+{
+    // A snapshot has everything it will ever have, so there is nothing to check or download.
+    if (store->snapshot_path) {
+        return 1;
+    }
+
+    struct ObsTimeRange *missing_ranges = 0;
+    size_t num_missing_ranges = 0;
+
+    double phase_start = obs_util_monotonic_ms();
+    int have_data = obs_db_have_inventory(db, site_buf, tr, &missing_ranges, &num_missing_ranges);
+    profile->phase_ms[OBS_QUERY_PHASE_INVENTORY] = obs_util_monotonic_ms() - phase_start;
+
+    StopIf(have_data < 0, return -1, "database error checking the inventory.");
+
+    if (!have_data) {
+        profile->num_missing_ranges = num_missing_ranges;
+
+        phase_start = obs_util_monotonic_ms();
+        int rc = obs_download_ranges(db, &store->curl, store->synoptic_labs_api_key, site_buf,
+                                     num_missing_ranges, missing_ranges, &store->tuning);
+        profile->phase_ms[OBS_QUERY_PHASE_DOWNLOAD] = obs_util_monotonic_ms() - phase_start;
+
+        free(missing_ranges);
+        StopIf(rc < 0, return rc, "Error downloading data.");
+    }
+
+    return have_data;
+}
+
 /** Internal implementation of obs_query_max_t() and obs_query_min_t().
  *
  * \param store - same as \ref obs_query_max_t()
- * \param site - same as \ref obs_query_max_t()
+ * \param site_buf - the lowercase site identifier.
  * \param time_range - same as \ref obs_query_max_t()
  * \param window_end - same as \ref obs_query_max_t()
  * \param window_length - same as \ref obs_query_max_t()
  * \param results - same as \ref obs_query_max_t()
  * \param num_results - same as \ref obs_query_max_t()
  * \param max_min_mode is either \ref OBS_DB_MAX_MODE or \ref OBS_DB_MIN_MODE.
+ * \param profile is where the timings and counts for the slow query log are recorded.
  *
- * All parameters other than \a max_min_mode are as in \ref obs_query_max_t() and
+ * The site must already be lowercase. All parameters other than \a max_min_mode and \a profile
+ * are as in \ref obs_query_max_t() and
  * \ref obs_query_min_t().
  */
 static int
-obs_store_query_t(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+obs_store_query_t(struct ObsStore *store, char const *const site_buf, struct ObsTimeRange tr,
                   unsigned window_end, unsigned window_length, struct ObsTemperature **results,
-                  size_t *num_results, int max_min_mode)
+                  size_t *num_results, int max_min_mode, struct ObsQueryProfile *profile)
 {
-    assert(store);
-    assert(site);
-    assert(tr.start < tr.end && "backwards time range");
-    assert(window_end <= 24 && "there is only 24 hours in a day");
-    assert(results && !*results && num_results && !*num_results);
-    assert(max_min_mode == OBS_DB_MAX_MODE || max_min_mode == OBS_DB_MIN_MODE);
+    struct ObsShmCacheKey key = {.op = max_min_mode,
+                                 .arg = {window_end, window_length},
+                                 .start = tr.start,
+                                 .end = tr.end};
+    strcpy(key.site, site_buf);
 
-    char site_buf[32] = {0};
-    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+    uint64_t generation = 0;
+    struct ObsShmCacheValue cached[OBS_SHM_CACHE_MAX_VALUES];
+    size_t num_cached = 0;
+    double phase_start = obs_util_monotonic_ms();
+    bool hit = store->shared_cache && obs_shm_cache_get(&key, cached, &num_cached, &generation);
+    profile->phase_ms[OBS_QUERY_PHASE_CACHE] = obs_util_monotonic_ms() - phase_start;
+
+    if (hit) {
+        profile->cache_hit = true;
+        *results = calloc(num_cached ? num_cached : 1, sizeof(**results));
+        StopIf(!*results, return -1, "out of memory");
+
+        for (size_t i = 0; i < num_cached; i++) {
+            (*results)[i] = (struct ObsTemperature){.valid_time = cached[i].valid_time,
+                                                    .temperature_f = cached[i].value};
+        }
+        *num_results = num_cached;
+        profile->num_results = num_cached;
+        return 0;
+    }
+
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "temperature query aborted, unable to open the local store.");
+    obs_slow_log_watch(&store->slow_log, profile, db);
 
     // Expand the time range to get enough data for ALL windows ending in the provided time range.
     struct ObsTimeRange need_hourlies_tr = tr;
     need_hourlies_tr.start -= HOURSEC * window_length;
 
-    struct ObsTimeRange *missing_ranges = 0;
-    size_t num_missing_ranges = 0;
-
-    int have_data = obs_db_have_inventory(store->db, site_buf, need_hourlies_tr, &missing_ranges,
-                                          &num_missing_ranges);
+    int have_data = obs_store_ensure_data(store, db, site_buf, need_hourlies_tr, profile);
+    StopIf(have_data < 0, return have_data, "temperature query aborted.");
 
-    StopIf(have_data < 0, return -1, "temperature query aborted, database error.");
-
-    int rc = 0;
-    if (!have_data) {
-        for (size_t i = 0; i < num_missing_ranges; i++) {
+    // Just take whatever data is available from the database now that we've tried to update it.
+    struct ObsDbQueryStats stats = {0};
+    int rc = obs_db_query_temperatures(db, max_min_mode, site_buf, tr, window_end, window_length,
+                                       results, num_results, &stats);
+    StopIf(rc < 0, goto ERR_RETURN, "Error fetching data from local store.");
 
-            rc = obs_download(store->db, &store->curl, store->synoptic_labs_api_key, site_buf,
-                              missing_ranges[i]);
+    profile->phase_ms[OBS_QUERY_PHASE_FETCH] = stats.fetch_ms;
+    profile->phase_ms[OBS_QUERY_PHASE_WINDOW] = stats.window_ms;
+    profile->num_rows = stats.num_rows;
+    profile->num_results = *num_results;
 
-            StopIf(rc < 0, goto ERR_RETURN, "Error downloading data.");
+    // Only share complete results.
+    if (store->shared_cache && have_data && *num_results <= OBS_SHM_CACHE_MAX_VALUES) {
+        for (size_t i = 0; i < *num_results; i++) {
+            cached[i] = (struct ObsShmCacheValue){(*results)[i].valid_time,
+                                                  (*results)[i].temperature_f};
         }
+        obs_shm_cache_put(&key, generation, *num_results, cached);
     }
 
-    // Just take whatever data is available from the database now that we've tried to update it.
-    rc = obs_db_query_temperatures(store->db, max_min_mode, site_buf, tr, window_end, window_length,
-                                   results, num_results);
-    StopIf(rc < 0, goto ERR_RETURN, "Error fetching data from local store.");
-
-    free(missing_ranges);
     return rc;
 
 ERR_RETURN:
 
     // Ensure these invariants are still in place.
     assert(num_results && !*num_results && results && !*results);
-    free(missing_ranges);
     return rc;
 }
 
@@ -163,8 +695,24 @@ obs_query_max_t(struct ObsStore *store, char const *const site, struct ObsTimeRa
     assert(window_end <= 24 && "there is only 24 hours in a day");
     assert(num_results && !*num_results && results && !*results);
 
-    return obs_store_query_t(store, site, tr, window_end, window_length, results, num_results,
-                             OBS_DB_MAX_MODE);
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_max_t",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_end, window_length},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_t(store, site_buf, tr, window_end, window_length, results,
+                               num_results, OBS_DB_MAX_MODE, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_MAX_T, obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
+    return rc;
 }
 
 int
@@ -179,8 +727,105 @@ obs_query_min_t(struct ObsStore *store, char const *const site, struct ObsTimeRa
     assert(window_end <= 24 && "there is only 24 hours in a day");
     assert(num_results && !*num_results && results && !*results);
 
-    return obs_store_query_t(store, site, tr, window_end, window_length, results, num_results,
-                             OBS_DB_MIN_MODE);
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_min_t",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_end, window_length},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_t(store, site_buf, tr, window_end, window_length, results,
+                               num_results, OBS_DB_MIN_MODE, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_MIN_T, obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
+    return rc;
+}
+
+/** Internal implementation of obs_query_precipitation().
+ *
+ * \param site_buf is the lowercase site identifier.
+ * \param profile is where the timings and counts for the slow query log are recorded.
+ *
+ * All other parameters are as in \ref obs_query_precipitation().
+ */
+static int
+obs_store_query_precipitation(struct ObsStore *store, char const *const site_buf,
+                              struct ObsTimeRange tr, unsigned window_length,
+                              unsigned window_increment, unsigned window_offset,
+                              struct ObsPrecipitation **results, size_t *num_results,
+                              struct ObsQueryProfile *profile)
+{
+    struct ObsShmCacheKey key = {.op = OBS_STORE_CACHE_PRECIP,
+                                 .arg = {window_length, window_increment, window_offset},
+                                 .start = tr.start,
+                                 .end = tr.end};
+    strcpy(key.site, site_buf);
+
+    uint64_t generation = 0;
+    struct ObsShmCacheValue cached[OBS_SHM_CACHE_MAX_VALUES];
+    size_t num_cached = 0;
+    double phase_start = obs_util_monotonic_ms();
+    bool hit = store->shared_cache && obs_shm_cache_get(&key, cached, &num_cached, &generation);
+    profile->phase_ms[OBS_QUERY_PHASE_CACHE] = obs_util_monotonic_ms() - phase_start;
+
+    if (hit) {
+        profile->cache_hit = true;
+        *results = calloc(num_cached ? num_cached : 1, sizeof(**results));
+        StopIf(!*results, return -1, "out of memory");
+
+        for (size_t i = 0; i < num_cached; i++) {
+            (*results)[i] = (struct ObsPrecipitation){.valid_time = cached[i].valid_time,
+                                                      .precip_in = cached[i].value};
+        }
+        *num_results = num_cached;
+        profile->num_results = num_cached;
+        return 0;
+    }
+
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "precipitation query aborted, unable to open the local store.");
+    obs_slow_log_watch(&store->slow_log, profile, db);
+
+    // Expand the time range to get enough data for ALL windows ending in the provided time range.
+    struct ObsTimeRange need_hourlies_tr = tr;
+    need_hourlies_tr.start -= HOURSEC * window_length;
+
+    int have_data = obs_store_ensure_data(store, db, site_buf, need_hourlies_tr, profile);
+    StopIf(have_data < 0, return have_data, "precipitation query aborted.");
+
+    // Just take whatever data is available from the database now that we have tried to update it.
+    struct ObsDbQueryStats stats = {0};
+    int rc = obs_db_query_precipitation(db, site_buf, tr, window_length, window_increment,
+                                        window_offset, results, num_results, &stats);
+    StopIf(rc < 0, goto ERR_RETURN, "Error fetching data from local store.");
+
+    profile->phase_ms[OBS_QUERY_PHASE_FETCH] = stats.fetch_ms;
+    profile->phase_ms[OBS_QUERY_PHASE_WINDOW] = stats.window_ms;
+    profile->num_rows = stats.num_rows;
+    profile->num_results = *num_results;
+
+    // Only share complete results.
+    if (store->shared_cache && have_data && *num_results <= OBS_SHM_CACHE_MAX_VALUES) {
+        for (size_t i = 0; i < *num_results; i++) {
+            cached[i] =
+                (struct ObsShmCacheValue){(*results)[i].valid_time, (*results)[i].precip_in};
+        }
+        obs_shm_cache_put(&key, generation, *num_results, cached);
+    }
+
+    return rc;
+
+ERR_RETURN:
+
+    // Ensure these invariants are still in place.
+    assert(num_results && !*num_results && results && !*results);
+    return rc;
 }
 
 int
@@ -198,41 +843,260 @@ obs_query_precipitation(struct ObsStore *store, char const *const site, struct O
     char site_buf[32] = {0};
     obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
 
+    struct ObsQueryProfile profile = {.api = "obs_query_precipitation",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_length, window_increment, window_offset},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_precipitation(store, site_buf, tr, window_length, window_increment,
+                                           window_offset, results, num_results, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_PRECIPITATION,
+                       obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
+    return rc;
+}
+
+/** Internal implementation of obs_query_daily_summary().
+ *
+ * \param site_buf is the lowercase site identifier.
+ * \param profile is where the timings and counts for the slow query log are recorded.
+ *
+ * All other parameters are as in \ref obs_query_daily_summary().
+ */
+static int
+obs_store_query_daily_summary(struct ObsStore *store, char const *const site_buf,
+                              struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
+                              struct ObsDailySummary **results, size_t *num_results,
+                              struct ObsQueryProfile *profile)
+{
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "daily summary query aborted, unable to open the local store.");
+    obs_slow_log_watch(&store->slow_log, profile, db);
+
     // Expand the time range to get enough data for ALL windows ending in the provided time range.
     struct ObsTimeRange need_hourlies_tr = tr;
     need_hourlies_tr.start -= HOURSEC * window_length;
 
-    struct ObsTimeRange *missing_ranges = 0;
-    size_t num_missing_ranges = 0;
+    int have_data = obs_store_ensure_data(store, db, site_buf, need_hourlies_tr, profile);
+    StopIf(have_data < 0, return have_data, "daily summary query aborted.");
 
-    int have_data = obs_db_have_inventory(store->db, site_buf, need_hourlies_tr, &missing_ranges,
-                                          &num_missing_ranges);
+    struct ObsDbQueryStats stats = {0};
+    int rc = obs_db_query_daily_summary(db, site_buf, tr, window_end, window_length, results,
+                                        num_results, &stats);
+    StopIf(rc < 0, return rc, "Error fetching data from local store.");
 
-    StopIf(have_data < 0, return -1, "precipitation query aborted, database error.");
+    profile->phase_ms[OBS_QUERY_PHASE_FETCH] = stats.fetch_ms;
+    profile->phase_ms[OBS_QUERY_PHASE_WINDOW] = stats.window_ms;
+    profile->num_rows = stats.num_rows;
+    profile->num_results = *num_results;
 
-    int rc = 0;
-    if (!have_data) {
-        for (size_t i = 0; i < num_missing_ranges; i++) {
-            rc = obs_download(store->db, &store->curl, store->synoptic_labs_api_key, site_buf,
-                              missing_ranges[i]);
+    return 0;
+}
 
-            StopIf(rc < 0, goto ERR_RETURN, "Error downloading data.");
-        }
-    }
+int
+obs_query_daily_summary(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsDailySummary **results, size_t *num_results)
+{
+    // These conditions are specified in the documentation.
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
+    assert(num_results && !*num_results && results && !*results);
 
-    // Just take whatever data is available from the database now that we have tried to update it.
-    rc = obs_db_query_precipitation(store->db, site_buf, tr, window_length, window_increment,
-                                    window_offset, results, num_results);
-    StopIf(rc < 0, goto ERR_RETURN, "Error fetching data from local store.");
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_daily_summary",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_end, window_length},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_daily_summary(store, site_buf, tr, window_end, window_length, results,
+                                           num_results, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_DAILY_SUMMARY,
+                       obs_util_monotonic_ms() - profile.start_ms);
 
-    free(missing_ranges);
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
 
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
     return rc;
+}
 
-ERR_RETURN:
+/** Internal implementation of obs_query_max_t_compact() and obs_query_min_t_compact().
+ *
+ * The same as obs_store_query_t(), without the shared cache.
+ */
+static int
+obs_store_query_t_compact(struct ObsStore *store, char const *const site_buf,
+                          struct ObsTimeRange tr, unsigned window_end, unsigned window_length,
+                          struct ObsTemperatureCompact **results, size_t *num_results,
+                          int max_min_mode, struct ObsQueryProfile *profile)
+{
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "temperature query aborted, unable to open the local store.");
+    obs_slow_log_watch(&store->slow_log, profile, db);
 
-    // Ensure these invariants are still in place.
+    // Expand the time range to get enough data for ALL windows ending in the provided time range.
+    struct ObsTimeRange need_hourlies_tr = tr;
+    need_hourlies_tr.start -= HOURSEC * window_length;
+
+    int have_data = obs_store_ensure_data(store, db, site_buf, need_hourlies_tr, profile);
+    StopIf(have_data < 0, return have_data, "temperature query aborted.");
+
+    struct ObsDbQueryStats stats = {0};
+    int rc = obs_db_query_temperatures_compact(db, max_min_mode, site_buf, tr, window_end,
+                                               window_length, results, num_results, &stats);
+    StopIf(rc < 0, return rc, "Error fetching data from local store.");
+
+    profile->phase_ms[OBS_QUERY_PHASE_FETCH] = stats.fetch_ms;
+    profile->phase_ms[OBS_QUERY_PHASE_WINDOW] = stats.window_ms;
+    profile->num_rows = stats.num_rows;
+    profile->num_results = *num_results;
+
+    return 0;
+}
+
+int
+obs_query_max_t_compact(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsTemperatureCompact **results, size_t *num_results)
+{
+    // These conditions are specified in the documentation.
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
+    assert(num_results && !*num_results && results && !*results);
+
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_max_t_compact",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_end, window_length},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_t_compact(store, site_buf, tr, window_end, window_length, results,
+                                       num_results, OBS_DB_MAX_MODE, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_MAX_T_COMPACT,
+                       obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
+    return rc;
+}
+
+int
+obs_query_min_t_compact(struct ObsStore *store, char const *const site, struct ObsTimeRange tr,
+                        unsigned window_end, unsigned window_length,
+                        struct ObsTemperatureCompact **results, size_t *num_results)
+{
+    // These conditions are specified in the documentation.
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_end <= 24 && "there is only 24 hours in a day");
     assert(num_results && !*num_results && results && !*results);
-    free(missing_ranges);
+
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_min_t_compact",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_end, window_length},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_t_compact(store, site_buf, tr, window_end, window_length, results,
+                                       num_results, OBS_DB_MIN_MODE, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_MIN_T_COMPACT,
+                       obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
+    return rc;
+}
+
+/** Internal implementation of obs_query_precipitation_compact().
+ *
+ * The same as obs_store_query_precipitation(), without the shared cache.
+ */
+static int
+obs_store_query_precipitation_compact(struct ObsStore *store, char const *const site_buf,
+                                      struct ObsTimeRange tr, unsigned window_length,
+                                      unsigned window_increment, unsigned window_offset,
+                                      struct ObsPrecipitationCompact **results,
+                                      size_t *num_results, struct ObsQueryProfile *profile)
+{
+    sqlite3 *db = obs_store_site_db(store, site_buf);
+    StopIf(!db, return -1, "precipitation query aborted, unable to open the local store.");
+    obs_slow_log_watch(&store->slow_log, profile, db);
+
+    // Expand the time range to get enough data for ALL windows ending in the provided time range.
+    struct ObsTimeRange need_hourlies_tr = tr;
+    need_hourlies_tr.start -= HOURSEC * window_length;
+
+    int have_data = obs_store_ensure_data(store, db, site_buf, need_hourlies_tr, profile);
+    StopIf(have_data < 0, return have_data, "precipitation query aborted.");
+
+    struct ObsDbQueryStats stats = {0};
+    int rc = obs_db_query_precipitation_compact(db, site_buf, tr, window_length, window_increment,
+                                                window_offset, results, num_results, &stats);
+    StopIf(rc < 0, return rc, "Error fetching data from local store.");
+
+    profile->phase_ms[OBS_QUERY_PHASE_FETCH] = stats.fetch_ms;
+    profile->phase_ms[OBS_QUERY_PHASE_WINDOW] = stats.window_ms;
+    profile->num_rows = stats.num_rows;
+    profile->num_results = *num_results;
+
+    return 0;
+}
+
+int
+obs_query_precipitation_compact(struct ObsStore *store, char const *const site,
+                                struct ObsTimeRange tr, unsigned window_length,
+                                unsigned window_increment, unsigned window_offset,
+                                struct ObsPrecipitationCompact **results, size_t *num_results)
+{
+    // These conditions are specified in the documentation.
+    assert(store);
+    assert(site);
+    assert(tr.start < tr.end && "backwards time range");
+    assert(window_offset <= 24 && "there is only 24 hours in a day");
+    assert(num_results && !*num_results && results && !*results);
+
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    struct ObsQueryProfile profile = {.api = "obs_query_precipitation_compact",
+                                      .site = site_buf,
+                                      .time_range = tr,
+                                      .args = {window_length, window_increment, window_offset},
+                                      .start_ms = obs_util_monotonic_ms()};
+
+    OBS_PROBE4(query_entry, profile.api, site_buf, tr.start, tr.end);
+    int rc = obs_store_query_precipitation_compact(store, site_buf, tr, window_length,
+                                                   window_increment, window_offset, results,
+                                                   num_results, &profile);
+    obs_latency_record(OBS_LATENCY_QUERY_PRECIPITATION_COMPACT,
+                       obs_util_monotonic_ms() - profile.start_ms);
+
+    OBS_PROBE4(query_return, profile.api, site_buf, *num_results, rc);
+
+    obs_slow_log_finish(&store->slow_log, &profile, obs_store_open_site_db(store, site_buf), rc);
     return rc;
 }
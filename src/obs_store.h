@@ -0,0 +1,82 @@
+#pragma once
+/** \file obs_store.h
+ *
+ * \brief Internal definition of the ObsStore, shared by the modules that implement the public API.
+ */
+#include "download.h"
+#include "obs.h"
+#include "obs_db.h"
+#include "slow_log.h"
+
+#include <stdbool.h>
+
+#include <curl/curl.h>
+#include <sqlite3.h>
+
+/** Abstraction of a data source.
+ *
+ * Abstracts away whether data is retrieved from a local database or retrieved from the web.
+ * Data retrieved from the web will be stored in the local archive so future requests can be
+ * fulfilled locally instead of via a web request.
+ */
+struct ObsStore {
+    /** Local, on disk storage, not opened until it is first needed. Use obs_store_db() to get the
+     * main file and obs_store_site_db() to get the file a site is kept in. */
+    struct ObsDbShards shards;
+
+    /** Handle to cURL object in case a web request is needed. */
+    CURL *curl;
+
+    /** Download throughput measurements, saved in the main file when the store is closed. */
+    struct ObsDownloadTuning tuning;
+
+    /** The storage settings \ref shards were opened with. */
+    struct ObsStoreConfig config;
+
+    /** Is the store using the shared memory result cache? */
+    bool shared_cache;
+
+    /** Where to log slow queries, off unless obs_set_slow_query_log() is called. */
+    struct ObsSlowLog slow_log;
+
+    /** The snapshot file for a store opened by obs_connect_snapshot(), \c NULL for the local
+     * archive. A store with a snapshot never downloads or writes anything. */
+    char *snapshot_path;
+
+    /** API Key for SynopticLabs API.
+     *
+     * This is an alias, so it must not be freed.
+     */
+    char const *const synoptic_labs_api_key;
+};
+
+/** Get the main file of the local storage of a store, opening it if this is the first time it is
+ * needed.
+ *
+ * The main file holds the settings and the backfill queue, and all the observations unless the
+ * archive is split into shards.
+ *
+ * \returns the database handle, or \c NULL if it couldn't be opened.
+ */
+sqlite3 *obs_store_db(struct ObsStore *store);
+
+/** Get the file of the local storage a site is kept in, opening it if needed.
+ *
+ * \returns the database handle, or \c NULL if it couldn't be opened.
+ */
+sqlite3 *obs_store_site_db(struct ObsStore *store, char const *const site);
+
+/** Is the local storage of a store split into more than one file?
+ *
+ * Snapshots, backups and the change log only work with a single file.
+ *
+ * \returns 1 if it is, 0 if it isn't, or -1 if the store couldn't be opened.
+ */
+int obs_store_is_sharded(struct ObsStore *store);
+
+/** Open another connection to the main file of the same storage as a store, for use on another
+ * thread. Pass it to obs_db_shards_init() to reach the other files.
+ *
+ * \returns the database handle, or \c NULL if it couldn't be opened.
+ */
+sqlite3 *obs_store_open_connection(struct ObsStore const *store);
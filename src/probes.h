@@ -0,0 +1,48 @@
+#pragma once
+/** \file probes.h
+ *
+ * \brief Static user level tracepoints (USDT) for perf, bpftrace and other tracers.
+ *
+ * When systemtap's sys/sdt.h is installed the makefile defines \c OBS_HAVE_SDT and every probe is
+ * a single nop instruction in the \c obsdb provider, which costs nothing until a tracer attaches
+ * to it. Without it the probes compile to nothing and their arguments are never evaluated.
+ *
+ * Probes and their arguments, site arguments are lowercase nul terminated strings:
+ *
+ *  - query_entry(api, site, start, end) and query_return(api, site, num_results, rc) around
+ *    obs_query_max_t(), obs_query_min_t(), obs_query_precipitation(), their \c _compact
+ *    versions and obs_query_daily_summary(), \c api is the name of the function.
+ *  - inventory_entry(site, start, end) and inventory_return(site, num_missing_ranges, rc) around
+ *    obs_db_have_inventory().
+ *  - download_entry(site, num_sites, start, end) and download_return(site, num_sites, rc) around
+ *    every download, \c site is the first site requested.
+ *  - curl_callback_entry(num_bytes) and curl_callback_return(num_bytes, num_rows) around each
+ *    piece of a response, \c num_rows is the number of rows stored from the response so far.
+ *  - row_callback_entry(num_rows) and row_callback_return(site, valid_time, stored) around each
+ *    row of a response, \c site is \c NULL if the row wasn't for a requested site. Rows are
+ *    stored in batches, so \c stored means the row was queued to be stored.
+ *  - window_temperature_entry(site, num_hourlies), window_temperature_return(site, num_results)
+ *    and the same for window_precipitation around the loops that combine hourly values into
+ *    windows.
+ */
+
+#ifdef OBS_HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define OBS_PROBE1(name, a) DTRACE_PROBE1(obsdb, name, a)
+#define OBS_PROBE2(name, a, b) DTRACE_PROBE2(obsdb, name, a, b)
+#define OBS_PROBE3(name, a, b, c) DTRACE_PROBE3(obsdb, name, a, b, c)
+#define OBS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(obsdb, name, a, b, c, d)
+
+#else
+
+// sizeof doesn't evaluate its operand, but it keeps variables only used by probes from looking
+// unused.
+#define OBS_PROBE1(name, a) ((void)sizeof(a))
+#define OBS_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define OBS_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define OBS_PROBE4(name, a, b, c, d)                                                           \
+    ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+
+#endif
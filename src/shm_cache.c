@@ -0,0 +1,331 @@
+/** \file shm_cache.c
+ *
+ * \brief Implementation of the cross process query result cache.
+ *
+ * Slots are published with a sequence lock. A writer claims a slot by moving its sequence number
+ * from even to odd with a compare and swap, fills it in, and makes it even again. A reader copies
+ * the slot and only trusts the copy if the sequence number was even and unchanged throughout.
+ */
+#include "shm_cache.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Marks an initialized segment, "OBSC" in ASCII. */
+#define OBS_SHM_CACHE_MAGIC 0x4F425343u
+
+/** Bumped whenever the layout of the segment changes. */
+#define OBS_SHM_CACHE_VERSION 1
+
+/** The number of sets in the hash table. */
+#define OBS_SHM_CACHE_NUM_SETS 1024
+
+/** The number of slots in each set. */
+#define OBS_SHM_CACHE_WAYS 4
+
+/** The number of generation counters, sites share them by hash. */
+#define OBS_SHM_CACHE_NUM_GENERATIONS 4096
+
+/** Results that end within this many seconds of when they were cached may still be filling in. */
+#define OBS_SHM_CACHE_RECENT_SEC (6 * HOURSEC)
+
+/** How long (in seconds) results that may still be filling in are kept. */
+#define OBS_SHM_CACHE_RECENT_TTL_SEC 300
+
+/** A cached result. */
+struct ObsShmCacheSlot {
+    _Atomic uint32_t seq;      /**< Odd while a writer is filling in the slot, 0 if never used. */
+    uint32_t num_values;       /**< The number of valid entries in \ref values. */
+    int64_t created;           /**< When the result was cached. */
+    uint64_t generation;       /**< The generation of the site when the result was computed. */
+    struct ObsShmCacheKey key; /**< The query this is the result of. */
+
+    /** The result. */
+    struct ObsShmCacheValue values[OBS_SHM_CACHE_MAX_VALUES];
+};
+
+/** The layout of the shared memory segment. */
+struct ObsShmCacheSegment {
+    _Atomic uint32_t magic; /**< \ref OBS_SHM_CACHE_MAGIC once the segment is initialized. */
+    uint32_t version;       /**< \ref OBS_SHM_CACHE_VERSION. */
+
+    /** Bumped when new data is stored for the sites that hash to them. */
+    _Atomic uint64_t generations[OBS_SHM_CACHE_NUM_GENERATIONS];
+
+    /** The hash table. */
+    struct ObsShmCacheSlot slots[OBS_SHM_CACHE_NUM_SETS][OBS_SHM_CACHE_WAYS];
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory atomics must be lock free");
+
+/** Protects \ref obs_shm_cache and \ref obs_shm_cache_refs. */
+static pthread_mutex_t obs_shm_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The segment mapped into this process, or \c NULL. */
+static struct ObsShmCacheSegment *_Atomic obs_shm_cache = 0;
+
+/** The number of attachments to \ref obs_shm_cache. */
+static size_t obs_shm_cache_refs = 0;
+
+/** The segment mapped to invalidate results when this process isn't attached, kept until exit so
+ * every commit doesn't map it again. Protected by \ref obs_shm_cache_lock. */
+static struct ObsShmCacheSegment *obs_shm_cache_writer = 0;
+
+/** Set if mapping \ref obs_shm_cache_writer failed, so the error is only reported once. */
+static bool obs_shm_cache_writer_failed = false;
+
+/** FNV-1a hash. */
+static uint64_t
+obs_shm_cache_hash(void const *data, size_t len)
+{
+    unsigned char const *bytes = data;
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+static _Atomic uint64_t *
+obs_shm_cache_generation(struct ObsShmCacheSegment *seg, char const *site)
+{
+    uint64_t hash = obs_shm_cache_hash(site, strlen(site));
+    return &seg->generations[hash % OBS_SHM_CACHE_NUM_GENERATIONS];
+}
+
+/** Map the segment, creating and sizing it if this is the first process to use it. */
+static struct ObsShmCacheSegment *
+obs_shm_cache_map(void)
+{
+    char name[64] = {0};
+    sprintf(name, "/obsdb-cache-%u-v%d", (unsigned)getuid(), OBS_SHM_CACHE_VERSION);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    StopIf(fd < 0, return 0, "unable to open shared cache %s: %s", name, strerror(errno));
+
+    struct stat st = {0};
+    StopIf(fstat(fd, &st), goto ERR_RETURN, "unable to stat shared cache: %s", strerror(errno));
+
+    // A new segment is zero filled, which is a valid empty cache.
+    if ((size_t)st.st_size < sizeof(struct ObsShmCacheSegment)) {
+        int rc = ftruncate(fd, sizeof(struct ObsShmCacheSegment));
+        StopIf(rc, goto ERR_RETURN, "unable to size shared cache: %s", strerror(errno));
+    }
+
+    struct ObsShmCacheSegment *seg =
+        mmap(0, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    StopIf(seg == MAP_FAILED, goto ERR_RETURN, "unable to map shared cache: %s", strerror(errno));
+    close(fd);
+
+    uint32_t magic = 0;
+    if (atomic_compare_exchange_strong(&seg->magic, &magic, OBS_SHM_CACHE_MAGIC)) {
+        seg->version = OBS_SHM_CACHE_VERSION;
+    } else {
+        StopIf(magic != OBS_SHM_CACHE_MAGIC, munmap(seg, sizeof(*seg)); return 0,
+               "shared cache %s is not an obsdb cache", name);
+    }
+
+    return seg;
+
+ERR_RETURN:
+    close(fd);
+    return 0;
+}
+
+int
+obs_shm_cache_attach(void)
+{
+    int rc = 0;
+    pthread_mutex_lock(&obs_shm_cache_lock);
+
+    if (!obs_shm_cache) {
+        obs_shm_cache = obs_shm_cache_map();
+    }
+
+    if (obs_shm_cache) {
+        obs_shm_cache_refs++;
+    } else {
+        rc = -1;
+    }
+
+    pthread_mutex_unlock(&obs_shm_cache_lock);
+    return rc;
+}
+
+void
+obs_shm_cache_detach(void)
+{
+    pthread_mutex_lock(&obs_shm_cache_lock);
+
+    if (obs_shm_cache_refs > 0) {
+        obs_shm_cache_refs--;
+
+        if (obs_shm_cache_refs == 0) {
+            munmap(obs_shm_cache, sizeof(*obs_shm_cache));
+            obs_shm_cache = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&obs_shm_cache_lock);
+}
+
+bool
+obs_shm_cache_get(struct ObsShmCacheKey const *key,
+                  struct ObsShmCacheValue values[OBS_SHM_CACHE_MAX_VALUES], size_t *num_values,
+                  uint64_t *generation)
+{
+    // No lock needed, the mapping is never removed while a store is attached to it.
+    struct ObsShmCacheSegment *seg = obs_shm_cache;
+    if (!seg) {
+        return false;
+    }
+
+    *generation = atomic_load(obs_shm_cache_generation(seg, key->site));
+    struct ObsShmCacheSlot *set = seg->slots[obs_shm_cache_hash(key, sizeof(*key)) %
+                                             OBS_SHM_CACHE_NUM_SETS];
+
+    for (size_t i = 0; i < OBS_SHM_CACHE_WAYS; i++) {
+        struct ObsShmCacheSlot *slot = &set[i];
+
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == 0 || seq & 1) {
+            continue;
+        }
+
+        if (slot->generation != *generation || memcmp(&slot->key, key, sizeof(*key))) {
+            continue;
+        }
+
+        size_t count = slot->num_values;
+        int64_t created = slot->created;
+        if (count > OBS_SHM_CACHE_MAX_VALUES) {
+            continue;
+        }
+        memcpy(values, slot->values, count * sizeof(values[0]));
+
+        // Make sure the copy is finished before checking that nothing changed while copying.
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        if (key->end > created - OBS_SHM_CACHE_RECENT_SEC &&
+            time(0) - created > OBS_SHM_CACHE_RECENT_TTL_SEC) {
+            continue;
+        }
+
+        *num_values = count;
+        return true;
+    }
+
+    return false;
+}
+
+void
+obs_shm_cache_put(struct ObsShmCacheKey const *key, uint64_t generation, size_t num_values,
+                  struct ObsShmCacheValue const values[num_values])
+{
+    struct ObsShmCacheSegment *seg = obs_shm_cache;
+    if (!seg || num_values > OBS_SHM_CACHE_MAX_VALUES) {
+        return;
+    }
+
+    if (atomic_load(obs_shm_cache_generation(seg, key->site)) != generation) {
+        // The data changed while the result was being computed.
+        return;
+    }
+    struct ObsShmCacheSlot *set = seg->slots[obs_shm_cache_hash(key, sizeof(*key)) %
+                                             OBS_SHM_CACHE_NUM_SETS];
+
+    // Replace the same query if it is here, otherwise an empty slot, otherwise the oldest.
+    struct ObsShmCacheSlot *victim = &set[0];
+    for (size_t i = 0; i < OBS_SHM_CACHE_WAYS; i++) {
+        if (memcmp(&set[i].key, key, sizeof(*key)) == 0) {
+            victim = &set[i];
+            break;
+        }
+
+        if (victim->seq != 0 && (set[i].seq == 0 || set[i].created < victim->created)) {
+            victim = &set[i];
+        }
+    }
+
+    uint32_t seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+    if (seq & 1 || !atomic_compare_exchange_strong(&victim->seq, &seq, seq + 1)) {
+        // Another writer has it, don't wait.
+        return;
+    }
+
+    // Keep the writes below from becoming visible before the slot is marked busy.
+    atomic_thread_fence(memory_order_release);
+
+    victim->key = *key;
+    victim->generation = generation;
+    victim->created = time(0);
+    victim->num_values = num_values;
+    memcpy(victim->values, values, num_values * sizeof(values[0]));
+
+    atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+}
+
+/** Find the segment to bump generations in.
+ *
+ * Processes that don't read from the cache still change the data other processes cached, so they
+ * map the segment too, creating it if no process has yet.
+ */
+static struct ObsShmCacheSegment *
+obs_shm_cache_for_writers(void)
+{
+    struct ObsShmCacheSegment *seg = obs_shm_cache;
+    if (seg) {
+        return seg;
+    }
+
+    pthread_mutex_lock(&obs_shm_cache_lock);
+
+    if (!obs_shm_cache_writer && !obs_shm_cache_writer_failed) {
+        obs_shm_cache_writer = obs_shm_cache_map();
+        obs_shm_cache_writer_failed = !obs_shm_cache_writer;
+    }
+    seg = obs_shm_cache_writer;
+
+    pthread_mutex_unlock(&obs_shm_cache_lock);
+    return seg;
+}
+
+void
+obs_shm_cache_site_changed(char const *site)
+{
+    struct ObsShmCacheSegment *seg = obs_shm_cache_for_writers();
+    if (!seg) {
+        return;
+    }
+
+    atomic_fetch_add(obs_shm_cache_generation(seg, site), 1);
+}
+
+void
+obs_shm_cache_all_changed(void)
+{
+    struct ObsShmCacheSegment *seg = obs_shm_cache_for_writers();
+    if (!seg) {
+        return;
+    }
+
+    for (size_t i = 0; i < OBS_SHM_CACHE_NUM_GENERATIONS; i++) {
+        atomic_fetch_add(&seg->generations[i], 1);
+    }
+}
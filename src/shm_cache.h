@@ -0,0 +1,81 @@
+#pragma once
+/** \file shm_cache.h
+ *
+ * \brief A cache of query results in shared memory, shared by every process on the machine.
+ *
+ * The cache is a fixed size set associative hash table of result arrays in a POSIX shared memory
+ * segment. Each slot is guarded by a sequence lock, so readers never block writers or each other,
+ * and a writer that finds a slot busy simply doesn't cache its result.
+ *
+ * Entries are tagged with a generation counter for their site. Every process that commits new
+ * observations for a site bumps it, whether or not it reads from the cache, and maintenance bumps
+ * them all after removing old data. A result computed from data that changed before it was saved
+ * is dropped. Results whose time range ends within a few hours of when they were cached also
+ * expire after a few minutes, since late observations may still arrive. Only writes made through
+ * obsdb are seen, changes made to the archive with other tools, like the sqlite3 shell, can leave
+ * stale results in the cache until it is recreated.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The largest result, in values, that can be cached. Bigger results are always computed. */
+#define OBS_SHM_CACHE_MAX_VALUES 512
+
+/** Identifies a query. Zero initialize it, all the bytes are used as the hash key. */
+struct ObsShmCacheKey {
+    uint32_t op;     /**< Which query, one of the values passed to the cache by the caller. */
+    uint32_t arg[3]; /**< The window arguments of the query. */
+    int64_t start;   /**< The start of the queried time range. */
+    int64_t end;     /**< The end of the queried time range. */
+    char site[32];   /**< The lowercase site identifier. */
+};
+
+/** A single cached result. */
+struct ObsShmCacheValue {
+    int64_t valid_time; /**< The valid time of the result. */
+    double value;       /**< The temperature or precipitation amount. */
+};
+
+/** Map the shared memory segment into this process, creating it if needed.
+ *
+ * The mapping is shared by every caller in the process and counted, so each successful call must
+ * be matched by a call to obs_shm_cache_detach().
+ *
+ * \returns 0 on success, or a negative number on failure.
+ */
+int obs_shm_cache_attach(void);
+
+/** Release a reference taken by obs_shm_cache_attach(), unmapping the segment after the last. */
+void obs_shm_cache_detach(void);
+
+/** Look for a cached result.
+ *
+ * \param key identifies the query.
+ * \param values must have room for \ref OBS_SHM_CACHE_MAX_VALUES values.
+ * \param num_values is where the number of values is stored on a hit.
+ * \param generation is where the current generation of the site is stored, pass it to
+ * obs_shm_cache_put() with the result computed after a miss.
+ *
+ * \returns \c true on a hit, \c false on a miss or if the cache isn't attached.
+ */
+bool obs_shm_cache_get(struct ObsShmCacheKey const *key,
+                       struct ObsShmCacheValue values[OBS_SHM_CACHE_MAX_VALUES],
+                       size_t *num_values, uint64_t *generation);
+
+/** Save a result in the cache, if the cache is attached and the result fits.
+ *
+ * The result is dropped if new data arrived for the site since \a generation was returned by
+ * obs_shm_cache_get().
+ */
+void obs_shm_cache_put(struct ObsShmCacheKey const *key, uint64_t generation, size_t num_values,
+                       struct ObsShmCacheValue const values[num_values]);
+
+/** Invalidate every cached result for a site, call after committing new data for it.
+ *
+ * This works whether or not the process is attached, the segment is mapped if needed.
+ */
+void obs_shm_cache_site_changed(char const *site);
+
+/** Invalidate every cached result, call after removing data for many sites. */
+void obs_shm_cache_all_changed(void);
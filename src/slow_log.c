@@ -0,0 +1,297 @@
+/** \file slow_log.c
+ *
+ * \brief Implementation of the slow query log.
+ *
+ * Statements are captured with a sqlite profile trace, which reports each statement and how long
+ * it ran when it finishes. Plans are only looked up once a query has been found to be slow.
+ */
+#include "slow_log.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** The size a log file may grow to before it is rotated when no size is given. */
+#define OBS_SLOW_LOG_DEFAULT_MAX_BYTES (10 * 1024 * 1024)
+
+int
+obs_slow_log_set(struct ObsSlowLog *log, char const *path, double threshold_ms, size_t max_bytes)
+{
+    char *path_copy = 0;
+    if (path) {
+        path_copy = strdup(path);
+        StopIf(!path_copy, return -1, "out of memory");
+    }
+
+    free(log->path);
+    *log = (struct ObsSlowLog){.path = path_copy,
+                               .threshold_ms = threshold_ms,
+                               .max_bytes = max_bytes ? max_bytes : OBS_SLOW_LOG_DEFAULT_MAX_BYTES};
+
+    return 0;
+}
+
+void
+obs_slow_log_free(struct ObsSlowLog *log)
+{
+    free(log->path);
+    *log = (struct ObsSlowLog){0};
+}
+
+/** Called by sqlite each time a statement finishes while a query is being watched. */
+static int
+obs_slow_log_trace(unsigned type, void *ctx, void *p, void *x)
+{
+    if (type != SQLITE_TRACE_PROFILE) {
+        return 0;
+    }
+
+    struct ObsQueryProfile *profile = ctx;
+    sqlite3_stmt *statement = p;
+    double ms = *(sqlite3_int64 *)x / 1.0e6;
+
+    char const *sql = sqlite3_sql(statement);
+    if (!sql) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < profile->num_statements; i++) {
+        struct ObsSlowLogStatement *st = &profile->statements[i];
+        if (strcmp(st->sql, sql) == 0) {
+            st->num_runs++;
+            st->ms += ms;
+            return 0;
+        }
+    }
+
+    if (profile->num_statements == OBS_SLOW_LOG_MAX_STATEMENTS) {
+        return 0;
+    }
+
+    char *sql_copy = strdup(sql);
+    if (!sql_copy) {
+        return 0;
+    }
+
+    profile->statements[profile->num_statements] = (struct ObsSlowLogStatement){
+        .sql = sql_copy, .expanded = sqlite3_expanded_sql(statement), .num_runs = 1, .ms = ms};
+    profile->num_statements++;
+
+    return 0;
+}
+
+void
+obs_slow_log_watch(struct ObsSlowLog const *log, struct ObsQueryProfile *profile, sqlite3 *db)
+{
+    if (!log->path || !db) {
+        return;
+    }
+
+    sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, obs_slow_log_trace, profile);
+}
+
+/** Write a string as a JSON string. */
+static void
+obs_slow_log_write_string(FILE *f, char const *str)
+{
+    fputc('"', f);
+    for (char const *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+            fputc(*c, f);
+        } else if ((unsigned char)*c < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned)*c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/** Write the plan sqlite uses for a statement as a JSON array of strings, one per plan step. */
+static void
+obs_slow_log_write_plan(FILE *f, sqlite3 *db, char const *sql)
+{
+    fputc('[', f);
+
+    char *explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+    sqlite3_stmt *statement = 0;
+    if (explain && sqlite3_prepare_v2(db, explain, -1, &statement, 0) == SQLITE_OK) {
+        bool first = true;
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            char const *detail = (char const *)sqlite3_column_text(statement, 3);
+            if (!detail) {
+                continue;
+            }
+
+            if (!first) {
+                fputc(',', f);
+            }
+            obs_slow_log_write_string(f, detail);
+            first = false;
+        }
+    }
+
+    sqlite3_finalize(statement);
+    sqlite3_free(explain);
+
+    fputc(']', f);
+}
+
+/** Format a profile as a single line of JSON. */
+static void
+obs_slow_log_write_profile(FILE *f, struct ObsQueryProfile const *profile, sqlite3 *db,
+                           int status, double total_ms)
+{
+    static char const *const phase_names[OBS_QUERY_NUM_PHASES] = {
+        [OBS_QUERY_PHASE_CACHE] = "cache",
+        [OBS_QUERY_PHASE_INVENTORY] = "inventory",
+        [OBS_QUERY_PHASE_DOWNLOAD] = "download",
+        [OBS_QUERY_PHASE_FETCH] = "fetch",
+        [OBS_QUERY_PHASE_WINDOW] = "window",
+    };
+
+    fprintf(f, "{\"time\":%lld,\"api\":", (long long)time(0));
+    obs_slow_log_write_string(f, profile->api);
+    fputs(",\"site\":", f);
+    obs_slow_log_write_string(f, profile->site);
+    fprintf(f, ",\"start\":%lld,\"end\":%lld,\"args\":[%u,%u,%u],\"status\":%d,\"total_ms\":%.3f",
+            (long long)profile->time_range.start, (long long)profile->time_range.end,
+            profile->args[0], profile->args[1], profile->args[2], status, total_ms);
+
+    fputs(",\"phases_ms\":{", f);
+    for (size_t i = 0; i < OBS_QUERY_NUM_PHASES; i++) {
+        fprintf(f, "%s\"%s\":%.3f", i ? "," : "", phase_names[i], profile->phase_ms[i]);
+    }
+
+    fprintf(f, "},\"cache_hit\":%s,\"missing_ranges\":%zu,\"rows\":%zu,\"results\":%zu",
+            profile->cache_hit ? "true" : "false", profile->num_missing_ranges,
+            profile->num_rows, profile->num_results);
+
+    fputs(",\"statements\":[", f);
+    for (size_t i = 0; i < profile->num_statements; i++) {
+        struct ObsSlowLogStatement const *st = &profile->statements[i];
+        char const *sql = st->expanded ? st->expanded : st->sql;
+
+        fputs(i ? ",{\"sql\":" : "{\"sql\":", f);
+        obs_slow_log_write_string(f, sql);
+        fprintf(f, ",\"runs\":%zu,\"ms\":%.3f,\"plan\":", st->num_runs, st->ms);
+        obs_slow_log_write_plan(f, db, sql);
+        fputc('}', f);
+    }
+
+    fputs("]}\n", f);
+}
+
+/** Open the log for appending and lock it, rotating it first if it is full.
+ *
+ * The lock is held from checking the size until the line is written, so two processes can't both
+ * decide to rotate, which would move the first one's fresh file over the rotated one.
+ *
+ * \returns the locked file descriptor, or -1 on error.
+ */
+static int
+obs_slow_log_open_locked(struct ObsSlowLog const *log)
+{
+    // Each try either finds the file another process just rotated, or rotates it.
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = open(log->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        StopIf(fd < 0, return -1, "unable to open slow query log %s: %s", log->path,
+               strerror(errno));
+
+        struct stat st = {0};
+        int rc = flock(fd, LOCK_EX);
+        rc = rc ? rc : fstat(fd, &st);
+        StopIf(rc, close(fd); return -1, "unable to lock slow query log %s: %s", log->path,
+               strerror(errno));
+
+        // The file was rotated while waiting for the lock, this is now the old one.
+        struct stat path_st = {0};
+        if (stat(log->path, &path_st) || path_st.st_ino != st.st_ino ||
+            path_st.st_dev != st.st_dev) {
+            close(fd);
+            continue;
+        }
+
+        if ((size_t)st.st_size < log->max_bytes) {
+            return fd;
+        }
+
+        char *rotated = 0;
+        if (asprintf(&rotated, "%s.1", log->path) < 0) {
+            return fd;
+        }
+
+        rc = rename(log->path, rotated);
+        free(rotated);
+        StopIf(rc, return fd, "unable to rotate slow query log %s: %s", log->path,
+               strerror(errno));
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+/** Append a line to the log, rotating the file first if it is full. */
+static void
+obs_slow_log_append(struct ObsSlowLog const *log, char const *line, size_t len)
+{
+    int fd = obs_slow_log_open_locked(log);
+    if (fd < 0) {
+        return;
+    }
+
+    // O_APPEND and a single write per line, so lines from processes sharing the file don't
+    // interleave. Only a short write, which the lock still protects, needs another.
+    while (len > 0) {
+        ssize_t written = write(fd, line, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        StopIf(written <= 0, break, "error writing slow query log %s: %s", log->path,
+               strerror(errno));
+
+        line += written;
+        len -= written;
+    }
+
+    close(fd);
+}
+
+void
+obs_slow_log_finish(struct ObsSlowLog const *log, struct ObsQueryProfile *profile, sqlite3 *db,
+                    int status)
+{
+    if (db && log->path) {
+        sqlite3_trace_v2(db, 0, 0, 0);
+    }
+
+    double total_ms = obs_util_monotonic_ms() - profile->start_ms;
+
+    if (log->path && total_ms >= log->threshold_ms) {
+        char *line = 0;
+        size_t len = 0;
+        FILE *f = open_memstream(&line, &len);
+        if (f) {
+            obs_slow_log_write_profile(f, profile, db, status, total_ms);
+            fclose(f);
+            obs_slow_log_append(log, line, len);
+        }
+        free(line);
+    }
+
+    for (size_t i = 0; i < profile->num_statements; i++) {
+        free(profile->statements[i].sql);
+        sqlite3_free(profile->statements[i].expanded);
+    }
+    profile->num_statements = 0;
+}
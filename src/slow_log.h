@@ -0,0 +1,102 @@
+#pragma once
+/** \file slow_log.h
+ *
+ * \brief Internal log of queries that took longer than a threshold.
+ *
+ * Each slow query is written as one JSON object on its own line, with the query parameters, how
+ * long each phase took, how many rows were involved, and every SQL statement the query ran along
+ * with the plan sqlite chose for it. When the file grows past its size limit it is renamed with a
+ * ".1" suffix, replacing any earlier one, and a new file is started.
+ */
+#include "obs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sqlite3.h>
+
+/** The phases of a query that are timed. */
+enum ObsQueryPhase {
+    OBS_QUERY_PHASE_CACHE,     /**< Looking in the shared result cache. */
+    OBS_QUERY_PHASE_INVENTORY, /**< Checking what is already in the local store. */
+    OBS_QUERY_PHASE_DOWNLOAD,  /**< Downloading and storing missing data. */
+    OBS_QUERY_PHASE_FETCH,     /**< Reading the hourly values from the local store. */
+    OBS_QUERY_PHASE_WINDOW,    /**< Combining the hourly values into windows. */
+    OBS_QUERY_NUM_PHASES
+};
+
+/** The most distinct SQL statements recorded for a single query. */
+#define OBS_SLOW_LOG_MAX_STATEMENTS 16
+
+/** Where and when to log slow queries. Zero initialized it is turned off. */
+struct ObsSlowLog {
+    char *path;          /**< The log file, or \c NULL if the log is turned off. */
+    double threshold_ms; /**< Queries taking at least this many milliseconds are logged. */
+    size_t max_bytes;    /**< The size at which the log file is rotated. */
+};
+
+/** A SQL statement run during a query. */
+struct ObsSlowLogStatement {
+    char *sql;       /**< The text of the statement, identifies it. */
+    char *expanded;  /**< The first run of the statement with its parameters filled in. */
+    size_t num_runs; /**< How many times the statement was run. */
+    double ms;       /**< The total time spent running the statement. */
+};
+
+/** What happened during a single query. Zero initialize it before filling it in. */
+struct ObsQueryProfile {
+    char const *api;                /**< The public function that was called. */
+    char const *site;               /**< The site that was queried. */
+    struct ObsTimeRange time_range; /**< The time range that was queried. */
+    unsigned args[3];               /**< The window arguments of the query. */
+    double start_ms;                /**< When the query started, from obs_util_monotonic_ms(). */
+    bool cache_hit;                 /**< Was the result found in the shared cache? */
+    size_t num_missing_ranges;      /**< The number of ranges that had to be downloaded. */
+    size_t num_rows;                /**< The number of hourly values read. */
+    size_t num_results;             /**< The number of results returned. */
+
+    /** Milliseconds spent in each phase, indexed by \ref ObsQueryPhase. */
+    double phase_ms[OBS_QUERY_NUM_PHASES];
+
+    /** The number of statements in \ref statements. */
+    size_t num_statements;
+
+    /** The SQL statements run while the query was being watched. */
+    struct ObsSlowLogStatement statements[OBS_SLOW_LOG_MAX_STATEMENTS];
+};
+
+/** Change the settings of a slow query log.
+ *
+ * \param log the log to change.
+ * \param path the file to write to, or \c NULL to turn the log off. It is copied.
+ * \param threshold_ms the shortest query, in milliseconds, that is logged.
+ * \param max_bytes the size the file may grow to before it is rotated, 0 for the default.
+ *
+ * \returns 0 on success or a negative number if memory couldn't be allocated.
+ */
+int obs_slow_log_set(struct ObsSlowLog *log, char const *path, double threshold_ms,
+                     size_t max_bytes);
+
+/** Release the memory used by a log and turn it off. */
+void obs_slow_log_free(struct ObsSlowLog *log);
+
+/** Record the SQL statements \a db runs until obs_slow_log_finish() is called.
+ *
+ * This does nothing if the log is turned off, so statements are only captured when they may be
+ * written out.
+ */
+void obs_slow_log_watch(struct ObsSlowLog const *log, struct ObsQueryProfile *profile,
+                        sqlite3 *db);
+
+/** Finish a query, writing it to the log if it was slow.
+ *
+ * Stops watching \a db, if it was being watched, and releases the statements in \a profile.
+ *
+ * \param log the log to write to.
+ * \param profile what happened during the query.
+ * \param db the database the query ran on, used to explain the statements. May be \c NULL if the
+ * query never opened the database.
+ * \param status the value the query returned.
+ */
+void obs_slow_log_finish(struct ObsSlowLog const *log, struct ObsQueryProfile *profile,
+                         sqlite3 *db, int status);
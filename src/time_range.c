@@ -1,11 +1,16 @@
 /** \file time_range.c
  *
- * \brief Implementation of the TimeRange type.
+ * \brief Implementation of the TimeRange and TimeRangeSet types.
  */
 
 #include "obs.h"
+#include "time_range.h"
+#include "utils.h"
 
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 struct ObsTimeRange *
 obs_time_range_init(struct ObsTimeRange *tr, time_t start, time_t end)
@@ -35,3 +40,293 @@ obs_time_range_print(struct ObsTimeRange tr)
 
     printf("TimeRange [%s -> %s]\n", start_buf, end_buf);
 }
+
+/*-------------------------------------------------------------------------------------------------
+ *                                      Time Range Sets
+ *-----------------------------------------------------------------------------------------------*/
+void
+obs_time_range_set_free(struct ObsTimeRangeSet *set)
+{
+    free(set->ranges);
+    *set = (struct ObsTimeRangeSet){0};
+}
+
+/** Find the first range in a set that ends at or after \a t. */
+static size_t
+obs_time_range_set_first_ending_at_or_after(struct ObsTimeRangeSet const *set, time_t t)
+{
+    size_t low = 0;
+    size_t high = set->len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (set->ranges[mid].end < t) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/** Find the first range in a set that starts after \a t. */
+static size_t
+obs_time_range_set_first_starting_after(struct ObsTimeRangeSet const *set, time_t t)
+{
+    size_t low = 0;
+    size_t high = set->len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (set->ranges[mid].start <= t) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/** Replace the ranges in [first, last) with \a num_new ranges from \a new_ranges. */
+static int
+obs_time_range_set_splice(struct ObsTimeRangeSet *set, size_t first, size_t last, size_t num_new,
+                          struct ObsTimeRange const new_ranges[num_new])
+{
+    size_t new_len = set->len - (last - first) + num_new;
+    if (new_len > set->capacity) {
+        size_t new_capacity = set->capacity ? 2 * set->capacity : 8;
+        while (new_capacity < new_len) {
+            new_capacity *= 2;
+        }
+
+        struct ObsTimeRange *ranges = realloc(set->ranges, new_capacity * sizeof(*ranges));
+        StopIf(!ranges, return -1, "out of memory");
+
+        set->ranges = ranges;
+        set->capacity = new_capacity;
+    }
+
+    memmove(&set->ranges[first + num_new], &set->ranges[last],
+            (set->len - last) * sizeof(set->ranges[0]));
+    memcpy(&set->ranges[first], new_ranges, num_new * sizeof(set->ranges[0]));
+    set->len = new_len;
+
+    return 0;
+}
+
+int
+obs_time_range_set_insert(struct ObsTimeRangeSet *set, struct ObsTimeRange tr)
+{
+    assert(tr.start <= tr.end);
+
+    // Every range from first up to last overlaps or touches tr.
+    size_t first = obs_time_range_set_first_ending_at_or_after(set, tr.start);
+    size_t last = obs_time_range_set_first_starting_after(set, tr.end);
+
+    if (first < last) {
+        if (set->ranges[first].start < tr.start) {
+            tr.start = set->ranges[first].start;
+        }
+
+        if (set->ranges[last - 1].end > tr.end) {
+            tr.end = set->ranges[last - 1].end;
+        }
+    }
+
+    return obs_time_range_set_splice(set, first, last, 1, &tr);
+}
+
+/** Add a range to the end of a set, merging it with the last range if they overlap or touch.
+ *
+ * The range must not start before the last range in the set.
+ */
+static int
+obs_time_range_set_append(struct ObsTimeRangeSet *set, struct ObsTimeRange tr)
+{
+    if (set->len > 0 && tr.start <= set->ranges[set->len - 1].end) {
+        struct ObsTimeRange *last = &set->ranges[set->len - 1];
+        if (tr.end > last->end) {
+            last->end = tr.end;
+        }
+
+        return 0;
+    }
+
+    return obs_time_range_set_splice(set, set->len, set->len, 1, &tr);
+}
+
+int
+obs_time_range_set_union(struct ObsTimeRangeSet *set, struct ObsTimeRangeSet const *other)
+{
+    if (other->len == 0) {
+        return 0;
+    }
+
+    struct ObsTimeRangeSet result = {0};
+
+    // Both sets are sorted, so merge them in one pass.
+    size_t i = 0, j = 0;
+    while (i < set->len || j < other->len) {
+        struct ObsTimeRange next = {0};
+        if (j >= other->len || (i < set->len && set->ranges[i].start <= other->ranges[j].start)) {
+            next = set->ranges[i];
+            i++;
+        } else {
+            next = other->ranges[j];
+            j++;
+        }
+
+        int rc = obs_time_range_set_append(&result, next);
+        StopIf(rc, obs_time_range_set_free(&result); return -1, "error merging time range sets");
+    }
+
+    obs_time_range_set_free(set);
+    *set = result;
+
+    return 0;
+}
+
+int
+obs_time_range_set_subtract(struct ObsTimeRangeSet *set, struct ObsTimeRange tr)
+{
+    assert(tr.start <= tr.end);
+
+    if (tr.start == tr.end) {
+        return 0;
+    }
+
+    // Every range from first up to last shares more than an end point with tr.
+    size_t first = obs_time_range_set_first_ending_at_or_after(set, tr.start + 1);
+    size_t last = obs_time_range_set_first_starting_after(set, tr.end - 1);
+
+    if (first >= last) {
+        return 0;
+    }
+
+    struct ObsTimeRange pieces[2] = {{0}};
+    size_t num_pieces = 0;
+
+    if (set->ranges[first].start < tr.start) {
+        pieces[num_pieces] = (struct ObsTimeRange){set->ranges[first].start, tr.start};
+        num_pieces++;
+    }
+
+    if (set->ranges[last - 1].end > tr.end) {
+        pieces[num_pieces] = (struct ObsTimeRange){tr.end, set->ranges[last - 1].end};
+        num_pieces++;
+    }
+
+    return obs_time_range_set_splice(set, first, last, num_pieces, pieces);
+}
+
+int
+obs_time_range_set_difference(struct ObsTimeRangeSet *set, struct ObsTimeRangeSet const *other)
+{
+    if (set->len == 0 || other->len == 0) {
+        return 0;
+    }
+
+    struct ObsTimeRangeSet result = {0};
+
+    // Both sets are sorted, so walk them together. A range in other that runs past the end of a
+    // range in set is looked at again for the next one, but every other range is passed once.
+    size_t j = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        struct ObsTimeRange a = set->ranges[i];
+
+        while (j < other->len && other->ranges[j].end <= a.start) {
+            j++;
+        }
+
+        time_t kept_start = a.start;
+        bool removed = false;
+        for (size_t k = j; k < other->len && other->ranges[k].start < a.end; k++) {
+            struct ObsTimeRange b = other->ranges[k];
+            if (b.start == b.end) {
+                // Removing a single instant removes nothing, like obs_time_range_set_subtract().
+                continue;
+            }
+
+            if (b.start > kept_start) {
+                struct ObsTimeRange piece = {.start = kept_start, .end = b.start};
+                int rc = obs_time_range_set_splice(&result, result.len, result.len, 1, &piece);
+                StopIf(rc, goto ERR_RETURN, "error subtracting from time range set");
+            }
+
+            if (b.end > kept_start) {
+                kept_start = b.end;
+                removed = true;
+            }
+        }
+
+        if (!removed) {
+            int rc = obs_time_range_set_splice(&result, result.len, result.len, 1, &a);
+            StopIf(rc, goto ERR_RETURN, "error subtracting from time range set");
+        } else if (kept_start < a.end) {
+            struct ObsTimeRange piece = {.start = kept_start, .end = a.end};
+            int rc = obs_time_range_set_splice(&result, result.len, result.len, 1, &piece);
+            StopIf(rc, goto ERR_RETURN, "error subtracting from time range set");
+        }
+    }
+
+    obs_time_range_set_free(set);
+    *set = result;
+
+    return 0;
+
+ERR_RETURN:
+    obs_time_range_set_free(&result);
+    return -1;
+}
+
+int
+obs_time_range_set_intersection(struct ObsTimeRangeSet *set, struct ObsTimeRangeSet const *other)
+{
+    struct ObsTimeRangeSet result = {0};
+
+    // Both sets are sorted, so walk them together.
+    size_t i = 0, j = 0;
+    while (i < set->len && j < other->len) {
+        struct ObsTimeRange a = set->ranges[i];
+        struct ObsTimeRange b = other->ranges[j];
+
+        struct ObsTimeRange overlap = {.start = a.start > b.start ? a.start : b.start,
+                                       .end = a.end < b.end ? a.end : b.end};
+        if (overlap.start < overlap.end) {
+            int rc = obs_time_range_set_splice(&result, result.len, result.len, 1, &overlap);
+            StopIf(rc, obs_time_range_set_free(&result); return -1, "error intersecting sets");
+        }
+
+        if (a.end < b.end) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    obs_time_range_set_free(set);
+    *set = result;
+
+    return 0;
+}
+
+bool
+obs_time_range_set_covers(struct ObsTimeRangeSet const *set, struct ObsTimeRange tr)
+{
+    size_t i = obs_time_range_set_first_ending_at_or_after(set, tr.end);
+    return i < set->len && set->ranges[i].start <= tr.start;
+}
+
+void
+obs_time_range_set_remove_shorter_than(struct ObsTimeRangeSet *set, time_t min_sec)
+{
+    size_t num_kept = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        if (set->ranges[i].end - set->ranges[i].start >= min_sec) {
+            set->ranges[num_kept] = set->ranges[i];
+            num_kept++;
+        }
+    }
+
+    set->len = num_kept;
+}
@@ -0,0 +1,74 @@
+#pragma once
+/** \file time_range.h
+ *
+ * \brief Internal algebra on sets of time ranges.
+ *
+ * Time ranges in a set are treated as continuous spans of time. Ranges that overlap or share an
+ * end point are merged, and removing a range leaves the end points it shared with its neighbors.
+ *
+ * A set is a flat sorted array. Adding or removing a single range finds its place with a binary
+ * search but then shifts the ranges after it, so it is O(n) in the size of the set. The sets built
+ * here are the coverage and missing lists for one site, and because touching ranges merge they
+ * stay at a handful of ranges; a tree would cost more in allocations than it saves in moves. The
+ * operations on two sets walk both arrays once and are O(n + m).
+ */
+#include "obs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/** A set of time ranges, sorted by start time with no two ranges overlapping or touching.
+ *
+ * Zero initialize it to get an empty set, and release it with obs_time_range_set_free().
+ */
+struct ObsTimeRangeSet {
+    struct ObsTimeRange *ranges; /**< The ranges in the set, in order. */
+    size_t len;                  /**< The number of ranges in \ref ranges. */
+    size_t capacity;             /**< The allocated length of \ref ranges. */
+};
+
+/** Free the memory used by a set and leave it empty. */
+void obs_time_range_set_free(struct ObsTimeRangeSet *set);
+
+/** Add a range to a set, merging it with any ranges it overlaps or touches.
+ *
+ * Finding the place for the range is a binary search, and moving the later ranges is O(n).
+ *
+ * \returns 0 on success, or a negative number if memory couldn't be allocated.
+ */
+int obs_time_range_set_insert(struct ObsTimeRangeSet *set, struct ObsTimeRange tr);
+
+/** Add every range in \a other to \a set in a single merge of the two sets.
+ *
+ * \returns 0 on success, or a negative number if memory couldn't be allocated.
+ */
+int obs_time_range_set_union(struct ObsTimeRangeSet *set, struct ObsTimeRangeSet const *other);
+
+/** Remove a range from a set, trimming or splitting any ranges it overlaps.
+ *
+ * Like obs_time_range_set_insert(), this is a binary search followed by an O(n) move.
+ *
+ * \returns 0 on success, or a negative number if memory couldn't be allocated.
+ */
+int obs_time_range_set_subtract(struct ObsTimeRangeSet *set, struct ObsTimeRange tr);
+
+/** Remove every range in \a other from \a set in a single walk over the two sets.
+ *
+ * \returns 0 on success, or a negative number if memory couldn't be allocated.
+ */
+int obs_time_range_set_difference(struct ObsTimeRangeSet *set,
+                                  struct ObsTimeRangeSet const *other);
+
+/** Keep only the parts of \a set that are also in \a other.
+ *
+ * \returns 0 on success, or a negative number if memory couldn't be allocated.
+ */
+int obs_time_range_set_intersection(struct ObsTimeRangeSet *set,
+                                    struct ObsTimeRangeSet const *other);
+
+/** Is all of \a tr inside a single range of the set? This is a binary search. */
+bool obs_time_range_set_covers(struct ObsTimeRangeSet const *set, struct ObsTimeRange tr);
+
+/** Remove the ranges that are shorter than \a min_sec seconds. */
+void obs_time_range_set_remove_shorter_than(struct ObsTimeRangeSet *set, time_t min_sec);
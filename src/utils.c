@@ -0,0 +1,13 @@
+/** \file utils.c
+ *
+ * \brief External definitions of the inline functions in utils.h.
+ *
+ * C11 inline functions need exactly one translation unit to emit a definition for the calls the
+ * compiler doesn't inline, this is it.
+ */
+#include "utils.h"
+
+extern inline double obs_util_monotonic_ms(void);
+extern inline void obs_util_str_to_lower(char *str);
+extern inline void obs_util_strcpy_to_lowercase(size_t buf_size, char buf[buf_size],
+                                                char const *const src);
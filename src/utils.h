@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 /*-------------------------------------------------------------------------------------------------
  *                                        Error handling.
@@ -29,6 +30,15 @@
 /** The number of seconds in an hour. */
 #define HOURSEC (3600)
 
+/** The time on a monotonic clock in milliseconds, for measuring how long something takes. */
+inline double
+obs_util_monotonic_ms(void)
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1.0e6;
+}
+
 /*-------------------------------------------------------------------------------------------------
  *                                    String Utilities
  *-----------------------------------------------------------------------------------------------*/
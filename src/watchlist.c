@@ -0,0 +1,371 @@
+/** \file watchlist.c
+ *
+ * \brief Implementation of the ObsWatchlist, which keeps the newest data for a set of sites in the
+ * store.
+ */
+#include "download.h"
+#include "obs.h"
+#include "obs_db.h"
+#include "obs_store.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <curl/curl.h>
+#include <sqlite3.h>
+
+/** How far back (in hours) to look for a site that has no data in the store yet. */
+#define OBS_WATCHLIST_INITIAL_HOURS 24
+
+/** A function to call when new data arrives. */
+struct ObsWatchlistSubscriber {
+    ObsWatchlistCallback callback; /**< The function to call. */
+    void *user_data;               /**< Passed through to \ref callback. */
+};
+
+/** A site being polled, and where its data ended before the poll. */
+struct ObsWatchlistSite {
+    char site[32];    /**< The lowercase site identifier. */
+    time_t last_time; /**< The valid time of the newest observation before the poll. */
+};
+
+/** Shared state between the thread that owns the watchlist and the background poller. */
+struct ObsWatchlist {
+    pthread_t thread;     /**< The background poller. */
+    pthread_mutex_t lock; /**< Protects everything below. */
+    pthread_cond_t wake;  /**< Signaled to wake the poller early. */
+
+    /** API Key for SynopticLabs API. This is an alias from the ObsStore, do not free. */
+    char const *synoptic_labs_api_key;
+
+    unsigned poll_interval_sec;   /**< Time between polls. */
+    struct ObsStoreConfig config; /**< Storage settings for the poller's connection. */
+
+    char (*sites)[32];     /**< The lowercase identifiers of the watched sites. */
+    size_t num_sites;      /**< The number of sites in \ref sites. */
+    size_t sites_capacity; /**< The allocated length of \ref sites. */
+
+    struct ObsWatchlistSubscriber *subscribers; /**< Functions to call with new data. */
+    size_t num_subscribers;                     /**< The number of \ref subscribers. */
+    size_t subscribers_capacity;                /**< The allocated length of \ref subscribers. */
+
+    bool poll_now; /**< Skip the rest of the wait and poll again. */
+    bool stop;     /**< Shut down the poller. */
+};
+
+static int
+obs_watchlist_compare_sites(void const *a, void const *b)
+{
+    struct ObsWatchlistSite const *left = a;
+    struct ObsWatchlistSite const *right = b;
+
+    if (left->last_time < right->last_time) {
+        return -1;
+    } else if (left->last_time > right->last_time) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Tell all the subscribers about the new data for a site. */
+static void
+obs_watchlist_notify(struct ObsWatchlist *wl, sqlite3 *db, struct ObsWatchlistSite const *site)
+{
+    time_t newest = 0;
+    int have_data = obs_db_last_valid_time(db, site->site, &newest);
+    if (have_data <= 0 || newest <= site->last_time) {
+        return;
+    }
+
+    struct ObsTimeRange new_tr = {.start = site->last_time + 1, .end = newest};
+    size_t num_new_rows = obs_db_count_rows_in_range(db, site->site, new_tr);
+    StopIf(num_new_rows == SIZE_MAX, return, "error counting new rows for %s", site->site);
+
+    // Don't hold the lock while calling out, a subscriber may want to change the watchlist.
+    pthread_mutex_lock(&wl->lock);
+    size_t num_subscribers = wl->num_subscribers;
+    struct ObsWatchlistSubscriber *subscribers = calloc(num_subscribers, sizeof(*subscribers));
+    if (subscribers) {
+        memcpy(subscribers, wl->subscribers, num_subscribers * sizeof(*subscribers));
+    }
+    pthread_mutex_unlock(&wl->lock);
+    StopIf(num_subscribers && !subscribers, return, "out of memory");
+
+    for (size_t i = 0; i < num_subscribers; i++) {
+        subscribers[i].callback(site->site, newest, num_new_rows, subscribers[i].user_data);
+    }
+
+    free(subscribers);
+}
+
+/** Download the data newer than what is in the store for every site in the watchlist.
+ *
+ * Sites are sorted by how recent their data is and requested in groups, so each request starts at
+ * the oldest last observation of the sites in it.
+ */
+static void
+obs_watchlist_poll(struct ObsWatchlist *wl, struct ObsDbShards *shards, CURL **curl,
+                   struct ObsDownloadTuning *tuning)
+{
+    pthread_mutex_lock(&wl->lock);
+    size_t num_sites = wl->num_sites;
+    struct ObsWatchlistSite *sites = calloc(num_sites, sizeof(*sites));
+    for (size_t i = 0; sites && i < num_sites; i++) {
+        strcpy(sites[i].site, wl->sites[i]);
+    }
+    pthread_mutex_unlock(&wl->lock);
+    StopIf(num_sites && !sites, return, "out of memory");
+
+    time_t now = time(0);
+    for (size_t i = 0; i < num_sites; i++) {
+        sites[i].last_time = now - OBS_WATCHLIST_INITIAL_HOURS * HOURSEC;
+
+        sqlite3 *db = obs_db_shards_site(shards, sites[i].site);
+        if (db) {
+            obs_db_last_valid_time(db, sites[i].site, &sites[i].last_time);
+        }
+    }
+
+    qsort(sites, num_sites, sizeof(*sites), obs_watchlist_compare_sites);
+
+    for (size_t first = 0; first < num_sites; first += OBS_DOWNLOAD_MAX_SITES_PER_REQUEST) {
+        size_t num_group = num_sites - first;
+        if (num_group > OBS_DOWNLOAD_MAX_SITES_PER_REQUEST) {
+            num_group = OBS_DOWNLOAD_MAX_SITES_PER_REQUEST;
+        }
+
+        struct ObsTimeRange tr = {.start = sites[first].last_time, .end = now};
+        if (tr.start >= tr.end) {
+            continue;
+        }
+
+        char const *group[OBS_DOWNLOAD_MAX_SITES_PER_REQUEST] = {0};
+        for (size_t i = 0; i < num_group; i++) {
+            group[i] = sites[first + i].site;
+        }
+
+        int rc = obs_download_sharded(shards, curl, wl->synoptic_labs_api_key, num_group, group,
+                                      tr, tuning);
+        StopIf(rc, continue, "watchlist poll failed, will try again next time");
+
+        for (size_t i = 0; i < num_group; i++) {
+            sqlite3 *db = obs_db_shards_site(shards, sites[first + i].site);
+            if (db) {
+                obs_watchlist_notify(wl, db, &sites[first + i]);
+            }
+        }
+    }
+
+    free(sites);
+}
+
+static void *
+obs_watchlist_thread(void *arg)
+{
+    struct ObsWatchlist *wl = arg;
+
+    sqlite3 *db = obs_db_open_create(&wl->config);
+    StopIf(!db, return 0, "watchlist unable to connect to sqlite");
+
+    struct ObsDbShards shards = {0};
+    StopIf(obs_db_shards_init(&shards, db, &wl->config), obs_db_close(db);
+           return 0, "watchlist unable to find the shards");
+
+    CURL *curl = 0;
+    struct ObsDownloadTuning tuning = {0};
+    obs_download_tuning_load(db, &tuning);
+
+    pthread_mutex_lock(&wl->lock);
+    while (!wl->stop) {
+        wl->poll_now = false;
+        pthread_mutex_unlock(&wl->lock);
+
+        obs_watchlist_poll(wl, &shards, &curl, &tuning);
+
+        pthread_mutex_lock(&wl->lock);
+
+        struct timespec deadline = {0};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wl->poll_interval_sec;
+
+        while (!wl->stop && !wl->poll_now) {
+            if (pthread_cond_timedwait(&wl->wake, &wl->lock, &deadline)) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&wl->lock);
+
+    obs_download_tuning_save(db, &tuning);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+
+    obs_db_shards_close(&shards);
+
+    return 0;
+}
+
+struct ObsWatchlist *
+obs_watchlist_start(struct ObsStore *store, unsigned poll_interval_sec)
+{
+    assert(store);
+    StopIf(store->snapshot_path, return 0, "a snapshot is read only, it can't be watched");
+
+    struct ObsWatchlist *wl = calloc(1, sizeof(*wl));
+    StopIf(!wl, return 0, "Memory allocation error.");
+
+    wl->synoptic_labs_api_key = store->synoptic_labs_api_key;
+    wl->poll_interval_sec = poll_interval_sec;
+    wl->config = store->config;
+
+    pthread_mutex_init(&wl->lock, 0);
+    pthread_cond_init(&wl->wake, 0);
+
+    int rc = pthread_create(&wl->thread, 0, obs_watchlist_thread, wl);
+    StopIf(rc, goto ERR_RETURN, "unable to start watchlist thread");
+
+    return wl;
+
+ERR_RETURN:
+
+    pthread_cond_destroy(&wl->wake);
+    pthread_mutex_destroy(&wl->lock);
+    free(wl);
+    return 0;
+}
+
+void
+obs_watchlist_stop(struct ObsWatchlist **watchlist)
+{
+    StopIf(!watchlist || !*watchlist, return, "Warning NULL passed for obs_watchlist_stop.");
+
+    struct ObsWatchlist *wl = *watchlist;
+
+    pthread_mutex_lock(&wl->lock);
+    wl->stop = true;
+    pthread_cond_signal(&wl->wake);
+    pthread_mutex_unlock(&wl->lock);
+
+    pthread_join(wl->thread, 0);
+
+    pthread_cond_destroy(&wl->wake);
+    pthread_mutex_destroy(&wl->lock);
+    free(wl->sites);
+    free(wl->subscribers);
+    free(wl);
+
+    *watchlist = 0;
+}
+
+int
+obs_watchlist_add(struct ObsWatchlist *wl, char const *const site)
+{
+    assert(wl);
+    assert(site);
+
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    int rc = 0;
+    pthread_mutex_lock(&wl->lock);
+
+    for (size_t i = 0; i < wl->num_sites; i++) {
+        if (strcmp(wl->sites[i], site_buf) == 0) {
+            goto RETURN;
+        }
+    }
+
+    if (wl->num_sites == wl->sites_capacity) {
+        size_t new_capacity = wl->sites_capacity ? 2 * wl->sites_capacity : 16;
+        char(*new_sites)[32] = realloc(wl->sites, new_capacity * sizeof(*new_sites));
+        StopIf(!new_sites, rc = -1; goto RETURN, "out of memory");
+
+        wl->sites = new_sites;
+        wl->sites_capacity = new_capacity;
+    }
+
+    strcpy(wl->sites[wl->num_sites], site_buf);
+    wl->num_sites++;
+
+    // Get the new site caught up without waiting for the next poll.
+    wl->poll_now = true;
+    pthread_cond_signal(&wl->wake);
+
+RETURN:
+    pthread_mutex_unlock(&wl->lock);
+    return rc;
+}
+
+int
+obs_watchlist_remove(struct ObsWatchlist *wl, char const *const site)
+{
+    assert(wl);
+    assert(site);
+
+    char site_buf[32] = {0};
+    obs_util_strcpy_to_lowercase(sizeof(site_buf), site_buf, site);
+
+    int rc = -1;
+    pthread_mutex_lock(&wl->lock);
+
+    for (size_t i = 0; i < wl->num_sites; i++) {
+        if (strcmp(wl->sites[i], site_buf) == 0) {
+            wl->num_sites--;
+            memmove(&wl->sites[i], &wl->sites[i + 1], (wl->num_sites - i) * sizeof(wl->sites[0]));
+            rc = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&wl->lock);
+    return rc;
+}
+
+int
+obs_watchlist_subscribe(struct ObsWatchlist *wl, ObsWatchlistCallback callback, void *user_data)
+{
+    assert(wl);
+    assert(callback);
+
+    int rc = 0;
+    pthread_mutex_lock(&wl->lock);
+
+    if (wl->num_subscribers == wl->subscribers_capacity) {
+        size_t new_capacity = wl->subscribers_capacity ? 2 * wl->subscribers_capacity : 4;
+        struct ObsWatchlistSubscriber *new_subscribers =
+            realloc(wl->subscribers, new_capacity * sizeof(*new_subscribers));
+        StopIf(!new_subscribers, rc = -1; goto RETURN, "out of memory");
+
+        wl->subscribers = new_subscribers;
+        wl->subscribers_capacity = new_capacity;
+    }
+
+    wl->subscribers[wl->num_subscribers] =
+        (struct ObsWatchlistSubscriber){.callback = callback, .user_data = user_data};
+    wl->num_subscribers++;
+
+RETURN:
+    pthread_mutex_unlock(&wl->lock);
+    return rc;
+}
+
+void
+obs_watchlist_poll_now(struct ObsWatchlist *wl)
+{
+    assert(wl);
+
+    pthread_mutex_lock(&wl->lock);
+    wl->poll_now = true;
+    pthread_cond_signal(&wl->wake);
+    pthread_mutex_unlock(&wl->lock);
+}
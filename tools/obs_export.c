@@ -0,0 +1,157 @@
+/** \file obs_export.c
+ *
+ * \brief Export the local archive to a columnar file, or list what is in one.
+ *
+ * Usage: obs_export [-j THREADS] [-s START] [-e END] -o FILE [SITE...]
+ *        obs_export -l FILE
+ *
+ *  - \c -j the number of sites to read at once, default one per processor.
+ *  - \c -s the start of the time range in seconds since the epoch, default the epoch.
+ *  - \c -e the end of the time range in seconds since the epoch, default now.
+ *  - \c -o the file to write. Every site in the archive is exported if none are given.
+ *  - \c -l print the sites, time ranges and row counts in FILE instead of exporting.
+ *
+ * The archive is the one in $HOME, the same as the library uses. The file layout is described in
+ * obs_columnar.h.
+ */
+#include "obs.h"
+#include "obs_columnar.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+obs_export_usage(char const *program)
+{
+    fprintf(stderr,
+            "usage: %s [-j THREADS] [-s START] [-e END] -o FILE [SITE...]\n"
+            "       %s -l FILE\n",
+            program, program);
+}
+
+/** Print the contents of a file, reading it the way any other program would, by mapping it. */
+static int
+obs_export_list(char const *path)
+{
+    int fd = open(path, O_RDONLY);
+    StopIf(fd < 0, return -1, "unable to open %s", path);
+
+    struct stat st = {0};
+    int rc = fstat(fd, &st);
+    size_t size = st.st_size;
+    StopIf(rc || size < sizeof(struct ObsColumnarHeader) + sizeof(struct ObsColumnarFooter),
+           close(fd);
+           return -1, "%s is too small", path);
+
+    char const *file = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    StopIf(file == MAP_FAILED, return -1, "unable to map %s", path);
+
+    int result = -1;
+    struct ObsColumnarFooter const *footer =
+        (struct ObsColumnarFooter const *)(file + size - sizeof(*footer));
+    StopIf(memcmp(footer->magic, OBS_COLUMNAR_MAGIC, sizeof(footer->magic)) ||
+               footer->byte_order != OBS_COLUMNAR_BYTE_ORDER ||
+               footer->version != OBS_COLUMNAR_VERSION,
+           goto CLEAN_UP, "%s is not a columnar export this program can read", path);
+    StopIf(footer->index_offset + footer->num_batches * sizeof(struct ObsColumnarBatch) >
+               size - sizeof(*footer),
+           goto CLEAN_UP, "%s is truncated", path);
+
+    struct ObsColumnarBatch const *index =
+        (struct ObsColumnarBatch const *)(file + footer->index_offset);
+
+    // Batches of the same site are next to each other in the index.
+    for (size_t b = 0; b < footer->num_batches;) {
+        size_t first = b;
+        uint64_t num_rows = 0;
+        double t_sum = 0.0;
+        while (b < footer->num_batches && strcmp(index[b].site, index[first].site) == 0) {
+            double const *t_f = (double const *)(file + index[b].t_f_offset);
+            for (size_t i = 0; i < index[b].num_rows; i++) {
+                t_sum += t_f[i];
+            }
+            num_rows += index[b].num_rows;
+            b++;
+        }
+
+        printf("%-8s %10lld %10lld %9llu rows %3zu batches mean %.2f F\n", index[first].site,
+               (long long)index[first].first_valid_time, (long long)index[b - 1].last_valid_time,
+               (unsigned long long)num_rows, b - first, t_sum / num_rows);
+    }
+    printf("%llu rows in %llu batches\n", (unsigned long long)footer->num_rows,
+           (unsigned long long)footer->num_batches);
+    result = 0;
+
+CLEAN_UP:
+    munmap((void *)file, size);
+    return result;
+}
+
+int
+main(int argc, char *argv[argc + 1])
+{
+    unsigned num_threads = 0;
+    struct ObsTimeRange tr = {0, time(0)};
+    char const *out_path = 0;
+    char const *list_path = 0;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "j:s:e:o:l:")) != -1) {
+        switch (opt) {
+        case 'j':
+            num_threads = strtoul(optarg, 0, 10);
+            break;
+        case 's':
+            tr.start = strtoll(optarg, 0, 10);
+            break;
+        case 'e':
+            tr.end = strtoll(optarg, 0, 10);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'l':
+            list_path = optarg;
+            break;
+        default:
+            obs_export_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (list_path) {
+        return obs_export_list(list_path) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (!out_path || tr.start > tr.end) {
+        obs_export_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Nothing is downloaded, so the key isn't needed.
+    ObsStore *store = obs_connect("");
+    StopIf(!store, return EXIT_FAILURE, "unable to connect to the store");
+
+    size_t num_sites = argc - optind;
+    char const *const *sites = (char const *const *)&argv[optind];
+
+    double start = obs_util_monotonic_ms();
+    long num_rows = obs_export(store, out_path, num_sites, sites, tr, num_threads);
+    double seconds = (obs_util_monotonic_ms() - start) / 1000.0;
+
+    obs_close(&store);
+
+    StopIf(num_rows < 0, return EXIT_FAILURE, "export failed");
+    fprintf(stderr, "exported %ld rows in %.2f s\n", num_rows, seconds);
+
+    return EXIT_SUCCESS;
+}